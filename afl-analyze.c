@@ -35,6 +35,7 @@
 #include "debug.h"
 #include "alloc-inl.h"
 #include "hash.h"
+#include "bitmap-inl.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -71,6 +72,8 @@ static u32 in_len,                    /* Input data length                 */
            exec_hangs,                /* Total number of hangs             */
            exec_tmout = EXEC_TIMEOUT; /* Exec timeout (ms)                 */
 
+static u32 map_size = MAP_SIZE;       /* Bitmap bytes used by the target   */
+
 static u64 mem_limit = MEM_LIMIT;     /* Memory limit (MB)                 */
 
 static s32 shm_id,                    /* ID of the SHM region              */
@@ -115,10 +118,15 @@ static u8 count_class_lookup[256] = {
 
 static void classify_counts(u8* mem) {
 
-  u32 i = MAP_SIZE;
+  u32 i = map_size;
 
   if (edges_only) {
 
+    if (bm_edges_only) {
+      bm_edges_only(mem, map_size);
+      return;
+    }
+
     while (i--) {
       if (*mem) *mem = 1;
       mem++;
@@ -126,6 +134,11 @@ static void classify_counts(u8* mem) {
 
   } else {
 
+    if (bm_classify) {
+      bm_classify(mem, NULL, map_size, NULL, 0);
+      return;
+    }
+
     while (i--) {
       *mem = count_class_lookup[*mem];
       mem++;
@@ -141,7 +154,7 @@ static void classify_counts(u8* mem) {
 static inline u8 anything_set(void) {
 
   u32* ptr = (u32*)trace_bits;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
 
   while (i--) if (*(ptr++)) return 1;
 
@@ -254,7 +267,7 @@ static u32 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
   s32 prog_in_fd;
   u32 cksum;
 
-  memset(trace_bits, 0, MAP_SIZE);
+  memset(trace_bits, 0, map_size);
   MEM_BARRIER();
 
   prog_in_fd = write_to_file(prog_in, mem, len);
@@ -347,7 +360,7 @@ static u32 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
 
   }
 
-  cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+  cksum = hash32(trace_bits, map_size, HASH_CONST);
 
   /* We don't actually care if the target is crashing or not,
      except that when it does, the checksum should be different. */
@@ -729,6 +742,11 @@ static void set_up_environment(void) {
     setenv("DYLD_INSERT_LIBRARIES", getenv("AFL_PRELOAD"), 1);
   }
 
+  /* We don't talk to a fork server, so the target can't tell us how much
+     of the map it uses; let the user do it instead. */
+
+  map_size = bm_env_map_size(map_size);
+
 }
 
 
@@ -1059,6 +1077,7 @@ int main(int argc, char** argv) {
   use_hex_offsets = !!getenv("AFL_ANALYZE_HEX");
 
   setup_shm();
+  init_bitmap_ops();
   setup_signal_handlers();
 
   set_up_environment();
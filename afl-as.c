@@ -88,6 +88,271 @@ static u8   use_64bit = 0;
 
 #endif /* ^WORD_SIZE_64 */
 
+/* Control flow seen in AFL_SOLVE_IDS mode. Blocks are trampolines, in the
+   order they were emitted; labels point at the block that follows them, and
+   jumps are resolved against the labels once the whole file has been read.
+   Groups are COMDAT section groups, with 0 being "none". */
+
+struct cfg_block {
+  u32 id;                       /* Random ID put in the trampoline      */
+  u32 grp;                      /* Section group the block lives in     */
+};
+
+struct cfg_label {
+  u8* name;                     /* Label, without the colon             */
+  u32 blk;                      /* Block right after the label          */
+};
+
+struct cfg_edge {
+  u32 src;                      /* Source block                         */
+  u32 dst;                      /* Destination block                    */
+};
+
+struct cfg_jump {
+  u32 src;                      /* Block the jump is in                 */
+  u8* to;                       /* Target label                         */
+};
+
+static u8   solve_ids;          /* AFL_SOLVE_IDS mode?                  */
+
+static struct cfg_block* cfg_blk;
+static struct cfg_label* cfg_lbl;
+static struct cfg_edge*  cfg_edge;
+static struct cfg_jump*  cfg_jmp;
+
+static u8** cfg_grp;            /* Section group names                  */
+
+static u32  cfg_blk_cnt, cfg_lbl_cnt, cfg_edge_cnt, cfg_jmp_cnt,
+            cfg_grp_cnt = 1, cfg_pend_lbl,
+            cur_grp, cur_blk;
+
+static u8   cur_falls;          /* Can the last insn fall through?      */
+
+#define CFG_NONE 0xffffffff
+
+/* Grow one of the arrays above to hold at least _cnt + 1 items. */
+
+#define CFG_GROW(_arr, _cnt) do { \
+    if (!((_cnt) & ((_cnt) + 1))) \
+      _arr = ck_realloc(_arr, ((_cnt) * 2 + 2) * sizeof(*(_arr))); \
+  } while (0)
+
+
+/* Emit a trampoline with a random ID. In AFL_SOLVE_IDS mode, also label the
+   ID and record the block, along with the fall-through edge into it and any
+   labels that were waiting for it. */
+
+static void emit_trampoline(FILE* outf) {
+
+  u32 id = R(MAP_SIZE);
+  u8  lbl[32] = "";
+
+  if (solve_ids) {
+
+    sprintf(lbl, ".Lafl_id_%u:\n", cfg_blk_cnt);
+
+    CFG_GROW(cfg_blk, cfg_blk_cnt);
+    cfg_blk[cfg_blk_cnt].id  = id;
+    cfg_blk[cfg_blk_cnt].grp = cur_grp;
+
+    if (cur_blk != CFG_NONE && cur_falls) {
+      CFG_GROW(cfg_edge, cfg_edge_cnt);
+      cfg_edge[cfg_edge_cnt].src = cur_blk;
+      cfg_edge[cfg_edge_cnt].dst = cfg_blk_cnt;
+      cfg_edge_cnt++;
+    }
+
+    while (cfg_pend_lbl < cfg_lbl_cnt)
+      cfg_lbl[cfg_pend_lbl++].blk = cfg_blk_cnt;
+
+    cur_blk   = cfg_blk_cnt++;
+    cur_falls = 1;
+
+  }
+
+  fprintf(outf, use_64bit ? trampoline_fmt_64 : trampoline_fmt_32, lbl, id);
+
+}
+
+
+/* Copy the label or jump operand at ptr into a fresh string. */
+
+static u8* cfg_name(u8* ptr) {
+
+  u8* end = ptr;
+
+  while (*end && !isspace(*end) && *end != ':' && *end != ',') end++;
+
+  return ck_memdup_str(ptr, end - ptr);
+
+}
+
+
+/* Remember a label that the next trampoline will be instrumenting. */
+
+static void cfg_add_label(u8* line) {
+
+  u8* name = cfg_name(line);
+
+  if (!name) return;
+
+  CFG_GROW(cfg_lbl, cfg_lbl_cnt);
+  cfg_lbl[cfg_lbl_cnt].name  = name;
+  cfg_lbl[cfg_lbl_cnt++].blk = CFG_NONE;
+
+}
+
+
+/* Look at an instruction for control flow: direct jumps are noted for later,
+   and jumps or returns end the fall-through into whatever comes next. */
+
+static void cfg_add_insn(u8* line) {
+
+  u8 *op = line + 1, *to;
+
+  if (!strncmp(op, "rep", 3)) {
+
+    while (*op && !isspace(*op)) op++;
+    while (isspace(*op)) op++;
+
+  }
+
+  if (!strncmp(op, "ret", 3) || !strncmp(op, "ud2", 3) ||
+      !strncmp(op, "hlt", 3)) {
+    cur_falls = 0;
+    return;
+  }
+
+  if (*op != 'j') return;
+
+  if (op[1] == 'm') cur_falls = 0;
+
+  while (*op && !isspace(*op)) op++;
+  while (isspace(*op)) op++;
+
+  if (*op == '*' || cur_blk == CFG_NONE || !(to = cfg_name(op))) return;
+
+  CFG_GROW(cfg_jmp, cfg_jmp_cnt);
+  cfg_jmp[cfg_jmp_cnt].src  = cur_blk;
+  cfg_jmp[cfg_jmp_cnt++].to = to;
+
+}
+
+
+/* Note the section group of a .section line switching to code; GCC puts
+   inline and template functions in COMDAT groups, and our records of them
+   have to be dropped by the linker together with the code. */
+
+static void cfg_set_group(u8* line) {
+
+  u8 *flags = strchr(line, '"'), *ptr;
+  u32 i;
+
+  cur_grp = 0;
+
+  if (!flags || !(ptr = strchr(flags + 1, '"'))) return;
+  if (!memchr(flags, 'G', ptr - flags)) return;
+
+  /* "flags",@type,group[,comdat] */
+
+  if (!(ptr = strchr(ptr, ',')) || !(ptr = strchr(ptr + 1, ','))) return;
+
+  ptr = cfg_name(ptr + 1);
+
+  for (i = 1; i < cfg_grp_cnt; i++)
+    if (!strcmp(cfg_grp[i], ptr)) break;
+
+  if (i == cfg_grp_cnt) {
+    CFG_GROW(cfg_grp, cfg_grp_cnt);
+    cfg_grp[cfg_grp_cnt++] = ptr;
+  } else ck_free(ptr);
+
+  cur_grp = i;
+
+}
+
+
+static int cfg_label_cmp(const void* a, const void* b) {
+
+  return strcmp(((struct cfg_label*)a)->name, ((struct cfg_label*)b)->name);
+
+}
+
+
+/* Resolve the jumps, and write out the CFG as one AS_CFG_SECTION record per
+   section group: a header (AS_CFG_MAGIC, block count, edge count, 0), then
+   the address and original ID of every block, then edges as pairs of block
+   numbers within the record. afl-gcc picks these up after linking. */
+
+static void write_cfg(FILE* outf) {
+
+  u32* local = ck_alloc(cfg_blk_cnt * sizeof(u32) + 1);
+  u32 i, g;
+
+  qsort(cfg_lbl, cfg_lbl_cnt, sizeof(struct cfg_label), cfg_label_cmp);
+
+  for (i = 0; i < cfg_jmp_cnt; i++) {
+
+    struct cfg_label key = { cfg_jmp[i].to, 0 }, *l;
+
+    l = bsearch(&key, cfg_lbl, cfg_lbl_cnt, sizeof(struct cfg_label),
+                cfg_label_cmp);
+
+    /* Labels right before the end of a section never get a block. */
+
+    if (l && l->blk != CFG_NONE) {
+      CFG_GROW(cfg_edge, cfg_edge_cnt);
+      cfg_edge[cfg_edge_cnt].src = cfg_jmp[i].src;
+      cfg_edge[cfg_edge_cnt].dst = l->blk;
+      cfg_edge_cnt++;
+    }
+
+  }
+
+  for (g = 0; g < cfg_grp_cnt; g++) {
+
+    u32 blocks = 0, edges = 0;
+
+    for (i = 0; i < cfg_blk_cnt; i++)
+      if (cfg_blk[i].grp == g) local[i] = blocks++;
+
+    if (!blocks) continue;
+
+    for (i = 0; i < cfg_edge_cnt; i++)
+      if (cfg_blk[cfg_edge[i].src].grp == g &&
+          cfg_blk[cfg_edge[i].dst].grp == g) edges++;
+
+    if (g) fprintf(outf, "\n\t.section " AS_CFG_SECTION ",\"G\",@note,"
+                         "%s,comdat\n", cfg_grp[g]);
+    else fputs("\n\t.section " AS_CFG_SECTION ",\"\",@note\n", outf);
+
+    fprintf(outf, "\t.balign 8\n\t.long 0x%08x, %u, %u, 0\n", AS_CFG_MAGIC,
+            blocks, edges);
+
+    for (i = 0; i < cfg_blk_cnt; i++) {
+
+      if (cfg_blk[i].grp != g) continue;
+
+      if (use_64bit)
+        fprintf(outf, "\t.quad .Lafl_id_%u\n\t.long 0x%08x, 0\n", i,
+                cfg_blk[i].id);
+      else
+        fprintf(outf, "\t.long .Lafl_id_%u, 0x%08x\n", i, cfg_blk[i].id);
+
+    }
+
+    for (i = 0; i < cfg_edge_cnt; i++)
+      if (cfg_blk[cfg_edge[i].src].grp == g &&
+          cfg_blk[cfg_edge[i].dst].grp == g)
+        fprintf(outf, "\t.long %u, %u\n", local[cfg_edge[i].src],
+                local[cfg_edge[i].dst]);
+
+  }
+
+  ck_free(local);
+
+}
+
 
 /* Examine and modify parameters to pass to 'as'. Note that the file name
    is always the last parameter passed by GCC, so we exploit this property
@@ -257,6 +522,8 @@ static void add_instrumentation(void) {
 
   if (!outf) PFATAL("fdopen() failed");  
 
+  cur_blk = CFG_NONE;
+
   while (fgets(line, MAX_LINE, inf)) {
 
     /* In some cases, we want to defer writing the instrumentation trampoline
@@ -267,8 +534,7 @@ static void add_instrumentation(void) {
     if (!pass_thru && !skip_intel && !skip_app && !skip_csect && instr_ok &&
         instrument_next && line[0] == '\t' && isalpha(line[1])) {
 
-      fprintf(outf, use_64bit ? trampoline_fmt_64 : trampoline_fmt_32,
-              R(MAP_SIZE));
+      emit_trampoline(outf);
 
       instrument_next = 0;
       ins_lines++;
@@ -299,6 +565,7 @@ static void add_instrumentation(void) {
           !strncmp(line + 2, "section\t__TEXT,__text", 21) ||
           !strncmp(line + 2, "section __TEXT,__text", 21)) {
         instr_ok = 1;
+        if (solve_ids) cfg_set_group(line);
         continue; 
       }
 
@@ -307,6 +574,7 @@ static void add_instrumentation(void) {
           !strncmp(line + 2, "bss\n", 4) ||
           !strncmp(line + 2, "data\n", 5)) {
         instr_ok = 0;
+        cfg_pend_lbl = cfg_lbl_cnt;
         continue;
       }
 
@@ -371,10 +639,11 @@ static void add_instrumentation(void) {
 
     if (line[0] == '\t') {
 
+      if (solve_ids && isalpha(line[1])) cfg_add_insn(line);
+
       if (line[1] == 'j' && line[2] != 'm' && R(100) < inst_ratio) {
 
-        fprintf(outf, use_64bit ? trampoline_fmt_64 : trampoline_fmt_32,
-                R(MAP_SIZE));
+        emit_trampoline(outf);
 
         ins_lines++;
 
@@ -402,6 +671,11 @@ static void add_instrumentation(void) {
 
     if (strstr(line, ":")) {
 
+      /* Code after a label that can't be reached by falling through is not
+         part of the block we were in; we don't know whose it is. */
+
+      if (solve_ids && !cur_falls) cur_blk = CFG_NONE;
+
       if (line[0] == '.') {
 
 #endif /* __APPLE__ */
@@ -435,7 +709,12 @@ static void add_instrumentation(void) {
              .Lfunc_begin0-style exception handling calculations (a problem on
              MacOS X). */
 
-          if (!skip_next_label) instrument_next = 1; else skip_next_label = 0;
+          if (!skip_next_label) {
+
+            instrument_next = 1;
+            if (solve_ids) cfg_add_label(line);
+
+          } else skip_next_label = 0;
 
         }
 
@@ -444,6 +723,11 @@ static void add_instrumentation(void) {
         /* Function label (always instrumented, deferred mode). */
 
         instrument_next = 1;
+
+        if (solve_ids) {
+          cfg_add_label(line);
+          cur_blk = CFG_NONE;
+        }
     
       }
 
@@ -454,6 +738,8 @@ static void add_instrumentation(void) {
   if (ins_lines)
     fputs(use_64bit ? main_payload_64 : main_payload_32, outf);
 
+  if (solve_ids && cfg_blk_cnt) write_cfg(outf);
+
   if (input_file) fclose(inf);
   fclose(outf);
 
@@ -522,6 +808,16 @@ int main(int argc, char** argv) {
 
   }
 
+  if (getenv("AFL_SOLVE_IDS")) {
+
+#ifdef __APPLE__
+    WARNF("AFL_SOLVE_IDS is not supported on this platform, ignoring");
+#else
+    solve_ids = 1;
+#endif /* ^__APPLE__ */
+
+  }
+
   if (getenv(AS_LOOP_ENV_VAR))
     FATAL("Endless loop when calling 'as' (remove '.' from your PATH)");
 
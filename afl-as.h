@@ -110,6 +110,10 @@
    to be optimized in funny ways, we need to be very careful to save every
    oddball register it may touch.
 
+   The %s in front of the mov that loads the location ID is normally empty.
+   With AFL_SOLVE_IDS, afl-as puts a local label there, so that afl-gcc can
+   find the immediate after linking and replace it with a solved ID.
+
  */
 
 static const u8* trampoline_fmt_32 =
@@ -124,7 +128,7 @@ static const u8* trampoline_fmt_32 =
   "movl %%edx,  4(%%esp)\n"
   "movl %%ecx,  8(%%esp)\n"
   "movl %%eax, 12(%%esp)\n"
-  "movl $0x%08x, %%ecx\n"
+  "%smovl $0x%08x, %%ecx\n"
   "call __afl_maybe_log\n"
   "movl 12(%%esp), %%eax\n"
   "movl  8(%%esp), %%ecx\n"
@@ -146,7 +150,7 @@ static const u8* trampoline_fmt_64 =
   "movq %%rdx,  0(%%rsp)\n"
   "movq %%rcx,  8(%%rsp)\n"
   "movq %%rax, 16(%%rsp)\n"
-  "movq $0x%08x, %%rcx\n"
+  "%smovq $0x%08x, %%rcx\n"
   "call __afl_maybe_log\n"
   "movq 16(%%rsp), %%rax\n"
   "movq  8(%%rsp), %%rcx\n"
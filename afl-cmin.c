@@ -0,0 +1,1002 @@
+/*
+  Copyright 2014 Google LLC All rights reserved.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at:
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+   american fuzzy lop - corpus minimization tool
+   ---------------------------------------------
+
+   Written and maintained by Michal Zalewski <lcamtuf@google.com>
+
+   This tool tries to find the smallest subset of files in the input directory
+   that still trigger the full range of instrumentation data points seen in
+   the starting corpus. This has two uses:
+
+     - Screening large corpora of input files before using them as a seed for
+       afl-fuzz. The tool will remove functionally redundant files and likely
+       leave you with a much smaller set.
+
+       (In this case, you probably also want to consider running afl-tmin on
+       the individual files later on to reduce their size.)
+
+     - Minimizing the corpus generated organically by afl-fuzz, perhaps when
+       planning to feed it to more resource-intensive tools. The tool achieves
+       this by removing all entries that used to trigger unique behaviors in
+       the past, but have been made obsolete by later finds.
+
+   Note that the tool doesn't modify the files themselves. For that, you want
+   afl-tmin.
+
+   Traces are collected through one or more fork servers (see fsrv-inl.h),
+   kept in memory as delta-coded lists of tuples, and the set cover is then
+   solved the same way the old shell script did: for every tuple, from the
+   least common to the most common one, take the smallest file that has it,
+   unless the tuple is already covered by an earlier pick.
+*/
+
+#define AFL_MAIN
+#include "android-ashmem.h"
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+#include "alloc-inl.h"
+#include "hash.h"
+#include "bitmap-inl.h"
+#include "fsrv-inl.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+
+/* A tuple is a map index together with the hit count class it was seen
+   with, as (index << 3) | log2(class). */
+
+#define TUPLE_SHIFT 3
+
+struct cmin_entry {
+
+  u8* name;                           /* File name, relative to in_dir     */
+  u32 size;                           /* File size                         */
+
+  u8* set;                            /* Delta-coded tuple list, or NULL   */
+  u32 set_len,                        /* Bytes in set                      */
+      tuples;                         /* Number of tuples in set           */
+
+  u8  picked;                         /* Part of the output set?           */
+
+};
+
+static struct cmin_entry* entries;    /* All the input files               */
+static u32 entry_cnt;
+
+static u8 *in_dir,                    /* Input directory                   */
+          *out_dir,                   /* Output directory                  */
+          *stdin_file,                /* Location read by the program (-f) */
+          *doc_path,                  /* Path to docs                      */
+          *target_path;               /* Path to target binary             */
+
+static u32 exec_tmout,                /* Exec timeout (ms)                 */
+           job_cnt = 1,               /* Fork servers to use               */
+           map_size = MAP_SIZE;       /* Bitmap bytes used by the target   */
+
+static u64 mem_limit = MEM_LIMIT_CMIN; /* Memory limit (MB)                */
+
+static u8  edges_only,                /* Ignore hit counts?                */
+           crashes_only,              /* Keep crashing inputs only?        */
+           qemu_mode;                 /* Running in QEMU mode?             */
+
+static volatile u8 stop_soon;         /* Ctrl-C pressed?                   */
+
+/* Same bucketing as in afl-fuzz, but kept as one bit per class. */
+
+static const u8 count_class_binary[256] = {
+
+  [0]           = 0,
+  [1]           = 1,
+  [2]           = 2,
+  [3]           = 4,
+  [4 ... 7]     = 8,
+  [8 ... 15]    = 16,
+  [16 ... 31]   = 32,
+  [32 ... 127]  = 64,
+  [128 ... 255] = 128
+
+};
+
+static void classify_counts(u8* mem) {
+
+  u32 i = map_size;
+
+  if (edges_only) {
+
+    if (bm_edges_only) {
+      bm_edges_only(mem, map_size);
+      return;
+    }
+
+    while (i--) {
+      if (*mem) *mem = 1;
+      mem++;
+    }
+
+  } else {
+
+    if (bm_classify) {
+      bm_classify(mem, NULL, map_size, NULL, 0);
+      return;
+    }
+
+    while (i--) {
+      *mem = count_class_binary[*mem];
+      mem++;
+    }
+
+  }
+
+}
+
+
+/* Append a varint to buf. */
+
+static inline u8* put_varint(u8* buf, u32 val) {
+
+  while (val >= 0x80) {
+    *(buf++) = val | 0x80;
+    val >>= 7;
+  }
+
+  *(buf++) = val;
+  return buf;
+
+}
+
+
+/* Read a varint from buf. */
+
+static inline u8* get_varint(u8* buf, u32* val) {
+
+  u32 ret = 0, shift = 0;
+
+  while (*buf & 0x80) {
+    ret |= (*(buf++) & 0x7f) << shift;
+    shift += 7;
+  }
+
+  *val = ret | (*(buf++) << shift);
+  return buf;
+
+}
+
+
+/* Decode the tuple list of an entry into dst[]. Returns the count. */
+
+static u32 decode_set(struct cmin_entry* e, u32* dst) {
+
+  u8* pos = e->set;
+  u32 i, t = 0;
+
+  for (i = 0; i < e->tuples; i++) {
+
+    u32 delta;
+
+    pos = get_varint(pos, &delta);
+    t += delta;
+    dst[i] = t;
+
+  }
+
+  return e->tuples;
+
+}
+
+
+/* Store the trace of a finished run as the tuple set of e. scratch needs to
+   hold 5 bytes per map byte in the worst case. */
+
+static void store_trace(struct cmin_entry* e, u8* trace, u8* scratch) {
+
+  u8* pos = scratch;
+  u32 i, last = 0;
+  u64* words = (u64*)trace;
+
+  classify_counts(trace);
+
+  for (i = 0; i < (map_size >> 3); i++) {
+
+    u32 j;
+
+    if (!words[i]) continue;
+
+    for (j = i << 3; j < (i + 1) << 3; j++) {
+
+      u32 t;
+
+      if (!trace[j]) continue;
+
+      t = (j << TUPLE_SHIFT) | __builtin_ctz(trace[j]);
+
+      pos  = put_varint(pos, t - last);
+      last = t;
+      e->tuples++;
+
+    }
+
+  }
+
+  e->set_len = pos - scratch;
+  e->set     = e->set_len ? ck_memdup(scratch, e->set_len) : NULL;
+
+}
+
+
+/* Handle Ctrl-C and the like. */
+
+static void handle_stop_sig(int sig) {
+
+  stop_soon = 1;
+  fsrv_kill_all();
+
+}
+
+
+/* Setup signal handlers, duh. */
+
+static void setup_signal_handlers(void) {
+
+  struct sigaction sa;
+
+  sa.sa_handler   = NULL;
+  sa.sa_flags     = SA_RESTART;
+  sa.sa_sigaction = NULL;
+
+  sigemptyset(&sa.sa_mask);
+
+  sa.sa_handler = handle_stop_sig;
+  sigaction(SIGHUP, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+}
+
+
+/* Do basic preparations - sanitizer settings and the like. */
+
+static void set_up_environment(void) {
+
+  setenv("ASAN_OPTIONS", "abort_on_error=1:"
+                         "detect_leaks=0:"
+                         "symbolize=0:"
+                         "allocator_may_return_null=1", 0);
+
+  setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
+                         "symbolize=0:"
+                         "abort_on_error=1:"
+                         "allocator_may_return_null=1:"
+                         "msan_track_origins=0", 0);
+
+  if (getenv("AFL_PRELOAD")) {
+    setenv("LD_PRELOAD", getenv("AFL_PRELOAD"), 1);
+    setenv("DYLD_INSERT_LIBRARIES", getenv("AFL_PRELOAD"), 1);
+  }
+
+}
+
+
+/* Find binary, check for instrumentation. */
+
+static void find_binary(u8* fname) {
+
+  u8* env_path = 0;
+  struct stat st;
+  s32 fd;
+  u8* f_data;
+
+  if (strchr(fname, '/') || !(env_path = getenv("PATH"))) {
+
+    target_path = ck_strdup(fname);
+
+    if (stat(target_path, &st) || !S_ISREG(st.st_mode) ||
+        !(st.st_mode & 0111) || st.st_size < 4)
+      FATAL("Program '%s' not found or not executable", fname);
+
+  } else {
+
+    while (env_path) {
+
+      u8 *cur_elem, *delim = strchr(env_path, ':');
+
+      if (delim) {
+
+        cur_elem = ck_alloc(delim - env_path + 1);
+        memcpy(cur_elem, env_path, delim - env_path);
+        delim++;
+
+      } else cur_elem = ck_strdup(env_path);
+
+      env_path = delim;
+
+      if (cur_elem[0])
+        target_path = alloc_printf("%s/%s", cur_elem, fname);
+      else
+        target_path = ck_strdup(fname);
+
+      ck_free(cur_elem);
+
+      if (!stat(target_path, &st) && S_ISREG(st.st_mode) &&
+          (st.st_mode & 0111) && st.st_size >= 4) break;
+
+      ck_free(target_path);
+      target_path = 0;
+
+    }
+
+    if (!target_path) FATAL("Program '%s' not found or not executable", fname);
+
+  }
+
+  if (getenv("AFL_SKIP_BIN_CHECK") || qemu_mode) return;
+
+  fd = open(target_path, O_RDONLY);
+  if (fd < 0) PFATAL("Unable to open '%s'", target_path);
+
+  f_data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (f_data == MAP_FAILED) PFATAL("Unable to mmap file '%s'", target_path);
+
+  close(fd);
+
+  if (!memmem(f_data, st.st_size, SHM_ENV_VAR, strlen(SHM_ENV_VAR) + 1))
+    FATAL("Binary '%s' doesn't appear to be instrumented", target_path);
+
+  munmap(f_data, st.st_size);
+
+}
+
+
+/* Fix up argv for QEMU. */
+
+static char** get_qemu_argv(u8* own_loc, char** argv, int argc) {
+
+  char** new_argv = ck_alloc(sizeof(char*) * (argc + 4));
+  u8 *tmp, *cp, *rsl, *own_copy;
+
+  /* Workaround for a QEMU stability glitch. */
+
+  setenv("QEMU_LOG", "nochain", 1);
+
+  memcpy(new_argv + 3, argv + 1, sizeof(char*) * argc);
+
+  new_argv[2] = target_path;
+  new_argv[1] = "--";
+
+  /* Now we need to actually find qemu for argv[0]. */
+
+  tmp = getenv("AFL_PATH");
+
+  if (tmp) {
+
+    cp = alloc_printf("%s/afl-qemu-trace", tmp);
+
+    if (access(cp, X_OK))
+      FATAL("Unable to find '%s'", tmp);
+
+    target_path = new_argv[0] = cp;
+    return new_argv;
+
+  }
+
+  own_copy = ck_strdup(own_loc);
+  rsl = strrchr(own_copy, '/');
+
+  if (rsl) {
+
+    *rsl = 0;
+
+    cp = alloc_printf("%s/afl-qemu-trace", own_copy);
+    ck_free(own_copy);
+
+    if (!access(cp, X_OK)) {
+
+      target_path = new_argv[0] = cp;
+      return new_argv;
+
+    }
+
+  } else ck_free(own_copy);
+
+  if (!access(BIN_PATH "/afl-qemu-trace", X_OK)) {
+
+    target_path = new_argv[0] = BIN_PATH "/afl-qemu-trace";
+    return new_argv;
+
+  }
+
+  FATAL("Unable to find 'afl-qemu-trace'.");
+
+}
+
+
+/* Read the list of input files. */
+
+static void read_inputs(void) {
+
+  struct dirent** nl;
+  s32 nl_cnt, i;
+  u8* fn = alloc_printf("%s/queue", in_dir);
+
+  /* Accept afl-fuzz output directories, too. */
+
+  if (!access(fn, F_OK)) in_dir = fn; else ck_free(fn);
+
+  nl_cnt = scandir(in_dir, &nl, NULL, alphasort);
+  if (nl_cnt < 0) PFATAL("Unable to open '%s'", in_dir);
+
+  entries = ck_alloc(sizeof(struct cmin_entry) * (nl_cnt + 1));
+
+  for (i = 0; i < nl_cnt; i++) {
+
+    struct stat st;
+
+    if (nl[i]->d_name[0] == '.') {
+      free(nl[i]); /* not tracked */
+      continue;
+    }
+
+    fn = alloc_printf("%s/%s", in_dir, nl[i]->d_name);
+
+    if (lstat(fn, &st)) PFATAL("Unable to access '%s'", fn);
+
+    if (S_ISDIR(st.st_mode))
+      FATAL("The input directory contains subdirectories - please fix.");
+
+    if (S_ISREG(st.st_mode)) {
+
+      if (st.st_size > 0xffffffffULL) FATAL("File '%s' is too large", fn);
+
+      entries[entry_cnt].name = ck_strdup(nl[i]->d_name);
+      entries[entry_cnt].size = st.st_size;
+      entry_cnt++;
+
+    }
+
+    ck_free(fn);
+    free(nl[i]); /* not tracked */
+
+  }
+
+  free(nl); /* not tracked */
+
+  if (!entry_cnt) {
+    OKF("Hmm, no inputs in the target directory. Nothing to be done.");
+    exit(1);
+  }
+
+}
+
+
+/* Get the output directory ready: it may exist, but must not contain
+   anything other than the output of an earlier run. */
+
+static void setup_out_dir(void) {
+
+  DIR* d;
+  struct dirent* de;
+
+  if (!mkdir(out_dir, 0700)) return;
+
+  if (errno != EEXIST) PFATAL("Unable to create '%s'", out_dir);
+
+  d = opendir(out_dir);
+  if (!d) PFATAL("Unable to open '%s'", out_dir);
+
+  while ((de = readdir(d))) {
+
+    if (!strncmp(de->d_name, "id:", 3) || !strncmp(de->d_name, "id_", 3)) {
+
+      u8* fn = alloc_printf("%s/%s", out_dir, de->d_name);
+      unlink(fn); /* Ignore errors */
+      ck_free(fn);
+
+    }
+
+  }
+
+  closedir(d);
+
+  if (rmdir(out_dir) || mkdir(out_dir, 0700))
+    FATAL("Directory '%s' exists and is not empty - delete it first",
+          out_dir);
+
+}
+
+
+/* Number of nonzero bytes in a trace. */
+
+static u32 count_bytes_nz(u8* mem) {
+
+  u32 i, ret = 0;
+
+  for (i = 0; i < map_size; i++)
+    if (mem[i]) ret++;
+
+  return ret;
+
+}
+
+
+/* Read a file and start it on the given server. */
+
+static void start_entry(struct fsrv* f, struct cmin_entry* e) {
+
+  u8* fn = alloc_printf("%s/%s", in_dir, e->name);
+  u8* mem = ck_alloc_nozero(e->size);
+  s32 fd = open(fn, O_RDONLY);
+
+  if (fd < 0) PFATAL("Unable to open '%s'", fn);
+  ck_read(fd, mem, e->size, fn);
+  close(fd);
+
+  fsrv_write(f, mem, e->size);
+  fsrv_go(f);
+
+  ck_free(mem);
+  ck_free(fn);
+
+}
+
+
+/* Collect traces for all inputs, keeping every server busy. */
+
+static void collect_traces(char** argv) {
+
+  struct fsrv** fs = ck_alloc(sizeof(struct fsrv*) * job_cnt);
+  u32* cur = ck_alloc(sizeof(u32) * job_cnt);
+  u8*  scratch;
+  u32  i, next = 0, busy = 0, done = 0, rejected = 0;
+  s32  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (job_cnt > entry_cnt) job_cnt = entry_cnt;
+
+  /* With -f, the target reads a fixed location, so there can only be one
+     run at a time. */
+
+  if (stdin_file && job_cnt > 1) {
+    WARNF("-f doesn't allow parallel runs, using just one fork server.");
+    job_cnt = 1;
+  }
+
+  for (i = 0; i < job_cnt; i++) {
+
+    struct fsrv* f = fs[i] = ck_alloc(sizeof(struct fsrv));
+    u8 found = 0;
+
+    fsrv_init(f);
+
+    f->target_path = target_path;
+    f->out_file    = stdin_file ? stdin_file :
+                     alloc_printf("%s/.cur_input.%u", out_dir, i);
+    f->argv        = fsrv_subst_argv(argv, f->out_file, &found);
+    f->use_stdin   = !found && !stdin_file;
+    f->quiet       = 1;
+    f->mem_limit   = mem_limit;
+    f->exec_tmout  = exec_tmout;
+
+    if (job_cnt > 1 && cpus > 0 && !getenv("AFL_NO_AFFINITY"))
+      f->cpu = i % cpus;
+
+    fsrv_start(f);
+
+  }
+
+  map_size = fs[0]->map_size;
+  scratch  = ck_alloc(map_size * 5);
+
+  /* Make sure that we can actually get anything out of the target before we
+     waste too much time. */
+
+  ACTF("Testing the target binary...");
+
+  start_entry(fs[0], &entries[0]);
+  fsrv_wait(fs, 1);
+
+  if (!count_bytes_nz(fs[0]->trace_bits))
+    FATAL("No instrumentation output detected (perhaps crash or timeout)");
+
+  OKF("OK, %u tuples recorded.", count_bytes_nz(fs[0]->trace_bits));
+
+  ACTF("Obtaining traces for input files in '%s'...", in_dir);
+
+  while (1) {
+
+    for (i = 0; i < job_cnt && !stop_soon; i++)
+      if (!fs[i]->running && next < entry_cnt) {
+        start_entry(fs[i], &entries[next]);
+        cur[i] = next++;
+        busy++;
+      }
+
+    if (!busy) break;
+
+    i = fsrv_wait(fs, job_cnt);
+    busy--;
+
+    if (stop_soon) continue;
+
+    /* Inputs with the wrong outcome are left with an empty set, so they
+       won't ever get picked. */
+
+    if (fsrv_fault(fs[i]) == (crashes_only ? FSRV_CRASH : FSRV_NONE))
+      store_trace(&entries[cur[i]], fs[i]->trace_bits, scratch);
+    else rejected++;
+
+    if (!(++done % 1000) || done == entry_cnt)
+      SAYF("\r    Processing file %u/%u... ", done, entry_cnt);
+
+  }
+
+  SAYF("\n");
+
+  if (stop_soon) FATAL("Aborted by user");
+
+  if (rejected)
+    WARNF("Rejected %u file%s that %s.", rejected, rejected == 1 ? "" : "s",
+          crashes_only ? "didn't crash" : "crashed or timed out");
+
+  for (i = 0; i < job_cnt; i++) {
+    fsrv_destroy(fs[i]);
+    if (!stdin_file) ck_free(fs[i]->out_file);
+  }
+
+  ck_free(scratch);
+
+}
+
+
+/* Sorting helpers. */
+
+static u32* tuple_cnt;
+
+static int cmp_size(const void* a, const void* b) {
+
+  struct cmin_entry *ea = &entries[*(u32*)a], *eb = &entries[*(u32*)b];
+
+  if (ea->size != eb->size) return ea->size < eb->size ? -1 : 1;
+  return *(u32*)a < *(u32*)b ? -1 : 1;
+
+}
+
+static int cmp_popularity(const void* a, const void* b) {
+
+  u32 ta = *(u32*)a, tb = *(u32*)b;
+
+  if (tuple_cnt[ta] != tuple_cnt[tb])
+    return tuple_cnt[ta] < tuple_cnt[tb] ? -1 : 1;
+
+  return ta < tb ? -1 : (ta > tb);
+
+}
+
+
+/* Pick the output set. Returns the number of files picked. */
+
+static u32 solve(void) {
+
+  u32 tuple_max = map_size << TUPLE_SHIFT;
+  u32 *best  = ck_alloc(sizeof(u32) * tuple_max),
+      *order = ck_alloc(sizeof(u32) * entry_cnt),
+      *list  = ck_alloc(sizeof(u32) * tuple_max),
+      *set   = ck_alloc(sizeof(u32) * map_size);
+  u8* covered = ck_alloc(tuple_max >> 3);
+  u32 i, j, cnt, uniq = 0, ret = 0;
+
+  tuple_cnt = ck_alloc(sizeof(u32) * tuple_max);
+
+  ACTF("Sorting trace sets...");
+
+  /* The best candidate for every tuple is simply the smallest file that
+     has it; going through the files by size, that's the first one. */
+
+  for (i = 0; i < entry_cnt; i++) order[i] = i;
+  qsort(order, entry_cnt, sizeof(u32), cmp_size);
+
+  for (i = 0; i < entry_cnt; i++) {
+
+    cnt = decode_set(&entries[order[i]], set);
+
+    for (j = 0; j < cnt; j++)
+      if (!tuple_cnt[set[j]]++) {
+        best[set[j]] = order[i];
+        list[uniq++] = set[j];
+      }
+
+  }
+
+  if (!uniq) FATAL("No traces obtained from test cases, check syntax!");
+
+  OKF("Found %u unique tuples across %u files.", uniq, entry_cnt);
+
+  /* We won't be able to avoid the files that trigger unique tuples anyway,
+     so start with them and work towards the most common ones. */
+
+  qsort(list, uniq, sizeof(u32), cmp_popularity);
+
+  ACTF("Processing candidates...");
+
+  for (i = 0; i < uniq; i++) {
+
+    struct cmin_entry* e;
+
+    if (covered[list[i] >> 3] & (1 << (list[i] & 7))) continue;
+
+    e = &entries[best[list[i]]];
+    e->picked = 1;
+    ret++;
+
+    cnt = decode_set(e, set);
+
+    for (j = 0; j < cnt; j++)
+      covered[set[j] >> 3] |= 1 << (set[j] & 7);
+
+  }
+
+  ck_free(tuple_cnt);
+  ck_free(covered);
+  ck_free(set);
+  ck_free(list);
+  ck_free(order);
+  ck_free(best);
+
+  return ret;
+
+}
+
+
+/* Link or copy the picked files to out_dir. */
+
+static void write_output(void) {
+
+  u32 i;
+
+  for (i = 0; i < entry_cnt; i++) {
+
+    u8 *src, *dst;
+
+    if (!entries[i].picked) continue;
+
+    src = alloc_printf("%s/%s", in_dir, entries[i].name);
+    dst = alloc_printf("%s/%s", out_dir, entries[i].name);
+
+    if (link(src, dst)) {
+
+      s32 sfd = open(src, O_RDONLY), dfd, len;
+      u8 tmp[64 * 1024];
+
+      if (sfd < 0) PFATAL("Unable to open '%s'", src);
+
+      dfd = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0600);
+      if (dfd < 0) PFATAL("Unable to create '%s'", dst);
+
+      while ((len = read(sfd, tmp, sizeof(tmp))) > 0)
+        ck_write(dfd, tmp, len, dst);
+
+      if (len < 0) PFATAL("read() failed");
+
+      close(sfd);
+      close(dfd);
+
+    }
+
+    ck_free(src);
+    ck_free(dst);
+
+  }
+
+}
+
+
+/* Display usage hints. */
+
+static void usage(u8* argv0) {
+
+  SAYF("\n%s [ options ] -- /path/to/target_app [ ... ]\n\n"
+
+       "Required parameters:\n\n"
+
+       "  -i dir        - input directory with the starting corpus\n"
+       "  -o dir        - output directory for minimized files\n\n"
+
+       "Execution control settings:\n\n"
+
+       "  -f file       - location read by the fuzzed program (stdin)\n"
+       "  -m megs       - memory limit for child process (%u MB)\n"
+       "  -t msec       - run time limit for child process (none)\n"
+       "  -j count      - number of fork servers to run in parallel (1)\n"
+       "  -Q            - use binary-only instrumentation (QEMU mode)\n\n"
+
+       "Minimization settings:\n\n"
+
+       "  -C            - keep crashing inputs, reject everything else\n"
+       "  -e            - solve for edge coverage only, ignore hit counts\n\n"
+
+       "For additional tips, please consult %s/README.\n\n",
+
+       argv0, MEM_LIMIT_CMIN, doc_path);
+
+  exit(1);
+
+}
+
+
+/* Main entry point */
+
+int main(int argc, char** argv) {
+
+  s32 opt;
+  u8  mem_limit_given = 0;
+  u32 out_cnt;
+  char** use_argv;
+
+  doc_path = access(DOC_PATH, F_OK) ? "docs" : DOC_PATH;
+
+  SAYF(cCYA "afl-cmin " cBRI VERSION cRST " by <lcamtuf@google.com>\n");
+
+  while ((opt = getopt(argc,argv,"+i:o:f:m:t:j:eQC")) > 0)
+
+    switch (opt) {
+
+      case 'i':
+
+        if (in_dir) FATAL("Multiple -i options not supported");
+        in_dir = optarg;
+        break;
+
+      case 'o':
+
+        if (out_dir) FATAL("Multiple -o options not supported");
+        out_dir = optarg;
+        break;
+
+      case 'f':
+
+        if (stdin_file) FATAL("Multiple -f options not supported");
+        stdin_file = optarg;
+        break;
+
+      case 'm': {
+
+          u8 suffix = 'M';
+
+          if (mem_limit_given) FATAL("Multiple -m options not supported");
+          mem_limit_given = 1;
+
+          if (!strcmp(optarg, "none")) {
+
+            mem_limit = 0;
+            break;
+
+          }
+
+          if (sscanf(optarg, "%llu%c", &mem_limit, &suffix) < 1 ||
+              optarg[0] == '-') FATAL("Bad syntax used for -m");
+
+          switch (suffix) {
+
+            case 'T': mem_limit *= 1024 * 1024; break;
+            case 'G': mem_limit *= 1024; break;
+            case 'k': mem_limit /= 1024; break;
+            case 'M': break;
+
+            default:  FATAL("Unsupported suffix or bad syntax for -m");
+
+          }
+
+          if (mem_limit < 5) FATAL("Dangerously low value of -m");
+
+          if (sizeof(rlim_t) == 4 && mem_limit > 2000)
+            FATAL("Value of -m out of range on 32-bit systems");
+
+        }
+
+        break;
+
+      case 't':
+
+        if (strcmp(optarg, "none")) {
+
+          exec_tmout = atoi(optarg);
+
+          if (exec_tmout < 10 || optarg[0] == '-')
+            FATAL("Dangerously low value of -t");
+
+        }
+
+        break;
+
+      case 'j':
+
+        job_cnt = atoi(optarg);
+
+        if (job_cnt < 1 || job_cnt > FSRV_MAX)
+          FATAL("Value of -j must be between 1 and %u", FSRV_MAX);
+
+        break;
+
+      case 'e':
+
+        edges_only = 1;
+        break;
+
+      case 'C':
+
+        crashes_only = 1;
+        break;
+
+      case 'Q':
+
+        if (qemu_mode) FATAL("Multiple -Q options not supported");
+        if (!mem_limit_given) mem_limit = MEM_LIMIT_CMIN_QEMU;
+
+        qemu_mode = 1;
+        break;
+
+      default:
+
+        usage(argv[0]);
+
+    }
+
+  if (optind == argc || !in_dir || !out_dir) usage(argv[0]);
+
+  init_bitmap_ops();
+  setup_signal_handlers();
+  set_up_environment();
+
+  find_binary(argv[optind]);
+
+  read_inputs();
+  setup_out_dir();
+
+  if (qemu_mode)
+    use_argv = get_qemu_argv(argv[0], argv + optind, argc - optind);
+  else
+    use_argv = argv + optind;
+
+  collect_traces(use_argv);
+
+  out_cnt = solve();
+
+  if (out_cnt == 1) WARNF("All test cases had the same traces, check syntax!");
+
+  write_output();
+
+  OKF("Narrowed down to %u file%s, saved in '%s'.", out_cnt,
+      out_cnt == 1 ? "" : "s", out_dir);
+
+  exit(0);
+
+}
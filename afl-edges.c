@@ -0,0 +1,464 @@
+/*
+  Copyright 2019 Google LLC All rights reserved.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at:
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+   american fuzzy lop - edge table audit
+   -------------------------------------
+
+   Reads the edge tables written by afl-llvm-pass.so when building with
+   AFL_LLVM_EDGE_TABLE=<dir> set, and tells you how well the map IDs came
+   out for the whole build: how many edges end up sharing a map slot with
+   some other edge, within a module and across modules, how full the map
+   is, and how the CollAFL solver fared.
+
+   With -a, it instead annotates the output of afl-showmap with the names
+   of the edges behind every map slot.
+
+   The tables only cover edges within a function; see llvm_mode/README.llvm
+   for what's left out.
+
+*/
+
+#define AFL_MAIN
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+#include "alloc-inl.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <dirent.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+struct edge {
+  u32 slot;                           /* Map index                         */
+  u32 mod;                            /* Module it comes from              */
+  u8* name;                           /* func:src->dst plus location       */
+};
+
+struct module {
+  u8* id;                             /* Module identifier                 */
+  u32 map_size,                       /* Map size it was solved for        */
+      y,                              /* Global y picked by the solver     */
+      fmul, fhash, fsingle,           /* Blocks of each kind               */
+      entries;                        /* Function entry blocks             */
+};
+
+static struct edge*   edges;          /* All edges, sorted by slot later   */
+static struct module* mods;           /* All modules                       */
+
+static u32 edge_cnt, mod_cnt,
+           map_size;                  /* Largest map size seen             */
+
+static u8  *annotate_file,            /* afl-showmap output for -a         */
+           *doc_path;                 /* Path to docs                      */
+
+static u8  be_quiet,                  /* Quiet mode (-q)                   */
+           list_slots;                /* List colliding slots (-v)         */
+
+
+/* Read one edge table. */
+
+static void read_table(u8* fn) {
+
+  FILE* f = fopen(fn, "r");
+  char* line = NULL;
+  size_t line_sz = 0;
+  u32 lineno = 0, cur_mod = 0;
+  u8  have_mod = 0;
+
+  if (!f) PFATAL("Unable to open '%s'", fn);
+
+  while (getline(&line, &line_sz, f) > 0) {
+
+    char* fld[8];
+    char* p = line;
+    u32 n = 0;
+
+    lineno++;
+
+    line[strcspn(line, "\n")] = 0;
+    if (!line[0] || line[0] == '#') continue;
+
+    while (n < 8) {
+      fld[n++] = p;
+      p = strchr(p, '\t');
+      if (!p) break;
+      *(p++) = 0;
+    }
+
+    if (!strcmp(fld[0], "M") && n == 8) {
+
+      struct module* m;
+
+      mods = ck_realloc(mods, (mod_cnt + 1) * sizeof(struct module));
+      m = mods + mod_cnt;
+
+      m->id       = ck_strdup(fld[1]);
+      m->map_size = atoi(fld[2]);
+      m->y        = atoi(fld[3]);
+      m->fmul     = atoi(fld[4]);
+      m->fhash    = atoi(fld[5]);
+      m->fsingle  = atoi(fld[6]);
+      m->entries  = atoi(fld[7]);
+
+      if (m->map_size < 2 || m->map_size > MAP_SIZE)
+        FATAL("Bad map size in '%s', line %u", fn, lineno);
+
+      if (map_size && m->map_size != map_size)
+        WARNF("Modules built for different map sizes (%u vs %u).",
+              m->map_size, map_size);
+
+      if (m->map_size > map_size) map_size = m->map_size;
+
+      cur_mod  = mod_cnt++;
+      have_mod = 1;
+
+    } else if (!strcmp(fld[0], "E") && n == 7 && have_mod) {
+
+      struct edge* e;
+
+      if (!(edge_cnt % 4096))
+        edges = ck_realloc(edges, (edge_cnt + 4096) * sizeof(struct edge));
+
+      e = edges + edge_cnt++;
+
+      e->slot = atoi(fld[1]);
+      e->mod  = cur_mod;
+
+      if (e->slot >= mods[cur_mod].map_size)
+        FATAL("Map index out of range in '%s', line %u", fn, lineno);
+
+      if (strcmp(fld[6], "-"))
+        e->name = alloc_printf("%s:%s->%s (%s)", fld[3], fld[4], fld[5],
+                               fld[6]);
+      else
+        e->name = alloc_printf("%s:%s->%s", fld[3], fld[4], fld[5]);
+
+    } else FATAL("Malformed edge table '%s', line %u", fn, lineno);
+
+  }
+
+  free(line);
+  fclose(f);
+
+  if (!have_mod) WARNF("No module header in '%s'.", fn);
+
+}
+
+
+/* Read a table, or all *.edges files in a directory. */
+
+static void read_path(u8* path) {
+
+  struct stat st;
+  struct dirent** nl;
+  s32 nl_cnt, i;
+
+  if (stat(path, &st)) PFATAL("Unable to access '%s'", path);
+
+  if (!S_ISDIR(st.st_mode)) {
+    read_table(path);
+    return;
+  }
+
+  nl_cnt = scandir(path, &nl, NULL, alphasort);
+  if (nl_cnt < 0) PFATAL("Unable to open '%s'", path);
+
+  for (i = 0; i < nl_cnt; i++) {
+
+    u32 len = strlen(nl[i]->d_name);
+
+    if (len > 6 && !strcmp(nl[i]->d_name + len - 6, ".edges")) {
+
+      u8* fn = alloc_printf("%s/%s", path, nl[i]->d_name);
+      read_table(fn);
+      ck_free(fn);
+
+    }
+
+    free(nl[i]);
+
+  }
+
+  free(nl);
+
+}
+
+
+static int compare_edges(const void* a, const void* b) {
+
+  const struct edge *ea = a, *eb = b;
+
+  if (ea->slot != eb->slot) return ea->slot < eb->slot ? -1 : 1;
+  if (ea->mod != eb->mod) return ea->mod < eb->mod ? -1 : 1;
+  return 0;
+
+}
+
+
+/* First edge in the given slot, or edge_cnt if there is none. */
+
+static u32 find_slot(u32 slot) {
+
+  u32 lo = 0, hi = edge_cnt;
+
+  while (lo < hi) {
+
+    u32 mid = (lo + hi) / 2;
+
+    if (edges[mid].slot < slot) lo = mid + 1; else hi = mid;
+
+  }
+
+  return (lo < edge_cnt && edges[lo].slot == slot) ? lo : edge_cnt;
+
+}
+
+
+/* Print the edges in the slot starting at edges[i], comma separated. */
+
+static void print_slot(u32 i) {
+
+  u32 j;
+
+  for (j = i; j < edge_cnt && edges[j].slot == edges[i].slot; j++)
+    printf("%s%s", j == i ? "" : ", ", edges[j].name);
+
+}
+
+
+/* Go over the slots and report what's what. */
+
+static void show_stats(void) {
+
+  u64 fmul = 0, fhash = 0, fsingle = 0, entries = 0;
+  u32 used = 0, crowded = 0, in_crowded = 0, lost_in = 0, lost_cross = 0;
+  u32 min_y = ~0, max_y = 0, i, j;
+  double exp_used;
+
+  for (i = 0; i < mod_cnt; i++) {
+
+    fmul    += mods[i].fmul;
+    fhash   += mods[i].fhash;
+    fsingle += mods[i].fsingle;
+    entries += mods[i].entries;
+
+    if (mods[i].y < min_y) min_y = mods[i].y;
+    if (mods[i].y > max_y) max_y = mods[i].y;
+
+  }
+
+  /* Within a slot, edges are sorted by module, so the number of distinct
+     modules is easy to tell. More than one edge from the same module means
+     the solver ran out of collision-free IDs; edges from different modules
+     collide because every module solves on its own. */
+
+  for (i = 0; i < edge_cnt; i = j) {
+
+    u32 n_mod = 1;
+
+    for (j = i + 1; j < edge_cnt && edges[j].slot == edges[i].slot; j++)
+      if (edges[j].mod != edges[j - 1].mod) n_mod++;
+
+    used++;
+
+    if (j - i > 1) {
+
+      crowded++;
+      in_crowded += j - i;
+      lost_in    += j - i - n_mod;
+      lost_cross += n_mod - 1;
+
+      if (list_slots) {
+        printf("    %06u: ", edges[i].slot);
+        print_slot(i);
+        printf("\n");
+      }
+
+    }
+
+  }
+
+  if (list_slots && crowded) printf("\n");
+
+  /* For comparison: what random IDs, as in classic AFL, would get us. */
+
+  exp_used = map_size * (1 - pow(1 - 1.0 / map_size, edge_cnt));
+
+  SAYF(cGRA "          Modules : " cRST "%u (map size %u)\n"
+       cGRA "           Blocks : " cRST "%llu Fmul, %llu Fhash, %llu Fsingle, "
+            "%llu function entries\n"
+       cGRA "           Solver : " cRST "%0.02f%% of multi-pred blocks solved "
+            "by Fmul, y = %u..%u\n"
+       cGRA "     Static edges : " cRST "%u\n"
+       cGRA "   Map slots used : " cRST "%u (%0.02f%% of the map)\n"
+       cGRA "     Shared slots : " cRST "%u, holding %u edges (%0.02f%%)\n"
+       cGRA "   Edges obscured : " cRST "%u within modules, %u across modules "
+            "(%0.02f%%)\n"
+       cGRA "  With random IDs : " cRST "about %0.0f edges obscured "
+            "(%0.02f%%)\n\n",
+       mod_cnt, map_size, fmul, fhash, fsingle, entries,
+       (fmul + fhash) ? fmul * 100.0 / (fmul + fhash) : 100.0,
+       mod_cnt ? min_y : 0, max_y, edge_cnt, used,
+       map_size ? used * 100.0 / map_size : 0, crowded, in_crowded,
+       edge_cnt ? in_crowded * 100.0 / edge_cnt : 0, lost_in, lost_cross,
+       edge_cnt ? (lost_in + lost_cross) * 100.0 / edge_cnt : 0,
+       edge_cnt - exp_used,
+       edge_cnt ? (edge_cnt - exp_used) * 100.0 / edge_cnt : 0);
+
+  if (lost_cross && mod_cnt > 1)
+    SAYF(cLBL "[*] " cRST "Building with AFL_LLVM_LTO would solve all modules "
+         "together, avoiding\n    the %u collision%s across modules.\n",
+         lost_cross, lost_cross == 1 ? "" : "s");
+
+  if (lost_in)
+    SAYF(cLBL "[*] " cRST "Some modules ran out of free IDs; a larger "
+         "MAP_SIZE_POW2 would help.\n");
+
+}
+
+
+/* Annotate afl-showmap output: every line gets the edges behind its slot
+   appended, or '?' if the slot isn't in any table. */
+
+static void annotate(void) {
+
+  FILE* f = strcmp(annotate_file, "-") ? fopen(annotate_file, "r") : stdin;
+  char* line = NULL;
+  size_t line_sz = 0;
+
+  if (!f) PFATAL("Unable to open '%s'", annotate_file);
+
+  while (getline(&line, &line_sz, f) > 0) {
+
+    u32 slot, i;
+
+    line[strcspn(line, "\n")] = 0;
+
+    if (sscanf(line, "%u:", &slot) != 1) {
+      printf("%s\n", line);
+      continue;
+    }
+
+    printf("%s\t", line);
+
+    i = find_slot(slot);
+
+    if (i < edge_cnt) print_slot(i); else printf("?");
+
+    printf("\n");
+
+  }
+
+  free(line);
+  if (f != stdin) fclose(f);
+
+}
+
+
+/* Display usage hints. */
+
+static void usage(u8* argv0) {
+
+  SAYF("\n%s [ options ] table_or_dir [ ... ]\n\n"
+
+       "Reads the edge tables written with AFL_LLVM_EDGE_TABLE=dir set during\n"
+       "the build, and reports on map collisions.\n\n"
+
+       "Options:\n\n"
+
+       "  -a file       - annotate afl-showmap output ('-' for stdin)\n"
+       "  -v            - list the map slots shared by more than one edge\n"
+       "  -q            - sssh...\n\n"
+
+       "For additional tips, please consult %s/README.\n\n",
+
+       argv0, doc_path);
+
+  exit(1);
+
+}
+
+
+/* Main entry point */
+
+int main(int argc, char** argv) {
+
+  s32 opt;
+
+  doc_path = access(DOC_PATH, F_OK) ? "docs" : DOC_PATH;
+
+  while ((opt = getopt(argc, argv, "+a:vq")) > 0)
+
+    switch (opt) {
+
+      case 'a':
+
+        if (annotate_file) FATAL("Multiple -a options not supported");
+        annotate_file = optarg;
+        break;
+
+      case 'v':
+
+        list_slots = 1;
+        break;
+
+      case 'q':
+
+        be_quiet = 1;
+        break;
+
+      default:
+
+        usage(argv[0]);
+
+    }
+
+  if (optind == argc) usage(argv[0]);
+
+  if (!be_quiet)
+    SAYF(cCYA "afl-edges " cBRI VERSION cRST " by <lcamtuf@google.com>\n");
+
+  while (optind < argc) read_path(argv[optind++]);
+
+  if (!mod_cnt) FATAL("No edge tables found");
+
+  qsort(edges, edge_cnt, sizeof(struct edge), compare_edges);
+
+  if (!be_quiet)
+    OKF("Read %u edges from %u module%s.", edge_cnt, mod_cnt,
+        mod_cnt == 1 ? "" : "s");
+
+  if (annotate_file) {
+    annotate();
+    return 0;
+  }
+
+  if (!be_quiet) SAYF("\n");
+
+  show_stats();
+
+  return 0;
+
+}
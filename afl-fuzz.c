@@ -42,6 +42,7 @@
 #include "debug.h"
 #include "alloc-inl.h"
 #include "hash.h"
+#include "bitmap-inl.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -53,9 +54,11 @@
 #include <dirent.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <termios.h>
 #include <dlfcn.h>
 #include <sched.h>
+#include <pthread.h>
 
 #include <sys/wait.h>
 #include <sys/time.h>
@@ -66,6 +69,8 @@
 #include <sys/mman.h>
 #include <sys/ioctl.h>
 #include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #if defined(__APPLE__) || defined(__FreeBSD__) || defined (__OpenBSD__)
 #  include <sys/sysctl.h>
@@ -78,6 +83,14 @@
 #  define HAVE_AFFINITY 1
 #endif /* __linux__ */
 
+/* Same for futex(2), used to drive persistent targets without pipes. */
+
+#ifdef __linux__
+#  define HAVE_FUTEX 1
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+#endif /* __linux__ */
+
 /* A toggle to export some variables when building as a library. Not very
    useful for the general public. */
 
@@ -131,6 +144,7 @@ EXP_ST u8  skip_deterministic,        /* Skip deterministic stages?       */
            no_arith,                  /* Skip most arithmetic ops         */
            shuffle_queue,             /* Shuffle input queue?             */
            bitmap_changed = 1,        /* Time to update bitmap?           */
+           trace_maybe_new = 1,       /* trace_bits overlap virgin_bits?  */
            qemu_mode,                 /* Running in QEMU mode?            */
            skip_requested,            /* Skip request, via SIGUSR1        */
            run_over10m,               /* Run time over 10 minutes?        */
@@ -150,14 +164,37 @@ static s32 forksrv_pid,               /* PID of the fork server           */
 
 EXP_ST u8* trace_bits;                /* SHM with instrumentation bitmap  */
 
-EXP_ST u8  virgin_bits[MAP_SIZE],     /* Regions yet untouched by fuzzing */
-           virgin_tmout[MAP_SIZE],    /* Bits we haven't seen in tmouts   */
-           virgin_crash[MAP_SIZE];    /* Bits we haven't seen in crashes  */
+static u8* dirty_bits;                /* Dirty-chunk summary, after map   */
+
+static u32 dirty_list[DIRTY_SIZE],    /* Chunks touched by the last exec  */
+           dirty_cnt;                 /* Number of entries in dirty_list  */
+
+static u8  dirty_mode,                /* Target keeps dirty_bits updated? */
+           trace_sparse,              /* dirty_list covers trace_bits?    */
+           trace_cksum_ok;            /* trace_cksum matches trace_bits?  */
+
+static u64 trace_cksum;               /* Path checksum, built by classify */
+
+static u8  virgin_local[3][MAP_SIZE]; /* Unless shared with other jobs:  */
+
+EXP_ST u8* virgin_bits  = virgin_local[0], /* Regions yet untouched by fuzzing */
+         * virgin_tmout = virgin_local[1], /* Bits we haven't seen in tmouts   */
+         * virgin_crash = virgin_local[2]; /* Bits we haven't seen in crashes  */
 
 static u8  var_bytes[MAP_SIZE];       /* Bytes that appear to be variable */
 
+static u32 map_size = MAP_SIZE;       /* Bitmap bytes used by the target  */
+
 static s32 shm_id;                    /* ID of the SHM region             */
 
+static s32 shm_fuzz_id = -1;          /* ID of the test case SHM region   */
+static u8* shm_fuzz;                  /* Test case SHM region (len, data) */
+static u8  shm_fuzz_mode;             /* Target reads inputs from shm_fuzz*/
+
+static u32* fsrv_ctl;                 /* Fork server control block        */
+static u8   futex_mode,               /* Runs are driven through fsrv_ctl */
+            futex_child;              /* ...and a child is waiting there  */
+
 static volatile u8 stop_soon,         /* Ctrl-C pressed?                  */
                    clear_screen = 1,  /* Window resized?                  */
                    child_timed_out;   /* Traced process timed out?        */
@@ -201,6 +238,15 @@ EXP_ST u64 total_crashes,             /* Total number of crashes          */
 
 static u32 subseq_tmouts;             /* Number of timeouts in a row      */
 
+/* Adaptive timeouts: while fuzzing an entry, runs get cut off at a budget
+   derived from its calibrated exec time and spread (see entry_tmout_us())
+   rather than at the full exec_tmout. */
+
+static u64 last_exec_us,              /* Duration of the last run (us)    */
+           cur_tmout_us;              /* Budget for the current entry     */
+
+static u8  no_adapt_tmout;            /* AFL_NO_ADAPT_TMOUT set?          */
+
 static u8 *stage_name = "init",       /* Name of the current fuzz stage   */
           *stage_short,               /* Short stage name                 */
           *syncing_party;             /* Currently syncing with...        */
@@ -215,6 +261,9 @@ static u32 syncing_case;              /* Syncing with case #...           */
 static s32 stage_cur_byte,            /* Byte offset of current stage op  */
            stage_cur_val;             /* Value used for stage op          */
 
+static u8* eff_inherit;               /* Effector map for new entries     */
+static u32 eff_span;                  /* Bytes changed by current step    */
+
 static u8  stage_val_type;            /* Value type (STAGE_VAL_*)         */
 
 static u64 stage_finds[32],           /* Patterns found per fuzz stage    */
@@ -253,28 +302,172 @@ struct queue_entry {
       fs_redundant;                   /* Marked as redundant in the fs?   */
 
   u32 bitmap_size,                    /* Number of bits set in bitmap     */
-      exec_cksum;                     /* Checksum of the execution trace  */
+      exec_cksum,                     /* Checksum of the execution trace  */
+      exec_sd;                        /* Std deviation of exec time (us)  */
 
   u64 exec_us,                        /* Execution time (us)              */
       handicap,                       /* Number of queue cycles behind    */
       depth;                          /* Path depth                       */
 
-  u8* trace_mini;                     /* Trace bytes, if kept             */
+  u32* trace_mini;                    /* Minimized trace, if kept         */
   u32 tc_ref;                         /* Trace bytes ref count            */
 
-  struct queue_entry *next,           /* Next element, if any             */
-                     *next_100;       /* 100 elements ahead               */
+  u32 id;                             /* Queue ID, as in the file name    */
+
+  u8* cache_buf;                      /* Cached file contents, if any     */
+
+  u8* eff_map;                        /* Effector map, if known           */
+  u32 eff_lo, eff_hi;                 /* Span eff_map doesn't vouch for   */
+
+  struct queue_entry *cache_prev,     /* LRU neighbours in the cache      */
+                     *cache_next;
+
+  struct queue_entry *next;           /* Next element, if any             */
 
 };
 
 static struct queue_entry *queue,     /* Fuzzing queue (linked list)      */
                           *queue_cur, /* Current offset within the queue  */
-                          *queue_top, /* Top of the list                  */
-                          *q_prev100; /* Previous 100 marker              */
+                          *queue_top; /* Top of the list                  */
+
+/* Queue entries are carved out of slabs of QUEUE_SLAB, in order, so walking
+   the queue mostly stays within contiguous memory; queue_buf[] maps queue
+   positions back to entries. The first entry of every slab is also what
+   we pass to ck_free() in the end. */
+
+static struct queue_entry** queue_buf;
+
+/* Input cache: file contents of recently used queue entries, kept in LRU
+   order against a byte budget (AFL_CACHE_MB), so that fuzz_one(), splicing
+   and calibration don't have to go back to disk every time. New and trimmed
+   entries are written out by a background thread (queue_write()); anything
+   that reads queue files from disk must call queue_flush() first. */
+
+static u64 cache_size,                /* Bytes currently held in cache    */
+           cache_limit;               /* Cache budget in bytes            */
+
+static struct queue_entry *cache_head, /* Most recently used entry        */
+                          *cache_tail; /* Least recently used entry       */
+
+static u8* cache_spare;               /* Last uncached read, if any       */
 
 static struct queue_entry*
   top_rated[MAP_SIZE];                /* Top entries for bitmap bytes     */
 
+/* Local parallel jobs (-j). The extra jobs are forked off after the dry run,
+   each with its own fork server and trace map; all of them share the virgin
+   maps and a table of new paths through an anonymous shared mapping. Queue
+   IDs are handed out from the same place, so slot n of the table always
+   describes queue/id:n, and every job imports the slots in order. */
+
+struct job_path {
+
+  u8  ready,                          /* Trimmed and safe to import?      */
+      has_new_cov,                    /* Triggers new coverage?           */
+      var_behavior,                   /* Variable behavior?               */
+      cal_failed;                     /* Calibration failed?              */
+
+  u32 owner,                          /* Job that found it                */
+      len,                            /* Input length                     */
+      bitmap_size,                    /* Number of bits set in bitmap     */
+      exec_cksum,                     /* Checksum of the execution trace  */
+      exec_sd;                        /* Std deviation of exec time (us)  */
+
+  u64 exec_us,                        /* Execution time (us)              */
+      depth;                          /* Path depth                       */
+
+  u8  fname[256];                     /* File name within queue/          */
+  u8  trace_mini[MAP_SIZE >> 3];      /* Minimized trace                  */
+
+};
+
+struct job_shm {
+
+  u8  virgin_bits[MAP_SIZE],          /* Shared versions of our own maps  */
+      virgin_tmout[MAP_SIZE],
+      virgin_crash[MAP_SIZE];
+
+  u32 next_path;                      /* Next queue ID to hand out        */
+
+  u64 next_crash,                     /* Next crash ID to hand out        */
+      next_hang;                      /* Next hang ID to hand out         */
+
+  struct {
+    u64 execs;                        /* Execs done by the job            */
+    u8  pad[56];                      /* Keep jobs off each other's lines */
+  } job[JOB_MAX];
+
+  u8  det_claim[JOB_MAX_PATHS];       /* Deterministic stages taken?      */
+
+  struct job_path path[JOB_MAX_PATHS];
+
+};
+
+static struct job_shm* job_shm;       /* Shared state for -j              */
+
+static struct queue_entry* job_last;  /* Last entry published or imported */
+
+static u32 job_cnt,                   /* Number of jobs, 0 without -j     */
+           job_id,                    /* Our job number (0 = master)      */
+           job_seen;                  /* Next path slot to import         */
+
+static s32 job_pids[JOB_MAX],         /* PIDs of the other jobs           */
+           job_master;                /* PID of the master job            */
+
+static u64 job_execs;                 /* Execs done by the other jobs     */
+
+/* Sync rings (AFL_SYNC_RING). Every instance appends its new queue entries,
+   along with their classified traces, to <out_dir>/.sync_ring; the others
+   map that file and only execute the inputs that still have something to
+   offer them. The queue/ directories remain authoritative: a reader that
+   falls too far behind simply goes back to scanning them. */
+
+struct sync_ring {
+
+  u32 magic,                          /* SYNC_RING_MAGIC                  */
+      size;                           /* Size of data[]                   */
+
+  u64 head;                           /* Total bytes ever reserved        */
+
+  u8  pad[48];                        /* Keep data[] on its own line      */
+  u8  data[];
+
+};
+
+struct sync_rec {
+
+  u64 seq;                            /* Ring offset, set once complete   */
+
+  u32 size,                           /* Size of the whole record         */
+      id,                             /* Queue ID at the peer             */
+      len,                            /* Input length                     */
+      tuples,                         /* Number of trace tuples           */
+      name_len,                       /* File name length, 0 for padding  */
+      data_len;                       /* Input bytes included (0 or len)  */
+
+  /* Followed by tuples[] as (offset << 8 | value) u32s, the file name
+     within queue/, and the input itself, unless it's too big. */
+
+};
+
+struct sync_peer {
+
+  u8* name;                           /* Directory name within sync_dir   */
+
+  struct sync_ring* ring;             /* Mapped ring, if any              */
+  u64 map_len;                        /* Length of the mapping            */
+  ino_t ino;                          /* Inode of the mapped file         */
+
+  u64 rd;                             /* Next ring offset to read         */
+  u8  caught_up;                      /* Directory scanned since mapping? */
+
+  struct sync_peer* next;
+
+};
+
+static struct sync_ring* sync_ring;   /* Our own ring, if AFL_SYNC_RING   */
+static struct sync_peer* sync_peers;  /* What we know about the others    */
+
 struct extra_data {
   u8* data;                           /* Dictionary token data            */
   u32 len;                            /* Dictionary token length          */
@@ -284,9 +477,30 @@ struct extra_data {
 static struct extra_data* extras;     /* Extra tokens to fuzz with        */
 static u32 extras_cnt;                /* Total number of tokens read      */
 
+/* Index of extras[], built once they're loaded: a trie over the lowercased
+   tokens, with the edges kept in one open-addressed hash keyed by parent node
+   and byte. Each node has a chain of the tokens that end there (1-based, 0
+   terminates), i.e., all the case variants of one keyword. */
+
+struct dict_edge {
+  u32 key;                            /* ((parent << 8) | byte) + 1, or 0 */
+  u32 child;                          /* Node the edge leads to           */
+};
+
+static struct dict_edge* dict_edges;  /* Trie edges                       */
+static u32  dict_edge_mask;           /* Size of dict_edges[], minus one  */
+static u32  dict_nodes;               /* Nodes in use (0 is the root)     */
+static u32* dict_term;                /* First token ending at each node  */
+static u32* dict_next;                /* Next token ending at same node   */
+static u32* dict_hit;                 /* Per token: matched at dict_pos?  */
+static u32  dict_pos;                 /* Tag of the current position      */
+
 static struct extra_data* a_extras;   /* Automatically selected extras    */
 static u32 a_extras_cnt;              /* Total number of tokens available */
 
+static u8* token_file;                /* libtokencap output to follow     */
+static u64 token_file_pos;            /* How much of it has been read     */
+
 static u8* (*post_handler)(u8* buf, u32* len);
 
 /* Interesting values, as per config.h */
@@ -365,6 +579,177 @@ static u64 get_cur_time_us(void) {
 }
 
 
+/* Get a cheap, monotonic timestamp: the cycle counter where there is one
+   we can read from userspace, microseconds otherwise. Only differences are
+   meaningful; see cyc_per_us(). */
+
+static inline u64 get_cycles(void) {
+
+#if defined(__x86_64__) || defined(__i386__)
+
+  return __builtin_ia32_rdtsc();
+
+#elif defined(__aarch64__)
+
+  u64 ret;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r" (ret));
+  return ret;
+
+#else
+
+  return get_cur_time_us();
+
+#endif /* ^__x86_64__ || __i386__ */
+
+}
+
+
+/* Time accounting. Every cycle is charged to exactly one phase: code that
+   wants to be tracked switches to its phase and back when done, so nested
+   phases (such as execs done during calibration) are not counted twice. */
+
+enum {
+  /* 00 */ PHASE_FUZZ,                /* Mutations, UI, everything else    */
+  /* 01 */ PHASE_CLEAR,               /* Clearing the trace map            */
+  /* 02 */ PHASE_EXEC,                /* Waiting for the target            */
+  /* 03 */ PHASE_CLASSIFY,            /* Dirty lists, hit count buckets    */
+  /* 04 */ PHASE_BITS,                /* has_new_bits() against virgin map */
+  /* 05 */ PHASE_SAVE,                /* Rest of save_if_interesting()     */
+  /* 06 */ PHASE_CAL,                 /* calibrate_case()                  */
+  /* 07 */ PHASE_TRIM,                /* trim_case()                       */
+  /* 08 */ PHASE_SYNC,                /* sync_fuzzers()                    */
+  PHASE_COUNT
+};
+
+static const u8* phase_names[PHASE_COUNT] = {
+  "fuzz", "clear", "exec", "classify", "bits", "save", "calibrate", "trim",
+  "sync"
+};
+
+static u64 phase_cyc[PHASE_COUNT],    /* Cycles charged to each phase      */
+           phase_mark,                /* Timestamp of last phase switch    */
+           start_cyc,                 /* get_cycles() at startup           */
+           start_cyc_us;              /* get_cur_time_us() at startup      */
+
+static u8  cur_phase;                 /* Phase being charged right now     */
+
+static inline u8 phase_switch(u8 ph) {
+
+  u64 now = get_cycles();
+  u8  ret = cur_phase;
+
+  phase_cyc[cur_phase] += now - phase_mark;
+  phase_mark = now;
+  cur_phase  = ph;
+
+  return ret;
+
+}
+
+
+/* Calibrate get_cycles() against wall clock time since startup. */
+
+static double cyc_per_us(void) {
+
+  u64 us = get_cur_time_us() - start_cyc_us;
+
+  if (!us) return 1;
+  return (double)(get_cycles() - start_cyc) / us;
+
+}
+
+
+/* Exec latency histograms, one per stage. Buckets are log-linear: values
+   below 8 us get one each, and every power of two above that is split into
+   8 slices, so that percentiles come out within 12.5% or so. */
+
+static const u8* lat_names[LAT_STAGES]; /* Stage names, by slot           */
+static u64 lat_hist[LAT_STAGES][LAT_BUCKETS],
+           lat_cnt[LAT_STAGES],       /* Execs recorded per slot           */
+           lat_sum[LAT_STAGES],       /* Sum of exec times per slot (us)   */
+           lat_max[LAT_STAGES];       /* Slowest exec per slot (us)        */
+
+static u32 lat_used,                  /* Slots in use                      */
+           lat_last;                  /* Slot hit by the last lookup       */
+
+static inline u32 lat_bucket(u64 us) {
+
+  u32 msb, ret;
+
+  if (us < 8) return us;
+
+  msb = 63 - __builtin_clzll(us);
+  ret = (msb - 2) * 8 + ((us >> (msb - 3)) & 7);
+
+  return MIN(ret, LAT_BUCKETS - 1);
+
+}
+
+
+/* Largest value that lands in bucket b. */
+
+static u64 lat_bucket_top(u32 b) {
+
+  if (b < 8) return b;
+  return ((9ULL + (b & 7)) << (b / 8 - 1)) - 1;
+
+}
+
+
+static void lat_record(const u8* name, u64 us) {
+
+  u32 i = lat_last;
+
+  /* Stage names are almost always string literals, so the pointer check
+     is usually all it takes. */
+
+  if (lat_names[i] != name) {
+
+    for (i = 0; i < lat_used; i++)
+      if (lat_names[i] == name || !strcmp(lat_names[i], name)) break;
+
+    if (i == lat_used) {
+
+      /* Out of slots? Lump everything else together. */
+
+      if (lat_used == LAT_STAGES) {
+
+        i = LAT_STAGES - 1;
+        lat_names[i] = "other";
+
+      } else lat_names[lat_used++] = name;
+
+    }
+
+    lat_last = i;
+
+  }
+
+  lat_hist[i][lat_bucket(us)]++;
+  lat_cnt[i]++;
+  lat_sum[i] += us;
+  if (us > lat_max[i]) lat_max[i] = us;
+
+}
+
+
+/* Value at the given percentile of a histogram with cnt samples. */
+
+static u64 lat_pct(u64* hist, u64 cnt, u32 pct) {
+
+  u64 want = (cnt * pct + 99) / 100, seen = 0;
+  u32 b;
+
+  for (b = 0; b < LAT_BUCKETS; b++) {
+    seen += hist[b];
+    if (seen >= want) return lat_bucket_top(b);
+  }
+
+  return lat_bucket_top(LAT_BUCKETS - 1);
+
+}
+
+
 /* Generate a random number (from 0 to limit - 1). This may
    have slight bias. */
 
@@ -751,7 +1136,9 @@ static void mark_as_variable(struct queue_entry* q) {
   ldest = alloc_printf("../../%s", fn);
   fn = alloc_printf("%s/queue/.state/variable_behavior/%s", out_dir, fn);
 
-  if (symlink(ldest, fn)) {
+  /* With -j, another job may have gotten here first. */
+
+  if (symlink(ldest, fn) && errno != EEXIST) {
 
     s32 fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
     if (fd < 0) PFATAL("Unable to create '%s'", fn);
@@ -775,7 +1162,9 @@ static void mark_as_redundant(struct queue_entry* q, u8 state) {
   u8* fn;
   s32 fd;
 
-  if (state == q->fs_redundant) return;
+  /* With -j, the master job owns these files. */
+
+  if (job_id || state == q->fs_redundant) return;
 
   q->fs_redundant = state;
 
@@ -803,12 +1192,23 @@ static void mark_as_redundant(struct queue_entry* q, u8 state) {
 
 static void add_to_queue(u8* fname, u32 len, u8 passed_det) {
 
-  struct queue_entry* q = ck_alloc(sizeof(struct queue_entry));
+  struct queue_entry* q;
+
+  if (!(queued_paths % QUEUE_SLAB)) {
+
+    queue_buf = ck_realloc(queue_buf, (queued_paths + QUEUE_SLAB) *
+                                      sizeof(struct queue_entry*));
+    q = ck_alloc(QUEUE_SLAB * sizeof(struct queue_entry));
+
+  } else q = queue_buf[queued_paths - 1] + 1;
+
+  queue_buf[queued_paths] = q;
 
   q->fname        = fname;
   q->len          = len;
   q->depth        = cur_depth + 1;
   q->passed_det   = passed_det;
+  q->id           = queued_paths;
 
   if (q->depth > max_depth) max_depth = q->depth;
 
@@ -817,1922 +1217,3621 @@ static void add_to_queue(u8* fname, u32 len, u8 passed_det) {
     queue_top->next = q;
     queue_top = q;
 
-  } else q_prev100 = queue = queue_top = q;
+  } else queue = queue_top = q;
 
   queued_paths++;
   pending_not_fuzzed++;
 
   cycles_wo_finds = 0;
 
-  /* Set next_100 pointer for every 100th element (index 0, 100, etc) to allow faster iteration. */
-  if ((queued_paths - 1) % 100 == 0 && queued_paths > 1) {
-
-    q_prev100->next_100 = q;
-    q_prev100 = q;
-
-  }
-
   last_path_time = get_cur_time();
 
 }
 
 
-/* Destroy the entire queue. */
-
-EXP_ST void destroy_queue(void) {
+/* Queue file writeback. save_if_interesting() and trim_case() hand their
+   output to a single writer thread, so that the fuzzing loop doesn't stall
+   on the file system; the data is already in the cache by then. Items are
+   malloc()ed rather than ck_alloc()ed, since they're freed on the writer's
+   side. */
 
-  struct queue_entry *q = queue, *n;
+struct wb_item {
 
-  while (q) {
+  u8* fname;                          /* Destination file                 */
+  u8* data;                           /* Contents to write                */
+  u32 len;                            /* Length of data                   */
+  u8  replace;                        /* Replace an existing file?        */
 
-    n = q->next;
-    ck_free(q->fname);
-    ck_free(q->trace_mini);
-    ck_free(q);
-    q = n;
+  struct wb_item* next;               /* Next queued write, if any        */
 
-  }
+};
 
-}
+static struct wb_item *wb_head,       /* Pending writes (FIFO)            */
+                      *wb_tail;
 
+static u8 wb_running,                 /* Writer thread started?           */
+          wb_busy,                    /* Writer in the middle of a write? */
+          wb_quit;                    /* Writer asked to exit?            */
 
-/* Write bitmap to file. The bitmap is useful mostly for the secret
-   -B option, to focus a separate fuzzing session on a particular
-   interesting input without rediscovering all the others. */
+static pthread_t       wb_thread;
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  wb_work = PTHREAD_COND_INITIALIZER,
+                       wb_idle = PTHREAD_COND_INITIALIZER;
 
-EXP_ST void write_bitmap(void) {
 
-  u8* fname;
-  s32 fd;
+/* Write a single queue file, synchronously. */
 
-  if (!bitmap_changed) return;
-  bitmap_changed = 0;
+static void write_queue_file(u8* fname, u8* mem, u32 len, u8 replace) {
 
-  fname = alloc_printf("%s/fuzz_bitmap", out_dir);
-  fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  s32 fd;
 
-  if (fd < 0) PFATAL("Unable to open '%s'", fname);
+  if (replace) unlink(fname); /* ignore errors */
 
-  ck_write(fd, virgin_bits, MAP_SIZE, fname);
+  fd = open(fname, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) PFATAL("Unable to create '%s'", fname);
 
+  ck_write(fd, mem, len, fname);
   close(fd);
-  ck_free(fname);
 
 }
 
 
-/* Read bitmap from file. This is for the -B option again. */
+/* Writer thread main loop. */
 
-EXP_ST void read_bitmap(u8* fname) {
+static void* wb_main(void* arg) {
 
-  s32 fd = open(fname, O_RDONLY);
+  pthread_mutex_lock(&wb_lock);
 
-  if (fd < 0) PFATAL("Unable to open '%s'", fname);
+  while (1) {
 
-  ck_read(fd, virgin_bits, MAP_SIZE, fname);
+    struct wb_item* w;
 
-  close(fd);
+    while (!wb_head && !wb_quit) pthread_cond_wait(&wb_work, &wb_lock);
 
-}
+    if (!wb_head) break;
 
+    w = wb_head;
+    wb_head = w->next;
+    if (!wb_head) wb_tail = NULL;
 
-/* Check if the current execution path brings anything new to the table.
-   Update virgin bits to reflect the finds. Returns 1 if the only change is
-   the hit-count for a particular tuple; 2 if there are new tuples seen. 
-   Updates the map, so subsequent calls will always return 0.
+    wb_busy = 1;
+    pthread_mutex_unlock(&wb_lock);
 
-   This function is called after every exec() on a fairly large buffer, so
-   it needs to be fast. We do this in 32-bit and 64-bit flavors. */
+    write_queue_file(w->fname, w->data, w->len, w->replace);
 
-static inline u8 has_new_bits(u8* virgin_map) {
+    free(w->fname);
+    free(w->data);
+    free(w);
 
-#ifdef WORD_SIZE_64
+    pthread_mutex_lock(&wb_lock);
+    wb_busy = 0;
 
-  u64* current = (u64*)trace_bits;
-  u64* virgin  = (u64*)virgin_map;
+    if (!wb_head) pthread_cond_broadcast(&wb_idle);
 
-  u32  i = (MAP_SIZE >> 3);
+  }
 
-#else
+  pthread_mutex_unlock(&wb_lock);
 
-  u32* current = (u32*)trace_bits;
-  u32* virgin  = (u32*)virgin_map;
+  return NULL;
 
-  u32  i = (MAP_SIZE >> 2);
+}
 
-#endif /* ^WORD_SIZE_64 */
 
-  u8   ret = 0;
+/* Start the writer thread. Signals stay blocked there, so that SIGINT and
+   friends keep going to the main loop. Returns 0 if the thread couldn't be
+   created, in which case we just write synchronously. */
 
-  while (i--) {
+static u8 wb_start(void) {
 
-    /* Optimize for (*current & *virgin) == 0 - i.e., no bits in current bitmap
-       that have not been already cleared from the virgin map - since this will
-       almost always be the case. */
+  sigset_t all, old;
+  u8 ret;
 
-    if (unlikely(*current) && unlikely(*current & *virgin)) {
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &old);
 
-      if (likely(ret < 2)) {
+  wb_quit = 0;
+  ret = !pthread_create(&wb_thread, NULL, wb_main, NULL);
 
-        u8* cur = (u8*)current;
-        u8* vir = (u8*)virgin;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
 
-        /* Looks like we have not found any new bytes yet; see if any non-zero
-           bytes in current[] are pristine in virgin[]. */
+  if (!ret) WARNF("Unable to start the writer thread, writing synchronously.");
 
-#ifdef WORD_SIZE_64
+  return ret;
 
-        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
-            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff) ||
-            (cur[4] && vir[4] == 0xff) || (cur[5] && vir[5] == 0xff) ||
-            (cur[6] && vir[6] == 0xff) || (cur[7] && vir[7] == 0xff)) ret = 2;
-        else ret = 1;
+}
 
-#else
 
-        if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
-            (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff)) ret = 2;
-        else ret = 1;
+/* Write a queue file, in the background if possible. */
 
-#endif /* ^WORD_SIZE_64 */
+static void queue_write(u8* fname, u8* mem, u32 len, u8 replace) {
 
-      }
+  static u8 wb_failed;
+  struct wb_item* w;
 
-      *virgin &= ~*current;
+  if (!wb_running && !wb_failed) {
 
-    }
+    wb_running = wb_start();
+    wb_failed  = !wb_running;
 
-    current++;
-    virgin++;
+  }
 
+  if (!wb_running || !(w = malloc(sizeof(struct wb_item)))) {
+    write_queue_file(fname, mem, len, replace);
+    return;
   }
 
-  if (ret && virgin_map == virgin_bits) bitmap_changed = 1;
+  w->fname   = (u8*)strdup((char*)fname);
+  w->data    = malloc(len ? len : 1);
+  w->len     = len;
+  w->replace = replace;
+  w->next    = NULL;
 
-  return ret;
+  if (!w->fname || !w->data) {
 
-}
+    free(w->fname);
+    free(w->data);
+    free(w);
 
+    write_queue_file(fname, mem, len, replace);
+    return;
 
-/* Count the number of bits set in the provided bitmap. Used for the status
-   screen several times every second, does not have to be fast. */
+  }
 
-static u32 count_bits(u8* mem) {
+  memcpy(w->data, mem, len);
 
-  u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
-  u32  ret = 0;
+  pthread_mutex_lock(&wb_lock);
 
-  while (i--) {
+  if (wb_tail) wb_tail->next = w; else wb_head = w;
+  wb_tail = w;
 
-    u32 v = *(ptr++);
+  pthread_cond_signal(&wb_work);
+  pthread_mutex_unlock(&wb_lock);
 
-    /* This gets called on the inverse, virgin bitmap; optimize for sparse
-       data. */
+}
 
-    if (v == 0xffffffff) {
-      ret += 32;
-      continue;
-    }
 
-    v -= ((v >> 1) & 0x55555555);
-    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
-    ret += (((v + (v >> 4)) & 0xF0F0F0F) * 0x01010101) >> 24;
+/* Wait until all pending queue writes are on disk. */
 
-  }
+static void queue_flush(void) {
 
-  return ret;
+  if (!wb_running) return;
 
-}
+  pthread_mutex_lock(&wb_lock);
 
+  while (wb_head || wb_busy) pthread_cond_wait(&wb_idle, &wb_lock);
 
-#define FF(_b)  (0xff << ((_b) << 3))
+  pthread_mutex_unlock(&wb_lock);
 
-/* Count the number of bytes set in the bitmap. Called fairly sporadically,
-   mostly to update the status screen or calibrate and examine confirmed
-   new paths. */
+}
 
-static u32 count_bytes(u8* mem) {
 
-  u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
-  u32  ret = 0;
-
-  while (i--) {
+/* Flush and shut down the writer thread. Done before fork()ing off jobs,
+   which then start their own writers as needed, and before exiting. */
 
-    u32 v = *(ptr++);
+static void queue_writer_stop(void) {
 
-    if (!v) continue;
-    if (v & FF(0)) ret++;
-    if (v & FF(1)) ret++;
-    if (v & FF(2)) ret++;
-    if (v & FF(3)) ret++;
+  if (!wb_running) return;
 
-  }
+  pthread_mutex_lock(&wb_lock);
+  wb_quit = 1;
+  pthread_cond_signal(&wb_work);
+  pthread_mutex_unlock(&wb_lock);
 
-  return ret;
+  pthread_join(wb_thread, NULL);
+  wb_running = 0;
 
 }
 
 
-/* Count the number of non-255 bytes set in the bitmap. Used strictly for the
-   status screen, several calls per second or so. */
-
-static u32 count_non_255_bytes(u8* mem) {
-
-  u32* ptr = (u32*)mem;
-  u32  i   = (MAP_SIZE >> 2);
-  u32  ret = 0;
+/* Drop an entry from the input cache. */
 
-  while (i--) {
+static void cache_drop(struct queue_entry* q) {
 
-    u32 v = *(ptr++);
+  if (!q->cache_buf) return;
 
-    /* This is called on the virgin bitmap, so optimize for the most likely
-       case. */
+  if (q->cache_prev) q->cache_prev->cache_next = q->cache_next;
+  else cache_head = q->cache_next;
 
-    if (v == 0xffffffff) continue;
-    if ((v & FF(0)) != FF(0)) ret++;
-    if ((v & FF(1)) != FF(1)) ret++;
-    if ((v & FF(2)) != FF(2)) ret++;
-    if ((v & FF(3)) != FF(3)) ret++;
+  if (q->cache_next) q->cache_next->cache_prev = q->cache_prev;
+  else cache_tail = q->cache_prev;
 
-  }
+  cache_size -= q->len;
 
-  return ret;
+  ck_free(q->cache_buf);
+  q->cache_buf  = NULL;
+  q->cache_prev = q->cache_next = NULL;
 
 }
 
 
-/* Destructively simplify trace by eliminating hit count information
-   and replacing it with 0x80 or 0x01 depending on whether the tuple
-   is hit or not. Called on every new crash or timeout, should be
-   reasonably fast. */
+/* Put a buffer in the input cache as the contents of q, evicting the least
+   recently used entries to stay within budget. Takes ownership of mem,
+   which must be a ck_alloc()ed buffer of q->len bytes. */
 
-static const u8 simplify_lookup[256] = { 
+static void cache_put(struct queue_entry* q, u8* mem) {
 
-  [0]         = 1,
-  [1 ... 255] = 128
+  if (q->cache_buf) cache_drop(q);
 
-};
+  if (!mem || q->len > cache_limit) {
+    ck_free(mem);
+    return;
+  }
 
-#ifdef WORD_SIZE_64
+  while (cache_tail && cache_size + q->len > cache_limit)
+    cache_drop(cache_tail);
 
-static void simplify_trace(u64* mem) {
+  q->cache_buf  = mem;
+  q->cache_prev = NULL;
+  q->cache_next = cache_head;
 
-  u32 i = MAP_SIZE >> 3;
+  if (cache_head) cache_head->cache_prev = q; else cache_tail = q;
+  cache_head = q;
 
-  while (i--) {
+  cache_size += q->len;
 
-    /* Optimize for sparse bitmaps. */
+}
 
-    if (unlikely(*mem)) {
 
-      u8* mem8 = (u8*)mem;
+/* Get the contents of a queue entry, from the cache or from disk. The
+   buffer belongs to the cache and may go away on the next call to either
+   cache_put() or queue_get(), so callers must copy what they want to keep
+   or modify. */
 
-      mem8[0] = simplify_lookup[mem8[0]];
-      mem8[1] = simplify_lookup[mem8[1]];
-      mem8[2] = simplify_lookup[mem8[2]];
-      mem8[3] = simplify_lookup[mem8[3]];
-      mem8[4] = simplify_lookup[mem8[4]];
-      mem8[5] = simplify_lookup[mem8[5]];
-      mem8[6] = simplify_lookup[mem8[6]];
-      mem8[7] = simplify_lookup[mem8[7]];
+static u8* queue_get(struct queue_entry* q) {
 
-    } else *mem = 0x0101010101010101ULL;
+  u8* mem;
+  s32 fd;
 
-    mem++;
+  if (q->cache_buf) {
 
-  }
+    if (q != cache_head) {
 
-}
+      q->cache_prev->cache_next = q->cache_next;
 
-#else
+      if (q->cache_next) q->cache_next->cache_prev = q->cache_prev;
+      else cache_tail = q->cache_prev;
 
-static void simplify_trace(u32* mem) {
+      q->cache_prev = NULL;
+      q->cache_next = cache_head;
+      cache_head->cache_prev = q;
+      cache_head = q;
 
-  u32 i = MAP_SIZE >> 2;
+    }
 
-  while (i--) {
+    return q->cache_buf;
 
-    /* Optimize for sparse bitmaps. */
+  }
 
-    if (unlikely(*mem)) {
+  queue_flush();
 
-      u8* mem8 = (u8*)mem;
+  fd = open(q->fname, O_RDONLY);
+  if (fd < 0) PFATAL("Unable to open '%s'", q->fname);
 
-      mem8[0] = simplify_lookup[mem8[0]];
-      mem8[1] = simplify_lookup[mem8[1]];
-      mem8[2] = simplify_lookup[mem8[2]];
-      mem8[3] = simplify_lookup[mem8[3]];
+  mem = ck_alloc_nozero(q->len);
+  ck_read(fd, mem, q->len, q->fname);
+  close(fd);
 
-    } else *mem = 0x01010101;
+  ck_free(cache_spare);
+  cache_spare = NULL;
 
-    mem++;
+  if (q->len > cache_limit) {
+    cache_spare = mem;
+    return mem;
   }
 
+  cache_put(q, mem);
+  return mem;
+
 }
 
-#endif /* ^WORD_SIZE_64 */
 
+/* Destroy the entire queue. */
 
-/* Destructively classify execution counts in a trace. This is used as a
-   preprocessing step for any newly acquired traces. Called on every exec,
-   must be fast. */
+EXP_ST void destroy_queue(void) {
 
-static const u8 count_class_lookup8[256] = {
+  u32 i;
 
-  [0]           = 0,
-  [1]           = 1,
-  [2]           = 2,
-  [3]           = 4,
-  [4 ... 7]     = 8,
-  [8 ... 15]    = 16,
-  [16 ... 31]   = 32,
-  [32 ... 127]  = 64,
-  [128 ... 255] = 128
+  for (i = 0; i < queued_paths; i++) {
 
-};
+    ck_free(queue_buf[i]->fname);
+    ck_free(queue_buf[i]->trace_mini);
+    ck_free(queue_buf[i]->cache_buf);
+    ck_free(queue_buf[i]->eff_map);
 
-static u16 count_class_lookup16[65536];
+  }
 
+  for (i = 0; i < queued_paths; i += QUEUE_SLAB)
+    ck_free(queue_buf[i]);
 
-EXP_ST void init_count_class16(void) {
+  ck_free(queue_buf);
+  ck_free(cache_spare);
 
-  u32 b1, b2;
+}
 
-  for (b1 = 0; b1 < 256; b1++) 
-    for (b2 = 0; b2 < 256; b2++)
-      count_class_lookup16[(b1 << 8) + b2] = 
-        (count_class_lookup8[b1] << 8) |
-        count_class_lookup8[b2];
 
-}
+/* Write bitmap to file. The bitmap is useful mostly for the secret
+   -B option, to focus a separate fuzzing session on a particular
+   interesting input without rediscovering all the others. */
 
+EXP_ST void write_bitmap(void) {
 
-#ifdef WORD_SIZE_64
+  u8* fname;
+  s32 fd;
 
-static inline void classify_counts(u64* mem) {
+  if (!bitmap_changed) return;
+  bitmap_changed = 0;
 
-  u32 i = MAP_SIZE >> 3;
+  fname = alloc_printf("%s/fuzz_bitmap", out_dir);
+  fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
 
-  while (i--) {
+  if (fd < 0) PFATAL("Unable to open '%s'", fname);
 
-    /* Optimize for sparse bitmaps. */
+  ck_write(fd, virgin_bits, MAP_SIZE, fname);
 
-    if (unlikely(*mem)) {
+  close(fd);
+  ck_free(fname);
 
-      u16* mem16 = (u16*)mem;
+}
 
-      mem16[0] = count_class_lookup16[mem16[0]];
-      mem16[1] = count_class_lookup16[mem16[1]];
-      mem16[2] = count_class_lookup16[mem16[2]];
-      mem16[3] = count_class_lookup16[mem16[3]];
 
-    }
+/* Read bitmap from file. This is for the -B option again. */
 
-    mem++;
+EXP_ST void read_bitmap(u8* fname) {
 
-  }
+  s32 fd = open(fname, O_RDONLY);
 
-}
+  if (fd < 0) PFATAL("Unable to open '%s'", fname);
 
-#else
+  ck_read(fd, virgin_bits, MAP_SIZE, fname);
 
-static inline void classify_counts(u32* mem) {
+  close(fd);
 
-  u32 i = MAP_SIZE >> 2;
+}
 
-  while (i--) {
 
-    /* Optimize for sparse bitmaps. */
+/* Dirty-chunk tracking. When the target supports it (FS_OPT_DIRTY), it
+   flags every DIRTY_CHUNK-byte slice of the map it writes to, and right
+   after an exec, dirty_list[] holds every chunk that may be nonzero. The
+   post-exec work then only needs to look at those, for as long as nobody
+   rewrites trace_bits[] wholesale.
 
-    if (unlikely(*mem)) {
+   This turns the summary into a list of chunk numbers: */
 
-      u16* mem16 = (u16*)mem;
+static u32 collect_dirty(u32* list) {
 
-      mem16[0] = count_class_lookup16[mem16[0]];
-      mem16[1] = count_class_lookup16[mem16[1]];
+  u32 n = map_size >> DIRTY_CHUNK_POW2, i = 0, cnt = 0;
 
+  while (i < n) {
+
+    if (!(i & 7) && i + 8 <= n && !*(u64*)(dirty_bits + i)) {
+      i += 8;
+      continue;
     }
 
-    mem++;
+    if (dirty_bits[i]) list[cnt++] = i;
+    i++;
 
   }
 
+  return cnt;
+
 }
 
-#endif /* ^WORD_SIZE_64 */
 
+/* Clear the trace before an exec; in dirty mode, only where needed. */
 
-/* Get rid of shared memory (atexit handler). */
+static void clear_trace(void) {
 
-static void remove_shm(void) {
+  u32 i, n;
 
-  shmctl(shm_id, IPC_RMID, NULL);
+  if (!dirty_mode) {
+    memset(trace_bits, 0, map_size);
+    return;
+  }
 
-}
+  n = collect_dirty(dirty_list);
 
+  for (i = 0; i < n; i++)
+    memset(trace_bits + (dirty_list[i] << DIRTY_CHUNK_POW2), 0, DIRTY_CHUNK);
 
-/* Compact trace bytes into a smaller bitmap. We effectively just drop the
-   count information here. This is called only sporadically, for some
-   new paths. */
+  memset(dirty_bits, 0, map_size >> DIRTY_CHUNK_POW2);
+  dirty_cnt = 0;
 
-static void minimize_bits(u8* dst, u8* src) {
+}
 
-  u32 i = 0;
 
-  while (i < MAP_SIZE) {
+/* Called whenever trace_bits[] gets changed by us rather than the target:
+   neither dirty_list[] nor the virgin_bits hint can be trusted anymore, and
+   the whole map needs clearing next time around. */
 
-    if (*(src++)) dst[i >> 3] |= 1 << (i & 7);
-    i++;
+static void mark_trace_dense(void) {
 
-  }
+  trace_maybe_new = 1;
+  trace_sparse    = 0;
+  trace_cksum_ok  = 0;
 
-}
+  if (dirty_mode) memset(dirty_bits, 1, map_size >> DIRTY_CHUNK_POW2);
 
+}
 
-/* When we bump into a new path, we call this to see if the path appears
-   more "favorable" than any of the existing ones. The purpose of the
-   "favorables" is to have a minimal set of paths that trigger all the bits
-   seen in the bitmap so far, and focus on fuzzing them at the expense of
-   the rest.
 
-   The first step of the process is to maintain a list of top_rated[] entries
-   for every byte in the bitmap. We win that slot if there is no previous
-   contender, or if the contender has a more favorable speed x size factor. */
+/* Checksum the current trace (see bm_mix_word() in bitmap-inl.h). Nearly
+   always, classify_counts() has already done the work for us; otherwise,
+   we look at the nonzero words of the map, or of the dirty chunks. */
 
-static void update_bitmap_score(struct queue_entry* q) {
+static u32 hash_trace(void) {
 
   u32 i;
-  u64 fav_factor = q->exec_us * q->len;
-
-  /* For every byte set in trace_bits[], see if there is a previous winner,
-     and how it compares to us. */
-
-  for (i = 0; i < MAP_SIZE; i++)
 
-    if (trace_bits[i]) {
+  if (!trace_cksum_ok) {
 
-       if (top_rated[i]) {
+    if (trace_sparse) {
 
-         /* Faster-executing or smaller test cases are favored. */
+      trace_cksum = 0;
 
-         if (fav_factor > top_rated[i]->exec_us * top_rated[i]->len) continue;
+      for (i = 0; i < dirty_cnt; i++)
+        trace_cksum += bm_cksum(trace_bits + (dirty_list[i] << DIRTY_CHUNK_POW2),
+                                DIRTY_CHUNK, dirty_list[i] << DIRTY_CHUNK_POW2);
 
-         /* Looks like we're going to win. Decrease ref count for the
-            previous winner, discard its trace_bits[] if necessary. */
+    } else trace_cksum = bm_cksum(trace_bits, map_size, 0);
 
-         if (!--top_rated[i]->tc_ref) {
-           ck_free(top_rated[i]->trace_mini);
-           top_rated[i]->trace_mini = 0;
-         }
+    trace_cksum_ok = 1;
 
-       }
-
-       /* Insert ourselves as the new winner. */
+  }
 
-       top_rated[i] = q;
-       q->tc_ref++;
+  return bm_fold_cksum(trace_cksum);
 
-       if (!q->trace_mini) {
-         q->trace_mini = ck_alloc(MAP_SIZE >> 3);
-         minimize_bits(q->trace_mini, trace_bits);
-       }
+}
 
-       score_changed = 1;
 
-     }
+/* Check if the current execution path brings anything new to the table.
+   Update virgin bits to reflect the finds. Returns 1 if the only change is
+   the hit-count for a particular tuple; 2 if there are new tuples seen. 
+   Updates the map, so subsequent calls will always return 0.
 
-}
+   This function is called after every exec() on a fairly large buffer, so
+   it needs to be fast. We do this in 32-bit and 64-bit flavors. */
 
+#ifdef WORD_SIZE_64
+#  define MAP_WORD u64
+#else
+#  define MAP_WORD u32
+#endif /* ^WORD_SIZE_64 */
 
-/* The second part of the mechanism discussed above is a routine that
-   goes over top_rated[] entries, and then sequentially grabs winners for
-   previously-unseen bytes (temp_v) and marks them as favored, at least
-   until the next run. The favored entries are given more air time during
-   all fuzzing steps. */
+static inline u8 has_new_bits_word(MAP_WORD* current, MAP_WORD* virgin,
+                                   u8 ret) {
 
-static void cull_queue(void) {
+  /* Optimize for (*current & *virgin) == 0 - i.e., no bits in current bitmap
+     that have not been already cleared from the virgin map - since this will
+     almost always be the case. */
 
-  struct queue_entry* q;
-  static u8 temp_v[MAP_SIZE >> 3];
-  u32 i;
+  if (unlikely(*current) && unlikely(*current & *virgin)) {
 
-  if (dumb_mode || !score_changed) return;
+    MAP_WORD old = *virgin;
 
-  score_changed = 0;
+    /* With -j, other jobs are clearing bits in the same map. Whoever clears
+       them first gets to keep the find. */
 
-  memset(temp_v, 255, MAP_SIZE >> 3);
+    if (job_cnt) {
 
-  queued_favored  = 0;
-  pending_favored = 0;
+      old = __atomic_fetch_and(virgin, ~*current, __ATOMIC_RELAXED);
+      if (!(old & *current)) return ret;
 
-  q = queue;
+    } else *virgin = old & ~*current;
 
-  while (q) {
-    q->favored = 0;
-    q = q->next;
-  }
+    if (likely(ret < 2)) {
 
-  /* Let's see if anything in the bitmap isn't captured in temp_v.
-     If yes, and if it has a top_rated[] contender, let's use it. */
+      u8* cur = (u8*)current;
+      u8* vir = (u8*)&old;
 
-  for (i = 0; i < MAP_SIZE; i++)
-    if (top_rated[i] && (temp_v[i >> 3] & (1 << (i & 7)))) {
+      /* Looks like we have not found any new bytes yet; see if any non-zero
+         bytes in current[] are pristine in virgin[]. */
 
-      u32 j = MAP_SIZE >> 3;
+#ifdef WORD_SIZE_64
 
-      /* Remove all bits belonging to the current entry from temp_v. */
+      if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
+          (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff) ||
+          (cur[4] && vir[4] == 0xff) || (cur[5] && vir[5] == 0xff) ||
+          (cur[6] && vir[6] == 0xff) || (cur[7] && vir[7] == 0xff)) ret = 2;
+      else ret = 1;
 
-      while (j--) 
-        if (top_rated[i]->trace_mini[j])
-          temp_v[j] &= ~top_rated[i]->trace_mini[j];
+#else
 
-      top_rated[i]->favored = 1;
-      queued_favored++;
+      if ((cur[0] && vir[0] == 0xff) || (cur[1] && vir[1] == 0xff) ||
+          (cur[2] && vir[2] == 0xff) || (cur[3] && vir[3] == 0xff)) ret = 2;
+      else ret = 1;
 
-      if (!top_rated[i]->was_fuzzed) pending_favored++;
+#endif /* ^WORD_SIZE_64 */
 
     }
 
-  q = queue;
-
-  while (q) {
-    mark_as_redundant(q, !q->favored);
-    q = q->next;
   }
 
+  return ret;
+
 }
 
+static inline u8 has_new_bits(u8* virgin_map) {
 
-/* Configure shared memory and virgin_bits. This is called at startup. */
+  MAP_WORD* current = (MAP_WORD*)trace_bits;
+  MAP_WORD* virgin  = (MAP_WORD*)virgin_map;
 
-EXP_ST void setup_shm(void) {
+  u32  i = map_size / sizeof(MAP_WORD);
+  u8   ret = 0;
 
-  u8* shm_str;
+  /* classify_counts() already told us whether this trace has anything in
+     common with virgin_bits at all; usually, it doesn't. */
 
-  if (!in_bitmap) memset(virgin_bits, 255, MAP_SIZE);
+  if (virgin_map == virgin_bits && !trace_maybe_new) return 0;
 
-  memset(virgin_tmout, 255, MAP_SIZE);
-  memset(virgin_crash, 255, MAP_SIZE);
+  if (virgin_map == virgin_bits && trace_sparse) {
 
-  shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+    /* Nothing outside of the dirty chunks can be set. */
 
-  if (shm_id < 0) PFATAL("shmget() failed");
+    u32 c;
 
-  atexit(remove_shm);
+    for (c = 0; c < dirty_cnt; c++) {
 
-  shm_str = alloc_printf("%d", shm_id);
+      u32 pos = dirty_list[c] << DIRTY_CHUNK_POW2,
+          j   = DIRTY_CHUNK / sizeof(MAP_WORD);
 
-  /* If somebody is asking us to fuzz instrumented binaries in dumb mode,
-     we don't want them to detect instrumentation, since we won't be sending
-     fork server commands. This should be replaced with better auto-detection
-     later on, perhaps? */
+      current = (MAP_WORD*)(trace_bits + pos);
+      virgin  = (MAP_WORD*)(virgin_map + pos);
 
-  if (!dumb_mode) setenv(SHM_ENV_VAR, shm_str, 1);
+      while (j--) ret = has_new_bits_word(current++, virgin++, ret);
 
-  ck_free(shm_str);
+    }
 
-  trace_bits = shmat(shm_id, NULL, 0);
-  
-  if (trace_bits == (void *)-1) PFATAL("shmat() failed");
+  } else if (bm_find_new) {
 
-}
+    /* Let the vector kernel skip ahead to the chunks worth a closer look. */
 
+    u32 pos = 0;
 
-/* Load postprocessor, if available. */
+    while ((pos = bm_find_new(trace_bits, virgin_map, pos, map_size)) <
+           map_size) {
 
-static void setup_post(void) {
+      u32 j = 64 / sizeof(MAP_WORD);
 
-  void* dh;
-  u8* fn = getenv("AFL_POST_LIBRARY");
-  u32 tlen = 6;
+      current = (MAP_WORD*)(trace_bits + pos);
+      virgin  = (MAP_WORD*)(virgin_map + pos);
 
-  if (!fn) return;
+      while (j--) ret = has_new_bits_word(current++, virgin++, ret);
 
-  ACTF("Loading postprocessor from '%s'...", fn);
+      pos += 64;
 
-  dh = dlopen(fn, RTLD_NOW);
-  if (!dh) FATAL("%s", dlerror());
+    }
 
-  post_handler = dlsym(dh, "afl_postprocess");
-  if (!post_handler) FATAL("Symbol 'afl_postprocess' not found.");
+  } else {
 
-  /* Do a quick test. It's better to segfault now than later =) */
+    while (i--) ret = has_new_bits_word(current++, virgin++, ret);
 
-  post_handler("hello", &tlen);
-
-  OKF("Postprocessor installed successfully.");
-
-}
+  }
 
+  if (ret && virgin_map == virgin_bits) bitmap_changed = 1;
 
-/* Read all testcases from the input directory, then queue them for testing.
-   Called at startup. */
+  return ret;
 
-static void read_testcases(void) {
+}
 
-  struct dirent **nl;
-  s32 nl_cnt;
-  u32 i;
-  u8* fn;
+#undef MAP_WORD
 
-  /* Auto-detect non-in-place resumption attempts. */
 
-  fn = alloc_printf("%s/queue", in_dir);
-  if (!access(fn, F_OK)) in_dir = fn; else ck_free(fn);
+/* Count the number of bits set in the provided bitmap. Used for the status
+   screen several times every second, does not have to be fast. */
 
-  ACTF("Scanning '%s'...", in_dir);
+static u32 count_bits(u8* mem) {
 
-  /* We use scandir() + alphasort() rather than readdir() because otherwise,
-     the ordering  of test cases would vary somewhat randomly and would be
-     difficult to control. */
+  u32* ptr = (u32*)mem;
+  u32  i   = (map_size >> 2);
+  u32  ret = 0;
 
-  nl_cnt = scandir(in_dir, &nl, NULL, alphasort);
+  while (i--) {
 
-  if (nl_cnt < 0) {
+    u32 v = *(ptr++);
 
-    if (errno == ENOENT || errno == ENOTDIR)
+    /* This gets called on the inverse, virgin bitmap; optimize for sparse
+       data. */
 
-      SAYF("\n" cLRD "[-] " cRST
-           "The input directory does not seem to be valid - try again. The fuzzer needs\n"
-           "    one or more test case to start with - ideally, a small file under 1 kB\n"
-           "    or so. The cases must be stored as regular files directly in the input\n"
-           "    directory.\n");
+    if (v == 0xffffffff) {
+      ret += 32;
+      continue;
+    }
 
-    PFATAL("Unable to open '%s'", in_dir);
+    v -= ((v >> 1) & 0x55555555);
+    v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+    ret += (((v + (v >> 4)) & 0xF0F0F0F) * 0x01010101) >> 24;
 
   }
 
-  if (shuffle_queue && nl_cnt > 1) {
+  return ret;
 
-    ACTF("Shuffling queue...");
-    shuffle_ptrs((void**)nl, nl_cnt);
+}
 
-  }
 
-  for (i = 0; i < nl_cnt; i++) {
+#define FF(_b)  (0xff << ((_b) << 3))
 
-    struct stat st;
+/* Count the number of bytes set in the bitmap. Called fairly sporadically,
+   mostly to update the status screen or calibrate and examine confirmed
+   new paths. */
 
-    u8* fn = alloc_printf("%s/%s", in_dir, nl[i]->d_name);
-    u8* dfn = alloc_printf("%s/.state/deterministic_done/%s", in_dir, nl[i]->d_name);
+static u32 count_bytes(u8* mem) {
 
-    u8  passed_det = 0;
+  u32* ptr = (u32*)mem;
+  u32  i   = (map_size >> 2);
+  u32  ret = 0;
 
-    free(nl[i]); /* not tracked */
- 
-    if (lstat(fn, &st) || access(fn, R_OK))
-      PFATAL("Unable to access '%s'", fn);
+  while (i--) {
 
-    /* This also takes care of . and .. */
+    u32 v = *(ptr++);
 
-    if (!S_ISREG(st.st_mode) || !st.st_size || strstr(fn, "/README.testcases")) {
+    if (!v) continue;
+    if (v & FF(0)) ret++;
+    if (v & FF(1)) ret++;
+    if (v & FF(2)) ret++;
+    if (v & FF(3)) ret++;
 
-      ck_free(fn);
-      ck_free(dfn);
-      continue;
+  }
 
-    }
+  return ret;
 
-    if (st.st_size > MAX_FILE) 
-      FATAL("Test case '%s' is too big (%s, limit is %s)", fn,
-            DMS(st.st_size), DMS(MAX_FILE));
+}
 
-    /* Check for metadata that indicates that deterministic fuzzing
-       is complete for this entry. We don't want to repeat deterministic
-       fuzzing when resuming aborted scans, because it would be pointless
-       and probably very time-consuming. */
 
-    if (!access(dfn, F_OK)) passed_det = 1;
-    ck_free(dfn);
+/* Count the number of non-255 bytes set in the bitmap. Used strictly for the
+   status screen, several calls per second or so. */
 
-    add_to_queue(fn, st.st_size, passed_det);
+static u32 count_non_255_bytes(u8* mem) {
 
-  }
+  u32* ptr = (u32*)mem;
+  u32  i   = (map_size >> 2);
+  u32  ret = 0;
 
-  free(nl); /* not tracked */
+  while (i--) {
 
-  if (!queued_paths) {
+    u32 v = *(ptr++);
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Looks like there are no valid test cases in the input directory! The fuzzer\n"
-         "    needs one or more test case to start with - ideally, a small file under\n"
-         "    1 kB or so. The cases must be stored as regular files directly in the\n"
-         "    input directory.\n");
+    /* This is called on the virgin bitmap, so optimize for the most likely
+       case. */
 
-    FATAL("No usable test cases in '%s'", in_dir);
+    if (v == 0xffffffff) continue;
+    if ((v & FF(0)) != FF(0)) ret++;
+    if ((v & FF(1)) != FF(1)) ret++;
+    if ((v & FF(2)) != FF(2)) ret++;
+    if ((v & FF(3)) != FF(3)) ret++;
 
   }
 
-  last_path_time = 0;
-  queued_at_start = queued_paths;
+  return ret;
 
 }
 
 
-/* Helper function for load_extras. */
+/* Destructively simplify trace by eliminating hit count information
+   and replacing it with 0x80 or 0x01 depending on whether the tuple
+   is hit or not. Called on every new crash or timeout, should be
+   reasonably fast. */
 
-static int compare_extras_len(const void* p1, const void* p2) {
-  struct extra_data *e1 = (struct extra_data*)p1,
-                    *e2 = (struct extra_data*)p2;
+static const u8 simplify_lookup[256] = { 
 
-  return e1->len - e2->len;
-}
+  [0]         = 1,
+  [1 ... 255] = 128
 
-static int compare_extras_use_d(const void* p1, const void* p2) {
-  struct extra_data *e1 = (struct extra_data*)p1,
-                    *e2 = (struct extra_data*)p2;
+};
 
-  return e2->hit_cnt - e1->hit_cnt;
-}
+#ifdef WORD_SIZE_64
 
+static void simplify_trace(u64* mem) {
 
-/* Read extras from a file, sort by size. */
+  u32 i = map_size >> 3;
 
-static void load_extras_file(u8* fname, u32* min_len, u32* max_len,
-                             u32 dict_level) {
+  mark_trace_dense();
 
-  FILE* f;
-  u8  buf[MAX_LINE];
-  u8  *lptr;
-  u32 cur_line = 0;
+  if (bm_simplify) {
+    bm_simplify((u8*)mem, map_size);
+    return;
+  }
 
-  f = fopen(fname, "r");
+  while (i--) {
 
-  if (!f) PFATAL("Unable to open '%s'", fname);
+    /* Optimize for sparse bitmaps. */
 
-  while ((lptr = fgets(buf, MAX_LINE, f))) {
+    if (unlikely(*mem)) {
 
-    u8 *rptr, *wptr;
-    u32 klen = 0;
+      u8* mem8 = (u8*)mem;
 
-    cur_line++;
+      mem8[0] = simplify_lookup[mem8[0]];
+      mem8[1] = simplify_lookup[mem8[1]];
+      mem8[2] = simplify_lookup[mem8[2]];
+      mem8[3] = simplify_lookup[mem8[3]];
+      mem8[4] = simplify_lookup[mem8[4]];
+      mem8[5] = simplify_lookup[mem8[5]];
+      mem8[6] = simplify_lookup[mem8[6]];
+      mem8[7] = simplify_lookup[mem8[7]];
 
-    /* Trim on left and right. */
+    } else *mem = 0x0101010101010101ULL;
 
-    while (isspace(*lptr)) lptr++;
+    mem++;
 
-    rptr = lptr + strlen(lptr) - 1;
-    while (rptr >= lptr && isspace(*rptr)) rptr--;
-    rptr++;
-    *rptr = 0;
+  }
 
-    /* Skip empty lines and comments. */
+}
 
-    if (!*lptr || *lptr == '#') continue;
+#else
 
-    /* All other lines must end with '"', which we can consume. */
+static void simplify_trace(u32* mem) {
 
-    rptr--;
+  u32 i = map_size >> 2;
 
-    if (rptr < lptr || *rptr != '"')
-      FATAL("Malformed name=\"value\" pair in line %u.", cur_line);
+  mark_trace_dense();
 
-    *rptr = 0;
+  if (bm_simplify) {
+    bm_simplify((u8*)mem, map_size);
+    return;
+  }
 
-    /* Skip alphanumerics and dashes (label). */
+  while (i--) {
 
-    while (isalnum(*lptr) || *lptr == '_') lptr++;
+    /* Optimize for sparse bitmaps. */
 
-    /* If @number follows, parse that. */
+    if (unlikely(*mem)) {
 
-    if (*lptr == '@') {
+      u8* mem8 = (u8*)mem;
 
-      lptr++;
-      if (atoi(lptr) > dict_level) continue;
-      while (isdigit(*lptr)) lptr++;
+      mem8[0] = simplify_lookup[mem8[0]];
+      mem8[1] = simplify_lookup[mem8[1]];
+      mem8[2] = simplify_lookup[mem8[2]];
+      mem8[3] = simplify_lookup[mem8[3]];
 
-    }
+    } else *mem = 0x01010101;
 
-    /* Skip whitespace and = signs. */
+    mem++;
+  }
 
-    while (isspace(*lptr) || *lptr == '=') lptr++;
+}
 
-    /* Consume opening '"'. */
+#endif /* ^WORD_SIZE_64 */
 
-    if (*lptr != '"')
-      FATAL("Malformed name=\"keyword\" pair in line %u.", cur_line);
 
-    lptr++;
+/* Destructively classify execution counts in a trace. This is used as a
+   preprocessing step for any newly acquired traces. Called on every exec,
+   must be fast. While we're at it, we also note whether any of the bits
+   are still set in virgin_bits, so that has_new_bits() can usually bail
+   out without looking at the map again, and build the path checksum for
+   hash_trace(). */
 
-    if (!*lptr) FATAL("Empty keyword in line %u.", cur_line);
+static const u8 count_class_lookup8[256] = {
 
-    /* Okay, let's allocate memory and copy data between "...", handling
-       \xNN escaping, \\, and \". */
+  [0]           = 0,
+  [1]           = 1,
+  [2]           = 2,
+  [3]           = 4,
+  [4 ... 7]     = 8,
+  [8 ... 15]    = 16,
+  [16 ... 31]   = 32,
+  [32 ... 127]  = 64,
+  [128 ... 255] = 128
 
-    extras = ck_realloc_block(extras, (extras_cnt + 1) *
-               sizeof(struct extra_data));
+};
 
-    wptr = extras[extras_cnt].data = ck_alloc(rptr - lptr);
+static u16 count_class_lookup16[65536];
 
-    while (*lptr) {
 
-      char* hexdigits = "0123456789abcdef";
+/* Classify only the chunks in dirty_list[], and checksum them while we're
+   at it. Chunks are small and few, so the plain byte-wise lookup is good
+   enough without SIMD. */
 
-      switch (*lptr) {
+static void classify_dirty(void) {
 
-        case 1 ... 31:
-        case 128 ... 255:
-          FATAL("Non-printable characters in line %u.", cur_line);
+  u8  maybe = 0;
+  u32 c;
 
-        case '\\':
+  trace_cksum = 0;
 
-          lptr++;
+  for (c = 0; c < dirty_cnt; c++) {
 
-          if (*lptr == '\\' || *lptr == '"') {
-            *(wptr++) = *(lptr++);
-            klen++;
-            break;
-          }
+    u32 pos = dirty_list[c] << DIRTY_CHUNK_POW2, j;
 
-          if (*lptr != 'x' || !isxdigit(lptr[1]) || !isxdigit(lptr[2]))
-            FATAL("Invalid escaping (not \\xNN) in line %u.", cur_line);
+    u8* mem = trace_bits + pos;
+    u8* vir = virgin_bits + pos;
 
-          *(wptr++) =
-            ((strchr(hexdigits, tolower(lptr[1])) - hexdigits) << 4) |
-            (strchr(hexdigits, tolower(lptr[2])) - hexdigits);
-
-          lptr += 3;
-          klen++;
+    if (bm_classify) {
+      maybe |= bm_classify(mem, vir, DIRTY_CHUNK, &trace_cksum, pos);
+      continue;
+    }
 
-          break;
+    for (j = 0; j < DIRTY_CHUNK; j++) {
+      mem[j] = count_class_lookup8[mem[j]];
+      maybe |= mem[j] & vir[j];
+    }
 
-        default:
+    trace_cksum += bm_cksum(mem, DIRTY_CHUNK, pos);
 
-          *(wptr++) = *(lptr++);
-          klen++;
+  }
 
-      }
+  trace_maybe_new = !!maybe;
+  trace_cksum_ok  = 1;
 
-    }
+}
 
-    extras[extras_cnt].len = klen;
 
-    if (extras[extras_cnt].len > MAX_DICT_FILE)
-      FATAL("Keyword too big in line %u (%s, limit is %s)", cur_line,
-            DMS(klen), DMS(MAX_DICT_FILE));
+EXP_ST void init_count_class16(void) {
 
-    if (*min_len > klen) *min_len = klen;
-    if (*max_len < klen) *max_len = klen;
+  u32 b1, b2;
 
-    extras_cnt++;
+  for (b1 = 0; b1 < 256; b1++) 
+    for (b2 = 0; b2 < 256; b2++)
+      count_class_lookup16[(b1 << 8) + b2] = 
+        (count_class_lookup8[b1] << 8) |
+        count_class_lookup8[b2];
 
-  }
+}
 
-  fclose(f);
 
-}
+#ifdef WORD_SIZE_64
 
+static inline void classify_counts(u64* mem) {
 
-/* Read extras from the extras directory and sort them by size. */
+  u64* virgin = (u64*)virgin_bits;
+  u64  maybe  = 0, cksum = 0;
+  u32  i = map_size >> 3;
 
-static void load_extras(u8* dir) {
+  if (trace_sparse) {
+    classify_dirty();
+    return;
+  }
 
-  DIR* d;
-  struct dirent* de;
-  u32 min_len = MAX_DICT_FILE, max_len = 0, dict_level = 0;
-  u8* x;
+  trace_cksum_ok = 1;
 
-  /* If the name ends with @, extract level and continue. */
+  if (bm_classify) {
+    trace_cksum = 0;
+    trace_maybe_new = bm_classify((u8*)mem, virgin_bits, map_size,
+                                  &trace_cksum, 0);
+    return;
+  }
 
-  if ((x = strchr(dir, '@'))) {
+  while (i--) {
 
-    *x = 0;
-    dict_level = atoi(x + 1);
+    /* Optimize for sparse bitmaps. */
 
-  }
+    if (unlikely(*mem)) {
 
-  ACTF("Loading extra dictionary from '%s' (level %u)...", dir, dict_level);
+      u16* mem16 = (u16*)mem;
 
-  d = opendir(dir);
+      mem16[0] = count_class_lookup16[mem16[0]];
+      mem16[1] = count_class_lookup16[mem16[1]];
+      mem16[2] = count_class_lookup16[mem16[2]];
+      mem16[3] = count_class_lookup16[mem16[3]];
 
-  if (!d) {
+      maybe |= *mem & *virgin;
+      cksum += bm_mix_word(*mem, (u8*)mem - trace_bits);
 
-    if (errno == ENOTDIR) {
-      load_extras_file(dir, &min_len, &max_len, dict_level);
-      goto check_and_sort;
     }
 
-    PFATAL("Unable to open '%s'", dir);
+    mem++;
+    virgin++;
 
   }
 
-  if (x) FATAL("Dictionary levels not supported for directories.");
+  trace_maybe_new = !!maybe;
+  trace_cksum     = cksum;
 
-  while ((de = readdir(d))) {
+}
 
-    struct stat st;
-    u8* fn = alloc_printf("%s/%s", dir, de->d_name);
-    s32 fd;
+#else
 
-    if (lstat(fn, &st) || access(fn, R_OK))
-      PFATAL("Unable to access '%s'", fn);
+static inline void classify_counts(u32* mem) {
 
-    /* This also takes care of . and .. */
-    if (!S_ISREG(st.st_mode) || !st.st_size) {
+  u32* virgin = (u32*)virgin_bits;
+  u32  maybe  = 0;
+  u32  i = map_size >> 2;
 
-      ck_free(fn);
-      continue;
+  if (trace_sparse) {
+    classify_dirty();
+    return;
+  }
 
-    }
+  /* Words are too narrow for the checksum here; hash_trace() will have to
+     do it separately. */
 
-    if (st.st_size > MAX_DICT_FILE)
-      FATAL("Extra '%s' is too big (%s, limit is %s)", fn,
-            DMS(st.st_size), DMS(MAX_DICT_FILE));
+  trace_cksum_ok = 0;
 
-    if (min_len > st.st_size) min_len = st.st_size;
-    if (max_len < st.st_size) max_len = st.st_size;
+  if (bm_classify) {
+    trace_maybe_new = bm_classify((u8*)mem, virgin_bits, map_size, NULL, 0);
+    return;
+  }
 
-    extras = ck_realloc_block(extras, (extras_cnt + 1) *
-               sizeof(struct extra_data));
+  while (i--) {
 
-    extras[extras_cnt].data = ck_alloc(st.st_size);
-    extras[extras_cnt].len  = st.st_size;
+    /* Optimize for sparse bitmaps. */
 
-    fd = open(fn, O_RDONLY);
+    if (unlikely(*mem)) {
 
-    if (fd < 0) PFATAL("Unable to open '%s'", fn);
+      u16* mem16 = (u16*)mem;
 
-    ck_read(fd, extras[extras_cnt].data, st.st_size, fn);
+      mem16[0] = count_class_lookup16[mem16[0]];
+      mem16[1] = count_class_lookup16[mem16[1]];
 
-    close(fd);
-    ck_free(fn);
+      maybe |= *mem & *virgin;
 
-    extras_cnt++;
+    }
+
+    mem++;
+    virgin++;
 
   }
 
-  closedir(d);
+  trace_maybe_new = !!maybe;
 
-check_and_sort:
+}
 
-  if (!extras_cnt) FATAL("No usable files in '%s'", dir);
+#endif /* ^WORD_SIZE_64 */
 
-  qsort(extras, extras_cnt, sizeof(struct extra_data), compare_extras_len);
 
-  OKF("Loaded %u extra tokens, size range %s to %s.", extras_cnt,
-      DMS(min_len), DMS(max_len));
+/* Get rid of shared memory (atexit handler). */
 
-  if (max_len > 32)
-    WARNF("Some tokens are relatively large (%s) - consider trimming.",
-          DMS(max_len));
+static void remove_shm(void) {
 
-  if (extras_cnt > MAX_DET_EXTRAS)
-    WARNF("More than %u tokens - will use them probabilistically.",
-          MAX_DET_EXTRAS);
+  shmctl(shm_id, IPC_RMID, NULL);
+  if (shm_fuzz_id >= 0) shmctl(shm_fuzz_id, IPC_RMID, NULL);
 
 }
 
 
+/* Compact trace bytes into a smaller bitmap. We effectively just drop the
+   count information here. This is called only sporadically, for some
+   new paths. */
 
+static void minimize_bits(u8* dst, u8* src) {
 
-/* Helper function for maybe_add_auto() */
-
-static inline u8 memcmp_nocase(u8* m1, u8* m2, u32 len) {
+  u32 i = 0;
 
-  while (len--) if (tolower(*(m1++)) ^ tolower(*(m2++))) return 1;
-  return 0;
+  if (src == trace_bits && trace_sparse) {
 
-}
+    u32 c;
 
+    for (c = 0; c < dirty_cnt; c++) {
 
-/* Maybe add automatic extra. */
+      u32 end = (dirty_list[c] + 1) << DIRTY_CHUNK_POW2;
 
-static void maybe_add_auto(u8* mem, u32 len) {
+      for (i = dirty_list[c] << DIRTY_CHUNK_POW2; i < end; i++)
+        if (src[i]) dst[i >> 3] |= 1 << (i & 7);
 
-  u32 i;
+    }
 
-  /* Allow users to specify that they don't want auto dictionaries. */
+    return;
 
-  if (!MAX_AUTO_EXTRAS || !USE_AUTO_EXTRAS) return;
+  }
 
-  /* Skip runs of identical bytes. */
+  while (i < map_size) {
 
-  for (i = 1; i < len; i++)
-    if (mem[0] ^ mem[i]) break;
+    if (*(src++)) dst[i >> 3] |= 1 << (i & 7);
+    i++;
 
-  if (i == len) return;
+  }
 
-  /* Reject builtin interesting values. */
+}
 
-  if (len == 2) {
 
-    i = sizeof(interesting_16) >> 1;
+/* Minimized traces kept for top_rated[] winners are stored as a list of the
+   map indices they hit, preceded by the count: most paths touch only a tiny
+   part of the map. Busier ones keep the bitmap form, with a count of
+   MINI_DENSE. */
 
-    while (i--) 
-      if (*((u16*)mem) == interesting_16[i] ||
-          *((u16*)mem) == SWAP16(interesting_16[i])) return;
+#define MINI_DENSE 0xffffffff
 
-  }
+static u32 mini_idx[MAP_SIZE];        /* Scratch index list               */
 
-  if (len == 4) {
+/* Collect the indices of the non-zero bytes in trace_bits[] into mini_idx[].
+   With a sparse trace, only dirty chunks can have anything set; otherwise,
+   we skip over the map a word at a time. Returns the count. */
 
-    i = sizeof(interesting_32) >> 2;
+static u32 trace_to_idx(void) {
 
-    while (i--) 
-      if (*((u32*)mem) == interesting_32[i] ||
-          *((u32*)mem) == SWAP32(interesting_32[i])) return;
+  u32 cnt = 0, c, i, end;
 
-  }
+  if (trace_sparse) {
 
-  /* Reject anything that matches existing extras. Do a case-insensitive
-     match. We optimize by exploiting the fact that extras[] are sorted
-     by size. */
+    for (c = 0; c < dirty_cnt; c++) {
 
-  for (i = 0; i < extras_cnt; i++)
-    if (extras[i].len >= len) break;
+      i   = dirty_list[c] << DIRTY_CHUNK_POW2;
+      end = i + DIRTY_CHUNK;
 
-  for (; i < extras_cnt && extras[i].len == len; i++)
-    if (!memcmp_nocase(extras[i].data, mem, len)) return;
+      for (; i < end; i++)
+        if (trace_bits[i]) mini_idx[cnt++] = i;
 
-  /* Last but not least, check a_extras[] for matches. There are no
-     guarantees of a particular sort order. */
+    }
 
-  auto_changed = 1;
+    return cnt;
 
-  for (i = 0; i < a_extras_cnt; i++) {
+  }
 
-    if (a_extras[i].len == len && !memcmp_nocase(a_extras[i].data, mem, len)) {
+  for (c = 0; c < (map_size >> 3); c++) {
 
-      a_extras[i].hit_cnt++;
-      goto sort_a_extras;
+    if (!((u64*)trace_bits)[c]) continue;
 
-    }
+    for (i = c << 3; i < (c + 1) << 3; i++)
+      if (trace_bits[i]) mini_idx[cnt++] = i;
 
   }
 
-  /* At this point, looks like we're dealing with a new entry. So, let's
-     append it if we have room. Otherwise, let's randomly evict some other
-     entry from the bottom half of the list. */
+  return cnt;
 
-  if (a_extras_cnt < MAX_AUTO_EXTRAS) {
+}
 
-    a_extras = ck_realloc_block(a_extras, (a_extras_cnt + 1) *
-                                sizeof(struct extra_data));
 
-    a_extras[a_extras_cnt].data = ck_memdup(mem, len);
-    a_extras[a_extras_cnt].len  = len;
-    a_extras_cnt++;
+/* Same, for a bitmap made by minimize_bits(). */
 
-  } else {
+static u32 mini_to_idx(u8* mini) {
 
-    i = MAX_AUTO_EXTRAS / 2 +
-        UR((MAX_AUTO_EXTRAS + 1) / 2);
+  u32 cnt = 0, i, b;
 
-    ck_free(a_extras[i].data);
+  for (i = 0; i < (map_size >> 3); i++)
 
-    a_extras[i].data    = ck_memdup(mem, len);
-    a_extras[i].len     = len;
-    a_extras[i].hit_cnt = 0;
+    if (mini[i])
+      for (b = 0; b < 8; b++)
+        if (mini[i] & (1 << b)) mini_idx[cnt++] = (i << 3) + b;
 
-  }
+  return cnt;
 
-sort_a_extras:
+}
 
-  /* First, sort all auto extras by use count, descending order. */
 
-  qsort(a_extras, a_extras_cnt, sizeof(struct extra_data),
-        compare_extras_use_d);
+/* Pack the first cnt indices in mini_idx[] into a minimized trace. */
 
-  /* Then, sort the top USE_AUTO_EXTRAS entries by size. */
+static u32* pack_mini(u32 cnt) {
 
-  qsort(a_extras, MIN(USE_AUTO_EXTRAS, a_extras_cnt),
-        sizeof(struct extra_data), compare_extras_len);
+  u32* ret;
+  u32  i;
 
-}
+  if ((u64)cnt * sizeof(u32) >= (map_size >> 3)) {
 
+    u8* bits;
 
-/* Save automatically generated extras. */
+    ret    = ck_alloc(sizeof(u32) + (map_size >> 3));
+    ret[0] = MINI_DENSE;
+    bits   = (u8*)(ret + 1);
 
-static void save_auto(void) {
+    for (i = 0; i < cnt; i++)
+      bits[mini_idx[i] >> 3] |= 1 << (mini_idx[i] & 7);
 
-  u32 i;
+  } else {
 
-  if (!auto_changed) return;
-  auto_changed = 0;
+    ret    = ck_alloc_nozero(sizeof(u32) * (cnt + 1));
+    ret[0] = cnt;
+    memcpy(ret + 1, mini_idx, sizeof(u32) * cnt);
 
-  for (i = 0; i < MIN(USE_AUTO_EXTRAS, a_extras_cnt); i++) {
+  }
 
-    u8* fn = alloc_printf("%s/queue/.state/auto_extras/auto_%06u", out_dir, i);
-    s32 fd;
+  return ret;
 
-    fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+}
 
-    if (fd < 0) PFATAL("Unable to create '%s'", fn);
 
-    ck_write(fd, a_extras[i].data, a_extras[i].len, fn);
+/* Bookkeeping for cull_queue(), which only looks at what changed since the
+   last time around, unless cull_full is set. */
 
-    close(fd);
-    ck_free(fn);
+static u32 top_list[MAP_SIZE],        /* Indices that have a top_rated[]  */
+           top_cnt,
+           rated_list[MAP_SIZE],      /* ...that changed hands since     */
+           rated_cnt;
 
-  }
+static u8  rated_map[MAP_SIZE >> 3],  /* Bitmap version of rated_list[]   */
+           cull_full = 1;             /* A favored entry lost a slot?     */
 
-}
 
+/* When we bump into a new path, we call this to see if the path appears
+   more "favorable" than any of the existing ones. The purpose of the
+   "favorables" is to have a minimal set of paths that trigger all the bits
+   seen in the bitmap so far, and focus on fuzzing them at the expense of
+   the rest.
 
-/* Load automatically generated extras. */
+   The first step of the process is to maintain a list of top_rated[] entries
+   for every byte in the bitmap. We win that slot if there is no previous
+   contender, or if the contender has a more favorable speed x size factor.
+   The path's own trace is expected in mini_idx[], cnt entries long. */
 
-static void load_auto(void) {
+static void rate_entry(struct queue_entry* q, u32 i, u64 fav_factor,
+                       u32 cnt) {
 
-  u32 i;
+  if (top_rated[i]) {
 
-  for (i = 0; i < USE_AUTO_EXTRAS; i++) {
+    /* Faster-executing or smaller test cases are favored. */
 
-    u8  tmp[MAX_AUTO_EXTRA + 1];
-    u8* fn = alloc_printf("%s/.state/auto_extras/auto_%06u", in_dir, i);
-    s32 fd, len;
+    if (fav_factor > top_rated[i]->exec_us * top_rated[i]->len) return;
 
-    fd = open(fn, O_RDONLY, 0600);
+    /* If the previous winner was favored, the favored set might not cover
+       everything anymore once it goes away; cull_queue() has to start
+       from scratch. */
 
-    if (fd < 0) {
+    if (top_rated[i]->favored) cull_full = 1;
 
-      if (errno != ENOENT) PFATAL("Unable to open '%s'", fn);
-      ck_free(fn);
-      break;
+    /* Looks like we're going to win. Decrease ref count for the
+       previous winner, discard its trace_bits[] if necessary. */
 
+    if (!--top_rated[i]->tc_ref) {
+      ck_free(top_rated[i]->trace_mini);
+      top_rated[i]->trace_mini = 0;
     }
 
-    /* We read one byte more to cheaply detect tokens that are too
-       long (and skip them). */
-
-    len = read(fd, tmp, MAX_AUTO_EXTRA + 1);
+  } else top_list[top_cnt++] = i;
 
-    if (len < 0) PFATAL("Unable to read from '%s'", fn);
+  if (!(rated_map[i >> 3] & (1 << (i & 7)))) {
+    rated_map[i >> 3] |= 1 << (i & 7);
+    rated_list[rated_cnt++] = i;
+  }
 
-    if (len >= MIN_AUTO_EXTRA && len <= MAX_AUTO_EXTRA)
-      maybe_add_auto(tmp, len);
+  /* Insert ourselves as the new winner. */
 
-    close(fd);
-    ck_free(fn);
+  top_rated[i] = q;
+  q->tc_ref++;
 
-  }
+  if (!q->trace_mini) q->trace_mini = pack_mini(cnt);
 
-  if (i) OKF("Loaded %u auto-discovered dictionary tokens.", i);
-  else OKF("No auto-generated dictionary tokens to reuse.");
+  score_changed = 1;
 
 }
 
+static void update_bitmap_score(struct queue_entry* q) {
 
-/* Destroy extras. */
+  u32 i, cnt = trace_to_idx();
+  u64 fav_factor = q->exec_us * q->len;
 
-static void destroy_extras(void) {
+  /* For every byte set in trace_bits[], see if there is a previous winner,
+     and how it compares to us. */
 
-  u32 i;
+  for (i = 0; i < cnt; i++)
+    rate_entry(q, mini_idx[i], fav_factor, cnt);
 
-  for (i = 0; i < extras_cnt; i++) 
-    ck_free(extras[i].data);
+}
 
-  ck_free(extras);
 
-  for (i = 0; i < a_extras_cnt; i++) 
-    ck_free(a_extras[i].data);
+/* Same thing for a path imported from another -j job, where all we have is
+   the minimized trace. */
 
-  ck_free(a_extras);
+static void update_bitmap_score_mini(struct queue_entry* q, u8* mini) {
 
-}
+  u32 i, cnt = mini_to_idx(mini);
+  u64 fav_factor = q->exec_us * q->len;
 
+  for (i = 0; i < cnt; i++)
+    rate_entry(q, mini_idx[i], fav_factor, cnt);
 
-/* Spin up fork server (instrumented mode only). The idea is explained here:
+}
 
-   http://lcamtuf.blogspot.com/2014/10/fuzzing-binaries-without-execve.html
 
-   In essence, the instrumentation allows us to skip execve(), and just keep
-   cloning a stopped child. So, we just execute once, and then send commands
-   through a pipe. The other part of this logic is in afl-as.h. */
+/* The second part of the mechanism discussed above is a routine that
+   goes over top_rated[] entries, and then sequentially grabs winners for
+   previously-unseen bytes (temp_v) and marks them as favored, at least
+   until the next run. The favored entries are given more air time during
+   all fuzzing steps.
 
-EXP_ST void init_forkserver(char** argv) {
+   As long as no favored entry lost any of its slots, the favored set from
+   last time still covers everything it used to, so we only need to go
+   over the slots that changed hands, and temp_v is kept across calls. The
+   same goes for the redundancy flags on disk: only entries that gained or
+   lost favored status, or are new, need to be looked at. */
 
-  static struct itimerval it;
-  int st_pipe[2], ctl_pipe[2];
-  int status;
-  s32 rlen;
+static void cull_queue(void) {
 
-  ACTF("Spinning up the fork server...");
+  static u8 temp_v[MAP_SIZE >> 3];
+  static struct queue_entry** fav_list;
+  static u32 cull_seen;
 
-  if (pipe(st_pipe) || pipe(ctl_pipe)) PFATAL("pipe() failed");
+  struct queue_entry** old_fav = NULL;
+  u32 old_cnt = 0, *list, cnt, i, k;
 
-  forksrv_pid = fork();
+  if (dumb_mode || !score_changed) return;
 
-  if (forksrv_pid < 0) PFATAL("fork() failed");
+  score_changed = 0;
 
-  if (!forksrv_pid) {
+  fav_list = ck_realloc(fav_list, queued_paths * sizeof(struct queue_entry*));
 
-    struct rlimit r;
+  if (cull_full) {
 
-    /* Umpf. On OpenBSD, the default fd limit for root users is set to
-       soft 128. Let's try to fix that... */
+    old_cnt = queued_favored;
 
-    if (!getrlimit(RLIMIT_NOFILE, &r) && r.rlim_cur < FORKSRV_FD + 2) {
+    if (old_cnt) {
 
-      r.rlim_cur = FORKSRV_FD + 2;
-      setrlimit(RLIMIT_NOFILE, &r); /* Ignore errors */
+      old_fav = ck_memdup(fav_list, old_cnt * sizeof(struct queue_entry*));
 
-    }
+      for (k = 0; k < old_cnt; k++) old_fav[k]->favored = 0;
 
-    if (mem_limit) {
+    }
 
-      r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+    memset(temp_v, 255, map_size >> 3);
 
-#ifdef RLIMIT_AS
+    queued_favored  = 0;
+    pending_favored = 0;
 
-      setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+    list = top_list;
+    cnt  = top_cnt;
 
-#else
+  } else {
 
-      /* This takes care of OpenBSD, which doesn't have RLIMIT_AS, but
-         according to reliable sources, RLIMIT_DATA covers anonymous
-         maps - so we should be getting good protection against OOM bugs. */
+    list = rated_list;
+    cnt  = rated_cnt;
 
-      setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+  }
 
-#endif /* ^RLIMIT_AS */
+  /* Let's see if anything in the bitmap isn't captured in temp_v.
+     If yes, and if it has a top_rated[] contender, let's use it. */
 
+  for (k = 0; k < cnt; k++) {
 
-    }
+    struct queue_entry* q;
+    u32* mini;
+    u32  j;
 
-    /* Dumping cores is slow and can lead to anomalies if SIGKILL is delivered
-       before the dump is complete. */
+    i = list[k];
+    q = top_rated[i];
 
-    r.rlim_max = r.rlim_cur = 0;
+    if (!(temp_v[i >> 3] & (1 << (i & 7)))) continue;
 
-    setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+    /* Remove all bits belonging to the current entry from temp_v. */
 
-    /* Isolate the process and configure standard descriptors. If out_file is
-       specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
+    mini = q->trace_mini;
 
-    setsid();
+    if (mini[0] == MINI_DENSE) {
 
-    dup2(dev_null_fd, 1);
-    dup2(dev_null_fd, 2);
+      u8* bits = (u8*)(mini + 1);
 
-    if (out_file) {
+      j = map_size >> 3;
 
-      dup2(dev_null_fd, 0);
+      while (j--)
+        if (bits[j]) temp_v[j] &= ~bits[j];
 
     } else {
 
-      dup2(out_fd, 0);
-      close(out_fd);
+      for (j = 1; j <= mini[0]; j++)
+        temp_v[mini[j] >> 3] &= ~(1 << (mini[j] & 7));
 
     }
 
-    /* Set up control and status pipes, close the unneeded original fds. */
+    q->favored = 1;
+    fav_list[queued_favored++] = q;
 
-    if (dup2(ctl_pipe[0], FORKSRV_FD) < 0) PFATAL("dup2() failed");
-    if (dup2(st_pipe[1], FORKSRV_FD + 1) < 0) PFATAL("dup2() failed");
+    if (!q->was_fuzzed) pending_favored++;
 
-    close(ctl_pipe[0]);
-    close(ctl_pipe[1]);
-    close(st_pipe[0]);
-    close(st_pipe[1]);
+    mark_as_redundant(q, 0);
 
-    close(out_dir_fd);
-    close(dev_null_fd);
-    close(dev_urandom_fd);
-    close(fileno(plot_file));
+  }
 
-    /* This should improve performance a bit, since it stops the linker from
-       doing extra work post-fork(). */
+  for (k = 0; k < rated_cnt; k++)
+    rated_map[rated_list[k] >> 3] &= ~(1 << (rated_list[k] & 7));
 
-    if (!getenv("LD_BIND_LAZY")) setenv("LD_BIND_NOW", "1", 0);
+  rated_cnt = 0;
+  cull_full = 0;
 
-    /* Set sane defaults for ASAN if nothing else specified. */
+  for (k = 0; k < old_cnt; k++)
+    if (!old_fav[k]->favored) mark_as_redundant(old_fav[k], 1);
 
-    setenv("ASAN_OPTIONS", "abort_on_error=1:"
-                           "detect_leaks=0:"
-                           "symbolize=0:"
-                           "allocator_may_return_null=1", 0);
+  ck_free(old_fav);
 
-    /* MSAN is tricky, because it doesn't support abort_on_error=1 at this
-       point. So, we do this in a very hacky way. */
+  for (; cull_seen < queued_paths; cull_seen++)
+    mark_as_redundant(queue_buf[cull_seen], !queue_buf[cull_seen]->favored);
 
-    setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
-                           "symbolize=0:"
-                           "abort_on_error=1:"
-                           "allocator_may_return_null=1:"
-                           "msan_track_origins=0", 0);
+}
 
-    execv(target_path, argv);
 
-    /* Use a distinctive bitmap signature to tell the parent about execv()
-       falling through. */
+/* Create the SHM region for trace_bits. This is also called by every -j
+   job we fork off, since each of them runs its own target. */
 
-    *(u32*)trace_bits = EXEC_FAIL_SIG;
-    exit(0);
+static void setup_trace_shm(void) {
 
-  }
+  u8* shm_str;
 
-  /* Close the unneeded endpoints. */
+  /* Leave room for the dirty-chunk summary and the fork server control
+     block; runtimes that don't use them never look past MAP_SIZE. */
 
-  close(ctl_pipe[0]);
-  close(st_pipe[1]);
+  shm_id = shmget(IPC_PRIVATE, MAP_SIZE + DIRTY_SIZE + FSRV_CTL_SIZE,
+                  IPC_CREAT | IPC_EXCL | 0600);
 
-  fsrv_ctl_fd = ctl_pipe[1];
-  fsrv_st_fd  = st_pipe[0];
+  if (shm_id < 0) PFATAL("shmget() failed");
 
-  /* Wait for the fork server to come up, but don't wait too long. */
+  atexit(remove_shm);
 
-  it.it_value.tv_sec = ((exec_tmout * FORK_WAIT_MULT) / 1000);
-  it.it_value.tv_usec = ((exec_tmout * FORK_WAIT_MULT) % 1000) * 1000;
+  shm_str = alloc_printf("%d", shm_id);
 
-  setitimer(ITIMER_REAL, &it, NULL);
+  /* If somebody is asking us to fuzz instrumented binaries in dumb mode,
+     we don't want them to detect instrumentation, since we won't be sending
+     fork server commands. This should be replaced with better auto-detection
+     later on, perhaps? */
 
-  rlen = read(fsrv_st_fd, &status, 4);
+  if (!dumb_mode) setenv(SHM_ENV_VAR, shm_str, 1);
 
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 0;
+  ck_free(shm_str);
 
-  setitimer(ITIMER_REAL, &it, NULL);
+  trace_bits = shmat(shm_id, NULL, 0);
+  
+  if (trace_bits == (void *)-1) PFATAL("shmat() failed");
 
-  /* If we have a four-byte "hello" message from the server, we're all set.
-     Otherwise, try to figure out what went wrong. */
+  dirty_bits = trace_bits + MAP_SIZE;
+  fsrv_ctl   = (u32*)(dirty_bits + DIRTY_SIZE);
 
-  if (rlen == 4) {
-    OKF("All right - fork server is up.");
-    return;
-  }
+  futex_mode = futex_child = 0;
 
-  if (child_timed_out)
-    FATAL("Timeout while initializing fork server (adjusting -t may help)");
+  /* The test case region is only advertised to the fork server (see
+     init_forkserver()), so nothing else we run ever picks it up. Whether
+     it gets used is up to the target. */
 
-  if (waitpid(forksrv_pid, &status, 0) <= 0)
-    PFATAL("waitpid() failed");
+  shm_fuzz_id = shmget(IPC_PRIVATE, SHM_FUZZ_SIZE, IPC_CREAT | IPC_EXCL | 0600);
 
-  if (WIFSIGNALED(status)) {
+  if (shm_fuzz_id < 0) PFATAL("shmget() failed");
 
-    if (mem_limit && mem_limit < 500 && uses_asan) {
+  shm_fuzz = shmat(shm_fuzz_id, NULL, 0);
 
-      SAYF("\n" cLRD "[-] " cRST
-           "Whoops, the target binary crashed suddenly, before receiving any input\n"
-           "    from the fuzzer! Since it seems to be built with ASAN and you have a\n"
-           "    restrictive memory limit configured, this is expected; please read\n"
-           "    %s/notes_for_asan.txt for help.\n", doc_path);
+  if (shm_fuzz == (void *)-1) PFATAL("shmat() failed");
 
-    } else if (!mem_limit) {
+  shm_fuzz_mode = 0;
 
-      SAYF("\n" cLRD "[-] " cRST
-           "Whoops, the target binary crashed suddenly, before receiving any input\n"
-           "    from the fuzzer! There are several probable explanations:\n\n"
+}
 
-           "    - The binary is just buggy and explodes entirely on its own. If so, you\n"
-           "      need to fix the underlying problem or find a better replacement.\n\n"
 
-#ifdef __APPLE__
+/* Configure shared memory and virgin_bits. This is called at startup. */
 
-           "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
-           "      break afl-fuzz performance optimizations when running platform-specific\n"
-           "      targets. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+EXP_ST void setup_shm(void) {
 
-#endif /* __APPLE__ */
+  if (!in_bitmap) memset(virgin_bits, 255, MAP_SIZE);
 
-           "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
-           "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
+  memset(virgin_tmout, 255, MAP_SIZE);
+  memset(virgin_crash, 255, MAP_SIZE);
 
-    } else {
+  setup_trace_shm();
 
-      SAYF("\n" cLRD "[-] " cRST
-           "Whoops, the target binary crashed suddenly, before receiving any input\n"
-           "    from the fuzzer! There are several probable explanations:\n\n"
+}
 
-           "    - The current memory limit (%s) is too restrictive, causing the\n"
-           "      target to hit an OOM condition in the dynamic linker. Try bumping up\n"
-           "      the limit with the -m setting in the command line. A simple way confirm\n"
-           "      this diagnosis would be:\n\n"
 
-#ifdef RLIMIT_AS
-           "      ( ulimit -Sv $[%llu << 10]; /path/to/fuzzed_app )\n\n"
-#else
-           "      ( ulimit -Sd $[%llu << 10]; /path/to/fuzzed_app )\n\n"
-#endif /* ^RLIMIT_AS */
+/* Load postprocessor, if available. */
 
-           "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
-           "      estimate the required amount of virtual memory for the binary.\n\n"
+static void setup_post(void) {
 
-           "    - The binary is just buggy and explodes entirely on its own. If so, you\n"
-           "      need to fix the underlying problem or find a better replacement.\n\n"
+  void* dh;
+  u8* fn = getenv("AFL_POST_LIBRARY");
+  u32 tlen = 6;
 
-#ifdef __APPLE__
+  if (!fn) return;
 
-           "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
-           "      break afl-fuzz performance optimizations when running platform-specific\n"
-           "      targets. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+  ACTF("Loading postprocessor from '%s'...", fn);
 
-#endif /* __APPLE__ */
+  dh = dlopen(fn, RTLD_NOW);
+  if (!dh) FATAL("%s", dlerror());
 
-           "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
-           "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
-           DMS(mem_limit << 20), mem_limit - 1);
+  post_handler = dlsym(dh, "afl_postprocess");
+  if (!post_handler) FATAL("Symbol 'afl_postprocess' not found.");
 
-    }
+  /* Do a quick test. It's better to segfault now than later =) */
 
-    FATAL("Fork server crashed with signal %d", WTERMSIG(status));
+  post_handler("hello", &tlen);
 
-  }
+  OKF("Postprocessor installed successfully.");
 
-  if (*(u32*)trace_bits == EXEC_FAIL_SIG)
-    FATAL("Unable to execute target application ('%s')", argv[0]);
+}
 
-  if (mem_limit && mem_limit < 500 && uses_asan) {
 
-    SAYF("\n" cLRD "[-] " cRST
-           "Hmm, looks like the target binary terminated before we could complete a\n"
-           "    handshake with the injected code. Since it seems to be built with ASAN and\n"
-           "    you have a restrictive memory limit configured, this is expected; please\n"
-           "    read %s/notes_for_asan.txt for help.\n", doc_path);
+/* Read all testcases from the input directory, then queue them for testing.
+   Called at startup. */
 
-  } else if (!mem_limit) {
+static void read_testcases(void) {
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Hmm, looks like the target binary terminated before we could complete a\n"
-         "    handshake with the injected code. Perhaps there is a horrible bug in the\n"
-         "    fuzzer. Poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
+  struct dirent **nl;
+  s32 nl_cnt;
+  u32 i;
+  u8* fn;
 
-  } else {
+  /* Auto-detect non-in-place resumption attempts. */
 
-    SAYF("\n" cLRD "[-] " cRST
-         "Hmm, looks like the target binary terminated before we could complete a\n"
-         "    handshake with the injected code. There are %s probable explanations:\n\n"
+  fn = alloc_printf("%s/queue", in_dir);
+  if (!access(fn, F_OK)) in_dir = fn; else ck_free(fn);
 
-         "%s"
-         "    - The current memory limit (%s) is too restrictive, causing an OOM\n"
-         "      fault in the dynamic linker. This can be fixed with the -m option. A\n"
-         "      simple way to confirm the diagnosis may be:\n\n"
+  ACTF("Scanning '%s'...", in_dir);
 
-#ifdef RLIMIT_AS
-         "      ( ulimit -Sv $[%llu << 10]; /path/to/fuzzed_app )\n\n"
-#else
-         "      ( ulimit -Sd $[%llu << 10]; /path/to/fuzzed_app )\n\n"
-#endif /* ^RLIMIT_AS */
+  /* We use scandir() + alphasort() rather than readdir() because otherwise,
+     the ordering  of test cases would vary somewhat randomly and would be
+     difficult to control. */
 
-         "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
+  nl_cnt = scandir(in_dir, &nl, NULL, alphasort);
+
+  if (nl_cnt < 0) {
+
+    if (errno == ENOENT || errno == ENOTDIR)
+
+      SAYF("\n" cLRD "[-] " cRST
+           "The input directory does not seem to be valid - try again. The fuzzer needs\n"
+           "    one or more test case to start with - ideally, a small file under 1 kB\n"
+           "    or so. The cases must be stored as regular files directly in the input\n"
+           "    directory.\n");
+
+    PFATAL("Unable to open '%s'", in_dir);
+
+  }
+
+  if (shuffle_queue && nl_cnt > 1) {
+
+    ACTF("Shuffling queue...");
+    shuffle_ptrs((void**)nl, nl_cnt);
+
+  }
+
+  for (i = 0; i < nl_cnt; i++) {
+
+    struct stat st;
+
+    u8* fn = alloc_printf("%s/%s", in_dir, nl[i]->d_name);
+    u8* dfn = alloc_printf("%s/.state/deterministic_done/%s", in_dir, nl[i]->d_name);
+
+    u8  passed_det = 0;
+
+    free(nl[i]); /* not tracked */
+ 
+    if (lstat(fn, &st) || access(fn, R_OK))
+      PFATAL("Unable to access '%s'", fn);
+
+    /* This also takes care of . and .. */
+
+    if (!S_ISREG(st.st_mode) || !st.st_size || strstr(fn, "/README.testcases")) {
+
+      ck_free(fn);
+      ck_free(dfn);
+      continue;
+
+    }
+
+    if (st.st_size > MAX_FILE) 
+      FATAL("Test case '%s' is too big (%s, limit is %s)", fn,
+            DMS(st.st_size), DMS(MAX_FILE));
+
+    /* Check for metadata that indicates that deterministic fuzzing
+       is complete for this entry. We don't want to repeat deterministic
+       fuzzing when resuming aborted scans, because it would be pointless
+       and probably very time-consuming. */
+
+    if (!access(dfn, F_OK)) passed_det = 1;
+    ck_free(dfn);
+
+    add_to_queue(fn, st.st_size, passed_det);
+
+  }
+
+  free(nl); /* not tracked */
+
+  if (!queued_paths) {
+
+    SAYF("\n" cLRD "[-] " cRST
+         "Looks like there are no valid test cases in the input directory! The fuzzer\n"
+         "    needs one or more test case to start with - ideally, a small file under\n"
+         "    1 kB or so. The cases must be stored as regular files directly in the\n"
+         "    input directory.\n");
+
+    FATAL("No usable test cases in '%s'", in_dir);
+
+  }
+
+  last_path_time = 0;
+  queued_at_start = queued_paths;
+
+}
+
+
+/* Helper function for load_extras. */
+
+static int compare_extras_len(const void* p1, const void* p2) {
+  struct extra_data *e1 = (struct extra_data*)p1,
+                    *e2 = (struct extra_data*)p2;
+
+  return e1->len - e2->len;
+}
+
+static int compare_extras_use_d(const void* p1, const void* p2) {
+  struct extra_data *e1 = (struct extra_data*)p1,
+                    *e2 = (struct extra_data*)p2;
+
+  return e2->hit_cnt - e1->hit_cnt;
+}
+
+
+/* Read extras from a file, sort by size. */
+
+static void load_extras_file(u8* fname, u32* min_len, u32* max_len,
+                             u32 dict_level) {
+
+  FILE* f;
+  u8  buf[MAX_LINE];
+  u8  *lptr;
+  u32 cur_line = 0;
+
+  f = fopen(fname, "r");
+
+  if (!f) PFATAL("Unable to open '%s'", fname);
+
+  while ((lptr = fgets(buf, MAX_LINE, f))) {
+
+    u8 *rptr, *wptr;
+    u32 klen = 0;
+
+    cur_line++;
+
+    /* Trim on left and right. */
+
+    while (isspace(*lptr)) lptr++;
+
+    rptr = lptr + strlen(lptr) - 1;
+    while (rptr >= lptr && isspace(*rptr)) rptr--;
+    rptr++;
+    *rptr = 0;
+
+    /* Skip empty lines and comments. */
+
+    if (!*lptr || *lptr == '#') continue;
+
+    /* All other lines must end with '"', which we can consume. */
+
+    rptr--;
+
+    if (rptr < lptr || *rptr != '"')
+      FATAL("Malformed name=\"value\" pair in line %u.", cur_line);
+
+    *rptr = 0;
+
+    /* Skip alphanumerics and dashes (label). */
+
+    while (isalnum(*lptr) || *lptr == '_') lptr++;
+
+    /* If @number follows, parse that. */
+
+    if (*lptr == '@') {
+
+      lptr++;
+      if (atoi(lptr) > dict_level) continue;
+      while (isdigit(*lptr)) lptr++;
+
+    }
+
+    /* Skip whitespace and = signs. */
+
+    while (isspace(*lptr) || *lptr == '=') lptr++;
+
+    /* Consume opening '"'. */
+
+    if (*lptr != '"')
+      FATAL("Malformed name=\"keyword\" pair in line %u.", cur_line);
+
+    lptr++;
+
+    if (!*lptr) FATAL("Empty keyword in line %u.", cur_line);
+
+    /* Okay, let's allocate memory and copy data between "...", handling
+       \xNN escaping, \\, and \". */
+
+    extras = ck_realloc_block(extras, (extras_cnt + 1) *
+               sizeof(struct extra_data));
+
+    wptr = extras[extras_cnt].data = ck_alloc(rptr - lptr);
+
+    while (*lptr) {
+
+      char* hexdigits = "0123456789abcdef";
+
+      switch (*lptr) {
+
+        case 1 ... 31:
+        case 128 ... 255:
+          FATAL("Non-printable characters in line %u.", cur_line);
+
+        case '\\':
+
+          lptr++;
+
+          if (*lptr == '\\' || *lptr == '"') {
+            *(wptr++) = *(lptr++);
+            klen++;
+            break;
+          }
+
+          if (*lptr != 'x' || !isxdigit(lptr[1]) || !isxdigit(lptr[2]))
+            FATAL("Invalid escaping (not \\xNN) in line %u.", cur_line);
+
+          *(wptr++) =
+            ((strchr(hexdigits, tolower(lptr[1])) - hexdigits) << 4) |
+            (strchr(hexdigits, tolower(lptr[2])) - hexdigits);
+
+          lptr += 3;
+          klen++;
+
+          break;
+
+        default:
+
+          *(wptr++) = *(lptr++);
+          klen++;
+
+      }
+
+    }
+
+    extras[extras_cnt].len = klen;
+
+    if (extras[extras_cnt].len > MAX_DICT_FILE)
+      FATAL("Keyword too big in line %u (%s, limit is %s)", cur_line,
+            DMS(klen), DMS(MAX_DICT_FILE));
+
+    if (*min_len > klen) *min_len = klen;
+    if (*max_len < klen) *max_len = klen;
+
+    extras_cnt++;
+
+  }
+
+  fclose(f);
+
+}
+
+
+/* Look up the trie edge for a given node and (lowercased) byte. Returns a
+   pointer to the slot, which is either the edge or the empty slot where it
+   should go. */
+
+static inline struct dict_edge* dict_slot(u32 node, u8 c) {
+
+  u32 key = ((node << 8) | c) + 1,
+      pos = (key * 0x9e3779b1) & dict_edge_mask;
+
+  while (dict_edges[pos].key && dict_edges[pos].key != key)
+    pos = (pos + 1) & dict_edge_mask;
+
+  return dict_edges + pos;
+
+}
+
+
+/* Build the dictionary index. Called from load_extras(), after sorting. */
+
+static void build_dict_index(void) {
+
+  u32 i, j, total = 1, size = 1;
+
+  for (i = 0; i < extras_cnt; i++) total += extras[i].len;
+
+  if (total >= (1 << 24)) FATAL("Dictionary too large to index");
+
+  while (size < total * 2) size <<= 1;
+
+  dict_edges     = ck_alloc(size * sizeof(struct dict_edge));
+  dict_edge_mask = size - 1;
+  dict_nodes     = 1;
+
+  dict_term = ck_alloc(total * sizeof(u32));
+  dict_next = ck_alloc(extras_cnt * sizeof(u32));
+  dict_hit  = ck_alloc(extras_cnt * sizeof(u32));
+
+  for (i = 0; i < extras_cnt; i++) {
+
+    u32 node = 0;
+
+    for (j = 0; j < extras[i].len; j++) {
+
+      struct dict_edge* e = dict_slot(node, tolower(extras[i].data[j]));
+
+      if (!e->key) {
+        e->key   = ((node << 8) | tolower(extras[i].data[j])) + 1;
+        e->child = dict_nodes++;
+      }
+
+      node = e->child;
+
+    }
+
+    dict_next[i]    = dict_term[node];
+    dict_term[node] = i + 1;
+
+  }
+
+}
+
+
+/* Check if a token is in extras[], ignoring case. */
+
+static u8 dict_has_nocase(u8* mem, u32 len) {
+
+  u32 node = 0;
+
+  if (!extras_cnt) return 0;
+
+  while (len--) {
+
+    struct dict_edge* e = dict_slot(node, tolower(*(mem++)));
+
+    if (!e->key) return 0;
+    node = e->child;
+
+  }
+
+  return !!dict_term[node];
+
+}
+
+
+/* Find the tokens that start at mem: those that match exactly get tagged in
+   dict_hit[] with a new value of dict_pos, returned to the caller. The
+   number of tokens found at least MIN_AUTO_EXTRA bytes long, ignoring case,
+   goes to *starts. Cost is bounded by the longest token, not by their
+   number. */
+
+static u32 dict_match(u8* mem, u32 len, u32* starts) {
+
+  u32 node = 0, depth = 0;
+
+  if (!++dict_pos) {
+    memset(dict_hit, 0, extras_cnt * sizeof(u32));
+    dict_pos = 1;
+  }
+
+  *starts = 0;
+
+  while (depth < len) {
+
+    struct dict_edge* e = dict_slot(node, tolower(mem[depth]));
+    u32 t;
+
+    if (!e->key) break;
+
+    node = e->child;
+    depth++;
+
+    for (t = dict_term[node]; t; t = dict_next[t - 1]) {
+
+      if (!memcmp(extras[t - 1].data, mem, depth)) dict_hit[t - 1] = dict_pos;
+      if (depth >= MIN_AUTO_EXTRA) (*starts)++;
+
+    }
+
+  }
+
+  return dict_pos;
+
+}
+
+
+/* Read extras from the extras directory and sort them by size. */
+
+static void load_extras(u8* dir) {
+
+  DIR* d;
+  struct dirent* de;
+  u32 min_len = MAX_DICT_FILE, max_len = 0, dict_level = 0;
+  u8* x;
+
+  /* If the name ends with @, extract level and continue. */
+
+  if ((x = strchr(dir, '@'))) {
+
+    *x = 0;
+    dict_level = atoi(x + 1);
+
+  }
+
+  ACTF("Loading extra dictionary from '%s' (level %u)...", dir, dict_level);
+
+  d = opendir(dir);
+
+  if (!d) {
+
+    if (errno == ENOTDIR) {
+      load_extras_file(dir, &min_len, &max_len, dict_level);
+      goto check_and_sort;
+    }
+
+    PFATAL("Unable to open '%s'", dir);
+
+  }
+
+  if (x) FATAL("Dictionary levels not supported for directories.");
+
+  while ((de = readdir(d))) {
+
+    struct stat st;
+    u8* fn = alloc_printf("%s/%s", dir, de->d_name);
+    s32 fd;
+
+    if (lstat(fn, &st) || access(fn, R_OK))
+      PFATAL("Unable to access '%s'", fn);
+
+    /* This also takes care of . and .. */
+    if (!S_ISREG(st.st_mode) || !st.st_size) {
+
+      ck_free(fn);
+      continue;
+
+    }
+
+    if (st.st_size > MAX_DICT_FILE)
+      FATAL("Extra '%s' is too big (%s, limit is %s)", fn,
+            DMS(st.st_size), DMS(MAX_DICT_FILE));
+
+    if (min_len > st.st_size) min_len = st.st_size;
+    if (max_len < st.st_size) max_len = st.st_size;
+
+    extras = ck_realloc_block(extras, (extras_cnt + 1) *
+               sizeof(struct extra_data));
+
+    extras[extras_cnt].data = ck_alloc(st.st_size);
+    extras[extras_cnt].len  = st.st_size;
+
+    fd = open(fn, O_RDONLY);
+
+    if (fd < 0) PFATAL("Unable to open '%s'", fn);
+
+    ck_read(fd, extras[extras_cnt].data, st.st_size, fn);
+
+    close(fd);
+    ck_free(fn);
+
+    extras_cnt++;
+
+  }
+
+  closedir(d);
+
+check_and_sort:
+
+  if (!extras_cnt) FATAL("No usable files in '%s'", dir);
+
+  qsort(extras, extras_cnt, sizeof(struct extra_data), compare_extras_len);
+
+  build_dict_index();
+
+  OKF("Loaded %u extra tokens, size range %s to %s.", extras_cnt,
+      DMS(min_len), DMS(max_len));
+
+  if (max_len > 32)
+    WARNF("Some tokens are relatively large (%s) - consider trimming.",
+          DMS(max_len));
+
+  if (extras_cnt > MAX_DET_EXTRAS)
+    WARNF("More than %u tokens - deterministic steps will spread them out.",
+          MAX_DET_EXTRAS);
+
+}
+
+
+/* Helper function for maybe_add_auto() */
+
+static inline u8 memcmp_nocase(u8* m1, u8* m2, u32 len) {
+
+  while (len--) if (tolower(*(m1++)) ^ tolower(*(m2++))) return 1;
+  return 0;
+
+}
+
+
+/* Maybe add automatic extra. */
+
+static void maybe_add_auto(u8* mem, u32 len) {
+
+  u32 i;
+
+  /* Allow users to specify that they don't want auto dictionaries. */
+
+  if (!MAX_AUTO_EXTRAS || !USE_AUTO_EXTRAS) return;
+
+  /* Skip runs of identical bytes. */
+
+  for (i = 1; i < len; i++)
+    if (mem[0] ^ mem[i]) break;
+
+  if (i == len) return;
+
+  /* Reject builtin interesting values. */
+
+  if (len == 2) {
+
+    i = sizeof(interesting_16) >> 1;
+
+    while (i--) 
+      if (*((u16*)mem) == interesting_16[i] ||
+          *((u16*)mem) == SWAP16(interesting_16[i])) return;
+
+  }
+
+  if (len == 4) {
+
+    i = sizeof(interesting_32) >> 2;
+
+    while (i--) 
+      if (*((u32*)mem) == interesting_32[i] ||
+          *((u32*)mem) == SWAP32(interesting_32[i])) return;
+
+  }
+
+  /* Reject anything that matches existing extras. Do a case-insensitive
+     match, using the index so that large dictionaries don't cost more. */
+
+  if (dict_has_nocase(mem, len)) return;
+
+  /* Last but not least, check a_extras[] for matches. There are no
+     guarantees of a particular sort order. */
+
+  auto_changed = 1;
+
+  for (i = 0; i < a_extras_cnt; i++) {
+
+    if (a_extras[i].len == len && !memcmp_nocase(a_extras[i].data, mem, len)) {
+
+      a_extras[i].hit_cnt++;
+      goto sort_a_extras;
+
+    }
+
+  }
+
+  /* At this point, looks like we're dealing with a new entry. So, let's
+     append it if we have room. Otherwise, let's randomly evict some other
+     entry from the bottom half of the list. */
+
+  if (a_extras_cnt < MAX_AUTO_EXTRAS) {
+
+    a_extras = ck_realloc_block(a_extras, (a_extras_cnt + 1) *
+                                sizeof(struct extra_data));
+
+    a_extras[a_extras_cnt].data = ck_memdup(mem, len);
+    a_extras[a_extras_cnt].len  = len;
+    a_extras_cnt++;
+
+  } else {
+
+    i = MAX_AUTO_EXTRAS / 2 +
+        UR((MAX_AUTO_EXTRAS + 1) / 2);
+
+    ck_free(a_extras[i].data);
+
+    a_extras[i].data    = ck_memdup(mem, len);
+    a_extras[i].len     = len;
+    a_extras[i].hit_cnt = 0;
+
+  }
+
+sort_a_extras:
+
+  /* First, sort all auto extras by use count, descending order. */
+
+  qsort(a_extras, a_extras_cnt, sizeof(struct extra_data),
+        compare_extras_use_d);
+
+  /* Then, sort the top USE_AUTO_EXTRAS entries by size. */
+
+  qsort(a_extras, MIN(USE_AUTO_EXTRAS, a_extras_cnt),
+        sizeof(struct extra_data), compare_extras_len);
+
+}
+
+
+/* Save automatically generated extras. */
+
+static void save_auto(void) {
+
+  u32 i;
+
+  if (!auto_changed) return;
+  auto_changed = 0;
+
+  for (i = 0; i < MIN(USE_AUTO_EXTRAS, a_extras_cnt); i++) {
+
+    u8* fn = alloc_printf("%s/queue/.state/auto_extras/auto_%06u", out_dir, i);
+    s32 fd;
+
+    fd = open(fn, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if (fd < 0) PFATAL("Unable to create '%s'", fn);
+
+    ck_write(fd, a_extras[i].data, a_extras[i].len, fn);
+
+    close(fd);
+    ck_free(fn);
+
+  }
+
+}
+
+
+/* Load automatically generated extras. */
+
+static void load_auto(void) {
+
+  u32 i;
+
+  for (i = 0; i < USE_AUTO_EXTRAS; i++) {
+
+    u8  tmp[MAX_AUTO_EXTRA + 1];
+    u8* fn = alloc_printf("%s/.state/auto_extras/auto_%06u", in_dir, i);
+    s32 fd, len;
+
+    fd = open(fn, O_RDONLY, 0600);
+
+    if (fd < 0) {
+
+      if (errno != ENOENT) PFATAL("Unable to open '%s'", fn);
+      ck_free(fn);
+      break;
+
+    }
+
+    /* We read one byte more to cheaply detect tokens that are too
+       long (and skip them). */
+
+    len = read(fd, tmp, MAX_AUTO_EXTRA + 1);
+
+    if (len < 0) PFATAL("Unable to read from '%s'", fn);
+
+    if (len >= MIN_AUTO_EXTRA && len <= MAX_AUTO_EXTRA)
+      maybe_add_auto(tmp, len);
+
+    close(fd);
+    ck_free(fn);
+
+  }
+
+  if (i) OKF("Loaded %u auto-discovered dictionary tokens.", i);
+  else OKF("No auto-generated dictionary tokens to reuse.");
+
+}
+
+
+/* Pick up any new tokens that libtokencap (running in the target, with the
+   same AFL_TOKEN_FILE) has written since the last call, and treat them as
+   auto-discovered. The library dedups on its own and writes whole lines in the
+   usual "..." format; anything else is skipped. Returns the number of tokens
+   read. */
+
+static u32 load_token_file(void) {
+
+  u8  buf[MAX_LINE];
+  u32 cnt = 0;
+  FILE* f;
+
+  if (!token_file || !(f = fopen(token_file, "r"))) return 0;
+
+  if (fseeko(f, token_file_pos, SEEK_SET)) {
+    fclose(f);
+    return 0;
+  }
+
+  while (fgets(buf, MAX_LINE, f)) {
+
+    u8  tok[MAX_AUTO_EXTRA];
+    u8* lptr = buf;
+    u32 len = 0;
+
+    /* Leave partial lines for next time. */
+
+    if (!strchr(buf, '\n')) break;
+
+    token_file_pos += strlen(buf);
+
+    if (*(lptr++) != '"') continue;
+
+    while (*lptr && *lptr != '"' && len < MAX_AUTO_EXTRA) {
+
+      if (lptr[0] == '\\' && lptr[1] == 'x' && isxdigit(lptr[2]) &&
+          isxdigit(lptr[3])) {
+
+        u8 hex[3] = { lptr[2], lptr[3], 0 };
+
+        tok[len++] = strtoul(hex, NULL, 16);
+        lptr += 4;
+
+      } else tok[len++] = *(lptr++);
+
+    }
+
+    if (*lptr != '"' || len < MIN_AUTO_EXTRA) continue;
+
+    maybe_add_auto(tok, len);
+    cnt++;
+
+  }
+
+  fclose(f);
+
+  return cnt;
+
+}
+
+
+/* Destroy extras. */
+
+static void destroy_extras(void) {
+
+  u32 i;
+
+  for (i = 0; i < extras_cnt; i++) 
+    ck_free(extras[i].data);
+
+  ck_free(extras);
+
+  for (i = 0; i < a_extras_cnt; i++) 
+    ck_free(a_extras[i].data);
+
+  ck_free(a_extras);
+
+}
+
+
+/* Spin up fork server (instrumented mode only). The idea is explained here:
+
+   http://lcamtuf.blogspot.com/2014/10/fuzzing-binaries-without-execve.html
+
+   In essence, the instrumentation allows us to skip execve(), and just keep
+   cloning a stopped child. So, we just execute once, and then send commands
+   through a pipe. The other part of this logic is in afl-as.h. */
+
+EXP_ST void init_forkserver(char** argv) {
+
+  static struct itimerval it;
+  int st_pipe[2], ctl_pipe[2];
+  int status;
+  s32 rlen;
+
+  ACTF("Spinning up the fork server...");
+
+  if (pipe(st_pipe) || pipe(ctl_pipe)) PFATAL("pipe() failed");
+
+  forksrv_pid = fork();
+
+  if (forksrv_pid < 0) PFATAL("fork() failed");
+
+  if (!forksrv_pid) {
+
+    struct rlimit r;
+
+    /* Umpf. On OpenBSD, the default fd limit for root users is set to
+       soft 128. Let's try to fix that... */
+
+    if (!getrlimit(RLIMIT_NOFILE, &r) && r.rlim_cur < FORKSRV_FD + 2) {
+
+      r.rlim_cur = FORKSRV_FD + 2;
+      setrlimit(RLIMIT_NOFILE, &r); /* Ignore errors */
+
+    }
+
+    if (mem_limit) {
+
+      r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+
+#ifdef RLIMIT_AS
+
+      setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+
+#else
+
+      /* This takes care of OpenBSD, which doesn't have RLIMIT_AS, but
+         according to reliable sources, RLIMIT_DATA covers anonymous
+         maps - so we should be getting good protection against OOM bugs. */
+
+      setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+
+#endif /* ^RLIMIT_AS */
+
+
+    }
+
+    /* Dumping cores is slow and can lead to anomalies if SIGKILL is delivered
+       before the dump is complete. */
+
+    r.rlim_max = r.rlim_cur = 0;
+
+    setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+
+    /* Isolate the process and configure standard descriptors. If out_file is
+       specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
+
+    setsid();
+
+    dup2(dev_null_fd, 1);
+    dup2(dev_null_fd, 2);
+
+    if (out_file) {
+
+      dup2(dev_null_fd, 0);
+
+    } else {
+
+      dup2(out_fd, 0);
+      close(out_fd);
+
+    }
+
+    /* Set up control and status pipes, close the unneeded original fds. */
+
+    if (dup2(ctl_pipe[0], FORKSRV_FD) < 0) PFATAL("dup2() failed");
+    if (dup2(st_pipe[1], FORKSRV_FD + 1) < 0) PFATAL("dup2() failed");
+
+    close(ctl_pipe[0]);
+    close(ctl_pipe[1]);
+    close(st_pipe[0]);
+    close(st_pipe[1]);
+
+    close(out_dir_fd);
+    close(dev_null_fd);
+    close(dev_urandom_fd);
+    close(fileno(plot_file));
+
+    /* This should improve performance a bit, since it stops the linker from
+       doing extra work post-fork(). */
+
+    if (!getenv("LD_BIND_LAZY")) setenv("LD_BIND_NOW", "1", 0);
+
+    /* Offer the test case region; the runtime maps it only if the target
+       was built to read from it, and tells us so in its hello. */
+
+    if (shm_fuzz_id >= 0) {
+
+      u8* shm_str = alloc_printf("%d", shm_fuzz_id);
+      setenv(SHM_FUZZ_ENV_VAR, shm_str, 1);
+      ck_free(shm_str);
+
+    }
+
+    /* Set sane defaults for ASAN if nothing else specified. */
+
+    setenv("ASAN_OPTIONS", "abort_on_error=1:"
+                           "detect_leaks=0:"
+                           "symbolize=0:"
+                           "allocator_may_return_null=1", 0);
+
+    /* MSAN is tricky, because it doesn't support abort_on_error=1 at this
+       point. So, we do this in a very hacky way. */
+
+    setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
+                           "symbolize=0:"
+                           "abort_on_error=1:"
+                           "allocator_may_return_null=1:"
+                           "msan_track_origins=0", 0);
+
+    execv(target_path, argv);
+
+    /* Use a distinctive bitmap signature to tell the parent about execv()
+       falling through. */
+
+    *(u32*)trace_bits = EXEC_FAIL_SIG;
+    exit(0);
+
+  }
+
+  /* Close the unneeded endpoints. */
+
+  close(ctl_pipe[0]);
+  close(st_pipe[1]);
+
+  fsrv_ctl_fd = ctl_pipe[1];
+  fsrv_st_fd  = st_pipe[0];
+
+  /* Wait for the fork server to come up, but don't wait too long. */
+
+  it.it_value.tv_sec = ((exec_tmout * FORK_WAIT_MULT) / 1000);
+  it.it_value.tv_usec = ((exec_tmout * FORK_WAIT_MULT) % 1000) * 1000;
+
+  setitimer(ITIMER_REAL, &it, NULL);
+
+  rlen = read(fsrv_st_fd, &status, 4);
+
+  it.it_value.tv_sec = 0;
+  it.it_value.tv_usec = 0;
+
+  setitimer(ITIMER_REAL, &it, NULL);
+
+  /* If we have a four-byte "hello" message from the server, we're all set.
+     Otherwise, try to figure out what went wrong. */
+
+  if (rlen == 4) {
+
+    /* Newer runtimes also tell us how much of the map they actually use,
+       so that we don't have to clear, scan and hash the rest. */
+
+    if ((status & FS_OPT_ENABLED) == FS_OPT_ENABLED &&
+        (status & FS_OPT_MAPSIZE)) {
+
+      u32 tsize = FS_OPT_GET_MAPSIZE(status);
+
+      if (tsize > MAP_SIZE)
+        FATAL("Target uses a %u-byte map, but afl-fuzz was built with a "
+              "MAP_SIZE of %u", tsize, MAP_SIZE);
+
+      map_size = (tsize + 63) & ~63;
+
+      if (map_size != MAP_SIZE)
+        OKF("Target reports a map size of %u bytes.", tsize);
+
+    }
+
+    /* ...and which parts of the map it touched. */
+
+    if ((status & FS_OPT_ENABLED) == FS_OPT_ENABLED &&
+        (status & FS_OPT_DIRTY) && !getenv("AFL_NO_DIRTY_MAP")) {
+
+      dirty_mode = 1;
+      OKF("Target tracks dirty map chunks, post-exec work will be sparse.");
+
+    }
+
+    /* ...and whether it takes its input from shared memory. */
+
+    if ((status & FS_OPT_ENABLED) == FS_OPT_ENABLED &&
+        (status & FS_OPT_SHMEM_FUZZ)) {
+
+      shm_fuzz_mode = 1;
+      OKF("Target reads test cases from shared memory.");
+
+    }
+
+#ifdef HAVE_FUTEX
+
+    /* ...and whether we can skip the pipes between persistent runs. This
+       has to be settled before the first child is spawned. */
+
+    if ((status & FS_OPT_ENABLED) == FS_OPT_ENABLED &&
+        (status & FS_OPT_FUTEX) && !getenv("AFL_NO_FUTEX")) {
+
+      fsrv_ctl[FSRV_CTL_MODE] = 1;
+      futex_mode = 1;
+      OKF("Persistent runs will be driven through shared memory.");
+
+    }
+
+#endif /* HAVE_FUTEX */
+
+    OKF("All right - fork server is up.");
+    return;
+
+  }
+
+  if (child_timed_out)
+    FATAL("Timeout while initializing fork server (adjusting -t may help)");
+
+  if (waitpid(forksrv_pid, &status, 0) <= 0)
+    PFATAL("waitpid() failed");
+
+  if (WIFSIGNALED(status)) {
+
+    if (mem_limit && mem_limit < 500 && uses_asan) {
+
+      SAYF("\n" cLRD "[-] " cRST
+           "Whoops, the target binary crashed suddenly, before receiving any input\n"
+           "    from the fuzzer! Since it seems to be built with ASAN and you have a\n"
+           "    restrictive memory limit configured, this is expected; please read\n"
+           "    %s/notes_for_asan.txt for help.\n", doc_path);
+
+    } else if (!mem_limit) {
+
+      SAYF("\n" cLRD "[-] " cRST
+           "Whoops, the target binary crashed suddenly, before receiving any input\n"
+           "    from the fuzzer! There are several probable explanations:\n\n"
+
+           "    - The binary is just buggy and explodes entirely on its own. If so, you\n"
+           "      need to fix the underlying problem or find a better replacement.\n\n"
+
+#ifdef __APPLE__
+
+           "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
+           "      break afl-fuzz performance optimizations when running platform-specific\n"
+           "      targets. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+
+#endif /* __APPLE__ */
+
+           "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
+           "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
+
+    } else {
+
+      SAYF("\n" cLRD "[-] " cRST
+           "Whoops, the target binary crashed suddenly, before receiving any input\n"
+           "    from the fuzzer! There are several probable explanations:\n\n"
+
+           "    - The current memory limit (%s) is too restrictive, causing the\n"
+           "      target to hit an OOM condition in the dynamic linker. Try bumping up\n"
+           "      the limit with the -m setting in the command line. A simple way confirm\n"
+           "      this diagnosis would be:\n\n"
+
+#ifdef RLIMIT_AS
+           "      ( ulimit -Sv $[%llu << 10]; /path/to/fuzzed_app )\n\n"
+#else
+           "      ( ulimit -Sd $[%llu << 10]; /path/to/fuzzed_app )\n\n"
+#endif /* ^RLIMIT_AS */
+
+           "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
+           "      estimate the required amount of virtual memory for the binary.\n\n"
+
+           "    - The binary is just buggy and explodes entirely on its own. If so, you\n"
+           "      need to fix the underlying problem or find a better replacement.\n\n"
+
+#ifdef __APPLE__
+
+           "    - On MacOS X, the semantics of fork() syscalls are non-standard and may\n"
+           "      break afl-fuzz performance optimizations when running platform-specific\n"
+           "      targets. To fix this, set AFL_NO_FORKSRV=1 in the environment.\n\n"
+
+#endif /* __APPLE__ */
+
+           "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
+           "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
+           DMS(mem_limit << 20), mem_limit - 1);
+
+    }
+
+    FATAL("Fork server crashed with signal %d", WTERMSIG(status));
+
+  }
+
+  if (*(u32*)trace_bits == EXEC_FAIL_SIG)
+    FATAL("Unable to execute target application ('%s')", argv[0]);
+
+  if (mem_limit && mem_limit < 500 && uses_asan) {
+
+    SAYF("\n" cLRD "[-] " cRST
+           "Hmm, looks like the target binary terminated before we could complete a\n"
+           "    handshake with the injected code. Since it seems to be built with ASAN and\n"
+           "    you have a restrictive memory limit configured, this is expected; please\n"
+           "    read %s/notes_for_asan.txt for help.\n", doc_path);
+
+  } else if (!mem_limit) {
+
+    SAYF("\n" cLRD "[-] " cRST
+         "Hmm, looks like the target binary terminated before we could complete a\n"
+         "    handshake with the injected code. Perhaps there is a horrible bug in the\n"
+         "    fuzzer. Poke <lcamtuf@coredump.cx> for troubleshooting tips.\n");
+
+  } else {
+
+    SAYF("\n" cLRD "[-] " cRST
+         "Hmm, looks like the target binary terminated before we could complete a\n"
+         "    handshake with the injected code. There are %s probable explanations:\n\n"
+
+         "%s"
+         "    - The current memory limit (%s) is too restrictive, causing an OOM\n"
+         "      fault in the dynamic linker. This can be fixed with the -m option. A\n"
+         "      simple way to confirm the diagnosis may be:\n\n"
+
+#ifdef RLIMIT_AS
+         "      ( ulimit -Sv $[%llu << 10]; /path/to/fuzzed_app )\n\n"
+#else
+         "      ( ulimit -Sd $[%llu << 10]; /path/to/fuzzed_app )\n\n"
+#endif /* ^RLIMIT_AS */
+
+         "      Tip: you can use http://jwilk.net/software/recidivm to quickly\n"
          "      estimate the required amount of virtual memory for the binary.\n\n"
 
-         "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
-         "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
-         getenv(DEFER_ENV_VAR) ? "three" : "two",
-         getenv(DEFER_ENV_VAR) ?
-         "    - You are using deferred forkserver, but __AFL_INIT() is never\n"
-         "      reached before the program terminates.\n\n" : "",
-         DMS(mem_limit << 20), mem_limit - 1);
+         "    - Less likely, there is a horrible bug in the fuzzer. If other options\n"
+         "      fail, poke <lcamtuf@coredump.cx> for troubleshooting tips.\n",
+         getenv(DEFER_ENV_VAR) ? "three" : "two",
+         getenv(DEFER_ENV_VAR) ?
+         "    - You are using deferred forkserver, but __AFL_INIT() is never\n"
+         "      reached before the program terminates.\n\n" : "",
+         DMS(mem_limit << 20), mem_limit - 1);
+
+  }
+
+  FATAL("Fork server handshake failed");
+
+}
+
+
+/* Execute target application, monitoring for timeouts. Return status
+   information. The called program will update trace_bits[]. */
+
+#ifdef HAVE_FUTEX
+
+/* Wait for a persistent child driven through fsrv_ctl to finish run seq,
+   killing it after tmout_us. If it's gone (crashed, exited, killed), the
+   fork server posts DEAD before sending the wait status down the pipe as
+   usual, so we pick that up; a child that simply finished reports zero.
+   Returns the time taken, in us. */
+
+static u64 futex_wait_child(u32 seq, u64 tmout_us, int* status) {
+
+  u64 start_us = get_cur_time_us(), cur_us = start_us,
+      stop_us  = start_us + tmout_us;
+  u32 done;
+  s32 res;
+
+  *status = 0;
+
+  while ((done = __atomic_load_n(&fsrv_ctl[FSRV_CTL_DONE],
+                                 __ATOMIC_ACQUIRE)) != seq) {
+
+    struct timespec ts;
+
+    if (stop_soon) return 0;
+
+    if (cur_us >= stop_us) {
+
+      child_timed_out = 1;
+      kill(child_pid, SIGKILL);
+      break;
+
+    }
+
+    ts.tv_sec  = (stop_us - cur_us) / 1000000;
+    ts.tv_nsec = ((stop_us - cur_us) % 1000000) * 1000;
+
+    syscall(SYS_futex, &fsrv_ctl[FSRV_CTL_DONE], FUTEX_WAIT, done, &ts,
+            NULL, 0);
+
+    cur_us = get_cur_time_us();
+
+  }
+
+  if (child_timed_out || __atomic_load_n(&fsrv_ctl[FSRV_CTL_DEAD],
+                                         __ATOMIC_ACQUIRE)) {
+
+    if ((res = read(fsrv_st_fd, status, 4)) != 4) {
+
+      if (stop_soon) return 0;
+      RPFATAL(res, "Unable to communicate with fork server (OOM?)");
+
+    }
+
+    fsrv_ctl[FSRV_CTL_DEAD] = 0;
+    futex_child = 0;
+    child_pid   = 0;
+
+  }
+
+  return cur_us - start_us;
+
+}
+
+#endif /* HAVE_FUTEX */
+
+
+/* Wait for fd to become readable, killing child_pid (and setting
+   child_timed_out) if that doesn't happen by stop_us. This is the status
+   pipe of the fork server, or a pidfd in dumb mode; either way, the caller
+   then collects the exit status as usual. Unlike setitimer(), this costs
+   no syscalls beyond the wait itself, and has microsecond resolution. */
+
+static void wait_timed(s32 fd, u64 stop_us) {
+
+  struct pollfd pfd;
+
+  pfd.fd     = fd;
+  pfd.events = POLLIN;
+
+  while (!stop_soon) {
+
+    u64 cur_us = get_cur_time_us();
+    s32 res;
+
+    if (cur_us >= stop_us) {
+
+      child_timed_out = 1;
+      if (child_pid > 0) kill(child_pid, SIGKILL);
+      return;
+
+    }
+
+#ifdef __linux__
+
+    {
+
+      struct timespec ts;
+
+      ts.tv_sec  = (stop_us - cur_us) / 1000000;
+      ts.tv_nsec = ((stop_us - cur_us) % 1000000) * 1000;
+
+      res = ppoll(&pfd, 1, &ts, NULL);
+
+    }
+
+#else
+
+    res = poll(&pfd, 1, (stop_us - cur_us + 999) / 1000);
+
+#endif /* ^__linux__ */
+
+    if (res > 0) return;
+    if (res < 0 && errno != EINTR) PFATAL("poll() failed");
+
+  }
+
+}
+
+
+static u8 run_target_us(char** argv, u64 tmout_us) {
+
+  static struct itimerval it;
+  static u32 prev_timed_out = 0;
+  static u64 exec_ms = 0;
+
+  int status = 0;
+  u32 tb4, seq = 0;
+  u64 start_us;
+  u8  old_phase = phase_switch(PHASE_CLEAR);
+
+  child_timed_out = 0;
+
+  /* After this memset, trace_bits[] are effectively volatile, so we
+     must prevent any earlier operations from venturing into that
+     territory. */
+
+  clear_trace();
+  MEM_BARRIER();
+
+  phase_switch(PHASE_EXEC);
+
+  /* If we're running in "dumb" mode, we can't rely on the fork server
+     logic compiled into the target program, so we will just keep calling
+     execve(). There is a bit of code duplication between here and 
+     init_forkserver(), but c'est la vie. */
+
+  if (dumb_mode == 1 || no_forkserver) {
+
+    child_pid = fork();
+
+    if (child_pid < 0) PFATAL("fork() failed");
+
+    if (!child_pid) {
+
+      struct rlimit r;
+
+      if (mem_limit) {
+
+        r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+
+#ifdef RLIMIT_AS
+
+        setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+
+#else
+
+        setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+
+#endif /* ^RLIMIT_AS */
+
+      }
+
+      r.rlim_max = r.rlim_cur = 0;
+
+      setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+
+      /* Isolate the process and configure standard descriptors. If out_file is
+         specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
+
+      setsid();
+
+      dup2(dev_null_fd, 1);
+      dup2(dev_null_fd, 2);
+
+      if (out_file) {
+
+        dup2(dev_null_fd, 0);
+
+      } else {
+
+        dup2(out_fd, 0);
+        close(out_fd);
+
+      }
+
+      /* On Linux, would be faster to use O_CLOEXEC. Maybe TODO. */
+
+      close(dev_null_fd);
+      close(out_dir_fd);
+      close(dev_urandom_fd);
+      close(fileno(plot_file));
+
+      /* Set sane defaults for ASAN if nothing else specified. */
+
+      setenv("ASAN_OPTIONS", "abort_on_error=1:"
+                             "detect_leaks=0:"
+                             "symbolize=0:"
+                             "allocator_may_return_null=1", 0);
+
+      setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
+                             "symbolize=0:"
+                             "msan_track_origins=0", 0);
+
+      execv(target_path, argv);
+
+      /* Use a distinctive bitmap value to tell the parent about execv()
+         falling through. */
+
+      *(u32*)trace_bits = EXEC_FAIL_SIG;
+      exit(0);
+
+    }
+
+  } else {
+
+    s32 res;
+
+    /* In futex mode, every run gets a new sequence number. If the previous
+       child is still waiting in __AFL_LOOP(), posting it is all there is
+       to do; otherwise, the new child picks it up when it starts. */
+
+    if (futex_mode) {
+
+      seq = fsrv_ctl[FSRV_CTL_START] + 1;
+      __atomic_store_n(&fsrv_ctl[FSRV_CTL_START], seq, __ATOMIC_RELEASE);
+
+    }
+
+#ifdef HAVE_FUTEX
+
+    if (futex_child) {
+
+      syscall(SYS_futex, &fsrv_ctl[FSRV_CTL_START], FUTEX_WAKE, 1,
+              NULL, NULL, 0);
+
+    } else
+
+#endif /* HAVE_FUTEX */
+
+    {
+
+      /* In non-dumb mode, we have the fork server up and running, so simply
+         tell it to have at it, and then read back PID. */
+
+      if ((res = write(fsrv_ctl_fd, &prev_timed_out, 4)) != 4) {
+
+        if (stop_soon) return 0;
+        RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+
+      }
+
+      if ((res = read(fsrv_st_fd, &child_pid, 4)) != 4) {
+
+        if (stop_soon) return 0;
+        RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+
+      }
+
+      if (child_pid <= 0) FATAL("Fork server is misbehaving (OOM?)");
+
+      futex_child = futex_mode;
+
+    }
+
+  }
+
+  start_us = get_cur_time_us();
+
+#ifdef HAVE_FUTEX
+
+  if (futex_mode) {
+
+    last_exec_us = futex_wait_child(seq, tmout_us, &status);
+    if (stop_soon) return 0;
+
+  } else
+
+#endif /* HAVE_FUTEX */
+
+  {
+
+    /* Wait for the child to terminate, killing it if it runs past the
+       timeout. */
+
+    if (dumb_mode == 1 || no_forkserver) {
+
+      s32 pidfd = -1;
+
+#ifdef SYS_pidfd_open
+      pidfd = syscall(SYS_pidfd_open, child_pid, 0);
+#endif /* SYS_pidfd_open */
+
+      if (pidfd >= 0) {
+
+        wait_timed(pidfd, start_us + tmout_us);
+        close(pidfd);
+
+      } else {
+
+        /* No pidfd_open() here; fall back to SIGALRM, which simply kills
+           the child_pid and sets child_timed_out. */
+
+        it.it_value.tv_sec  = tmout_us / 1000000;
+        it.it_value.tv_usec = tmout_us % 1000000;
+
+        setitimer(ITIMER_REAL, &it, NULL);
+
+      }
+
+      if (waitpid(child_pid, &status, 0) <= 0) PFATAL("waitpid() failed");
+
+      if (pidfd < 0) {
+
+        it.it_value.tv_sec = 0;
+        it.it_value.tv_usec = 0;
+
+        setitimer(ITIMER_REAL, &it, NULL);
+
+      }
+
+    } else {
+
+      s32 res;
+
+      wait_timed(fsrv_st_fd, start_us + tmout_us);
+
+      if ((res = read(fsrv_st_fd, &status, 4)) != 4) {
+
+        if (stop_soon) return 0;
+        RPFATAL(res, "Unable to communicate with fork server (OOM?)");
+
+      }
+
+    }
+
+    if (!WIFSTOPPED(status)) child_pid = 0;
+
+    last_exec_us = get_cur_time_us() - start_us;
+
+  }
+
+  exec_ms = last_exec_us / 1000;
+
+  total_execs++;
+
+  /* Any subsequent operations on trace_bits must not be moved by the
+     compiler below this point. Past this location, trace_bits[] behave
+     very normally and do not have to be treated as volatile. */
+
+  MEM_BARRIER();
+
+  tb4 = *(u32*)trace_bits;
+
+  phase_switch(PHASE_CLASSIFY);
+
+  if (dirty_mode) {
+    dirty_cnt    = collect_dirty(dirty_list);
+    trace_sparse = 1;
+  }
+
+#ifdef WORD_SIZE_64
+  classify_counts((u64*)trace_bits);
+#else
+  classify_counts((u32*)trace_bits);
+#endif /* ^WORD_SIZE_64 */
+
+  phase_switch(old_phase);
+
+  /* Execs done on behalf of calibration, trimming and so on are filed
+     under that; the rest, under the fuzzing stage they came from. */
+
+  if (old_phase >= PHASE_SAVE)
+    lat_record(phase_names[old_phase], last_exec_us);
+  else
+    lat_record(stage_short ? stage_short : (u8*)"other", last_exec_us);
+
+  prev_timed_out = child_timed_out;
+
+  /* Report outcome to caller. */
+
+  if (WIFSIGNALED(status) && !stop_soon) {
+
+    kill_signal = WTERMSIG(status);
+
+    if (child_timed_out && kill_signal == SIGKILL) return FAULT_TMOUT;
+
+    return FAULT_CRASH;
+
+  }
+
+  /* A somewhat nasty hack for MSAN, which doesn't support abort_on_error and
+     must use a special exit code. */
+
+  if (uses_asan && WEXITSTATUS(status) == MSAN_ERROR) {
+    kill_signal = 0;
+    return FAULT_CRASH;
+  }
+
+  if ((dumb_mode == 1 || no_forkserver) && tb4 == EXEC_FAIL_SIG)
+    return FAULT_ERROR;
+
+  /* It makes sense to account for the slowest units only if the testcase was run
+  under the user defined timeout. */
+  if (!(tmout_us > (u64)exec_tmout * 1000) && (slowest_exec_ms < exec_ms)) {
+    slowest_exec_ms = exec_ms;
+  }
+
+  return FAULT_NONE;
+
+}
+
+
+/* The same, with the timeout in ms. */
+
+static u8 run_target(char** argv, u32 timeout) {
+
+  return run_target_us(argv, (u64)timeout * 1000);
+
+}
+
+
+/* Write modified data to file for testing. If out_file is set, the old file
+   is unlinked and a new one is created. Otherwise, out_fd is rewound and
+   truncated. Targets that read from shared memory just get a copy in
+   shm_fuzz, without any syscalls. */
+
+static void write_to_testcase(void* mem, u32 len) {
+
+  s32 fd = out_fd;
+
+  if (shm_fuzz_mode) {
+
+    if (len > MAX_FILE) len = MAX_FILE;
+
+    memcpy(shm_fuzz + sizeof(u32), mem, len);
+    *(u32*)shm_fuzz = len;
+    return;
+
+  }
+
+  if (out_file) {
+
+    unlink(out_file); /* Ignore errors. */
+
+    fd = open(out_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+    if (fd < 0) PFATAL("Unable to create '%s'", out_file);
+
+  } else lseek(fd, 0, SEEK_SET);
+
+  ck_write(fd, mem, len, out_file);
+
+  if (!out_file) {
+
+    if (ftruncate(fd, len)) PFATAL("ftruncate() failed");
+    lseek(fd, 0, SEEK_SET);
+
+  } else close(fd);
+
+}
+
+
+/* The same, but with an adjustable gap. Used for trimming. */
+
+static void write_with_gap(void* mem, u32 len, u32 skip_at, u32 skip_len) {
+
+  s32 fd = out_fd;
+  u32 tail_len = len - skip_at - skip_len;
+
+  if (shm_fuzz_mode) {
+
+    memcpy(shm_fuzz + sizeof(u32), mem, skip_at);
+    memcpy(shm_fuzz + sizeof(u32) + skip_at, mem + skip_at + skip_len,
+           tail_len);
+    *(u32*)shm_fuzz = len - skip_len;
+    return;
+
+  }
+
+  if (out_file) {
+
+    unlink(out_file); /* Ignore errors. */
+
+    fd = open(out_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+    if (fd < 0) PFATAL("Unable to create '%s'", out_file);
+
+  } else lseek(fd, 0, SEEK_SET);
+
+  if (skip_at) ck_write(fd, mem, skip_at, out_file);
+
+  if (tail_len) ck_write(fd, mem + skip_at + skip_len, tail_len, out_file);
+
+  if (!out_file) {
+
+    if (ftruncate(fd, len - skip_len)) PFATAL("ftruncate() failed");
+    lseek(fd, 0, SEEK_SET);
+
+  } else close(fd);
+
+}
+
+
+static void show_stats(void);
+
+/* Integer square root, for calibrate_case(). */
+
+static u32 isqrt64(u64 val) {
+
+  u64 ret = 0, bit = 1ULL << 62;
+
+  while (bit > val) bit >>= 2;
+
+  while (bit) {
+
+    if (val >= ret + bit) {
+      val -= ret + bit;
+      ret  = (ret >> 1) + bit;
+    } else ret >>= 1;
+
+    bit >>= 2;
+
+  }
+
+  return ret;
+
+}
+
+
+/* Calibrate a new test case. This is done when processing the input directory
+   to warn about flaky or otherwise problematic test cases early on; and when
+   new paths are discovered to detect variable behavior and so on. */
+
+static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
+                         u32 handicap, u8 from_queue) {
+
+  static u8 first_trace[MAP_SIZE];
+
+  u8  fault = 0, new_bits = 0, var_detected = 0, hnb = 0,
+      first_run = (q->exec_cksum == 0);
+
+  u64 start_us, stop_us, sum_us = 0, sum_sq = 0, mean_us;
+
+  s32 old_sc = stage_cur, old_sm = stage_max;
+  u32 use_tmout = exec_tmout;
+  u8* old_sn = stage_name;
+  u8  old_phase = phase_switch(PHASE_CAL);
+
+  /* Be a bit more generous about timeouts when resuming sessions, or when
+     trying to calibrate already-added finds. This helps avoid trouble due
+     to intermittent latency. */
+
+  if (!from_queue || resuming_fuzz)
+    use_tmout = MAX(exec_tmout + CAL_TMOUT_ADD,
+                    exec_tmout * CAL_TMOUT_PERC / 100);
+
+  q->cal_failed++;
+
+  stage_name = "calibration";
+  stage_max  = fast_cal ? 3 : CAL_CYCLES;
+
+  /* Make sure the forkserver is up before we do anything, and let's not
+     count its spin-up time toward binary calibration. */
 
-  }
+  if (dumb_mode != 1 && !no_forkserver && !forksrv_pid)
+    init_forkserver(argv);
 
-  FATAL("Fork server handshake failed");
+  if (q->exec_cksum) {
 
-}
+    memcpy(first_trace, trace_bits, map_size);
+    hnb = has_new_bits(virgin_bits);
+    if (hnb > new_bits) new_bits = hnb;
 
+  }
 
-/* Execute target application, monitoring for timeouts. Return status
-   information. The called program will update trace_bits[]. */
+  start_us = get_cur_time_us();
 
-static u8 run_target(char** argv, u32 timeout) {
+  for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
 
-  static struct itimerval it;
-  static u32 prev_timed_out = 0;
-  static u64 exec_ms = 0;
+    u32 cksum;
 
-  int status = 0;
-  u32 tb4;
+    if (!first_run && !(stage_cur % stats_update_freq)) show_stats();
 
-  child_timed_out = 0;
+    write_to_testcase(use_mem, q->len);
 
-  /* After this memset, trace_bits[] are effectively volatile, so we
-     must prevent any earlier operations from venturing into that
-     territory. */
+    fault = run_target(argv, use_tmout);
 
-  memset(trace_bits, 0, MAP_SIZE);
-  MEM_BARRIER();
+    /* stop_soon is set by the handler for Ctrl+C. When it's pressed,
+       we want to bail out quickly. */
 
-  /* If we're running in "dumb" mode, we can't rely on the fork server
-     logic compiled into the target program, so we will just keep calling
-     execve(). There is a bit of code duplication between here and 
-     init_forkserver(), but c'est la vie. */
+    if (stop_soon || fault != crash_mode) goto abort_calibration;
 
-  if (dumb_mode == 1 || no_forkserver) {
+    sum_us += last_exec_us;
+    sum_sq += last_exec_us * last_exec_us;
 
-    child_pid = fork();
+    if (!dumb_mode && !stage_cur && !count_bytes(trace_bits)) {
+      fault = FAULT_NOINST;
+      goto abort_calibration;
+    }
 
-    if (child_pid < 0) PFATAL("fork() failed");
+    cksum = hash_trace();
 
-    if (!child_pid) {
+    if (q->exec_cksum != cksum) {
 
-      struct rlimit r;
+      hnb = has_new_bits(virgin_bits);
+      if (hnb > new_bits) new_bits = hnb;
 
-      if (mem_limit) {
+      if (q->exec_cksum) {
 
-        r.rlim_max = r.rlim_cur = ((rlim_t)mem_limit) << 20;
+        u32 i;
 
-#ifdef RLIMIT_AS
+        for (i = 0; i < map_size; i++) {
 
-        setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+          if (!var_bytes[i] && first_trace[i] != trace_bits[i]) {
 
-#else
+            var_bytes[i] = 1;
+            stage_max    = CAL_CYCLES_LONG;
 
-        setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+          }
 
-#endif /* ^RLIMIT_AS */
+        }
 
-      }
+        var_detected = 1;
 
-      r.rlim_max = r.rlim_cur = 0;
+      } else {
 
-      setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+        q->exec_cksum = cksum;
+        memcpy(first_trace, trace_bits, map_size);
 
-      /* Isolate the process and configure standard descriptors. If out_file is
-         specified, stdin is /dev/null; otherwise, out_fd is cloned instead. */
+      }
 
-      setsid();
+    }
 
-      dup2(dev_null_fd, 1);
-      dup2(dev_null_fd, 2);
+  }
 
-      if (out_file) {
+  stop_us = get_cur_time_us();
 
-        dup2(dev_null_fd, 0);
+  total_cal_us     += stop_us - start_us;
+  total_cal_cycles += stage_max;
 
-      } else {
+  /* OK, let's collect some stats about the performance of this test case.
+     This is used for fuzzing air time calculations in calculate_score(). */
 
-        dup2(out_fd, 0);
-        close(out_fd);
+  q->exec_us     = (stop_us - start_us) / stage_max;
 
-      }
+  mean_us        = sum_us / stage_max;
+  q->exec_sd     = isqrt64(sum_sq / stage_max - MIN(mean_us * mean_us,
+                                                   sum_sq / stage_max));
+  q->bitmap_size = count_bytes(trace_bits);
+  q->handicap    = handicap;
+  q->cal_failed  = 0;
 
-      /* On Linux, would be faster to use O_CLOEXEC. Maybe TODO. */
+  total_bitmap_size += q->bitmap_size;
+  total_bitmap_entries++;
 
-      close(dev_null_fd);
-      close(out_dir_fd);
-      close(dev_urandom_fd);
-      close(fileno(plot_file));
+  update_bitmap_score(q);
 
-      /* Set sane defaults for ASAN if nothing else specified. */
+  /* If this case didn't result in new output from the instrumentation, tell
+     parent. This is a non-critical problem, but something to warn the user
+     about. */
 
-      setenv("ASAN_OPTIONS", "abort_on_error=1:"
-                             "detect_leaks=0:"
-                             "symbolize=0:"
-                             "allocator_may_return_null=1", 0);
+  if (!dumb_mode && first_run && !fault && !new_bits) fault = FAULT_NOBITS;
 
-      setenv("MSAN_OPTIONS", "exit_code=" STRINGIFY(MSAN_ERROR) ":"
-                             "symbolize=0:"
-                             "msan_track_origins=0", 0);
+abort_calibration:
 
-      execv(target_path, argv);
+  if (new_bits == 2 && !q->has_new_cov) {
+    q->has_new_cov = 1;
+    queued_with_cov++;
+  }
 
-      /* Use a distinctive bitmap value to tell the parent about execv()
-         falling through. */
+  /* Mark variable paths. */
 
-      *(u32*)trace_bits = EXEC_FAIL_SIG;
-      exit(0);
+  if (var_detected) {
+
+    var_byte_count = count_bytes(var_bytes);
 
+    if (!q->var_behavior) {
+      mark_as_variable(q);
+      queued_variable++;
     }
 
-  } else {
+  }
 
-    s32 res;
+  stage_name = old_sn;
+  stage_cur  = old_sc;
+  stage_max  = old_sm;
 
-    /* In non-dumb mode, we have the fork server up and running, so simply
-       tell it to have at it, and then read back PID. */
+  phase_switch(old_phase);
 
-    if ((res = write(fsrv_ctl_fd, &prev_timed_out, 4)) != 4) {
+  if (!first_run) show_stats();
 
-      if (stop_soon) return 0;
-      RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+  return fault;
 
-    }
+}
 
-    if ((res = read(fsrv_st_fd, &child_pid, 4)) != 4) {
 
-      if (stop_soon) return 0;
-      RPFATAL(res, "Unable to request new process from fork server (OOM?)");
+/* Examine map coverage. Called once, for first test case. */
 
-    }
+static void check_map_coverage(void) {
 
-    if (child_pid <= 0) FATAL("Fork server is misbehaving (OOM?)");
+  u32 i;
 
-  }
+  if (count_bytes(trace_bits) < 100) return;
 
-  /* Configure timeout, as requested by user, then wait for child to terminate. */
+  for (i = map_size >> 1; i < map_size; i++)
+    if (trace_bits[i]) return;
 
-  it.it_value.tv_sec = (timeout / 1000);
-  it.it_value.tv_usec = (timeout % 1000) * 1000;
+  WARNF("Recompile binary with newer version of afl to improve coverage!");
 
-  setitimer(ITIMER_REAL, &it, NULL);
+}
 
-  /* The SIGALRM handler simply kills the child_pid and sets child_timed_out. */
 
-  if (dumb_mode == 1 || no_forkserver) {
+/* Fast resume. Every queue cycle and on the way out, the master writes
+   <out_dir>/.resume_index with the calibration results for the queue,
+   the top_rated[] winners with their minimized traces, and virgin_bits[].
+   When resuming with -i- against the same binary and command line, the
+   dry run takes entries found there at face value instead of running
+   them again. Anything not covered by the index (or not matching it) is
+   calibrated as usual.
 
-    if (waitpid(child_pid, &status, 0) <= 0) PFATAL("waitpid() failed");
+   The name and the trace that follow every record are zero-padded to a
+   multiple of 8 bytes, so that the records and traces can be used in place
+   straight from the buffer the file is read into. */
 
-  } else {
+#define RESUME_MAGIC   0x58525341     /* "ASRX"                           */
+#define RESUME_VERSION 3
 
-    s32 res;
+#define RESUME_PAD(_l) (((u64)(_l) + 7) & ~7ULL)
 
-    if ((res = read(fsrv_st_fd, &status, 4)) != 4) {
+struct resume_hdr {
 
-      if (stop_soon) return 0;
-      RPFATAL(res, "Unable to communicate with fork server (OOM?)");
+  u32 magic,                          /* RESUME_MAGIC                     */
+      version,                        /* RESUME_VERSION                   */
+      cksum,                          /* Target binary and argv checksum  */
+      map_size,                       /* Map size the data is for         */
+      entries,                        /* Number of resume_rec records     */
+      slots;                          /* Number of top_rated[] pairs      */
 
-    }
+};
 
-  }
+struct resume_rec {
 
-  if (!WIFSTOPPED(status)) child_pid = 0;
+  u64 exec_us;                        /* Same as in queue_entry           */
 
-  getitimer(ITIMER_REAL, &it);
-  exec_ms = (u64) timeout - (it.it_value.tv_sec * 1000 +
-                             it.it_value.tv_usec / 1000);
+  u32 id,
+      len,
+      exec_cksum,
+      exec_sd,
+      bitmap_size,
+      name_len,                       /* Length of the file name to follow */
+      mini_len;                       /* Bytes of trace_mini to follow    */
 
-  it.it_value.tv_sec = 0;
-  it.it_value.tv_usec = 0;
+  u8  valid,                          /* Calibrated at all?               */
+      var_behavior,
+      has_new_cov,
+      pad;
 
-  setitimer(ITIMER_REAL, &it, NULL);
+};
 
-  total_execs++;
+static u8* resume_virgin;             /* Saved virgin_bits, until merged  */
 
-  /* Any subsequent operations on trace_bits must not be moved by the
-     compiler below this point. Past this location, trace_bits[] behave
-     very normally and do not have to be treated as volatile. */
+/* Checksum the target binary (the real one, in QEMU mode) and its command
+   line. */
 
-  MEM_BARRIER();
+static u32 resume_cksum(char** argv) {
 
-  tb4 = *(u32*)trace_bits;
+  static u32 ck;
+  static u8  done;
 
-#ifdef WORD_SIZE_64
-  classify_counts((u64*)trace_bits);
-#else
-  classify_counts((u32*)trace_bits);
-#endif /* ^WORD_SIZE_64 */
+  u8* fn = qemu_mode ? (u8*)argv[2] : target_path;
+  struct stat st;
+  u8* f_data;
+  s32 fd, i;
 
-  prev_timed_out = child_timed_out;
+  if (done) return ck;
+  done = 1;
 
-  /* Report outcome to caller. */
+  fd = open(fn, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) || !st.st_size) PFATAL("Unable to read '%s'", fn);
 
-  if (WIFSIGNALED(status) && !stop_soon) {
+  f_data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (f_data == MAP_FAILED) PFATAL("Unable to mmap '%s'", fn);
 
-    kill_signal = WTERMSIG(status);
+  ck = hash32(f_data, st.st_size, HASH_CONST);
 
-    if (child_timed_out && kill_signal == SIGKILL) return FAULT_TMOUT;
+  munmap(f_data, st.st_size);
+  close(fd);
 
-    return FAULT_CRASH;
+  for (i = 1; argv[i]; i++)
+    ck ^= hash32(argv[i], strlen(argv[i]), HASH_CONST + i);
 
-  }
+  return ck;
 
-  /* A somewhat nasty hack for MSAN, which doesn't support abort_on_error and
-     must use a special exit code. */
+}
 
-  if (uses_asan && WEXITSTATUS(status) == MSAN_ERROR) {
-    kill_signal = 0;
-    return FAULT_CRASH;
-  }
 
-  if ((dumb_mode == 1 || no_forkserver) && tb4 == EXEC_FAIL_SIG)
-    return FAULT_ERROR;
+/* Size of a minimized trace, in bytes. */
 
-  /* It makes sense to account for the slowest units only if the testcase was run
-  under the user defined timeout. */
-  if (!(timeout > exec_tmout) && (slowest_exec_ms < exec_ms)) {
-    slowest_exec_ms = exec_ms;
-  }
+static u32 mini_bytes(u32* mini) {
 
-  return FAULT_NONE;
+  if (mini[0] == MINI_DENSE) return sizeof(u32) + (map_size >> 3);
+  return sizeof(u32) * (mini[0] + 1);
 
 }
 
 
-/* Write modified data to file for testing. If out_file is set, the old file
-   is unlinked and a new one is created. Otherwise, out_fd is rewound and
-   truncated. */
-
-static void write_to_testcase(void* mem, u32 len) {
+/* Write the resume index. */
 
-  s32 fd = out_fd;
+static void save_resume_index(char** argv) {
 
-  if (out_file) {
+  struct resume_hdr h;
+  struct queue_entry* q;
+  u8 *fn, *tmp;
+  FILE* f;
+  u32 i;
 
-    unlink(out_file); /* Ignore errors. */
+  if (dumb_mode || crash_mode || job_id || getenv("AFL_NO_FAST_RESUME"))
+    return;
 
-    fd = open(out_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  /* The index must never refer to files that aren't there yet. */
 
-    if (fd < 0) PFATAL("Unable to create '%s'", out_file);
+  queue_flush();
 
-  } else lseek(fd, 0, SEEK_SET);
+  fn  = alloc_printf("%s/.resume_index", out_dir);
+  tmp = alloc_printf("%s/.resume_index.tmp", out_dir);
 
-  ck_write(fd, mem, len, out_file);
+  f = fopen(tmp, "w");
+  if (!f) PFATAL("Unable to create '%s'", tmp);
 
-  if (!out_file) {
+  h.magic    = RESUME_MAGIC;
+  h.version  = RESUME_VERSION;
+  h.cksum    = resume_cksum(argv);
+  h.map_size = map_size;
+  h.entries  = queued_paths;
+  h.slots    = 0;
 
-    if (ftruncate(fd, len)) PFATAL("ftruncate() failed");
-    lseek(fd, 0, SEEK_SET);
+  for (i = 0; i < top_cnt; i++)
+    if (!top_rated[top_list[i]]->cal_failed) h.slots++;
 
-  } else close(fd);
+  fwrite(&h, sizeof(h), 1, f);
+  fwrite(virgin_bits, map_size, 1, f);
+  fwrite(var_bytes, map_size, 1, f);
 
-}
+  for (q = queue; q; q = q->next) {
 
+    static const u8 zero[8];
 
-/* The same, but with an adjustable gap. Used for trimming. */
+    struct resume_rec r;
+    u8* name = strrchr(q->fname, '/') + 1;
 
-static void write_with_gap(void* mem, u32 len, u32 skip_at, u32 skip_len) {
+    memset(&r, 0, sizeof(r));
 
-  s32 fd = out_fd;
-  u32 tail_len = len - skip_at - skip_len;
+    r.exec_us      = q->exec_us;
+    r.id           = q->id;
+    r.len          = q->len;
+    r.exec_cksum   = q->exec_cksum;
+    r.exec_sd      = q->exec_sd;
+    r.bitmap_size  = q->bitmap_size;
+    r.name_len     = strlen(name);
+    r.mini_len     = q->trace_mini ? mini_bytes(q->trace_mini) : 0;
+    r.valid        = q->exec_cksum && !q->cal_failed;
+    r.var_behavior = q->var_behavior;
+    r.has_new_cov  = q->has_new_cov;
 
-  if (out_file) {
+    fwrite(&r, sizeof(r), 1, f);
+    fwrite(name, r.name_len, 1, f);
+    fwrite(zero, RESUME_PAD(r.name_len) - r.name_len, 1, f);
 
-    unlink(out_file); /* Ignore errors. */
+    if (r.mini_len) {
+      fwrite(q->trace_mini, r.mini_len, 1, f);
+      fwrite(zero, RESUME_PAD(r.mini_len) - r.mini_len, 1, f);
+    }
 
-    fd = open(out_file, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  }
 
-    if (fd < 0) PFATAL("Unable to create '%s'", out_file);
+  for (i = 0; i < top_cnt; i++) {
 
-  } else lseek(fd, 0, SEEK_SET);
+    u32 slot[2] = { top_list[i], top_rated[top_list[i]]->id };
 
-  if (skip_at) ck_write(fd, mem, skip_at, out_file);
+    if (top_rated[top_list[i]]->cal_failed) continue;
+    fwrite(slot, sizeof(slot), 1, f);
 
-  if (tail_len) ck_write(fd, mem + skip_at + skip_len, tail_len, out_file);
+  }
 
-  if (!out_file) {
+  if (ferror(f) || fclose(f)) PFATAL("Unable to write '%s'", tmp);
 
-    if (ftruncate(fd, len - skip_len)) PFATAL("ftruncate() failed");
-    lseek(fd, 0, SEEK_SET);
+  if (rename(tmp, fn)) PFATAL("Unable to rename '%s'", tmp);
 
-  } else close(fd);
+  ck_free(tmp);
+  ck_free(fn);
 
 }
 
 
-static void show_stats(void);
+/* Try to load the resume index for the current queue. Returns the number of
+   entries restored. The saved virgin_bits[] are merged by perform_dry_run()
+   once the rest of the queue has been calibrated. */
 
-/* Calibrate a new test case. This is done when processing the input directory
-   to warn about flaky or otherwise problematic test cases early on; and when
-   new paths are discovered to detect variable behavior and so on. */
+static u32 load_resume_index(char** argv) {
 
-static u8 calibrate_case(char** argv, struct queue_entry* q, u8* use_mem,
-                         u32 handicap, u8 from_queue) {
+  struct resume_hdr* h;
+  struct resume_rec* r;
+  struct stat st;
+  u8 *fn, *buf, *pos, *end, *saved_var, *name;
+  u8 *valid = NULL;
+  u32 i, ret = 0;
+  s32 fd;
 
-  static u8 first_trace[MAP_SIZE];
+  if (!in_place_resume || dumb_mode || crash_mode ||
+      getenv("AFL_NO_FAST_RESUME")) return 0;
 
-  u8  fault = 0, new_bits = 0, var_detected = 0, hnb = 0,
-      first_run = (q->exec_cksum == 0);
+  fn = alloc_printf("%s/.resume_index", out_dir);
+  fd = open(fn, O_RDONLY);
 
-  u64 start_us, stop_us;
+  if (fd < 0) {
+    ck_free(fn);
+    return 0;
+  }
 
-  s32 old_sc = stage_cur, old_sm = stage_max;
-  u32 use_tmout = exec_tmout;
-  u8* old_sn = stage_name;
+  if (fstat(fd, &st)) PFATAL("fstat() failed");
+
+  if (st.st_size < sizeof(struct resume_hdr) + 2 * map_size) goto bad_index;
+
+  buf = ck_alloc_nozero(st.st_size);
+  ck_read(fd, buf, st.st_size, fn);
+  close(fd);
+  fd = -1;
 
-  /* Be a bit more generous about timeouts when resuming sessions, or when
-     trying to calibrate already-added finds. This helps avoid trouble due
-     to intermittent latency. */
+  h   = (struct resume_hdr*)buf;
+  end = buf + st.st_size;
 
-  if (!from_queue || resuming_fuzz)
-    use_tmout = MAX(exec_tmout + CAL_TMOUT_ADD,
-                    exec_tmout * CAL_TMOUT_PERC / 100);
+  if (h->magic != RESUME_MAGIC || h->version != RESUME_VERSION ||
+      h->map_size != map_size) goto bad_data;
 
-  q->cal_failed++;
+  if (h->cksum != resume_cksum(argv)) {
+    WARNF("Target binary or command line changed, ignoring '%s'.", fn);
+    goto out;
+  }
 
-  stage_name = "calibration";
-  stage_max  = fast_cal ? 3 : CAL_CYCLES;
+  pos       = buf + sizeof(struct resume_hdr) + map_size;
+  saved_var = pos;
+  pos      += map_size;
 
-  /* Make sure the forkserver is up before we do anything, and let's not
-     count its spin-up time toward binary calibration. */
+  valid = ck_alloc(queued_paths);
 
-  if (dumb_mode != 1 && !no_forkserver && !forksrv_pid)
-    init_forkserver(argv);
+  /* First pass: make sure that every entry still matches the queue. If
+     anything is off, we can't trust the saved virgin_bits[] either. */
 
-  if (q->exec_cksum) {
+  for (i = 0; i < h->entries; i++) {
 
-    memcpy(first_trace, trace_bits, MAP_SIZE);
-    hnb = has_new_bits(virgin_bits);
-    if (hnb > new_bits) new_bits = hnb;
+    struct queue_entry* q;
 
-  }
+    r = (struct resume_rec*)pos;
 
-  start_us = get_cur_time_us();
+    if (end - pos < sizeof(*r) ||
+        end - pos - sizeof(*r) < RESUME_PAD(r->name_len) +
+                                 RESUME_PAD(r->mini_len)) goto bad_data;
 
-  for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
+    pos += sizeof(*r);
 
-    u32 cksum;
+    q = r->id < queued_paths ? queue_buf[r->id] : NULL;
+    if (q) name = strrchr(q->fname, '/') + 1;
 
-    if (!first_run && !(stage_cur % stats_update_freq)) show_stats();
+    if (!q || r->len != q->len || r->name_len != strlen(name) ||
+        memcmp(pos, name, r->name_len)) {
+      WARNF("Queue doesn't match '%s', ignoring it.", fn);
+      goto out;
+    }
 
-    write_to_testcase(use_mem, q->len);
+    /* The trace has to be exactly as long as it says, and a sparse one may
+       only list indices within the map; cull_queue() and friends take both
+       on faith. */
 
-    fault = run_target(argv, use_tmout);
+    if (r->mini_len) {
 
-    /* stop_soon is set by the handler for Ctrl+C. When it's pressed,
-       we want to bail out quickly. */
+      u32* mini = (u32*)(pos + RESUME_PAD(r->name_len));
+      u32  j;
 
-    if (stop_soon || fault != crash_mode) goto abort_calibration;
+      if (r->mini_len < sizeof(u32) ||
+          (mini[0] != MINI_DENSE && mini[0] > map_size) ||
+          r->mini_len != mini_bytes(mini)) goto bad_data;
+
+      if (mini[0] != MINI_DENSE)
+        for (j = 1; j <= mini[0]; j++)
+          if (mini[j] >= map_size) goto bad_data;
 
-    if (!dumb_mode && !stage_cur && !count_bytes(trace_bits)) {
-      fault = FAULT_NOINST;
-      goto abort_calibration;
     }
 
-    cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+    pos += RESUME_PAD(r->name_len) + RESUME_PAD(r->mini_len);
 
-    if (q->exec_cksum != cksum) {
+  }
 
-      hnb = has_new_bits(virgin_bits);
-      if (hnb > new_bits) new_bits = hnb;
+  if ((u64)(end - pos) != (u64)h->slots * 2 * sizeof(u32)) goto bad_data;
 
-      if (q->exec_cksum) {
+  /* Second pass: restore. */
 
-        u32 i;
+  pos = buf + sizeof(struct resume_hdr) + 2 * map_size;
 
-        for (i = 0; i < MAP_SIZE; i++) {
+  for (i = 0; i < h->entries; i++) {
 
-          if (!var_bytes[i] && first_trace[i] != trace_bits[i]) {
+    struct queue_entry* q;
 
-            var_bytes[i] = 1;
-            stage_max    = CAL_CYCLES_LONG;
+    r    = (struct resume_rec*)pos;
+    pos += sizeof(*r) + RESUME_PAD(r->name_len);
+    q    = queue_buf[r->id];
 
-          }
+    if (r->valid && !valid[r->id]) {
 
-        }
+      valid[r->id] = 1;
 
-        var_detected = 1;
+      q->exec_us     = r->exec_us;
+      q->exec_cksum  = r->exec_cksum;
+      q->exec_sd     = r->exec_sd;
+      q->bitmap_size = r->bitmap_size;
 
-      } else {
+      if (r->has_new_cov) {
+        q->has_new_cov = 1;
+        queued_with_cov++;
+      }
 
-        q->exec_cksum = cksum;
-        memcpy(first_trace, trace_bits, MAP_SIZE);
+      if (r->var_behavior) {
+        mark_as_variable(q);
+        queued_variable++;
+      }
 
+      if (r->mini_len) {
+        q->trace_mini = ck_alloc_nozero(r->mini_len);
+        memcpy(q->trace_mini, pos, r->mini_len);
       }
 
-    }
+      total_cal_us      += q->exec_us * CAL_CYCLES;
+      total_cal_cycles  += CAL_CYCLES;
+      total_bitmap_size += q->bitmap_size;
+      total_bitmap_entries++;
 
-  }
+      ret++;
 
-  stop_us = get_cur_time_us();
+    }
 
-  total_cal_us     += stop_us - start_us;
-  total_cal_cycles += stage_max;
+    pos += RESUME_PAD(r->mini_len);
 
-  /* OK, let's collect some stats about the performance of this test case.
-     This is used for fuzzing air time calculations in calculate_score(). */
+  }
 
-  q->exec_us     = (stop_us - start_us) / stage_max;
-  q->bitmap_size = count_bytes(trace_bits);
-  q->handicap    = handicap;
-  q->cal_failed  = 0;
+  for (i = 0; i < h->slots; i++, pos += 2 * sizeof(u32)) {
 
-  total_bitmap_size += q->bitmap_size;
-  total_bitmap_entries++;
+    u32 idx = ((u32*)pos)[0], id = ((u32*)pos)[1];
+    struct queue_entry* q;
 
-  update_bitmap_score(q);
+    if (idx >= map_size || id >= queued_paths || !valid[id] ||
+        top_rated[idx]) continue;
 
-  /* If this case didn't result in new output from the instrumentation, tell
-     parent. This is a non-critical problem, but something to warn the user
-     about. */
+    q = queue_buf[id];
 
-  if (!dumb_mode && first_run && !fault && !new_bits) fault = FAULT_NOBITS;
+    /* A slot owner without a trace means a damaged index; let the entry
+       rate itself again later on. */
 
-abort_calibration:
+    if (!q->trace_mini) continue;
 
-  if (new_bits == 2 && !q->has_new_cov) {
-    q->has_new_cov = 1;
-    queued_with_cov++;
-  }
+    top_rated[idx] = q;
+    q->tc_ref++;
 
-  /* Mark variable paths. */
+    top_list[top_cnt++] = idx;
+    rated_map[idx >> 3] |= 1 << (idx & 7);
+    rated_list[rated_cnt++] = idx;
 
-  if (var_detected) {
+  }
 
-    var_byte_count = count_bytes(var_bytes);
+  /* Traces that aren't referenced by anything were saved only by entries
+     that lost every slot since; don't keep them around. */
 
-    if (!q->var_behavior) {
-      mark_as_variable(q);
-      queued_variable++;
+  for (i = 0; i < queued_paths; i++)
+    if (valid[i] && !queue_buf[i]->tc_ref && queue_buf[i]->trace_mini) {
+      ck_free(queue_buf[i]->trace_mini);
+      queue_buf[i]->trace_mini = NULL;
     }
 
-  }
-
-  stage_name = old_sn;
-  stage_cur  = old_sc;
-  stage_max  = old_sm;
+  for (i = 0; i < map_size; i++) var_bytes[i] |= saved_var[i];
+  var_byte_count = count_bytes(var_bytes);
 
-  if (!first_run) show_stats();
+  resume_virgin = ck_memdup(buf + sizeof(struct resume_hdr), map_size);
 
-  return fault;
+  score_changed = 1;
+  cull_full     = 1;
 
-}
+  OKF("Restored calibration data for %u test case%s from '%s'.", ret,
+      ret == 1 ? "" : "s", fn);
 
+  goto out;
 
-/* Examine map coverage. Called once, for first test case. */
+bad_index:
 
-static void check_map_coverage(void) {
+  close(fd);
+  WARNF("Malformed data in '%s', ignoring it.", fn);
+  ck_free(fn);
+  return 0;
 
-  u32 i;
+bad_data:
 
-  if (count_bytes(trace_bits) < 100) return;
+  WARNF("Malformed data in '%s', ignoring it.", fn);
 
-  for (i = (1 << (MAP_SIZE_POW2 - 1)); i < MAP_SIZE; i++)
-    if (trace_bits[i]) return;
+out:
 
-  WARNF("Recompile binary with newer version of afl to improve coverage!");
+  ck_free(valid);
+  ck_free(buf);
+  ck_free(fn);
+  return ret;
 
 }
 
@@ -2743,31 +4842,32 @@ static void check_map_coverage(void) {
 static void perform_dry_run(char** argv) {
 
   struct queue_entry* q = queue;
-  u32 cal_failures = 0;
+  u32 cal_failures = 0, i;
   u8* skip_crashes = getenv("AFL_SKIP_CRASHES");
 
+  load_resume_index(argv);
+
   while (q) {
 
     u8* use_mem;
     u8  res;
-    s32 fd;
 
     u8* fn = strrchr(q->fname, '/') + 1;
 
-    ACTF("Attempting dry run with '%s'...", fn);
+    /* Already taken care of by load_resume_index()? */
 
-    fd = open(q->fname, O_RDONLY);
-    if (fd < 0) PFATAL("Unable to open '%s'", q->fname);
+    if (q->exec_cksum) {
+      q = q->next;
+      continue;
+    }
 
-    use_mem = ck_alloc_nozero(q->len);
+    ACTF("Attempting dry run with '%s'...", fn);
 
-    if (read(fd, use_mem, q->len) != q->len)
-      FATAL("Short read from '%s'", q->fname);
+    /* This also warms up the input cache for the first queue cycle. */
 
-    close(fd);
+    use_mem = queue_get(q);
 
     res = calibrate_case(argv, q, use_mem, 0, 1);
-    ck_free(use_mem);
 
     if (stop_soon) return;
 
@@ -2922,6 +5022,23 @@ static void perform_dry_run(char** argv) {
 
   }
 
+  /* Fold in the coverage of the entries restored from the resume index. */
+
+  if (resume_virgin) {
+
+    for (i = 0; i < map_size; i++) virgin_bits[i] &= resume_virgin[i];
+
+    ck_free(resume_virgin);
+    resume_virgin = NULL;
+    bitmap_changed = 1;
+
+    /* Normally started by calibrate_case(), which may not have run. */
+
+    if (dumb_mode != 1 && !no_forkserver && !forksrv_pid)
+      init_forkserver(argv);
+
+  }
+
   if (cal_failures) {
 
     if (cal_failures == queued_paths)
@@ -3156,6 +5273,147 @@ static void write_crash_readme(void) {
 }
 
 
+/* Append a new queue entry to our sync ring. Like share_path(), this needs
+   the trace to still be in trace_bits[]. There may be several -j jobs doing
+   this at the same time, so space is reserved with a CAS; records never wrap
+   around, and readers skip any tail too short for a header. */
+
+static void sync_ring_publish(struct queue_entry* q, void* mem) {
+
+  static u32 tuples[MAP_SIZE];
+
+  struct sync_rec* r;
+  u8* fn = strrchr(q->fname, '/') + 1;
+  u32 cnt = 0, i, name_len = strlen(fn) + 1, data_len = q->len, size, pos, pad;
+  u64 off, next;
+
+  for (i = 0; i < map_size; i++)
+    if (trace_bits[i]) tuples[cnt++] = (i << 8) | trace_bits[i];
+
+  size = sizeof(struct sync_rec) + (cnt << 2) + name_len;
+
+  /* Really big inputs are left for peers to read from the queue. */
+
+  if (size + data_len > SYNC_RING_SIZE / 16) data_len = 0;
+
+  size = (size + data_len + 7) & ~7;
+
+  do {
+
+    off  = __atomic_load_n(&sync_ring->head, __ATOMIC_RELAXED);
+    pos  = off % SYNC_RING_SIZE;
+    pad  = (pos + size > SYNC_RING_SIZE) ? SYNC_RING_SIZE - pos : 0;
+    next = off + pad + size;
+
+  } while (!__atomic_compare_exchange_n(&sync_ring->head, &off, next, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  if (pad >= sizeof(struct sync_rec)) {
+
+    r = (struct sync_rec*)(sync_ring->data + pos);
+
+    r->size     = pad;
+    r->name_len = 0;
+
+    __atomic_store_n(&r->seq, off, __ATOMIC_RELEASE);
+
+  }
+
+  off += pad;
+  r = (struct sync_rec*)(sync_ring->data + off % SYNC_RING_SIZE);
+
+  r->size     = size;
+  r->id       = q->id;
+  r->len      = q->len;
+  r->tuples   = cnt;
+  r->name_len = name_len;
+  r->data_len = data_len;
+
+  memcpy(r + 1, tuples, cnt << 2);
+  memcpy((u8*)(r + 1) + (cnt << 2), fn, name_len);
+  memcpy((u8*)(r + 1) + (cnt << 2) + name_len, mem, data_len);
+
+  __atomic_store_n(&r->seq, off, __ATOMIC_RELEASE);
+
+}
+
+
+/* With -j, fill in the path table slot for a freshly calibrated queue entry,
+   while its trace is still in trace_bits[]. The other jobs won't import it
+   until publish_paths() is done with it. */
+
+static void share_path(struct queue_entry* q) {
+
+  static u8 table_full;
+
+  struct job_path* p;
+  u8* fn = strrchr(q->fname, '/') + 1;
+
+  if (q->id >= JOB_MAX_PATHS) {
+
+    if (!table_full) {
+
+      WARNF("The -j path table is full (%u entries), new paths will not be "
+            "shared", JOB_MAX_PATHS);
+      table_full = 1;
+
+    }
+
+    return;
+
+  }
+
+  p = &job_shm->path[q->id];
+
+  p->owner        = job_id;
+  p->has_new_cov  = q->has_new_cov;
+  p->var_behavior = q->var_behavior;
+  p->cal_failed   = q->cal_failed;
+  p->bitmap_size  = q->bitmap_size;
+  p->exec_cksum   = q->exec_cksum;
+  p->exec_us      = q->exec_us;
+  p->exec_sd      = q->exec_sd;
+  p->depth        = q->depth;
+
+  /* Names this long are only possible with very long -S IDs. Such paths
+     are left for us to fuzz alone. */
+
+  if (strlen(fn) < sizeof(p->fname)) strcpy(p->fname, fn);
+
+  minimize_bits(p->trace_mini, trace_bits);
+
+}
+
+
+/* Sum up the execs done by the other -j jobs, for the stats. */
+
+static u64 count_job_execs(void) {
+
+  u64 ret = 0;
+  u32 i;
+
+  for (i = 1; i < job_cnt; i++)
+    ret += __atomic_load_n(&job_shm->job[i].execs, __ATOMIC_RELAXED);
+
+  return ret;
+
+}
+
+
+/* Effector map helpers (see fuzz_one()). These macros calculate:
+
+   EFF_APOS      - position of a particular file offset in the map.
+   EFF_ALEN      - length of a map with a particular number of bytes.
+   EFF_SPAN_ALEN - map span for a sequence of bytes.
+
+ */
+
+#define EFF_APOS(_p)          ((_p) >> EFF_MAP_SCALE2)
+#define EFF_REM(_x)           ((_x) & ((1 << EFF_MAP_SCALE2) - 1))
+#define EFF_ALEN(_l)          (EFF_APOS(_l) + !!EFF_REM(_l))
+#define EFF_SPAN_ALEN(_p, _l) (EFF_APOS((_p) + (_l) - 1) - EFF_APOS(_p) + 1)
+
+
 /* Check if the result of an execve() during routine fuzzing is interesting,
    save or queue the input test case for further analysis if so. Returns 1 if
    entry is saved, 0 otherwise. */
@@ -3166,36 +5424,54 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
   u8  hnb;
   s32 fd;
   u8  keeping = 0, res;
+  u64 id;
 
   if (fault == crash_mode) {
 
     /* Keep only if there are new bits in the map, add to queue for
        future fuzzing, etc. */
 
-    if (!(hnb = has_new_bits(virgin_bits))) {
+    phase_switch(PHASE_BITS);
+    hnb = has_new_bits(virgin_bits);
+    phase_switch(PHASE_SAVE);
+
+    if (!hnb) {
       if (crash_mode) total_crashes++;
       return 0;
     }    
 
+    id = job_cnt ? __atomic_fetch_add(&job_shm->next_path, 1, __ATOMIC_RELAXED)
+                 : queued_paths;
+
 #ifndef SIMPLE_FILES
 
-    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, queued_paths,
+    fn = alloc_printf("%s/queue/id:%06u,%s", out_dir, (u32)id,
                       describe_op(hnb));
 
 #else
 
-    fn = alloc_printf("%s/queue/id_%06u", out_dir, queued_paths);
+    fn = alloc_printf("%s/queue/id_%06u", out_dir, (u32)id);
 
 #endif /* ^!SIMPLE_FILES */
 
     add_to_queue(fn, len, 0);
+    queue_top->id = id;
+
+    /* Deterministic steps change a known span of bytes in place, so the
+       parent's effector map still holds for the rest of the new entry. */
+
+    if (eff_inherit && len == queue_cur->len) {
+      queue_top->eff_map = ck_memdup(eff_inherit, EFF_ALEN(len));
+      queue_top->eff_lo  = stage_cur_byte;
+      queue_top->eff_hi  = MIN(stage_cur_byte + eff_span, len);
+    }
 
     if (hnb == 2) {
       queue_top->has_new_cov = 1;
       queued_with_cov++;
     }
 
-    queue_top->exec_cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+    queue_top->exec_cksum = hash_trace();
 
     /* Try to calibrate inline; this also calls update_bitmap_score() when
        successful. */
@@ -3205,10 +5481,11 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
     if (res == FAULT_ERROR)
       FATAL("Unable to execute target application");
 
-    fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
-    if (fd < 0) PFATAL("Unable to create '%s'", fn);
-    ck_write(fd, mem, len, fn);
-    close(fd);
+    queue_write(fn, mem, len, 0);
+    cache_put(queue_top, ck_memdup(mem, len));
+
+    if (job_cnt) share_path(queue_top);
+    if (sync_ring) sync_ring_publish(queue_top, mem);
 
     keeping = 1;
 
@@ -3249,7 +5526,7 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
 
         u8 new_fault;
         write_to_testcase(mem, len);
-        new_fault = run_target(argv, hang_tmout);
+        new_fault = run_target(argv, MAX(exec_tmout, hang_tmout));
 
         /* A corner case that one user reported bumping into: increasing the
            timeout actually uncovers a crash. Make sure we don't discard it if
@@ -3261,19 +5538,22 @@ static u8 save_if_interesting(char** argv, void* mem, u32 len, u8 fault) {
 
       }
 
+      id = job_cnt ? __atomic_fetch_add(&job_shm->next_hang, 1,
+                                        __ATOMIC_RELAXED) : unique_hangs;
+
 #ifndef SIMPLE_FILES
 
       fn = alloc_printf("%s/hangs/id:%06llu,%s", out_dir,
-                        unique_hangs, describe_op(0));
+                        id, describe_op(0));
 
 #else
 
       fn = alloc_printf("%s/hangs/id_%06llu", out_dir,
-                        unique_hangs);
+                        id);
 
 #endif /* ^!SIMPLE_FILES */
 
-      unique_hangs++;
+      unique_hangs = id + 1;
 
       last_hang_time = get_cur_time();
 
@@ -3303,21 +5583,24 @@ keep_as_crash:
 
       }
 
-      if (!unique_crashes) write_crash_readme();
+      id = job_cnt ? __atomic_fetch_add(&job_shm->next_crash, 1,
+                                        __ATOMIC_RELAXED) : unique_crashes;
+
+      if (!id) write_crash_readme();
 
 #ifndef SIMPLE_FILES
 
       fn = alloc_printf("%s/crashes/id:%06llu,sig:%02u,%s", out_dir,
-                        unique_crashes, kill_signal, describe_op(0));
+                        id, kill_signal, describe_op(0));
 
 #else
 
-      fn = alloc_printf("%s/crashes/id_%06llu_%02u", out_dir, unique_crashes,
+      fn = alloc_printf("%s/crashes/id_%06llu_%02u", out_dir, id,
                         kill_signal);
 
 #endif /* ^!SIMPLE_FILES */
 
-      unique_crashes++;
+      unique_crashes = id + 1;
 
       last_crash_time = get_cur_time();
       last_crash_execs = total_execs;
@@ -3416,6 +5699,38 @@ static void find_timeout(void) {
 }
 
 
+/* Append time accounting and exec latency percentiles to the stats file:
+   time_<phase>_ms is the wall clock time spent in each phase, and
+   lat_<stage>_us gives execs, p50, p90, p99 and max for every stage. */
+
+static void write_perf_stats(FILE* f) {
+
+  double cpu = cyc_per_us();
+  u8 key[32];
+  u32 i;
+
+  phase_switch(cur_phase);
+
+  for (i = 0; i < PHASE_COUNT; i++) {
+
+    snprintf(key, sizeof(key), "time_%s_ms", phase_names[i]);
+    fprintf(f, "%-17s : %llu\n", key, (u64)(phase_cyc[i] / cpu / 1000));
+
+  }
+
+  for (i = 0; i < lat_used; i++) {
+
+    snprintf(key, sizeof(key), "lat_%s_us", lat_names[i]);
+    fprintf(f, "%-17s : %llu %llu %llu %llu %llu\n", key, lat_cnt[i],
+            lat_pct(lat_hist[i], lat_cnt[i], 50),
+            lat_pct(lat_hist[i], lat_cnt[i], 90),
+            lat_pct(lat_hist[i], lat_cnt[i], 99), lat_max[i]);
+
+  }
+
+}
+
+
 /* Update stats file for unattended monitoring. */
 
 static void write_stats_file(double bitmap_cvg, double stability, double eps) {
@@ -3480,7 +5795,7 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps) {
              "command_line      : %s\n"
              "slowest_exec_ms   : %llu\n",
              start_time / 1000, get_cur_time() / 1000, getpid(),
-             queue_cycle ? (queue_cycle - 1) : 0, total_execs, eps,
+             queue_cycle ? (queue_cycle - 1) : 0, total_execs + job_execs, eps,
              queued_paths, queued_favored, queued_discovered, queued_imported,
              max_depth, current_entry, pending_favored, pending_not_fuzzed,
              queued_variable, stability, bitmap_cvg, unique_crashes,
@@ -3495,22 +5810,160 @@ static void write_stats_file(double bitmap_cvg, double stability, double eps) {
              orig_cmdline, slowest_exec_ms);
              /* ignore errors */
 
-  /* Get rss value from the children
-     We must have killed the forkserver process and called waitpid
-     before calling getrusage */
-  if (getrusage(RUSAGE_CHILDREN, &usage)) {
-      WARNF("getrusage failed");
-  } else if (usage.ru_maxrss == 0) {
-    fprintf(f, "peak_rss_mb       : not available while afl is running\n");
-  } else {
-#ifdef __APPLE__
-    fprintf(f, "peak_rss_mb       : %zu\n", usage.ru_maxrss >> 20);
-#else
-    fprintf(f, "peak_rss_mb       : %zu\n", usage.ru_maxrss >> 10);
-#endif /* ^__APPLE__ */
+  /* Get rss value from the children
+     We must have killed the forkserver process and called waitpid
+     before calling getrusage */
+  if (getrusage(RUSAGE_CHILDREN, &usage)) {
+      WARNF("getrusage failed");
+  } else if (usage.ru_maxrss == 0) {
+    fprintf(f, "peak_rss_mb       : not available while afl is running\n");
+  } else {
+#ifdef __APPLE__
+    fprintf(f, "peak_rss_mb       : %zu\n", usage.ru_maxrss >> 20);
+#else
+    fprintf(f, "peak_rss_mb       : %zu\n", usage.ru_maxrss >> 10);
+#endif /* ^__APPLE__ */
+  }
+
+  write_perf_stats(f);
+
+  fclose(f);
+
+}
+
+
+/* Set up AFL_STATS_SOCKET, if asked to: a UNIX socket that answers every
+   connection with the counters above, in the Prometheus text format. */
+
+static s32 stats_sock_fd = -1;        /* Listening socket, if any          */
+static u8* stats_sock_path;           /* Where it lives                    */
+
+static void setup_stats_socket(void) {
+
+  struct sockaddr_un sa;
+  struct stat st;
+
+  stats_sock_path = getenv("AFL_STATS_SOCKET");
+  if (!stats_sock_path) return;
+
+  if (strlen(stats_sock_path) >= sizeof(sa.sun_path))
+    FATAL("AFL_STATS_SOCKET path is too long");
+
+  /* Replace a stale socket, but nothing else. */
+
+  if (!lstat(stats_sock_path, &st)) {
+
+    if (!S_ISSOCK(st.st_mode))
+      FATAL("AFL_STATS_SOCKET points to '%s', which is not a socket",
+            stats_sock_path);
+
+    unlink(stats_sock_path); /* Ignore errors */
+
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sun_family = AF_UNIX;
+  strcpy(sa.sun_path, stats_sock_path);
+
+  stats_sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (stats_sock_fd < 0) PFATAL("socket() failed");
+
+  if (bind(stats_sock_fd, (struct sockaddr*)&sa, sizeof(sa)) ||
+      listen(stats_sock_fd, 16))
+    PFATAL("Unable to listen on '%s'", stats_sock_path);
+
+  fcntl(stats_sock_fd, F_SETFL, O_NONBLOCK);
+  fcntl(stats_sock_fd, F_SETFD, FD_CLOEXEC);
+
+  OKF("Serving stats on '%s'.", stats_sock_path);
+
+}
+
+
+static void write_stats_metrics(FILE* f) {
+
+  double cpu = cyc_per_us();
+  u64 top_us = (u64)MAX(exec_tmout, hang_tmout) * 1000;
+  u32 i, b;
+
+  phase_switch(cur_phase);
+
+  fprintf(f, "# TYPE afl_execs_total counter\n"
+             "afl_execs_total %llu\n", total_execs + job_execs);
+
+  fprintf(f, "# TYPE afl_phase_seconds_total counter\n");
+
+  for (i = 0; i < PHASE_COUNT; i++)
+    fprintf(f, "afl_phase_seconds_total{phase=\"%s\"} %0.06f\n",
+            phase_names[i], phase_cyc[i] / cpu / 1000000);
+
+  /* Only report bucket bounds at powers of two, and only up to the longest
+     timeout, or this gets long. */
+
+  fprintf(f, "# TYPE afl_exec_latency_us histogram\n");
+
+  for (i = 0; i < lat_used; i++) {
+
+    u64 seen = 0;
+
+    for (b = 0; b < LAT_BUCKETS; b++) {
+
+      u64 top = lat_bucket_top(b);
+
+      seen += lat_hist[i][b];
+
+      if (top & (top + 1)) continue;
+
+      fprintf(f, "afl_exec_latency_us_bucket{stage=\"%s\",le=\"%llu\"} "
+              "%llu\n", lat_names[i], top, seen);
+
+      if (top >= top_us) break;
+
+    }
+
+    fprintf(f, "afl_exec_latency_us_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n"
+               "afl_exec_latency_us_sum{stage=\"%s\"} %llu\n"
+               "afl_exec_latency_us_count{stage=\"%s\"} %llu\n",
+            lat_names[i], lat_cnt[i], lat_names[i], lat_sum[i],
+            lat_names[i], lat_cnt[i]);
+
   }
 
-  fclose(f);
+}
+
+
+/* Answer whoever is waiting on the stats socket. Called from show_stats(),
+   so this never holds up fuzzing for more than a send() or two. */
+
+static void serve_stats_socket(void) {
+
+  u8*    buf = NULL;
+  size_t len = 0;
+  s32    fd;
+
+  if (stats_sock_fd < 0) return;
+
+  while ((fd = accept(stats_sock_fd, NULL, NULL)) >= 0) {
+
+    if (!buf) {
+
+      FILE* f = open_memstream((char**)&buf, &len);
+      if (!f) PFATAL("open_memstream() failed");
+
+      fprintf(f, "HTTP/1.0 200 OK\r\n"
+                 "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+
+      write_stats_metrics(f);
+      fclose(f);
+
+    }
+
+    send(fd, buf, len, MSG_DONTWAIT); /* Ignore errors */
+    close(fd);
+
+  }
+
+  free(buf);
 
 }
 
@@ -3521,6 +5974,10 @@ static void maybe_update_plot_file(double bitmap_cvg, double eps) {
 
   static u32 prev_qp, prev_pf, prev_pnf, prev_ce, prev_md;
   static u64 prev_qc, prev_uc, prev_uh;
+  static u64 hist[LAT_BUCKETS];
+
+  u64 cnt = 0;
+  u32 i, b;
 
   if (prev_qp == queued_paths && prev_pf == pending_favored && 
       prev_pnf == pending_not_fuzzed && prev_ce == current_entry &&
@@ -3536,17 +5993,30 @@ static void maybe_update_plot_file(double bitmap_cvg, double eps) {
   prev_uh  = unique_hangs;
   prev_md  = max_depth;
 
+  /* Exec latency percentiles, across all stages. */
+
+  memset(hist, 0, sizeof(hist));
+
+  for (i = 0; i < lat_used; i++) {
+
+    for (b = 0; b < LAT_BUCKETS; b++) hist[b] += lat_hist[i][b];
+    cnt += lat_cnt[i];
+
+  }
+
   /* Fields in the file:
 
      unix_time, cycles_done, cur_path, paths_total, paths_not_fuzzed,
      favored_not_fuzzed, unique_crashes, unique_hangs, max_depth,
-     execs_per_sec */
+     execs_per_sec, exec_p50_us, exec_p99_us */
 
   fprintf(plot_file, 
-          "%llu, %llu, %u, %u, %u, %u, %0.02f%%, %llu, %llu, %u, %0.02f\n",
+          "%llu, %llu, %u, %u, %u, %u, %0.02f%%, %llu, %llu, %u, %0.02f, "
+          "%llu, %llu\n",
           get_cur_time() / 1000, queue_cycle - 1, current_entry, queued_paths,
           pending_not_fuzzed, pending_favored, bitmap_cvg, unique_crashes,
-          unique_hangs, max_depth, eps); /* ignore errors */
+          unique_hangs, max_depth, eps, lat_pct(hist, cnt, 50),
+          lat_pct(hist, cnt, 99)); /* ignore errors */
 
   fflush(plot_file);
 
@@ -3888,14 +6358,28 @@ static void maybe_delete_out_dir(void) {
   if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
   ck_free(fn);
 
+  fn = alloc_printf("%s/jobs", out_dir);
+  if (delete_files(fn, NULL)) goto dir_cleanup_failed;
+  ck_free(fn);
+
+  fn = alloc_printf("%s/.sync_ring", out_dir);
+  if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+  ck_free(fn);
+
   fn = alloc_printf("%s/fuzz_bitmap", out_dir);
   if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
   ck_free(fn);
 
   if (!in_place_resume) {
+
     fn  = alloc_printf("%s/fuzzer_stats", out_dir);
     if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
     ck_free(fn);
+
+    fn  = alloc_printf("%s/.resume_index", out_dir);
+    if (unlink(fn) && errno != ENOENT) goto dir_cleanup_failed;
+    ck_free(fn);
+
   }
 
   fn = alloc_printf("%s/plot_data", out_dir);
@@ -3942,25 +6426,37 @@ static void show_stats(void) {
   u32 banner_len, banner_pad;
   u8  tmp[256];
 
+  /* Extra -j jobs don't have a UI; they only report their exec counts. */
+
+  if (job_id) {
+    job_shm->job[job_id].execs = total_execs;
+    return;
+  }
+
   cur_ms = get_cur_time();
 
   /* If not enough time has passed since last UI update, bail out. */
 
   if (cur_ms - last_ms < 1000 / UI_TARGET_HZ) return;
 
+  serve_stats_socket();
+
   /* Check if we're past the 10 minute mark. */
 
   if (cur_ms - start_time > 10 * 60 * 1000) run_over10m = 1;
 
+  if (job_cnt) job_execs = count_job_execs();
+
   /* Calculate smoothed exec speed stats. */
 
   if (!last_execs) {
   
-    avg_exec = ((double)total_execs) * 1000 / (cur_ms - start_time);
+    avg_exec = ((double)total_execs + job_execs) * 1000 /
+               (cur_ms - start_time);
 
   } else {
 
-    double cur_avg = ((double)(total_execs - last_execs)) * 1000 /
+    double cur_avg = ((double)(total_execs + job_execs - last_execs)) * 1000 /
                      (cur_ms - last_ms);
 
     /* If there is a dramatic (5x+) jump in speed, reset the indicator
@@ -3975,17 +6471,17 @@ static void show_stats(void) {
   }
 
   last_ms = cur_ms;
-  last_execs = total_execs;
+  last_execs = total_execs + job_execs;
 
   /* Tell the callers when to contact us (as measured in execs). */
 
-  stats_update_freq = avg_exec / (UI_TARGET_HZ * 10);
+  stats_update_freq = avg_exec / (UI_TARGET_HZ * 10) / MAX(job_cnt, 1);
   if (!stats_update_freq) stats_update_freq = 1;
 
   /* Do some bitmap stats. */
 
   t_bytes = count_non_255_bytes(virgin_bits);
-  t_byte_ratio = ((double)t_bytes * 100) / MAP_SIZE;
+  t_byte_ratio = ((double)t_bytes * 100) / map_size;
 
   if (t_bytes) 
     stab_ratio = 100 - ((double)var_byte_count) * 100 / t_bytes;
@@ -4025,7 +6521,7 @@ static void show_stats(void) {
 
   /* Compute some mildly useful bitmap stats. */
 
-  t_bits = (MAP_SIZE << 3) - count_bits(virgin_bits);
+  t_bits = (map_size << 3) - count_bits(virgin_bits);
 
   /* Now, for the visuals... */
 
@@ -4163,7 +6659,7 @@ static void show_stats(void) {
   SAYF(bV bSTOP "  now processing : " cRST "%-17s " bSTG bV bSTOP, tmp);
 
   sprintf(tmp, "%0.02f%% / %0.02f%%", ((double)queue_cur->bitmap_size) * 
-          100 / MAP_SIZE, t_byte_ratio);
+          100 / map_size, t_byte_ratio);
 
   SAYF("    map density : %s%-21s " bSTG bV "\n", t_byte_ratio > 70 ? cLRD : 
        ((t_bytes < 200 && !dumb_mode) ? cPIN : cRST), tmp);
@@ -4213,13 +6709,13 @@ static void show_stats(void) {
   if (crash_mode) {
 
     SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
-         "   new crashes : %s%-22s " bSTG bV "\n", DI(total_execs),
+         "   new crashes : %s%-22s " bSTG bV "\n", DI(total_execs + job_execs),
          unique_crashes ? cLRD : cRST, tmp);
 
   } else {
 
     SAYF(bV bSTOP " total execs : " cRST "%-21s " bSTG bV bSTOP
-         " total crashes : %s%-22s " bSTG bV "\n", DI(total_execs),
+         " total crashes : %s%-22s " bSTG bV "\n", DI(total_execs + job_execs),
          unique_crashes ? cLRD : cRST, tmp);
 
   }
@@ -4532,6 +7028,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
   u32 trim_exec = 0;
   u32 remove_len;
   u32 len_p2;
+  u8  old_phase;
 
   /* Although the trimmer will be less useful when variable behavior is
      detected, it will still work to some extent, so we don't check for
@@ -4539,6 +7036,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
   if (q->len < 5) return 0;
 
+  old_phase  = phase_switch(PHASE_TRIM);
   stage_name = tmp;
   bytes_trim_in += q->len;
 
@@ -4574,7 +7072,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
       /* Note that we don't keep track of crashes or hangs here; maybe TODO? */
 
-      cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+      cksum = hash_trace();
 
       /* If the deletion had no impact on the trace, make it permanent. This
          isn't perfect for variable-path inputs, but we're just making a
@@ -4597,7 +7095,7 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
         if (!needs_write) {
 
           needs_write = 1;
-          memcpy(clean_trace, trace_bits, MAP_SIZE);
+          memcpy(clean_trace, trace_bits, map_size);
 
         }
 
@@ -4619,24 +7117,24 @@ static u8 trim_case(char** argv, struct queue_entry* q, u8* in_buf) {
 
   if (needs_write) {
 
-    s32 fd;
-
-    unlink(q->fname); /* ignore errors */
+    queue_write(q->fname, in_buf, q->len, 1);
+    cache_put(q, ck_memdup(in_buf, q->len));
 
-    fd = open(q->fname, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    /* Offsets have moved, so an inherited effector map is no good. */
 
-    if (fd < 0) PFATAL("Unable to create '%s'", q->fname);
-
-    ck_write(fd, in_buf, q->len, q->fname);
-    close(fd);
+    ck_free(q->eff_map);
+    q->eff_map = NULL;
 
-    memcpy(trace_bits, clean_trace, MAP_SIZE);
+    memcpy(trace_bits, clean_trace, map_size);
+    mark_trace_dense();
     update_bitmap_score(q);
 
   }
 
 abort_trimming:
 
+  phase_switch(old_phase);
+
   bytes_trim_out += q->len;
   return fault;
 
@@ -4660,10 +7158,27 @@ EXP_ST u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
 
   write_to_testcase(out_buf, len);
 
-  fault = run_target(argv, exec_tmout);
+  fault = run_target_us(argv, cur_tmout_us);
 
   if (stop_soon) return 1;
 
+  /* A run cut off at the budget is tried again with the full timeout, and
+     only that second result counts, for the timeout streak below as well as
+     for save_if_interesting(). If it didn't actually hang, the budget was
+     too tight, so give the entry twice as much. */
+
+  if (fault == FAULT_TMOUT && cur_tmout_us < (u64)exec_tmout * 1000) {
+
+    write_to_testcase(out_buf, len);
+    fault = run_target(argv, exec_tmout);
+
+    if (stop_soon) return 1;
+
+    if (fault != FAULT_TMOUT)
+      cur_tmout_us = MIN(cur_tmout_us * 2, (u64)exec_tmout * 1000);
+
+  }
+
   if (fault == FAULT_TMOUT) {
 
     if (subseq_tmouts++ > TMOUT_LIMIT) {
@@ -4686,7 +7201,9 @@ EXP_ST u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
 
   /* This handles FAULT_ERROR for us: */
 
+  phase_switch(PHASE_SAVE);
   queued_discovered += save_if_interesting(argv, out_buf, len, fault);
+  phase_switch(PHASE_FUZZ);
 
   if (!(stage_cur % stats_update_freq) || stage_cur + 1 == stage_max)
     show_stats();
@@ -4696,6 +7213,22 @@ EXP_ST u8 common_fuzz_stuff(char** argv, u8* out_buf, u32 len) {
 }
 
 
+/* Timeout budget for fuzzing q (us): a generous multiple of its calibrated
+   exec time plus a few standard deviations, but no more than exec_tmout. */
+
+static u64 entry_tmout_us(struct queue_entry* q) {
+
+  u64 full = (u64)exec_tmout * 1000, ret;
+
+  if (no_adapt_tmout || !q->exec_us) return full;
+
+  ret = q->exec_us * ADAPT_TMOUT_MULT + (u64)q->exec_sd * ADAPT_TMOUT_SD;
+
+  return MIN(MAX(ret, ADAPT_TMOUT_MIN_US), full);
+
+}
+
+
 /* Helper to choose random block len for block operations in fuzz_one().
    Doesn't return zero, provided that max_len is > 0. */
 
@@ -5002,10 +7535,11 @@ static u8 could_be_interest(u32 old_val, u32 new_val, u8 blen, u8 check_le) {
 
 static u8 fuzz_one(char** argv) {
 
-  s32 len, fd, temp_len, i, j;
+  s32 len, temp_len, i, j;
   u8  *in_buf, *out_buf, *orig_in, *ex_tmp, *eff_map = 0;
   u64 havoc_queued,  orig_hit_cnt, new_hit_cnt;
-  u32 splice_cycle = 0, perf_score = 100, orig_perf, prev_cksum, eff_cnt = 1;
+  u32 splice_cycle = 0, perf_score = 100, orig_perf, prev_cksum, eff_cnt = 1,
+      ext_stride, eff_skip = 0;
 
   u8  ret_val = 1, doing_det = 0;
 
@@ -5056,19 +7590,11 @@ static u8 fuzz_one(char** argv) {
     fflush(stdout);
   }
 
-  /* Map the test case into memory. */
-
-  fd = open(queue_cur->fname, O_RDONLY);
-
-  if (fd < 0) PFATAL("Unable to open '%s'", queue_cur->fname);
+  /* Grab a private copy of the test case; trimming modifies it in place. */
 
   len = queue_cur->len;
 
-  orig_in = in_buf = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-
-  if (orig_in == MAP_FAILED) PFATAL("Unable to mmap '%s'", queue_cur->fname);
-
-  close(fd);
+  orig_in = in_buf = ck_memdup(queue_get(queue_cur), len);
 
   /* We could mmap() out_buf as MAP_PRIVATE, but we end up clobbering every
      single byte anyway, so it wouldn't give us any performance or memory usage
@@ -5136,6 +7662,8 @@ static u8 fuzz_one(char** argv) {
 
   memcpy(out_buf, in_buf, len);
 
+  cur_tmout_us = entry_tmout_us(queue_cur);
+
   /*********************
    * PERFORMANCE SCORE *
    *********************/
@@ -5155,12 +7683,28 @@ static u8 fuzz_one(char** argv) {
   if (master_max && (queue_cur->exec_cksum % master_max) != master_id - 1)
     goto havoc_stage;
 
+  /* With -j, the deterministic stages for any given path are done by
+     whichever job gets to it first. */
+
+  if (job_cnt && queue_cur->id < JOB_MAX_PATHS &&
+      __atomic_exchange_n(&job_shm->det_claim[queue_cur->id], 1,
+                          __ATOMIC_RELAXED)) goto havoc_stage;
+
   doing_det = 1;
 
   /*********************************************
    * SIMPLE BITFLIP (+dictionary construction) *
    *********************************************/
 
+/* Bytes that an effector map inherited from the parent entry has down as
+   having no effect, outside of the span that the parent's mutation changed.
+   The walking bit flips (1/1 through 4/1) leave them alone; bitflip 8/8
+   still measures them, and the new map is built only from that. */
+
+#define EFF_SKIP(_b) (queue_cur->eff_map && \
+    ((_b) < queue_cur->eff_lo || (_b) >= queue_cur->eff_hi) && \
+    !queue_cur->eff_map[EFF_APOS(_b)])
+
 #define FLIP_BIT(_ar, _b) do { \
     u8* _arf = (u8*)(_ar); \
     u32 _bf = (_b); \
@@ -5181,13 +7725,23 @@ static u8 fuzz_one(char** argv) {
 
   for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
 
+    u8 skip = EFF_SKIP(stage_cur >> 3);
+
     stage_cur_byte = stage_cur >> 3;
 
-    FLIP_BIT(out_buf, stage_cur);
+    if (skip) {
 
-    if (common_fuzz_stuff(argv, out_buf, len)) goto abandon_entry;
+      eff_skip++;
 
-    FLIP_BIT(out_buf, stage_cur);
+    } else {
+
+      FLIP_BIT(out_buf, stage_cur);
+
+      if (common_fuzz_stuff(argv, out_buf, len)) goto abandon_entry;
+
+      FLIP_BIT(out_buf, stage_cur);
+
+    }
 
     /* While flipping the least significant bit in every byte, pull of an extra
        trick to detect possible syntax tokens. In essence, the idea is that if
@@ -5218,7 +7772,9 @@ static u8 fuzz_one(char** argv) {
 
     if (!dumb_mode && (stage_cur & 7) == 7) {
 
-      u32 cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+      /* A byte with no effect would have left the path alone. */
+
+      u32 cksum = skip ? queue_cur->exec_cksum : hash_trace();
 
       if (stage_cur == stage_max - 1 && cksum == prev_cksum) {
 
@@ -5261,7 +7817,7 @@ static u8 fuzz_one(char** argv) {
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_FLIP1]  += new_hit_cnt - orig_hit_cnt;
-  stage_cycles[STAGE_FLIP1] += stage_max;
+  stage_cycles[STAGE_FLIP1] += stage_max - eff_skip;
 
   /* Two walking bits. */
 
@@ -5271,8 +7827,15 @@ static u8 fuzz_one(char** argv) {
 
   orig_hit_cnt = new_hit_cnt;
 
+  eff_skip = 0;
+
   for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
 
+    if (EFF_SKIP(stage_cur >> 3) && EFF_SKIP((stage_cur + 1) >> 3)) {
+      eff_skip++;
+      continue;
+    }
+
     stage_cur_byte = stage_cur >> 3;
 
     FLIP_BIT(out_buf, stage_cur);
@@ -5288,7 +7851,7 @@ static u8 fuzz_one(char** argv) {
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_FLIP2]  += new_hit_cnt - orig_hit_cnt;
-  stage_cycles[STAGE_FLIP2] += stage_max;
+  stage_cycles[STAGE_FLIP2] += stage_max - eff_skip;
 
   /* Four walking bits. */
 
@@ -5298,8 +7861,15 @@ static u8 fuzz_one(char** argv) {
 
   orig_hit_cnt = new_hit_cnt;
 
+  eff_skip = 0;
+
   for (stage_cur = 0; stage_cur < stage_max; stage_cur++) {
 
+    if (EFF_SKIP(stage_cur >> 3) && EFF_SKIP((stage_cur + 3) >> 3)) {
+      eff_skip++;
+      continue;
+    }
+
     stage_cur_byte = stage_cur >> 3;
 
     FLIP_BIT(out_buf, stage_cur);
@@ -5319,20 +7889,7 @@ static u8 fuzz_one(char** argv) {
   new_hit_cnt = queued_paths + unique_crashes;
 
   stage_finds[STAGE_FLIP4]  += new_hit_cnt - orig_hit_cnt;
-  stage_cycles[STAGE_FLIP4] += stage_max;
-
-  /* Effector map setup. These macros calculate:
-
-     EFF_APOS      - position of a particular file offset in the map.
-     EFF_ALEN      - length of a map with a particular number of bytes.
-     EFF_SPAN_ALEN - map span for a sequence of bytes.
-
-   */
-
-#define EFF_APOS(_p)          ((_p) >> EFF_MAP_SCALE2)
-#define EFF_REM(_x)           ((_x) & ((1 << EFF_MAP_SCALE2) - 1))
-#define EFF_ALEN(_l)          (EFF_APOS(_l) + !!EFF_REM(_l))
-#define EFF_SPAN_ALEN(_p, _l) (EFF_APOS((_p) + (_l) - 1) - EFF_APOS(_p) + 1)
+  stage_cycles[STAGE_FLIP4] += stage_max - eff_skip;
 
   /* Initialize effector map for the next step (see comments below). Always
      flag first and last byte as doing something. */
@@ -5374,7 +7931,7 @@ static u8 fuzz_one(char** argv) {
          without wasting time on checksums. */
 
       if (!dumb_mode && len >= EFF_MIN_LEN)
-        cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+        cksum = hash_trace();
       else
         cksum = ~queue_cur->exec_cksum;
 
@@ -5389,6 +7946,17 @@ static u8 fuzz_one(char** argv) {
 
   }
 
+  /* This stage always measures every byte, so the map is this entry's own,
+     whatever it inherited. Keep it with the entry, and let anything found by
+     the later deterministic steps inherit it. That comes before the density
+     check below, which would only blur it. */
+
+  ck_free(queue_cur->eff_map);
+  queue_cur->eff_map = ck_memdup(eff_map, EFF_ALEN(len));
+  queue_cur->eff_lo  = queue_cur->eff_hi = 0;
+
+  if (!post_handler) eff_inherit = queue_cur->eff_map;
+
   /* If the effector map is more than EFF_MAX_PERC dense, just flag the
      whole thing as worth fuzzing, since we wouldn't be saving much time
      anyway. */
@@ -5419,6 +7987,7 @@ static u8 fuzz_one(char** argv) {
 
   stage_name  = "bitflip 16/8";
   stage_short = "flip16";
+  eff_span    = 2;
   stage_cur   = 0;
   stage_max   = len - 1;
 
@@ -5456,6 +8025,7 @@ static u8 fuzz_one(char** argv) {
 
   stage_name  = "bitflip 32/8";
   stage_short = "flip32";
+  eff_span    = 4;
   stage_cur   = 0;
   stage_max   = len - 3;
 
@@ -5498,6 +8068,7 @@ skip_bitflip:
 
   stage_name  = "arith 8/8";
   stage_short = "arith8";
+  eff_span    = 1;
   stage_cur   = 0;
   stage_max   = 2 * len * ARITH_MAX;
 
@@ -5564,6 +8135,7 @@ skip_bitflip:
 
   stage_name  = "arith 16/8";
   stage_short = "arith16";
+  eff_span    = 2;
   stage_cur   = 0;
   stage_max   = 4 * (len - 1) * ARITH_MAX;
 
@@ -5658,6 +8230,7 @@ skip_bitflip:
 
   stage_name  = "arith 32/8";
   stage_short = "arith32";
+  eff_span    = 4;
   stage_cur   = 0;
   stage_max   = 4 * (len - 3) * ARITH_MAX;
 
@@ -5752,6 +8325,7 @@ skip_arith:
 
   stage_name  = "interest 8/8";
   stage_short = "int8";
+  eff_span    = 1;
   stage_cur   = 0;
   stage_max   = len * sizeof(interesting_8);
 
@@ -5807,6 +8381,7 @@ skip_arith:
 
   stage_name  = "interest 16/8";
   stage_short = "int16";
+  eff_span    = 2;
   stage_cur   = 0;
   stage_max   = 2 * (len - 1) * (sizeof(interesting_16) >> 1);
 
@@ -5875,6 +8450,7 @@ skip_arith:
 
   stage_name  = "interest 32/8";
   stage_short = "int32";
+  eff_span    = 4;
   stage_cur   = 0;
   stage_max   = 2 * (len - 3) * (sizeof(interesting_32) >> 2);
 
@@ -5957,12 +8533,21 @@ skip_interest:
 
   orig_hit_cnt = new_hit_cnt;
 
+  /* With more than MAX_DET_EXTRAS tokens, every position gets only every
+     ext_stride-th of them, in a rotating pattern, so that each token still
+     lands at evenly spaced offsets. The exception are offsets where the input
+     already has a dictionary token; these get the full set. */
+
+  ext_stride = (extras_cnt + MAX_DET_EXTRAS - 1) / MAX_DET_EXTRAS;
+
   for (i = 0; i < len; i++) {
 
-    u32 last_len = 0;
+    u32 last_len = 0, ext_pos, ext_starts;
 
     stage_cur_byte = i;
 
+    ext_pos = dict_match(in_buf + i, len - i, &ext_starts);
+
     /* Extras are sorted by size, from smallest to largest. This means
        that we don't have to worry about restoring the buffer in
        between writes at a particular offset determined by the outer
@@ -5970,14 +8555,13 @@ skip_interest:
 
     for (j = 0; j < extras_cnt; j++) {
 
-      /* Skip extras probabilistically if extras_cnt > MAX_DET_EXTRAS. Also
-         skip them if there's no room to insert the payload, if the token
-         is redundant, or if its entire span has no bytes set in the effector
-         map. */
+      /* Skip extras not due at this offset if extras_cnt > MAX_DET_EXTRAS.
+         Also skip them if there's no room to insert the payload, if the
+         token is already there, or if its entire span has no bytes set in
+         the effector map. */
 
-      if ((extras_cnt > MAX_DET_EXTRAS && UR(extras_cnt) >= MAX_DET_EXTRAS) ||
-          extras[j].len > len - i ||
-          !memcmp(extras[j].data, out_buf + i, extras[j].len) ||
+      if ((!ext_starts && (i + j) % ext_stride) ||
+          extras[j].len > len - i || dict_hit[j] == ext_pos ||
           !memchr(eff_map + EFF_APOS(i), 1, EFF_SPAN_ALEN(i, extras[j].len))) {
 
         stage_max--;
@@ -5985,7 +8569,7 @@ skip_interest:
 
       }
 
-      last_len = extras[j].len;
+      last_len = eff_span = extras[j].len;
       memcpy(out_buf + i, extras[j].data, last_len);
 
       if (common_fuzz_stuff(argv, out_buf, len)) goto abandon_entry;
@@ -6017,11 +8601,18 @@ skip_interest:
 
   for (i = 0; i <= len; i++) {
 
+    u32 ext_starts = 0;
+
     stage_cur_byte = i;
 
+    if (i < len) dict_match(in_buf + i, len - i, &ext_starts);
+
     for (j = 0; j < extras_cnt; j++) {
 
-      if (len + extras[j].len > MAX_FILE) {
+      /* Same spreading as above, to keep large dictionaries affordable. */
+
+      if ((!ext_starts && (i + j) % ext_stride) ||
+          len + extras[j].len > MAX_FILE) {
         stage_max--; 
         continue;
       }
@@ -6085,7 +8676,7 @@ skip_user_extras:
 
       }
 
-      last_len = a_extras[j].len;
+      last_len = eff_span = a_extras[j].len;
       memcpy(out_buf + i, a_extras[j].data, last_len);
 
       if (common_fuzz_stuff(argv, out_buf, len)) goto abandon_entry;
@@ -6119,6 +8710,7 @@ skip_extras:
 havoc_stage:
 
   stage_cur_byte = -1;
+  eff_inherit    = NULL;
 
   /* The havoc stage mutation code is also invoked when splicing files; if the
      splice_cycle variable is set, generate different descriptions and such. */
@@ -6605,10 +9197,7 @@ retry_splicing:
     do { tid = UR(queued_paths); } while (tid == current_entry);
 
     splicing_with = tid;
-    target = queue;
-
-    while (tid >= 100) { target = target->next_100; tid -= 100; }
-    while (tid--) target = target->next;
+    target = queue_buf[tid];
 
     /* Make sure that the target has a reasonable length. */
 
@@ -6619,17 +9208,9 @@ retry_splicing:
 
     if (!target) goto retry_splicing;
 
-    /* Read the testcase into a new buffer. */
-
-    fd = open(target->fname, O_RDONLY);
-
-    if (fd < 0) PFATAL("Unable to open '%s'", target->fname);
+    /* Copy the test case into a new buffer. */
 
-    new_buf = ck_alloc_nozero(target->len);
-
-    ck_read(fd, new_buf, target->len, target->fname);
-
-    close(fd);
+    new_buf = ck_memdup(queue_get(target), target->len);
 
     /* Find a suitable splicing location, somewhere between the first and
        the last differing byte. Bail out if the difference is just a single
@@ -6658,34 +9239,234 @@ retry_splicing:
 
     goto havoc_stage;
 
-  }
+  }
+
+#endif /* !IGNORE_FINDS */
+
+  ret_val = 0;
+
+abandon_entry:
+
+  splicing_with = -1;
+  eff_inherit   = NULL;
+
+  /* Update pending_not_fuzzed count if we made it through the calibration
+     cycle and have not seen this entry before. */
+
+  if (!stop_soon && !queue_cur->cal_failed && !queue_cur->was_fuzzed) {
+    queue_cur->was_fuzzed = 1;
+    pending_not_fuzzed--;
+    if (queue_cur->favored) pending_favored--;
+  }
+
+  ck_free(orig_in);
+
+  if (in_buf != orig_in) ck_free(in_buf);
+  ck_free(out_buf);
+  ck_free(eff_map);
+
+  return ret_val;
+
+#undef FLIP_BIT
+
+}
+
+
+/* Catch up with another instance through its sync ring, if it has one.
+   Inputs whose published traces don't have anything in common with our
+   virgin_bits are skipped without running them (or even reading them from
+   disk). Returns 0 if the caller should scan the peer's queue/ instead. */
+
+static u8 sync_ring_read(char** argv, u8* name, u32* next_min_accept) {
+
+  struct sync_peer* p;
+  struct stat st;
+  u8* fn;
+  u64 head;
+  u32 size;
+
+  for (p = sync_peers; p; p = p->next)
+    if (!strcmp(p->name, name)) break;
+
+  if (!p) {
+
+    p = ck_alloc(sizeof(struct sync_peer));
+    p->name = ck_strdup(name);
+    p->next = sync_peers;
+    sync_peers = p;
+
+  }
+
+  /* (Re-)map the ring if it's new, or if the peer has been restarted. */
+
+  fn = alloc_printf("%s/%s/.sync_ring", sync_dir, name);
+
+  if (stat(fn, &st) || !p->ring || st.st_ino != p->ino) {
+
+    s32 fd;
+
+    if (p->ring) munmap(p->ring, p->map_len);
+    p->ring = NULL;
+
+    fd = open(fn, O_RDONLY);
+    ck_free(fn);
+
+    if (fd < 0 || fstat(fd, &st) || st.st_size < sizeof(struct sync_ring)) {
+      if (fd >= 0) close(fd);
+      return 0;
+    }
+
+    p->ring = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (p->ring == MAP_FAILED) {
+      p->ring = NULL;
+      return 0;
+    }
+
+    p->map_len   = st.st_size;
+    p->ino       = st.st_ino;
+    p->caught_up = 0;
+
+    if (p->ring->magic != SYNC_RING_MAGIC ||
+        p->ring->size + sizeof(struct sync_ring) > p->map_len) {
+
+      munmap(p->ring, p->map_len);
+      p->ring = NULL;
+      return 0;
+
+    }
+
+  } else ck_free(fn);
+
+  size = p->ring->size;
+  head = __atomic_load_n(&p->ring->head, __ATOMIC_ACQUIRE);
+
+  /* If we've just mapped the ring or fell behind by more than a full lap,
+     the caller scans the directory, and we carry on from here next time. */
+
+  if (!p->caught_up || head - p->rd > size) {
+
+    p->rd = head;
+    p->caught_up = 1;
+    return 0;
+
+  }
+
+  while (p->rd < head) {
+
+    u32 pos = p->rd % size, rsize, id, len, cnt, name_len, data_len, i;
+    struct sync_rec* r;
+    u32* tuples;
+    u8  *rname, *mem = NULL;
+
+    if (size - pos < sizeof(struct sync_rec)) {
+      p->rd += size - pos;
+      continue;
+    }
+
+    r = (struct sync_rec*)(p->ring->data + pos);
+
+    /* Not done writing this one yet. */
+
+    if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != p->rd) break;
+
+    rsize    = r->size;
+    id       = r->id;
+    len      = r->len;
+    cnt      = r->tuples;
+    name_len = r->name_len;
+    data_len = r->data_len;
+
+    tuples = (u32*)(r + 1);
+    rname  = (u8*)(r + 1) + (cnt << 2);
+
+    if (rsize < sizeof(struct sync_rec) || rsize > size - pos) goto lapped;
+
+    if (name_len) {
+
+      if (sizeof(struct sync_rec) + (cnt << 2) + name_len + data_len > rsize ||
+          rname[name_len - 1] || (data_len && data_len != len)) goto lapped;
+
+      for (i = 0; i < cnt; i++)
+
+        if ((tuples[i] >> 8) < map_size &&
+            (virgin_bits[tuples[i] >> 8] & tuples[i])) {
+
+          if (!len || len > MAX_FILE) break;
+
+          mem = ck_alloc_nozero(len);
+
+          if (data_len) {
+
+            memcpy(mem, rname + name_len, len);
+
+          } else {
+
+            u8* path = alloc_printf("%s/%s/queue/%s", sync_dir, name, rname);
+            s32 fd = open(path, O_RDONLY);
+
+            if (fd < 0 || read(fd, mem, len) != len) {
+              ck_free(mem);
+              mem = NULL;
+            }
+
+            if (fd >= 0) close(fd);
+            ck_free(path);
+
+          }
+
+          break;
+
+        }
+
+    }
+
+    /* Make sure that nobody has overwritten any of this while we looked. */
+
+    if (__atomic_load_n(&p->ring->head, __ATOMIC_ACQUIRE) - p->rd > size) {
+      ck_free(mem);
+      goto lapped;
+    }
+
+    p->rd += rsize;
+
+    if (!name_len) continue;
+
+    if (id >= *next_min_accept) *next_min_accept = id + 1;
+
+    if (mem) {
+
+      u8 fault;
+
+      write_to_testcase(mem, len);
+
+      fault = run_target(argv, exec_tmout);
 
-#endif /* !IGNORE_FINDS */
+      if (stop_soon) {
+        ck_free(mem);
+        return 1;
+      }
 
-  ret_val = 0;
+      syncing_party = name;
+      syncing_case  = id;
+      queued_imported += save_if_interesting(argv, mem, len, fault);
+      syncing_party = 0;
 
-abandon_entry:
+      ck_free(mem);
 
-  splicing_with = -1;
+      if (!(stage_cur++ % stats_update_freq)) show_stats();
 
-  /* Update pending_not_fuzzed count if we made it through the calibration
-     cycle and have not seen this entry before. */
+    }
 
-  if (!stop_soon && !queue_cur->cal_failed && !queue_cur->was_fuzzed) {
-    queue_cur->was_fuzzed = 1;
-    pending_not_fuzzed--;
-    if (queue_cur->favored) pending_favored--;
   }
 
-  munmap(orig_in, queue_cur->len);
-
-  if (in_buf != orig_in) ck_free(in_buf);
-  ck_free(out_buf);
-  ck_free(eff_map);
+  return 1;
 
-  return ret_val;
+lapped:
 
-#undef FLIP_BIT
+  p->rd = __atomic_load_n(&p->ring->head, __ATOMIC_ACQUIRE);
+  return 0;
 
 }
 
@@ -6750,6 +9531,13 @@ static void sync_fuzzers(char** argv) {
     stage_cur  = 0;
     stage_max  = 0;
 
+    /* With AFL_SYNC_RING, the peer's ring usually has everything we need. */
+
+    if (sync_ring && sync_ring_read(argv, sd_ent->d_name, &next_min_accept)) {
+      if (stop_soon) return;
+      goto peer_done;
+    }
+
     /* For every file queued by this fuzzer, parse ID and see if we have looked at
        it before; exec a test case if not. */
 
@@ -6814,6 +9602,8 @@ static void sync_fuzzers(char** argv) {
 
     }
 
+peer_done:
+
     ck_write(id_fd, &next_min_accept, sizeof(u32), qd_synced_path);
 
     close(id_fd);
@@ -7136,6 +9926,7 @@ static void usage(u8* argv0) {
 
        "  -T text       - text banner to show on the screen\n"
        "  -M / -S id    - distributed mode (see parallel_fuzzing.txt)\n"
+       "  -j jobs       - number of local fuzzing jobs to run in parallel\n"
        "  -C            - crash exploration mode (the peruvian rabbit thing)\n"
        "  -V            - show version number and exit\n\n"
        "  -b cpu_id     - bind the fuzzing process to the specified CPU core\n\n"
@@ -7149,6 +9940,36 @@ static void usage(u8* argv0) {
 }
 
 
+/* Create our own sync ring for AFL_SYNC_RING. It's a plain file in the output
+   directory, so that peers can find it next to our queue. */
+
+static void setup_sync_ring(void) {
+
+  u8* fn = alloc_printf("%s/.sync_ring", out_dir);
+  s32 fd;
+
+  unlink(fn); /* Ignore errors */
+
+  fd = open(fn, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+
+  if (ftruncate(fd, sizeof(struct sync_ring) + SYNC_RING_SIZE))
+    PFATAL("ftruncate() failed");
+
+  sync_ring = mmap(0, sizeof(struct sync_ring) + SYNC_RING_SIZE,
+                   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (sync_ring == MAP_FAILED) PFATAL("Unable to mmap '%s'", fn);
+
+  close(fd);
+  ck_free(fn);
+
+  sync_ring->size  = SYNC_RING_SIZE;
+  sync_ring->magic = SYNC_RING_MAGIC;
+
+}
+
+
 /* Prepare output directories and fds. */
 
 EXP_ST void setup_dirs_fds(void) {
@@ -7232,6 +10053,8 @@ EXP_ST void setup_dirs_fds(void) {
 
     ck_free(tmp);
 
+    if (getenv("AFL_SYNC_RING")) setup_sync_ring();
+
   }
 
   /* All recorded crashes. */
@@ -7266,7 +10089,8 @@ EXP_ST void setup_dirs_fds(void) {
 
   fprintf(plot_file, "# unix_time, cycles_done, cur_path, paths_total, "
                      "pending_total, pending_favs, map_size, unique_crashes, "
-                     "unique_hangs, max_depth, execs_per_sec\n");
+                     "unique_hangs, max_depth, execs_per_sec, "
+                     "exec_p50_us, exec_p99_us\n");
                      /* ignore errors */
 
 }
@@ -7743,6 +10567,331 @@ static char** get_qemu_argv(u8* own_loc, char** argv, int argc) {
 }
 
 
+/* Publish our own new paths for the other -j jobs, trimming them first. Doing
+   the trimming here rather than in fuzz_one() means that queue files never
+   change once somebody else might be reading them. */
+
+static void publish_paths(char** argv) {
+
+  struct queue_entry* q;
+
+  for (q = job_last->next; q; job_last = q, q = q->next) {
+
+    struct job_path* p;
+
+    if (q->id >= JOB_MAX_PATHS) continue;
+
+    p = &job_shm->path[q->id];
+    if (p->ready) continue;
+
+    if (!dumb_mode && !q->trim_done) {
+
+      u8* in_buf = ck_memdup(queue_get(q), q->len);
+      u8  fault;
+
+      fault = trim_case(argv, q, in_buf);
+      ck_free(in_buf);
+
+      if (stop_soon) return;
+
+      if (fault == FAULT_ERROR)
+        FATAL("Unable to execute target application");
+
+      q->trim_done = 1;
+
+    }
+
+    /* The file has to be on disk before anybody goes looking for it. */
+
+    queue_flush();
+
+    p->len = q->len;
+    __atomic_store_n(&p->ready, 1, __ATOMIC_RELEASE);
+
+  }
+
+}
+
+
+/* Add the paths published by the other -j jobs to our queue, using the
+   calibration data that came with them, and catch up with the shared crash
+   and hang counters. */
+
+static void import_paths(void) {
+
+  u32 top = __atomic_load_n(&job_shm->next_path, __ATOMIC_RELAXED),
+      depth = cur_depth;
+  u64 cnt;
+
+  if (top > JOB_MAX_PATHS) top = JOB_MAX_PATHS;
+
+  for (; job_seen < top; job_seen++) {
+
+    struct job_path* p = &job_shm->path[job_seen];
+    struct queue_entry* q;
+
+    /* Slots are filled out of order; wait for the next one in line. */
+
+    if (!__atomic_load_n(&p->ready, __ATOMIC_ACQUIRE)) break;
+
+    if (p->owner == job_id || !p->fname[0]) continue;
+
+    cur_depth = p->depth - 1;
+    add_to_queue(alloc_printf("%s/queue/%s", out_dir, p->fname), p->len, 0);
+
+    q = queue_top;
+
+    q->id           = job_seen;
+    q->trim_done    = 1;
+    q->has_new_cov  = p->has_new_cov;
+    q->var_behavior = p->var_behavior;
+    q->cal_failed   = p->cal_failed;
+    q->bitmap_size  = p->bitmap_size;
+    q->exec_cksum   = p->exec_cksum;
+    q->exec_us      = p->exec_us;
+    q->exec_sd      = p->exec_sd;
+    q->handicap     = queue_cycle - 1;
+
+    if (q->has_new_cov) queued_with_cov++;
+    if (q->var_behavior) queued_variable++;
+
+    total_bitmap_size += q->bitmap_size;
+    total_bitmap_entries++;
+
+    update_bitmap_score_mini(q, p->trace_mini);
+
+    bitmap_changed = 1;
+
+  }
+
+  cur_depth = depth;
+
+  cnt = __atomic_load_n(&job_shm->next_crash, __ATOMIC_RELAXED);
+  if (cnt > unique_crashes) unique_crashes = cnt;
+
+  cnt = __atomic_load_n(&job_shm->next_hang, __ATOMIC_RELAXED);
+  if (cnt > unique_hangs) unique_hangs = cnt;
+
+}
+
+
+/* Make sure that the other -j jobs are still around. A job that went away
+   could be holding a path slot that will now never be filled, so this is
+   fatal for the master; the other jobs wind down if the master is gone. */
+
+static void check_jobs(void) {
+
+  u32 i;
+
+  if (job_id) {
+
+    if (getppid() != job_master) stop_soon = 1;
+    return;
+
+  }
+
+  for (i = 1; i < job_cnt; i++)
+    if (waitpid(job_pids[i], NULL, WNOHANG) == job_pids[i] && !stop_soon)
+      FATAL("Job %u exited unexpectedly (see '%s/jobs/log.%u')",
+            i, out_dir, i);
+
+}
+
+
+/* Stop the other -j jobs and wait for them. */
+
+static void stop_jobs(void) {
+
+  u32 i;
+
+  for (i = 1; i < job_cnt; i++) {
+
+    if (job_pids[i] <= 0) continue;
+
+    kill(job_pids[i], SIGTERM);
+    waitpid(job_pids[i], NULL, 0);
+
+  }
+
+}
+
+
+/* Set up a freshly forked -j job: logging, its own trace map, input file,
+   CPU core and fork server. Returns the argv to use. */
+
+static char** init_job(u8* own_loc, char** argv, u32 argc) {
+
+  char** use_argv;
+  u8* fn;
+  s32 fd;
+
+  fn = alloc_printf("%s/jobs/log.%u", out_dir, job_id);
+  fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) PFATAL("Unable to create '%s'", fn);
+  ck_free(fn);
+
+  dup2(fd, 1);
+  dup2(fd, 2);
+  close(fd);
+
+  not_on_tty = 1;
+
+  /* The fork server and everything about the inputs belong to the master;
+     we also don't want to replay its random number sequence. */
+
+  close(fsrv_ctl_fd);
+  close(fsrv_st_fd);
+
+  forksrv_pid = 0;
+  child_pid   = -1;
+  total_execs = 0;
+  rand_cnt    = 0;
+
+  setup_trace_shm();
+
+  if (out_file) {
+
+    out_file = alloc_printf("%s/jobs/cur_input.%u", out_dir, job_id);
+    detect_file_args(argv + 1);
+
+  } else {
+
+    close(out_fd);
+
+    fn = alloc_printf("%s/jobs/cur_input.%u", out_dir, job_id);
+    out_fd = open(fn, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (out_fd < 0) PFATAL("Unable to create '%s'", fn);
+    ck_free(fn);
+
+  }
+
+  if (qemu_mode)
+    use_argv = get_qemu_argv(own_loc, argv, argc);
+  else
+    use_argv = argv;
+
+#ifdef HAVE_AFFINITY
+
+  /* We inherited the master's CPU core; go find one of our own. */
+
+  if (cpu_aff >= 0) {
+
+    cpu_set_t c;
+    s32 i;
+
+    CPU_ZERO(&c);
+    for (i = 0; i < cpu_core_count; i++) CPU_SET(i, &c);
+
+    if (sched_setaffinity(0, sizeof(c), &c))
+      PFATAL("sched_setaffinity failed");
+
+    cpu_to_bind_given = 0;
+    bind_to_free_cpu();
+
+  }
+
+#endif /* HAVE_AFFINITY */
+
+  if (dumb_mode != 1 && !no_forkserver) init_forkserver(use_argv);
+
+  return use_argv;
+
+}
+
+
+/* Fork off the other -j jobs once the dry run is done, so that calibration
+   only happens once. argv is a copy of the target command line from before
+   detect_file_args(). Returns the argv to use in the calling process. */
+
+static char** start_jobs(u8* own_loc, char** argv, u32 argc,
+                         char** use_argv) {
+
+  u8* tmp;
+  u32 i;
+  s32 flags = MAP_SHARED | MAP_ANON;
+
+#ifdef MAP_NORESERVE
+  flags |= MAP_NORESERVE;
+#endif /* MAP_NORESERVE */
+
+  job_shm = mmap(0, sizeof(struct job_shm), PROT_READ | PROT_WRITE, flags,
+                 -1, 0);
+
+  if (job_shm == MAP_FAILED) PFATAL("mmap() failed");
+
+  memcpy(job_shm->virgin_bits, virgin_bits, MAP_SIZE);
+  memcpy(job_shm->virgin_tmout, virgin_tmout, MAP_SIZE);
+  memcpy(job_shm->virgin_crash, virgin_crash, MAP_SIZE);
+
+  virgin_bits  = job_shm->virgin_bits;
+  virgin_tmout = job_shm->virgin_tmout;
+  virgin_crash = job_shm->virgin_crash;
+
+  job_shm->next_path  = queued_paths;
+  job_shm->next_crash = unique_crashes;
+  job_shm->next_hang  = unique_hangs;
+
+  job_seen = queued_paths;
+  job_last = queue_top;
+
+  tmp = alloc_printf("%s/jobs", out_dir);
+  if (mkdir(tmp, 0700)) PFATAL("Unable to create '%s'", tmp);
+  ck_free(tmp);
+
+  ACTF("Starting %u more fuzzing jobs...", job_cnt - 1);
+
+  job_master = getpid();
+
+  /* Don't fork() with the writer thread around. */
+
+  queue_writer_stop();
+
+  fflush(stdout);
+  fflush(plot_file);
+
+  for (i = 1; i < job_cnt; i++) {
+
+    s32 st_pipe[2];
+    u8  c = 0;
+
+    if (pipe(st_pipe)) PFATAL("pipe() failed");
+
+    job_pids[i] = fork();
+
+    if (job_pids[i] < 0) PFATAL("fork() failed");
+
+    if (!job_pids[i]) {
+
+      close(st_pipe[0]);
+
+      job_id   = i;
+      use_argv = init_job(own_loc, argv, argc);
+
+      if (write(st_pipe[1], &c, 1) != 1) PFATAL("write() failed");
+      close(st_pipe[1]);
+
+      return use_argv;
+
+    }
+
+    /* Start them one by one, so that each gets to pick a free core. */
+
+    close(st_pipe[1]);
+
+    if (read(st_pipe[0], &c, 1) != 1)
+      FATAL("Job %u failed to start (see '%s/jobs/log.%u')", i, out_dir, i);
+
+    close(st_pipe[0]);
+
+  }
+
+  OKF("All %u jobs are up and running.", job_cnt);
+
+  return use_argv;
+
+}
+
+
 /* Make a copy of the current command line. */
 
 static void save_cmdline(u32 argc, char** argv) {
@@ -7784,6 +10933,7 @@ int main(int argc, char** argv) {
   u8  mem_limit_given = 0;
   u8  exit_1 = !!getenv("AFL_BENCH_JUST_ONE");
   char** use_argv;
+  char** job_argv = NULL;
 
   struct timeval tv;
   struct timezone tz;
@@ -7795,7 +10945,10 @@ int main(int argc, char** argv) {
   gettimeofday(&tv, &tz);
   srandom(tv.tv_sec ^ tv.tv_usec ^ getpid());
 
-  while ((opt = getopt(argc, argv, "+i:o:f:m:b:t:T:dnCB:S:M:x:QV")) > 0)
+  start_cyc    = phase_mark = get_cycles();
+  start_cyc_us = get_cur_time_us();
+
+  while ((opt = getopt(argc, argv, "+i:o:f:m:b:j:t:T:dnCB:S:M:x:QV")) > 0)
 
     switch (opt) {
 
@@ -7921,6 +11074,18 @@ int main(int argc, char** argv) {
 
       }
 
+      case 'j': /* parallel jobs */
+
+        if (job_cnt) FATAL("Multiple -j options not supported");
+
+        if (sscanf(optarg, "%u", &job_cnt) < 1 || optarg[0] == '-' ||
+            !job_cnt || job_cnt > JOB_MAX)
+          FATAL("Bad value for -j (must be between 1 and %u)", JOB_MAX);
+
+        if (job_cnt == 1) job_cnt = 0;
+
+        break;
+
       case 'd': /* skip deterministic */
 
         if (skip_deterministic) FATAL("Multiple -d options not supported");
@@ -8006,6 +11171,7 @@ int main(int argc, char** argv) {
   if (getenv("AFL_NO_FORKSRV"))    no_forkserver    = 1;
   if (getenv("AFL_NO_CPU_RED"))    no_cpu_meter_red = 1;
   if (getenv("AFL_NO_ARITH"))      no_arith         = 1;
+  if (getenv("AFL_NO_ADAPT_TMOUT")) no_adapt_tmout  = 1;
   if (getenv("AFL_SHUFFLE_QUEUE")) shuffle_queue    = 1;
   if (getenv("AFL_FAST_CAL"))      fast_cal         = 1;
 
@@ -8014,9 +11180,24 @@ int main(int argc, char** argv) {
     if (!hang_tmout) FATAL("Invalid value of AFL_HANG_TMOUT");
   }
 
+  cache_limit = (u64)CACHE_SIZE_MB << 20;
+
+  if (getenv("AFL_CACHE_MB")) {
+    u8* x = getenv("AFL_CACHE_MB");
+    if (!isdigit(x[0])) FATAL("Invalid value of AFL_CACHE_MB");
+    cache_limit = (u64)strtoull(x, NULL, 10) << 20;
+  }
+
+  token_file = getenv("AFL_TOKEN_FILE");
+
+  map_size = bm_env_map_size(map_size);
+
   if (dumb_mode == 2 && no_forkserver)
     FATAL("AFL_DUMB_FORKSRV and AFL_NO_FORKSRV are mutually exclusive");
 
+  if (job_cnt && out_file)
+    FATAL("-j and -f are mutually exclusive");
+
   if (getenv("AFL_PRELOAD")) {
     setenv("LD_PRELOAD", getenv("AFL_PRELOAD"), 1);
     setenv("DYLD_INSERT_LIBRARIES", getenv("AFL_PRELOAD"), 1);
@@ -8043,8 +11224,10 @@ int main(int argc, char** argv) {
   setup_post();
   setup_shm();
   init_count_class16();
+  init_bitmap_ops();
 
   setup_dirs_fds();
+  setup_stats_socket();
   read_testcases();
   load_auto();
 
@@ -8052,8 +11235,18 @@ int main(int argc, char** argv) {
 
   if (extras_dir) load_extras(extras_dir);
 
+  if (token_file) {
+    u32 cnt = load_token_file();
+    if (cnt) OKF("Loaded %u libtokencap tokens from '%s'.", cnt, token_file);
+  }
+
   if (!timeout_given) find_timeout();
 
+  /* The other -j jobs will need to substitute @@ on their own. */
+
+  if (job_cnt)
+    job_argv = ck_memdup(argv + optind, (argc - optind + 1) * sizeof(char*));
+
   detect_file_args(argv + optind + 1);
 
   if (!out_file) setup_stdio_file();
@@ -8080,9 +11273,19 @@ int main(int argc, char** argv) {
 
   if (stop_soon) goto stop_fuzzing;
 
+  if (job_cnt) {
+
+    use_argv = start_jobs(argv[0], job_argv, argc - optind, use_argv);
+
+    /* Spread the jobs out across the queue. */
+
+    if (job_id) seek_to = (u64)queued_paths * job_id / job_cnt;
+
+  }
+
   /* Woop woop woop */
 
-  if (!not_on_tty) {
+  if (!not_on_tty && !job_id) {
     sleep(4);
     start_time += 4000;
     if (stop_soon) goto stop_fuzzing;
@@ -8097,17 +11300,13 @@ int main(int argc, char** argv) {
     if (!queue_cur) {
 
       queue_cycle++;
-      current_entry     = 0;
+      current_entry     = seek_to;
       cur_skipped_paths = 0;
-      queue_cur         = queue;
-
-      while (seek_to) {
-        current_entry++;
-        seek_to--;
-        queue_cur = queue_cur->next;
-      }
+      queue_cur         = queue_buf[seek_to];
+      seek_to           = 0;
 
       show_stats();
+      save_resume_index(use_argv);
 
       if (not_on_tty) {
         ACTF("Entering queue cycle %llu.", queue_cycle);
@@ -8125,17 +11324,36 @@ int main(int argc, char** argv) {
 
       prev_queued = queued_paths;
 
-      if (sync_id && queue_cycle == 1 && getenv("AFL_IMPORT_FIRST"))
+      if (sync_id && !job_id && queue_cycle == 1 &&
+          getenv("AFL_IMPORT_FIRST")) {
+        phase_switch(PHASE_SYNC);
         sync_fuzzers(use_argv);
+        phase_switch(PHASE_FUZZ);
+      }
 
     }
 
     skipped_fuzz = fuzz_one(use_argv);
 
-    if (!stop_soon && sync_id && !skipped_fuzz) {
+    if (!stop_soon && token_file) load_token_file();
+
+    if (!stop_soon && job_cnt) {
+
+      check_jobs();
+      publish_paths(use_argv);
+      import_paths();
+
+    }
+
+    /* With -j, syncing is up to the master job. */
+
+    if (!stop_soon && sync_id && !job_id && !skipped_fuzz) {
       
-      if (!(sync_interval_cnt++ % SYNC_INTERVAL))
+      if (!(sync_interval_cnt++ % SYNC_INTERVAL)) {
+        phase_switch(PHASE_SYNC);
         sync_fuzzers(use_argv);
+        phase_switch(PHASE_FUZZ);
+      }
 
     }
 
@@ -8148,6 +11366,23 @@ int main(int argc, char** argv) {
 
   }
 
+  queue_writer_stop();
+
+  /* Extra -j jobs leave the bookkeeping to the master. */
+
+  if (job_id) {
+
+    if (forksrv_pid > 0) {
+      kill(forksrv_pid, SIGKILL);
+      waitpid(forksrv_pid, NULL, 0);
+    }
+
+    exit(0);
+
+  }
+
+  stop_jobs();
+
   if (queue_cur) show_stats();
 
   /* If we stopped programmatically, we kill the forkserver and the current runner. 
@@ -8164,9 +11399,13 @@ int main(int argc, char** argv) {
   write_bitmap();
   write_stats_file(0, 0, 0);
   save_auto();
+  save_resume_index(use_argv);
 
 stop_fuzzing:
 
+  queue_writer_stop();
+  stop_jobs();
+
   SAYF(CURSOR_SHOW cLRD "\n\n+++ Testing aborted %s +++\n" cRST,
        stop_soon == 2 ? "programmatically" : "by user");
 
@@ -8181,6 +11420,7 @@ stop_fuzzing:
   }
 
   fclose(plot_file);
+  if (stats_sock_fd >= 0 && !job_id) unlink(stats_sock_path);
   destroy_queue();
   destroy_extras();
   ck_free(target_path);
@@ -37,6 +37,10 @@
    If you want to call a non-default compiler as a next step of the chain,
    specify its location via AFL_CC or AFL_CXX.
 
+   With AFL_SOLVE_IDS, afl-as records the control flow it instruments, and
+   when the wrapper does the final link, it picks the location IDs in the
+   output so that the edges it knows about don't collide in the map.
+
 */
 
 #define AFL_MAIN
@@ -50,12 +54,23 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#ifndef __APPLE__
+#  include <elf.h>
+#endif /* !__APPLE__ */
 
 static u8*  as_path;                /* Path to the AFL 'as' wrapper      */
 static u8** cc_params;              /* Parameters passed to the real CC  */
 static u32  cc_par_cnt = 1;         /* Param count, including argv0      */
+static u8*  out_file = "a.out";     /* Output of the compiler            */
 static u8   be_quiet,               /* Quiet mode                        */
-            clang_mode;             /* Invoked as afl-clang*?            */
+            clang_mode,             /* Invoked as afl-clang*?            */
+            link_mode = 1;          /* Producing a linked binary?        */
 
 
 /* Try to find our "fake" GNU assembler in AFL_PATH or at the location derived
@@ -201,6 +216,15 @@ static void edit_params(u32 argc, char** argv) {
 
     if (!strcmp(cur, "-pipe")) continue;
 
+    if (!strcmp(cur, "-c") || !strcmp(cur, "-S") || !strcmp(cur, "-E") ||
+        !strcmp(cur, "-M") || !strcmp(cur, "-MM") ||
+        !strcmp(cur, "-fsyntax-only")) link_mode = 0;
+
+    if (!strncmp(cur, "-o", 2)) {
+      if (cur[2]) out_file = cur + 2;
+      else if (argc > 1) out_file = argv[1];
+    }
+
 #if defined(__FreeBSD__) && defined(__x86_64__)
     if (!strcmp(cur, "-m32")) m32_set = 1;
 #endif
@@ -305,6 +329,483 @@ static void edit_params(u32 argc, char** argv) {
 }
 
 
+#ifndef __APPLE__
+
+/* AFL_SOLVE_IDS state for the linked output. Blocks are the trampolines
+   listed in AS_CFG_SECTION; edges are kept in both directions, indexed by
+   block (CSR style). */
+
+static u8** blk_imm;                /* ID immediate in the mapped file   */
+static u32* blk_orig;               /* ID afl-as put there               */
+static u32* blk_key;                /* ID picked by the solver           */
+static u8*  blk_done;               /* Key assigned yet?                 */
+
+static u32 *in_off, *in_src,        /* Incoming edges of every block     */
+           *out_off, *out_dst;      /* Outgoing edges of every block     */
+
+static u8*  map_used;               /* Map slots taken by known edges    */
+static u32  map_mask;               /* Size of the map being solved - 1  */
+
+static u32  blk_cnt, edge_cnt;
+
+struct cfg_edge { u32 src, dst; };
+
+static int edge_cmp(const void* a, const void* b) {
+
+  const struct cfg_edge *x = a, *y = b;
+
+  if (x->src != y->src) return x->src < y->src ? -1 : 1;
+  if (x->dst != y->dst) return x->dst < y->dst ? -1 : 1;
+  return 0;
+
+}
+
+
+/* Find the ID immediate of the trampoline at file offset off, and return a
+   pointer to it if it still holds the expected value. The mov is either
+   48 c7 c1 imm32 (movq) or b9 imm32 (movl, or movq shortened by 'as'). */
+
+static u8* find_imm(u8* map, u64 size, u64 off, u32 orig) {
+
+  u8* p = map + off;
+  u32 val;
+
+  if (off + 7 > size) return NULL;
+
+  if (p[0] == 0x48 && p[1] == 0xc7 && p[2] == 0xc1) p += 3;
+  else if (p[0] == 0xb9) p += 1;
+  else return NULL;
+
+  memcpy(&val, p, 4);
+
+  return val == orig ? p : NULL;
+
+}
+
+
+/* Read AS_CFG_SECTION from the ELF file at map, and fill blk_* and edges.
+   Blocks whose code is gone (--gc-sections) or doesn't look like ours are
+   left with a NULL blk_imm. Returns the number of blocks that didn't match,
+   or -1 if there's no section to be found. */
+
+static s32 read_cfg(u8* map, u64 size, struct cfg_edge** edges) {
+
+  u8  is64 = map[EI_CLASS] == ELFCLASS64;
+  u64 shoff, cfg_off = 0, cfg_size = 0, pos;
+  u32 shnum, shstrndx, i, stale = 0;
+  u8  *shdrs, found = 0;
+
+  struct cfg_sect { u64 addr, off, size; u32 name, type, flags; } *sect;
+
+  if (is64) {
+    Elf64_Ehdr* eh = (Elf64_Ehdr*)map;
+    shoff = eh->e_shoff; shnum = eh->e_shnum; shstrndx = eh->e_shstrndx;
+  } else {
+    Elf32_Ehdr* eh = (Elf32_Ehdr*)map;
+    shoff = eh->e_shoff; shnum = eh->e_shnum; shstrndx = eh->e_shstrndx;
+  }
+
+  if (!shoff || !shnum || shstrndx >= shnum ||
+      shoff + (u64)shnum * (is64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr))
+      > size) return -1;
+
+  shdrs = map + shoff;
+  sect  = ck_alloc(shnum * sizeof(struct cfg_sect));
+
+  for (i = 0; i < shnum; i++) {
+
+    if (is64) {
+      Elf64_Shdr* sh = (Elf64_Shdr*)shdrs + i;
+      sect[i].addr = sh->sh_addr; sect[i].off = sh->sh_offset;
+      sect[i].size = sh->sh_size; sect[i].name = sh->sh_name;
+      sect[i].type = sh->sh_type; sect[i].flags = sh->sh_flags;
+    } else {
+      Elf32_Shdr* sh = (Elf32_Shdr*)shdrs + i;
+      sect[i].addr = sh->sh_addr; sect[i].off = sh->sh_offset;
+      sect[i].size = sh->sh_size; sect[i].name = sh->sh_name;
+      sect[i].type = sh->sh_type; sect[i].flags = sh->sh_flags;
+    }
+
+  }
+
+  for (i = 0; i < shnum; i++) {
+
+    u64 name = sect[shstrndx].off + sect[i].name;
+
+    if (name + sizeof(AS_CFG_SECTION) > size ||
+        memcmp(map + name, AS_CFG_SECTION, sizeof(AS_CFG_SECTION))) continue;
+
+    if (sect[i].off + sect[i].size > size) break;
+
+    cfg_off  = sect[i].off;
+    cfg_size = sect[i].size;
+    found    = 1;
+    break;
+
+  }
+
+  if (!found) {
+    ck_free(sect);
+    return -1;
+  }
+
+  /* One record per object and section group, possibly with some padding in
+     between. */
+
+  pos = 0;
+
+  while (pos + 16 <= cfg_size) {
+
+    u32* hdr = (u32*)(map + cfg_off + pos);
+    u32  b_len = is64 ? 16 : 8, base = blk_cnt;
+
+    if (!hdr[0]) { pos += 8; continue; }
+
+    if (hdr[0] != AS_CFG_MAGIC ||
+        pos + 16 + (u64)hdr[1] * b_len + (u64)hdr[2] * 8 > cfg_size) {
+      WARNF("Malformed " AS_CFG_SECTION " section, ignoring the rest");
+      break;
+    }
+
+    blk_cnt += hdr[1];
+
+    blk_imm  = ck_realloc(blk_imm, blk_cnt * sizeof(u8*));
+    blk_orig = ck_realloc(blk_orig, blk_cnt * sizeof(u32));
+
+    for (i = 0; i < hdr[1]; i++) {
+
+      u8* ent = map + cfg_off + pos + 16 + i * b_len;
+      u64 addr;
+      u32 s;
+
+      if (is64) {
+        memcpy(&addr, ent, 8);
+        memcpy(&blk_orig[base + i], ent + 8, 4);
+      } else {
+        u32 a32;
+        memcpy(&a32, ent, 4);
+        memcpy(&blk_orig[base + i], ent + 4, 4);
+        addr = a32;
+      }
+
+      blk_imm[base + i] = NULL;
+
+      if (!addr) continue;
+
+      for (s = 0; s < shnum; s++)
+        if ((sect[s].flags & SHF_EXECINSTR) && sect[s].type != SHT_NOBITS &&
+            addr >= sect[s].addr && addr - sect[s].addr < sect[s].size) break;
+
+      if (s < shnum)
+        blk_imm[base + i] = find_imm(map, size, sect[s].off + addr -
+                                     sect[s].addr, blk_orig[base + i]);
+
+      if (!blk_imm[base + i]) stale++;
+
+    }
+
+    pos += 16 + hdr[1] * b_len;
+
+    *edges = ck_realloc(*edges, (edge_cnt + hdr[2]) * sizeof(struct cfg_edge));
+
+    for (i = 0; i < hdr[2]; i++, pos += 8) {
+
+      u32* e = (u32*)(map + cfg_off + pos);
+
+      if (e[0] >= hdr[1] || e[1] >= hdr[1]) continue;
+
+      (*edges)[edge_cnt].src   = base + e[0];
+      (*edges)[edge_cnt++].dst = base + e[1];
+
+    }
+
+  }
+
+  ck_free(sect);
+  return stale;
+
+}
+
+
+/* Compute the map slots that the known edges of block b would land in with
+   key k, given the neighbours solved so far. Returns the number of those
+   that collide with each other or with slots already taken. */
+
+static u32 key_cost(u32 b, u32 k, u32* idx, u32* idx_cnt) {
+
+  u32 i, j, n = 0, cost = 0;
+
+  for (i = in_off[b]; i < in_off[b + 1]; i++) {
+
+    u32 a = in_src[i];
+
+    if (a == b) idx[n++] = k ^ (k >> 1);
+    else if (blk_done[a]) idx[n++] = k ^ (blk_key[a] >> 1);
+
+  }
+
+  for (i = out_off[b]; i < out_off[b + 1]; i++) {
+
+    u32 c = out_dst[i];
+
+    if (c != b && blk_done[c]) idx[n++] = blk_key[c] ^ (k >> 1);
+
+  }
+
+  for (i = 0; i < n; i++) {
+
+    if (map_used[idx[i]]) { cost++; continue; }
+
+    for (j = 0; j < i; j++)
+      if (idx[j] == idx[i]) { cost++; break; }
+
+  }
+
+  *idx_cnt = n;
+  return cost;
+
+}
+
+
+/* Pick keys for all blocks, one at a time, so that every known edge gets a
+   slot of its own: cur ^ (prev >> 1), as computed by the afl-as runtime.
+   Blocks with a single solved predecessor simply take a free slot (the
+   Fsingle case); the rest try random keys and keep the best one. Returns the
+   number of edges that ended up colliding. */
+
+static u32 assign_keys(void) {
+
+  u32 *idx = ck_alloc((edge_cnt * 2 + 1) * sizeof(u32));
+  u32 b, i, coll = 0;
+
+  for (b = 0; b < blk_cnt; b++) {
+
+    u32 n, cost, best_k = 0, best_cost = 0xffffffff, t;
+
+    if (!blk_imm[b]) continue;
+
+    /* Fsingle: the only constraint is one edge from a solved block. */
+
+    if (in_off[b + 1] - in_off[b] == 1 && out_off[b + 1] == out_off[b] &&
+        in_src[in_off[b]] != b && blk_done[in_src[in_off[b]]]) {
+
+      u32 start = random() & map_mask, s = start;
+
+      while (map_used[s] && (s = (s + 1) & map_mask) != start);
+
+      best_k = s ^ (blk_key[in_src[in_off[b]]] >> 1);
+
+    } else {
+
+      for (t = 0; t < AS_SOLVE_TRIES && best_cost; t++) {
+
+        u32 k = random() & map_mask;
+
+        cost = key_cost(b, k, idx, &n);
+
+        if (cost < best_cost) {
+          best_cost = cost;
+          best_k    = k;
+        }
+
+      }
+
+    }
+
+    key_cost(b, best_k, idx, &n);
+
+    for (i = 0; i < n; i++) {
+      if (map_used[idx[i]]) coll++;
+      map_used[idx[i]] = 1;
+    }
+
+    blk_key[b]  = best_k;
+    blk_done[b] = 1;
+
+  }
+
+  ck_free(idx);
+  return coll;
+
+}
+
+
+/* Solve the IDs of the freshly linked file fn and patch them in. */
+
+static void solve_ids(u8* fn) {
+
+  struct cfg_edge* edges = NULL;
+  struct stat st;
+  u8* map;
+  u32* fill;
+  s32 fd, stale;
+  u32 i, j, live = 0, entries = 0, coll, map_pow2;
+
+  fd = open(fn, O_RDWR);
+  if (fd < 0) PFATAL("Unable to open '%s'", fn);
+
+  if (fstat(fd, &st) || st.st_size < sizeof(Elf32_Ehdr)) {
+    close(fd);
+    return;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) PFATAL("Unable to mmap '%s'", fn);
+
+  close(fd);
+
+  if (memcmp(map, ELFMAG, SELFMAG) || ((Elf32_Ehdr*)map)->e_type == ET_REL) {
+    munmap(map, st.st_size);
+    return;
+  }
+
+  stale = read_cfg(map, st.st_size, &edges);
+
+  if (stale < 0) {
+    if (!be_quiet) WARNF("No " AS_CFG_SECTION " section in '%s', leaving "
+                         "IDs alone (built without AFL_SOLVE_IDS?)", fn);
+    munmap(map, st.st_size);
+    return;
+  }
+
+  if (stale && !be_quiet)
+    WARNF("%d trampolines in '%s' don't match " AS_CFG_SECTION
+          " (solved already?)", stale, fn);
+
+  /* Drop duplicates and edges into dead code. */
+
+  qsort(edges, edge_cnt, sizeof(struct cfg_edge), edge_cmp);
+
+  for (i = j = 0; i < edge_cnt; i++) {
+
+    if (!blk_imm[edges[i].src] || !blk_imm[edges[i].dst]) continue;
+    if (j && !edge_cmp(&edges[i], &edges[j - 1])) continue;
+
+    edges[j++] = edges[i];
+
+  }
+
+  edge_cnt = j;
+
+  in_off  = ck_alloc((blk_cnt + 1) * sizeof(u32));
+  out_off = ck_alloc((blk_cnt + 1) * sizeof(u32));
+  in_src  = ck_alloc((edge_cnt + 1) * sizeof(u32));
+  out_dst = ck_alloc((edge_cnt + 1) * sizeof(u32));
+
+  for (i = 0; i < edge_cnt; i++) {
+    in_off[edges[i].dst + 1]++;
+    out_off[edges[i].src + 1]++;
+  }
+
+  for (i = 0; i < blk_cnt; i++) {
+
+    in_off[i + 1]  += in_off[i];
+    out_off[i + 1] += out_off[i];
+
+    if (!blk_imm[i]) continue;
+
+    live++;
+
+    /* Function entries get edges we can't see; leave room for one each. */
+
+    if (in_off[i + 1] == in_off[i]) entries++;
+
+  }
+
+  /* edges[] is sorted by source, so out_dst[] is just the destinations in
+     order; in_src[] needs a fill cursor per block. */
+
+  fill = ck_alloc((blk_cnt + 1) * sizeof(u32));
+  memcpy(fill, in_off, blk_cnt * sizeof(u32));
+
+  for (i = 0; i < edge_cnt; i++) {
+    out_dst[i] = edges[i].dst;
+    in_src[fill[edges[i].dst]++] = edges[i].src;
+  }
+
+  ck_free(fill);
+
+  /* Same rule as the LTO mode: the smallest map that keeps the load under
+     1 / LTO_MAP_LOAD_DIV, if everything in the program was solved here. */
+
+  for (map_pow2 = LTO_MAP_SIZE_POW2_MIN; map_pow2 < MAP_SIZE_POW2; map_pow2++)
+    if ((1ULL << map_pow2) >= (u64)(edge_cnt + entries) * LTO_MAP_LOAD_DIV)
+      break;
+
+  map_mask = (1 << map_pow2) - 1;
+  map_used = ck_alloc(map_mask + 1);
+  blk_key  = ck_alloc((blk_cnt + 1) * sizeof(u32));
+  blk_done = ck_alloc(blk_cnt + 1);
+
+  srandom(AS_CFG_MAGIC ^ blk_cnt ^ (edge_cnt << 16));
+
+  coll = assign_keys();
+
+  for (i = 0; i < blk_cnt; i++)
+    if (blk_imm[i]) memcpy(blk_imm[i], &blk_key[i], 4);
+
+  if (msync(map, st.st_size, MS_SYNC)) PFATAL("msync() failed");
+  munmap(map, st.st_size);
+
+  if (!be_quiet) {
+
+    OKF("Solved IDs for %u blocks and %u edges in '%s', %u collision%s.",
+        live, edge_cnt, fn, coll, coll == 1 ? "" : "s");
+
+    if (map_pow2 < MAP_SIZE_POW2)
+      OKF("All of it fits in %u bytes; run afl-fuzz with AFL_MAP_SIZE=%u if "
+          "nothing else in the target is instrumented.", map_mask + 1,
+          map_mask + 1);
+
+  }
+
+  ck_free(edges);
+
+}
+
+
+/* Run the real compiler as a child, and solve the IDs in its output when
+   it's done linking. */
+
+static void link_and_solve(void) {
+
+  struct stat st;
+  s32 pid;
+  int status;
+  u8  had_out = !stat(out_file, &st);
+  struct timespec old_mtime = st.st_mtim;
+
+  pid = fork();
+
+  if (pid < 0) PFATAL("fork() failed");
+
+  if (!pid) {
+
+    execvp(cc_params[0], (char**)cc_params);
+    FATAL("Oops, failed to execute '%s' - check your PATH", cc_params[0]);
+
+  }
+
+  if (waitpid(pid, &status, 0) <= 0) PFATAL("waitpid() failed");
+
+  if (!WIFEXITED(status)) exit(1);
+  if (WEXITSTATUS(status)) exit(WEXITSTATUS(status));
+
+  /* Things like --version don't link anything. */
+
+  if (stat(out_file, &st) || !S_ISREG(st.st_mode) ||
+      (had_out && st.st_mtim.tv_sec == old_mtime.tv_sec &&
+       st.st_mtim.tv_nsec == old_mtime.tv_nsec)) exit(0);
+
+  solve_ids(out_file);
+
+  exit(0);
+
+}
+
+#endif /* !__APPLE__ */
+
+
 /* Main entry point */
 
 int main(int argc, char** argv) {
@@ -337,6 +838,13 @@ int main(int argc, char** argv) {
 
   edit_params(argc, argv);
 
+#ifndef __APPLE__
+
+  if (link_mode && getenv("AFL_SOLVE_IDS") && strcmp(out_file, "-"))
+    link_and_solve();
+
+#endif /* !__APPLE__ */
+
   execvp(cc_params[0], (char**)cc_params);
 
   FATAL("Oops, failed to execute '%s' - check your PATH", cc_params[0]);
@@ -26,16 +26,26 @@
 
    Exit code is 2 if the target program crashes; 1 if it times out or
    there is a problem executing it; or 0 if execution is successful.
+
+   With -i, all the files in a directory are run through one or more fork
+   servers instead (see run_batch()), and the traces go to a single binary
+   file.
 */
 
 #define AFL_MAIN
 #include "android-ashmem.h"
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "config.h"
 #include "types.h"
 #include "debug.h"
 #include "alloc-inl.h"
 #include "hash.h"
+#include "bitmap-inl.h"
+#include "fsrv-inl.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -59,12 +69,17 @@ static s32 child_pid;                 /* PID of the tested program         */
 static u8* trace_bits;                /* SHM with instrumentation bitmap   */
 
 static u8 *out_file,                  /* Trace output file                 */
+          *in_dir,                    /* Input directory (batch mode)      */
           *doc_path,                  /* Path to docs                      */
           *target_path,               /* Path to target binary             */
           *at_file;                   /* Substitution string for @@        */
 
 static u32 exec_tmout;                /* Exec timeout (ms)                 */
 
+static u32 job_cnt = 1;               /* Fork servers to use with -i       */
+
+static u32 map_size = MAP_SIZE;       /* Bitmap bytes used by the target   */
+
 static u64 mem_limit = MEM_LIMIT;     /* Memory limit (MB)                 */
 
 static s32 shm_id;                    /* ID of the SHM region              */
@@ -113,10 +128,15 @@ static const u8 count_class_binary[256] = {
 
 static void classify_counts(u8* mem, const u8* map) {
 
-  u32 i = MAP_SIZE;
+  u32 i = map_size;
 
   if (edges_only) {
 
+    if (bm_edges_only) {
+      bm_edges_only(mem, map_size);
+      return;
+    }
+
     while (i--) {
       if (*mem) *mem = 1;
       mem++;
@@ -124,6 +144,11 @@ static void classify_counts(u8* mem, const u8* map) {
 
   } else {
 
+    if (map == count_class_binary && bm_classify) {
+      bm_classify(mem, NULL, map_size, NULL, 0);
+      return;
+    }
+
     while (i--) {
       *mem = map[*mem];
       mem++;
@@ -167,15 +192,11 @@ static void setup_shm(void) {
 
 }
 
-/* Write results. */
+/* Open the output file. */
 
-static u32 write_results(void) {
+static s32 open_out_file(void) {
 
   s32 fd;
-  u32 i, ret = 0;
-
-  u8  cco = !!getenv("AFL_CMIN_CRASHES_ONLY"),
-      caa = !!getenv("AFL_CMIN_ALLOW_ANY");
 
   if (!strncmp(out_file, "/dev/", 5)) {
 
@@ -195,10 +216,25 @@ static u32 write_results(void) {
 
   }
 
+  return fd;
+
+}
+
+
+/* Write results. */
+
+static u32 write_results(void) {
+
+  s32 fd = open_out_file();
+  u32 i, ret = 0;
+
+  u8  cco = !!getenv("AFL_CMIN_CRASHES_ONLY"),
+      caa = !!getenv("AFL_CMIN_ALLOW_ANY");
+
 
   if (binary_mode) {
 
-    for (i = 0; i < MAP_SIZE; i++)
+    for (i = 0; i < map_size; i++)
       if (trace_bits[i]) ret++;
     
     ck_write(fd, trace_bits, MAP_SIZE, out_file);
@@ -210,7 +246,7 @@ static u32 write_results(void) {
 
     if (!f) PFATAL("fdopen() failed");
 
-    for (i = 0; i < MAP_SIZE; i++) {
+    for (i = 0; i < map_size; i++) {
 
       if (!trace_bits[i]) continue;
       ret++;
@@ -367,6 +403,7 @@ static void handle_stop_sig(int sig) {
   stop_soon = 1;
 
   if (child_pid > 0) kill(child_pid, SIGKILL);
+  fsrv_kill_all();
 
 }
 
@@ -391,6 +428,13 @@ static void set_up_environment(void) {
     setenv("DYLD_INSERT_LIBRARIES", getenv("AFL_PRELOAD"), 1);
   }
 
+  /* In the one-shot mode, the target runs without a fork server and has no
+     way to tell us how much of the map it uses; let the user do it instead.
+     With -i, this is only the default for targets whose fork server hello
+     doesn't carry a map size (see run_batch()). */
+
+  map_size = bm_env_map_size(map_size);
+
 }
 
 
@@ -465,6 +509,210 @@ static void detect_file_args(char** argv) {
 }
 
 
+/* Batch mode (-i). Every regular file in in_dir is run through one of
+   job_cnt fork servers, each with its own input file and, if there's more
+   than one, pinned to its own core. The output is a single binary file:
+
+     u32 BATCH_MAGIC, map size, flags (BATCH_EDGES, BATCH_BINARY)
+
+   followed by one record per input, in no particular order:
+
+     u32 name length, tuple count, outcome (FSRV_*);
+     the file name (relative to in_dir, not NUL-terminated);
+     one u32 per tuple: (map index << 8) | classified hit count
+
+   The hit counts use the same classes as the text output (or the -b ones),
+   so the records carry exactly what the text output for that file would
+   have had. */
+
+#define BATCH_MAGIC  0x4d534641       /* "AFSM"                            */
+#define BATCH_EDGES  1                /* Made with -e                      */
+#define BATCH_BINARY 2                /* Made with -b                      */
+
+#if MAP_SIZE_POW2 > 24
+#  error "Batch mode records can't hold map indices this large."
+#endif /* MAP_SIZE_POW2 > 24 */
+
+/* Read one input and start it on the given server. Returns 0 if the file
+   couldn't be read. */
+
+static u8 batch_start(struct fsrv* f, u8* fn) {
+
+  struct stat st;
+  u8* mem;
+  s32 fd = open(fn, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st)) {
+    WARNF("Unable to read '%s', skipping.", fn);
+    if (fd >= 0) close(fd);
+    return 0;
+  }
+
+  mem = ck_alloc_nozero(st.st_size);
+  ck_read(fd, mem, st.st_size, fn);
+  close(fd);
+
+  fsrv_write(f, mem, st.st_size);
+  ck_free(mem);
+
+  fsrv_go(f);
+  return 1;
+
+}
+
+
+/* Store the record for the input that just finished on f. */
+
+static void batch_record(FILE* out, struct fsrv* f, u8* name, u32* tuples) {
+
+  u32 hdr[3], i, cnt = 0;
+
+  classify_counts(f->trace_bits, binary_mode ?
+                  count_class_binary : count_class_human);
+
+  for (i = 0; i < map_size; i++)
+    if (f->trace_bits[i]) tuples[cnt++] = (i << 8) | f->trace_bits[i];
+
+  hdr[0] = strlen(name);
+  hdr[1] = cnt;
+  hdr[2] = fsrv_fault(f);
+
+  if (fwrite(hdr, sizeof(hdr), 1, out) != 1 ||
+      fwrite(name, hdr[0], 1, out) != 1 ||
+      (cnt && fwrite(tuples, sizeof(u32) * cnt, 1, out) != 1))
+    PFATAL("Short write to '%s'", out_file);
+
+}
+
+
+/* Run the whole directory. */
+
+static void run_batch(char** argv) {
+
+  struct fsrv** fs = ck_alloc(sizeof(struct fsrv*) * job_cnt);
+  struct dirent** nl;
+  u32 *cur = ck_alloc(sizeof(u32) * job_cnt), *tuples;
+  u32 hdr[3], i, next = 0, busy = 0, done = 0, crashes = 0, tmouts = 0;
+  s32 nl_cnt, cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  u8* use_dir = ".";
+  FILE* out;
+
+  nl_cnt = scandir(in_dir, &nl, NULL, alphasort);
+  if (nl_cnt < 0) PFATAL("Unable to open '%s'", in_dir);
+
+  if (access(use_dir, R_OK | W_OK | X_OK)) {
+
+    use_dir = getenv("TMPDIR");
+    if (!use_dir) use_dir = "/tmp";
+
+  }
+
+  if (job_cnt > nl_cnt) job_cnt = nl_cnt ? nl_cnt : 1;
+
+  if (!quiet_mode)
+    ACTF("Spinning up %u fork server%s...", job_cnt, job_cnt == 1 ? "" : "s");
+
+  for (i = 0; i < job_cnt; i++) {
+
+    struct fsrv* f = fs[i] = ck_alloc(sizeof(struct fsrv));
+    u8 found = 0;
+
+    fsrv_init(f);
+
+    f->target_path = target_path;
+    f->out_file    = alloc_printf("%s/.afl-showmap-temp-%u-%u", use_dir,
+                                  getpid(), i);
+    f->argv        = fsrv_subst_argv(argv, f->out_file, &found);
+    f->use_stdin   = !found;
+    f->quiet       = 1;
+    f->keep_cores  = keep_cores;
+    f->mem_limit   = mem_limit;
+    f->exec_tmout  = exec_tmout;
+    f->map_size    = map_size;
+
+    if (job_cnt > 1 && cpus > 0 && !getenv("AFL_NO_AFFINITY"))
+      f->cpu = i % cpus;
+
+    fsrv_start(f);
+
+  }
+
+  map_size = fs[0]->map_size;
+  tuples   = ck_alloc(sizeof(u32) * map_size);
+
+  out = fdopen(open_out_file(), "w");
+  if (!out) PFATAL("fdopen() failed");
+
+  hdr[0] = BATCH_MAGIC;
+  hdr[1] = map_size;
+  hdr[2] = (edges_only ? BATCH_EDGES : 0) | (binary_mode ? BATCH_BINARY : 0);
+
+  if (fwrite(hdr, sizeof(hdr), 1, out) != 1)
+    PFATAL("Short write to '%s'", out_file);
+
+  /* Keep every server busy until we run out of files. */
+
+  while (1) {
+
+    for (i = 0; i < job_cnt && !stop_soon; i++) {
+
+      while (!fs[i]->running && next < nl_cnt) {
+
+        u8* fn = alloc_printf("%s/%s", in_dir, nl[next]->d_name);
+        struct stat st;
+
+        if (!lstat(fn, &st) && S_ISREG(st.st_mode) &&
+            batch_start(fs[i], fn)) {
+          cur[i] = next;
+          busy++;
+        }
+
+        ck_free(fn);
+        next++;
+
+      }
+
+    }
+
+    if (!busy) break;
+
+    i = fsrv_wait(fs, job_cnt);
+    busy--;
+
+    if (stop_soon) continue;
+
+    batch_record(out, fs[i], nl[cur[i]]->d_name, tuples);
+
+    switch (fsrv_fault(fs[i])) {
+      case FSRV_CRASH: crashes++; break;
+      case FSRV_TMOUT: tmouts++; break;
+    }
+
+    done++;
+
+  }
+
+  if (fclose(out)) PFATAL("Unable to write '%s'", out_file);
+
+  if (stop_soon) {
+    SAYF(cLRD "\n+++ Aborted by user +++\n" cRST);
+    exit(1);
+  }
+
+  if (!quiet_mode)
+    OKF("Processed %u input%s (%u crash%s, %u timeout%s) into '%s'." cRST,
+        done, done == 1 ? "" : "s", crashes, crashes == 1 ? "" : "es",
+        tmouts, tmouts == 1 ? "" : "s", out_file);
+
+  for (i = 0; i < nl_cnt; i++) free(nl[i]); /* not tracked */
+  free(nl);
+
+  ck_free(tuples);
+  ck_free(cur);
+
+}
+
+
 /* Show banner. */
 
 static void show_banner(void) {
@@ -485,6 +733,11 @@ static void usage(u8* argv0) {
 
        "  -o file       - file to write the trace data to\n\n"
 
+       "Batch mode:\n\n"
+
+       "  -i dir        - run every file in dir, write binary records to -o\n"
+       "  -j count      - number of fork servers to spread the work over\n\n"
+
        "Execution control settings:\n\n"
 
        "  -t msec       - timeout for each run (none)\n"
@@ -635,10 +888,25 @@ int main(int argc, char** argv) {
 
   doc_path = access(DOC_PATH, F_OK) ? "docs" : DOC_PATH;
 
-  while ((opt = getopt(argc,argv,"+o:m:t:A:eqZQbcV")) > 0)
+  while ((opt = getopt(argc,argv,"+i:j:o:m:t:A:eqZQbcV")) > 0)
 
     switch (opt) {
 
+      case 'i':
+
+        if (in_dir) FATAL("Multiple -i options not supported");
+        in_dir = optarg;
+        break;
+
+      case 'j':
+
+        job_cnt = atoi(optarg);
+
+        if (job_cnt < 1 || job_cnt > FSRV_MAX)
+          FATAL("Value of -j must be between 1 and %u", FSRV_MAX);
+
+        break;
+
       case 'o':
 
         if (out_file) FATAL("Multiple -o options not supported");
@@ -759,7 +1027,11 @@ int main(int argc, char** argv) {
 
   if (optind == argc || !out_file) usage(argv[0]);
 
-  setup_shm();
+  if (in_dir && (cmin_mode || at_file))
+    FATAL("-i and -Z / -A are mutually exclusive");
+
+  if (!in_dir) setup_shm();
+  init_bitmap_ops();
   setup_signal_handlers();
 
   set_up_environment();
@@ -771,13 +1043,18 @@ int main(int argc, char** argv) {
     ACTF("Executing '%s'...\n", target_path);
   }
 
-  detect_file_args(argv + optind);
+  if (!in_dir) detect_file_args(argv + optind);
 
   if (qemu_mode)
     use_argv = get_qemu_argv(argv[0], argv + optind, argc - optind);
   else
     use_argv = argv + optind;
 
+  if (in_dir) {
+    run_batch(use_argv);
+    exit(0);
+  }
+
   run_target(use_argv);
 
   tcnt = write_results();
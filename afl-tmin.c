@@ -24,16 +24,25 @@
    as much data as possible while keeping the binary in a crashing state
    *or* producing consistent instrumentation output (the mode is auto-selected
    based on the initially observed behavior).
+
+   With -j, the candidates of each stage are run speculatively on several
+   fork servers at once (see find_first()).
 */
 
 #define AFL_MAIN
 #include "android-ashmem.h"
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "config.h"
 #include "types.h"
 #include "debug.h"
 #include "alloc-inl.h"
 #include "hash.h"
+#include "bitmap-inl.h"
+#include "fsrv-inl.h"
 
 #include <stdio.h>
 #include <unistd.h>
@@ -63,7 +72,10 @@ static u8 *in_file,                   /* Minimizer input test case         */
           *target_path,               /* Path to target binary             */
           *doc_path;                  /* Path to docs                      */
 
-static u8* in_data;                   /* Input data for trimming           */
+static u8 *in_data,                   /* Input data for trimming           */
+          *cand_buf;                  /* Candidate being tried             */
+
+static struct fsrv** fs;              /* Fork servers (-j), or NULL        */
 
 static u32 in_len,                    /* Input data length                 */
            orig_cksum,                /* Original checksum                 */
@@ -71,8 +83,13 @@ static u32 in_len,                    /* Input data length                 */
            missed_hangs,              /* Misses due to hangs               */
            missed_crashes,            /* Misses due to crashes             */
            missed_paths,              /* Misses due to exec path diffs     */
+           wasted_execs,              /* Speculative runs thrown away      */
+           job_cnt,                   /* Number of fork servers (-j)       */
+           spec_width = 1,            /* Runs to keep in flight            */
            exec_tmout = EXEC_TIMEOUT; /* Exec timeout (ms)                 */
 
+static u32 map_size = MAP_SIZE;       /* Bitmap bytes used by the target   */
+
 static u64 mem_limit = MEM_LIMIT;     /* Memory limit (MB)                 */
 
 static s32 shm_id,                    /* ID of the SHM region              */
@@ -107,10 +124,15 @@ static const u8 count_class_lookup[256] = {
 
 static void classify_counts(u8* mem) {
 
-  u32 i = MAP_SIZE;
+  u32 i = map_size;
 
   if (edges_only) {
 
+    if (bm_edges_only) {
+      bm_edges_only(mem, map_size);
+      return;
+    }
+
     while (i--) {
       if (*mem) *mem = 1;
       mem++;
@@ -118,6 +140,11 @@ static void classify_counts(u8* mem) {
 
   } else {
 
+    if (bm_classify) {
+      bm_classify(mem, NULL, map_size, NULL, 0);
+      return;
+    }
+
     while (i--) {
       *mem = count_class_lookup[*mem];
       mem++;
@@ -132,7 +159,7 @@ static void classify_counts(u8* mem) {
 
 static void apply_mask(u32* mem, u32* mask) {
 
-  u32 i = (MAP_SIZE >> 2);
+  u32 i = (map_size >> 2);
 
   if (!mask) return;
 
@@ -152,7 +179,7 @@ static void apply_mask(u32* mem, u32* mask) {
 static inline u8 anything_set(void) {
 
   u32* ptr = (u32*)trace_bits;
-  u32  i   = (MAP_SIZE >> 2);
+  u32  i   = (map_size >> 2);
 
   while (i--) if (*(ptr++)) return 1;
 
@@ -255,6 +282,8 @@ static void handle_timeout(int sig) {
 }
 
 
+static u8 check_result(u8* trace, s32 status, u8 timed_out, u8 first_run);
+
 /* Execute target application. Returns 0 if the changes are a dud, or
    1 if they should be kept. */
 
@@ -264,9 +293,8 @@ static u8 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
   int status = 0;
 
   s32 prog_in_fd;
-  u32 cksum;
 
-  memset(trace_bits, 0, MAP_SIZE);
+  memset(trace_bits, 0, map_size);
   MEM_BARRIER();
 
   prog_in_fd = write_to_file(prog_in, mem, len);
@@ -339,26 +367,45 @@ static u8 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
 
   MEM_BARRIER();
 
-  /* Clean up bitmap, analyze exit condition, etc. */
-
   if (*(u32*)trace_bits == EXEC_FAIL_SIG)
     FATAL("Unable to execute '%s'", argv[0]);
 
-  classify_counts(trace_bits);
-  apply_mask((u32*)trace_bits, (u32*)mask_bitmap);
-  total_execs++;
+  return check_result(trace_bits, status, child_timed_out, first_run);
 
-  if (stop_soon) {
+}
 
-    SAYF(cRST cLRD "\n+++ Minimization aborted by user +++\n" cRST);
-    close(write_to_file(out_file, in_data, in_len));
-    exit(1);
 
-  }
+/* Bail out if Ctrl-C was pressed, saving what we have so far. */
+
+static void check_stop(void) {
+
+  if (!stop_soon) return;
+
+  SAYF(cRST cLRD "\n+++ Minimization aborted by user +++\n" cRST);
+  close(write_to_file(out_file, in_data, in_len));
+  exit(1);
+
+}
+
+
+/* Look at the outcome of a run, with the trace in trace[]. Returns 0 if the
+   changes are a dud, or 1 if they should be kept. */
+
+static u8 check_result(u8* trace, s32 status, u8 timed_out, u8 first_run) {
+
+  u32 cksum;
+
+  /* Clean up bitmap, analyze exit condition, etc. */
+
+  classify_counts(trace);
+  apply_mask((u32*)trace, (u32*)mask_bitmap);
+  total_execs++;
+
+  check_stop();
 
   /* Always discard inputs that time out. */
 
-  if (child_timed_out) {
+  if (timed_out) {
 
     missed_hangs++;
     return 0;
@@ -395,7 +442,7 @@ static u8 run_target(char** argv, u8* mem, u32 len, u8 first_run) {
 
   }
 
-  cksum = hash32(trace_bits, MAP_SIZE, HASH_CONST);
+  cksum = hash32(trace, map_size, HASH_CONST);
 
   if (first_run) orig_cksum = cksum;
 
@@ -418,56 +465,295 @@ static u32 next_p2(u32 val) {
 }
 
 
-/* Actually minimize! */
+/* Candidate generators for find_first(). Each one puts the k-th candidate of
+   its stage, counting from wherever the stage is at, in *buf and *len. */
 
-static void minimize(char** argv) {
+#define CAND_RUN    0                 /* Candidate ready to go             */
+#define CAND_SKIP   1                 /* Would be a no-op, move on         */
+#define CAND_END    2                 /* No more candidates                */
 
-  static u32 alpha_map[256];
+typedef u8 (*cand_fn)(u32 k, u8** buf, u32* len);
 
-  u8* tmp_buf = ck_alloc_nozero(in_len);
-  u32 orig_len = in_len, stage_o_len;
 
-  u32 del_len, set_len, del_pos, set_pos, i, alpha_size, cur_pass = 0;
-  u32 syms_removed, alpha_del0 = 0, alpha_del1, alpha_del2, alpha_d_total = 0;
-  u8  changed_any, prev_del;
+/* Try the candidates in order and return the index of the first one that
+   should be kept (with the candidate itself in *buf and *len), or -1 if
+   there is none.
 
-  /***********************
-   * BLOCK NORMALIZATION *
-   ***********************/
+   With -j, up to job_cnt candidates are in flight at any time, on the
+   assumption that all the earlier ones will fail. Once one succeeds,
+   whatever was started after it is stale and gets killed, but earlier ones
+   still have to finish - so the outcome is the same as trying them one by
+   one.
 
-  set_len    = next_p2(in_len / TMIN_SET_STEPS);
-  set_pos    = 0;
+   Since everything in flight past a success is wasted, the number of runs
+   in flight grows by one with every failure and is halved on success. */
 
-  if (set_len < TMIN_SET_MIN_SIZE) set_len = TMIN_SET_MIN_SIZE;
+static s32 find_first(char** argv, cand_fn make, u8** buf, u32* len) {
 
-  ACTF(cBRI "Stage #0: " cRST "One-time block normalization...");
+  u32 cand[FSRV_MAX], next = 0, busy = 0, i, j;
+  s32 best = -1;
+  u8  at_end = 0;
 
-  while (set_pos < in_len) {
+  if (!job_cnt) {
 
-    u8  res;
-    u32 use_len = MIN(set_len, in_len - set_pos);
+    while (1) {
 
-    for (i = 0; i < use_len; i++)
-      if (in_data[set_pos + i] != '0') break;
+      switch (make(next, buf, len)) {
 
-    if (i != use_len) {
+        case CAND_END: return -1;
 
-      memcpy(tmp_buf, in_data, in_len);
-      memset(tmp_buf + set_pos, '0', use_len);
-  
-      res = run_target(argv, tmp_buf, in_len, 0);
+        case CAND_RUN:
+          if (run_target(argv, *buf, *len, 0)) return next;
+
+      }
 
-      if (res) {
+      next++;
 
-        memset(in_data + set_pos, '0', use_len);
-        changed_any = 1;
-        alpha_del0 += use_len;
+    }
+
+  }
+
+  while (1) {
+
+    /* Keep the servers busy until there's a winner. */
+
+    for (i = 0; i < job_cnt && !at_end && best < 0 && !stop_soon; i++) {
+
+      u8 res;
+
+      if (busy >= spec_width) break;
+      if (fs[i]->running) continue;
 
+      while ((res = make(next, buf, len)) == CAND_SKIP) next++;
+
+      if (res == CAND_END) {
+        at_end = 1;
+        break;
       }
 
+      fsrv_write(fs[i], *buf, *len);
+      fsrv_go(fs[i]);
+
+      cand[i] = next++;
+      busy++;
+
     }
 
-    set_pos += set_len;
+    if (!busy) break;
+
+    i = fsrv_wait(fs, job_cnt);
+    busy--;
+
+    check_stop();
+
+    if (best >= 0 && cand[i] > best) {
+
+      total_execs++;
+      wasted_execs++;
+      continue;
+
+    }
+
+    if (!check_result(fs[i]->trace_bits, fs[i]->status, fs[i]->timed_out, 0)) {
+
+      if (spec_width < job_cnt) spec_width++;
+      continue;
+
+    }
+
+    best = cand[i];
+
+    if (spec_width > 1) spec_width /= 2;
+
+    for (j = 0; j < job_cnt; j++)
+      if (fs[j]->running && cand[j] > best && !fs[j]->timed_out) {
+        kill(fs[j]->child_pid, SIGKILL);
+        fs[j]->timed_out = 1;
+      }
+
+  }
+
+  /* The generators only look at the current state, so this gets us the
+     same candidate again. */
+
+  if (best >= 0) make(best, buf, len);
+
+  return best;
+
+}
+
+
+/* Stage #0: replace a block with '0's. */
+
+static u32 set_pos, set_len;
+
+static u8 cand_norm(u32 k, u8** buf, u32* len) {
+
+  u32 pos = set_pos + k * set_len, use_len, i;
+
+  if (pos >= in_len) return CAND_END;
+
+  use_len = MIN(set_len, in_len - pos);
+
+  for (i = 0; i < use_len; i++)
+    if (in_data[pos + i] != '0') break;
+
+  if (i == use_len) return CAND_SKIP;
+
+  memcpy(cand_buf, in_data, in_len);
+  memset(cand_buf + pos, '0', use_len);
+
+  *buf = cand_buf;
+  *len = in_len;
+  return CAND_RUN;
+
+}
+
+
+/* Stage #1, first part: cut off the tail. The probes split [trunc_lo,
+   trunc_hi) evenly, so that every round narrows down the range by a factor
+   of trunc_cnt + 1. */
+
+static u32 trunc_lo, trunc_hi, trunc_cnt;
+
+static u32 trunc_len(u32 k) {
+
+  return trunc_lo + (u64)(trunc_hi - trunc_lo) * (k + 1) / (trunc_cnt + 1);
+
+}
+
+static u8 cand_trunc(u32 k, u8** buf, u32* len) {
+
+  if (k >= trunc_cnt) return CAND_END;
+
+  *buf = in_data;
+  *len = trunc_len(k);
+  return CAND_RUN;
+
+}
+
+
+/* Stage #1, second part: remove a block. */
+
+static u32 del_pos, del_len;
+static u8  prev_del;
+
+static u8 cand_del(u32 k, u8** buf, u32* len) {
+
+  u32 pos = del_pos + k * del_len;
+  s32 tail_len;
+
+  if (pos >= in_len) return CAND_END;
+
+  tail_len = in_len - pos - del_len;
+  if (tail_len < 0) tail_len = 0;
+
+  /* If we have processed at least one full block (initially, prev_del == 1),
+     and we did so without deleting the previous one, and we aren't at the
+     very end of the buffer (tail_len > 0), and the current block is the same
+     as the previous one... skip this step as a no-op. Past k == 0, all the
+     earlier candidates are assumed to have failed. */
+
+  if ((k || !prev_del) && tail_len && !memcmp(in_data + pos - del_len,
+      in_data + pos, del_len)) return CAND_SKIP;
+
+  /* Head */
+  memcpy(cand_buf, in_data, pos);
+
+  /* Tail */
+  memcpy(cand_buf + pos, in_data + pos + del_len, tail_len);
+
+  *buf = cand_buf;
+  *len = pos + tail_len;
+  return CAND_RUN;
+
+}
+
+
+/* Stage #2: replace all occurrences of a symbol with '0'. */
+
+static u32 alpha_map[256], sym_pos;
+
+static u8 cand_sym(u32 k, u8** buf, u32* len) {
+
+  u32 i = sym_pos + k, r;
+
+  if (i > 255) return CAND_END;
+
+  if (i == '0' || !alpha_map[i]) return CAND_SKIP;
+
+  memcpy(cand_buf, in_data, in_len);
+
+  for (r = 0; r < in_len; r++)
+    if (cand_buf[r] == i) cand_buf[r] = '0';
+
+  *buf = cand_buf;
+  *len = in_len;
+  return CAND_RUN;
+
+}
+
+
+/* Stage #3: replace a single character with '0'. cand_buf is kept in sync
+   with in_data, other than for the byte changed by the last call. */
+
+static u32 char_pos;
+static s32 char_dirty = -1;
+
+static u8 cand_char(u32 k, u8** buf, u32* len) {
+
+  u32 i = char_pos + k;
+
+  if (char_dirty >= 0) {
+    cand_buf[char_dirty] = in_data[char_dirty];
+    char_dirty = -1;
+  }
+
+  if (i >= in_len) return CAND_END;
+
+  if (in_data[i] == '0') return CAND_SKIP;
+
+  cand_buf[i] = '0';
+  char_dirty  = i;
+
+  *buf = cand_buf;
+  *len = in_len;
+  return CAND_RUN;
+
+}
+
+
+/* Actually minimize! */
+
+static void minimize(char** argv) {
+
+  u32 orig_len = in_len, stage_o_len, len;
+  u32 alpha_size, cur_pass = 0, i;
+  u32 syms_removed, alpha_del0 = 0, alpha_del1, alpha_del2, alpha_d_total = 0;
+  u8  changed_any;
+  s32 k;
+  u8* buf;
+
+  cand_buf = ck_alloc_nozero(in_len);
+
+  /***********************
+   * BLOCK NORMALIZATION *
+   ***********************/
+
+  set_len    = next_p2(in_len / TMIN_SET_STEPS);
+  set_pos    = 0;
+
+  if (set_len < TMIN_SET_MIN_SIZE) set_len = TMIN_SET_MIN_SIZE;
+
+  ACTF(cBRI "Stage #0: " cRST "One-time block normalization...");
+
+  while ((k = find_first(argv, cand_norm, &buf, &len)) >= 0) {
+
+    u32 pos = set_pos + k * set_len, use_len = MIN(set_len, in_len - pos);
+
+    memcpy(in_data, buf, in_len);
+    alpha_del0 += use_len;
+    set_pos = pos + set_len;
 
   }
 
@@ -485,60 +771,65 @@ next_pass:
    * BLOCK DELETION *
    ******************/
 
-  del_len = next_p2(in_len / TRIM_START_STEPS);
   stage_o_len = in_len;
 
   ACTF(cBRI "Stage #1: " cRST "Removing blocks of data...");
 
-next_del_blksize:
+  /* Start by bisecting for the shortest prefix that still does the job;
+     that's just a handful of execs, and trailing junk is common. */
 
-  if (!del_len) del_len = 1;
-  del_pos  = 0;
-  prev_del = 1;
+  SAYF(cGRA "    Truncating the tail, remaining size = %u\n" cRST, in_len);
 
-  SAYF(cGRA "    Block length = %u, remaining size = %u\n" cRST,
-       del_len, in_len);
+  trunc_lo = 0;
+  trunc_hi = in_len;
 
-  while (del_pos < in_len) {
+  while (trunc_lo < trunc_hi) {
 
-    u8  res;
-    s32 tail_len;
+    trunc_cnt = MIN(job_cnt ? job_cnt : 1, trunc_hi - trunc_lo);
 
-    tail_len = in_len - del_pos - del_len;
-    if (tail_len < 0) tail_len = 0;
+    k = find_first(argv, cand_trunc, &buf, &len);
 
-    /* If we have processed at least one full block (initially, prev_del == 1),
-       and we did so without deleting the previous one, and we aren't at the
-       very end of the buffer (tail_len > 0), and the current block is the same
-       as the previous one... skip this step as a no-op. */
+    if (k < 0) {
 
-    if (!prev_del && tail_len && !memcmp(in_data + del_pos - del_len,
-        in_data + del_pos, del_len)) {
+      trunc_lo = trunc_len(trunc_cnt - 1) + 1;
 
-      del_pos += del_len;
-      continue;
+    } else {
+
+      u32 new_lo = k ? trunc_len(k - 1) + 1 : trunc_lo;
+
+      trunc_hi = len;
+      trunc_lo = new_lo;
 
     }
 
-    prev_del = 0;
+  }
+
+  if (trunc_hi < in_len) {
 
-    /* Head */
-    memcpy(tmp_buf, in_data, del_pos);
+    in_len = trunc_hi;
+    changed_any = 1;
 
-    /* Tail */
-    memcpy(tmp_buf + del_pos, in_data + del_pos + del_len, tail_len);
+  }
 
-    res = run_target(argv, tmp_buf, del_pos + tail_len, 0);
+  del_len = next_p2(in_len / TRIM_START_STEPS);
 
-    if (res) {
+next_del_blksize:
 
-      memcpy(in_data, tmp_buf, del_pos + tail_len);
-      prev_del = 1;
-      in_len   = del_pos + tail_len;
+  if (!del_len) del_len = 1;
+  del_pos  = 0;
+  prev_del = 1;
 
-      changed_any = 1;
+  SAYF(cGRA "    Block length = %u, remaining size = %u\n" cRST,
+       del_len, in_len);
+
+  while ((k = find_first(argv, cand_del, &buf, &len)) >= 0) {
 
-    } else del_pos += del_len;
+    memcpy(in_data, buf, len);
+    del_pos += k * del_len;
+    prev_del = 1;
+    in_len   = len;
+
+    changed_any = 1;
 
   }
 
@@ -574,28 +865,16 @@ next_del_blksize:
   ACTF(cBRI "Stage #2: " cRST "Minimizing symbols (%u code point%s)...",
        alpha_size, alpha_size == 1 ? "" : "s");
 
-  for (i = 0; i < 256; i++) {
-
-    u32 r;
-    u8 res;
-
-    if (i == '0' || !alpha_map[i]) continue;
-
-    memcpy(tmp_buf, in_data, in_len);
-
-    for (r = 0; r < in_len; r++)
-      if (tmp_buf[r] == i) tmp_buf[r] = '0'; 
+  sym_pos = 0;
 
-    res = run_target(argv, tmp_buf, in_len, 0);
+  while ((k = find_first(argv, cand_sym, &buf, &len)) >= 0) {
 
-    if (res) {
+    memcpy(in_data, buf, in_len);
+    syms_removed++;
+    alpha_del1 += alpha_map[sym_pos + k];
+    changed_any = 1;
 
-      memcpy(in_data, tmp_buf, in_len);
-      syms_removed++;
-      alpha_del1 += alpha_map[i];
-      changed_any = 1;
-
-    }
+    sym_pos += k + 1;
 
   }
 
@@ -613,24 +892,17 @@ next_del_blksize:
 
   ACTF(cBRI "Stage #3: " cRST "Character minimization...");
 
-  memcpy(tmp_buf, in_data, in_len);
-
-  for (i = 0; i < in_len; i++) {
-
-    u8 res, orig = tmp_buf[i];
-
-    if (orig == '0') continue;
-    tmp_buf[i] = '0';
+  memcpy(cand_buf, in_data, in_len);
+  char_pos   = 0;
+  char_dirty = -1;
 
-    res = run_target(argv, tmp_buf, in_len, 0);
+  while ((k = find_first(argv, cand_char, &buf, &len)) >= 0) {
 
-    if (res) {
+    in_data[char_pos + k] = '0';
+    alpha_del2++;
+    changed_any = 1;
 
-      in_data[i] = '0';
-      alpha_del2++;
-      changed_any = 1;
-
-    } else tmp_buf[i] = orig;
+    char_pos += k + 1;
 
   }
 
@@ -647,15 +919,22 @@ finalize_all:
        cGRA "     File size reduced by : " cRST "%0.02f%% (to %u byte%s)\n"
        cGRA "    Characters simplified : " cRST "%0.02f%%\n"
        cGRA "     Number of execs done : " cRST "%u\n"
-       cGRA "          Fruitless execs : " cRST "path=%u crash=%u hang=%s%u\n\n",
+       cGRA "          Fruitless execs : " cRST "path=%u crash=%u hang=%s%u\n",
        100 - ((double)in_len) * 100 / orig_len, in_len, in_len == 1 ? "" : "s",
        ((double)(alpha_d_total)) * 100 / (in_len ? in_len : 1),
        total_execs, missed_paths, missed_crashes, missed_hangs ? cLRD : "",
        missed_hangs);
 
+  if (job_cnt)
+    SAYF(cGRA "   Speculative execs lost : " cRST "%u\n", wasted_execs);
+
+  SAYF("\n");
+
   if (total_execs > 50 && missed_hangs * 10 > total_execs)
     WARNF(cLRD "Frequent timeouts - results may be skewed." cRST);
 
+  ck_free(cand_buf);
+
 }
 
 
@@ -664,10 +943,18 @@ finalize_all:
 
 static void handle_stop_sig(int sig) {
 
+  u32 i;
+
   stop_soon = 1;
 
   if (child_pid > 0) kill(child_pid, SIGKILL);
 
+  /* Leave the fork servers alone, so that find_first() gets to see the
+     runs finish and can save the output. */
+
+  for (i = 0; fs && i < job_cnt; i++)
+    if (fs[i] && fs[i]->child_pid > 0) kill(fs[i]->child_pid, SIGKILL);
+
 }
 
 
@@ -738,6 +1025,13 @@ static void set_up_environment(void) {
     setenv("DYLD_INSERT_LIBRARIES", getenv("AFL_PRELOAD"), 1);
   }
 
+  /* Without -j, the target runs without a fork server and has no way to
+     tell us how much of the map it uses; let the user do it instead. With
+     -j, this is only the default for targets whose fork server hello
+     doesn't carry a map size. */
+
+  map_size = bm_env_map_size(map_size);
+
 }
 
 
@@ -826,6 +1120,7 @@ static void usage(u8* argv0) {
        "  -f file       - input file read by the tested program (stdin)\n"
        "  -t msec       - timeout for each run (%u ms)\n"
        "  -m megs       - memory limit for child process (%u MB)\n"
+       "  -j count      - run candidates on this many fork servers (off)\n"
        "  -Q            - use binary-only instrumentation (QEMU mode)\n\n"
 
        "Minimization settings:\n\n"
@@ -962,6 +1257,55 @@ static char** get_qemu_argv(u8* own_loc, char** argv, int argc) {
 }
 
 
+/* Start the fork servers for -j. Each one gets its own copy of the input
+   file, unless the target reads from a fixed location (-f without @@). */
+
+static void setup_fsrv(char** argv) {
+
+  s32 cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  u8  aa = 0;
+  u32 i;
+
+  for (i = 0; argv[i]; i++)
+    if (strstr(argv[i], "@@")) aa = 1;
+
+  if (!use_stdin && !aa && job_cnt > 1) {
+    WARNF("Target reads a fixed file (-f without @@), using one fork server.");
+    job_cnt = 1;
+  }
+
+  fs = ck_alloc(sizeof(struct fsrv*) * job_cnt);
+
+  for (i = 0; i < job_cnt; i++) {
+
+    struct fsrv* f = fs[i] = ck_alloc(sizeof(struct fsrv));
+    u8 found = 0;
+
+    fsrv_init(f);
+
+    f->target_path = target_path;
+    f->out_file    = job_cnt == 1 ? prog_in :
+                     alloc_printf("%s.%u", prog_in, i);
+    f->argv        = fsrv_subst_argv(argv, f->out_file, &found);
+    f->use_stdin   = use_stdin;
+    f->quiet       = 1;
+    f->mem_limit   = mem_limit;
+    f->exec_tmout  = exec_tmout;
+    f->map_size    = map_size;
+
+    if (job_cnt > 1 && cpus > 0 && !getenv("AFL_NO_AFFINITY"))
+      f->cpu = i % cpus;
+
+    fsrv_start(f);
+
+  }
+
+  map_size   = fs[0]->map_size;
+  trace_bits = fs[0]->trace_bits;
+
+}
+
+
 /* Read mask bitmap from file. This is for the -B option. */
 
 static void read_bitmap(u8* fname) {
@@ -990,7 +1334,7 @@ int main(int argc, char** argv) {
 
   SAYF(cCYA "afl-tmin " cBRI VERSION cRST " by <lcamtuf@google.com>\n");
 
-  while ((opt = getopt(argc,argv,"+i:o:f:m:t:B:xeQV")) > 0)
+  while ((opt = getopt(argc,argv,"+i:o:f:m:t:j:B:xeQV")) > 0)
 
     switch (opt) {
 
@@ -1074,6 +1418,17 @@ int main(int argc, char** argv) {
 
         break;
 
+      case 'j':
+
+        if (job_cnt) FATAL("Multiple -j options not supported");
+
+        job_cnt = atoi(optarg);
+
+        if (job_cnt < 1 || job_cnt > FSRV_MAX)
+          FATAL("Value of -j must be between 1 and %u", FSRV_MAX);
+
+        break;
+
       case 'Q':
 
         if (qemu_mode) FATAL("Multiple -Q options not supported");
@@ -1115,19 +1470,22 @@ int main(int argc, char** argv) {
 
   if (optind == argc || !in_file || !out_file) usage(argv[0]);
 
-  setup_shm();
+  if (!job_cnt) setup_shm();
+  init_bitmap_ops();
   setup_signal_handlers();
 
   set_up_environment();
 
   find_binary(argv[optind]);
-  detect_file_args(argv + optind);
+  if (!job_cnt) detect_file_args(argv + optind);
 
   if (qemu_mode)
     use_argv = get_qemu_argv(argv[0], argv + optind, argc - optind);
   else
     use_argv = argv + optind;
 
+  if (job_cnt) setup_fsrv(use_argv);
+
   exact_mode = !!getenv("AFL_TMIN_EXACT");
 
   SAYF("\n");
@@ -1137,7 +1495,13 @@ int main(int argc, char** argv) {
   ACTF("Performing dry run (mem limit = %llu MB, timeout = %u ms%s)...",
        mem_limit, exec_tmout, edges_only ? ", edges only" : "");
 
-  run_target(use_argv, in_data, in_len, 1);
+  if (job_cnt) {
+
+    fsrv_run(fs[0], in_data, in_len);
+    child_timed_out = fs[0]->timed_out;
+    check_result(fs[0]->trace_bits, fs[0]->status, child_timed_out, 1);
+
+  } else run_target(use_argv, in_data, in_len, 1);
 
   if (child_timed_out)
     FATAL("Target binary times out (adjusting -t may help).");
@@ -0,0 +1,268 @@
+/*
+  Copyright 2019 Google LLC All rights reserved.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at:
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+   american fuzzy lop - bitmap microbenchmarks
+   -------------------------------------------
+
+   Times the per-exec bitmap routines of afl-fuzz - has_new_bits(),
+   classify_counts(), simplify_trace(), hash32(), update_bitmap_score() and
+   count_bits() - over a few map sizes and trace densities, and prints the
+   results as a JSON array on stdout.
+
+   The routines are taken straight from afl-fuzz.c, built with AFL_LIB, so
+   that what gets measured is exactly what the fuzzer runs; AFL_NO_SIMD is
+   honored as usual. Run it through 'make bench', which also does the end-
+   to-end part (see bench/run-bench.sh).
+
+*/
+
+#define AFL_LIB
+
+/* Some of the code gets inlined in ways that make GCC see ghosts. */
+
+#if defined(__GNUC__) && !defined(__clang__)
+#  pragma GCC diagnostic ignored "-Wformat-overflow"
+#endif /* __GNUC__ && !__clang__ */
+
+#include "../afl-fuzz.c"
+
+/* Map sizes and trace densities (nonzero bytes per million) to go over. */
+
+static const u32 bench_sizes[] = { 1 << 12, 1 << 16, MAP_SIZE };
+static const u32 bench_ppm[]   = { 1000, 10000, 100000 };
+
+#define BENCH_ROUNDS  5               /* Best of this many rounds          */
+#define BENCH_MIN_US  20000           /* Minimum length of a round         */
+
+static u8* bench_trace;               /* Pristine trace for the current run */
+static u8  first_result = 1;
+
+static struct queue_entry bench_best, bench_q;
+
+
+/* Fill bench_trace[] with hit counts at random positions. Only 1, 2 and 128
+   are used, since classify_counts() leaves those alone; that way, repeated
+   runs over the same map see the same data. */
+
+static void make_trace(u32 ppm) {
+
+  static const u8 vals[] = { 1, 2, 128 };
+  u32 i;
+
+  memset(bench_trace, 0, MAP_SIZE);
+
+  for (i = 0; i < map_size; i++)
+    if (random() % 1000000 < ppm) bench_trace[i] = vals[random() % 3];
+
+  /* Make sure there's at least something there. */
+
+  bench_trace[random() % map_size] = 1;
+
+}
+
+
+/* The routines being timed. Each gets the map in the state it expects it
+   in; the ones that modify trace_bits[] put bench_trace[] back first. */
+
+static void op_has_new_bits(void) {
+
+  trace_maybe_new = 1;
+  has_new_bits(virgin_bits);
+
+}
+
+static void op_classify(void) {
+
+#ifdef WORD_SIZE_64
+  classify_counts((u64*)trace_bits);
+#else
+  classify_counts((u32*)trace_bits);
+#endif /* ^WORD_SIZE_64 */
+
+}
+
+static void op_simplify(void) {
+
+  memcpy(trace_bits, bench_trace, map_size);
+
+#ifdef WORD_SIZE_64
+  simplify_trace((u64*)trace_bits);
+#else
+  simplify_trace((u32*)trace_bits);
+#endif /* ^WORD_SIZE_64 */
+
+}
+
+static void op_copy(void) {
+
+  memcpy(trace_bits, bench_trace, map_size);
+
+}
+
+static void op_hash32(void) {
+
+  volatile u32 res = hash32(trace_bits, map_size, HASH_CONST);
+  (void)res;
+
+}
+
+static void op_update_score(void) {
+
+  update_bitmap_score(&bench_q);
+
+}
+
+static void op_count_bits(void) {
+
+  volatile u32 res = count_bits(virgin_bits);
+  (void)res;
+
+}
+
+
+/* Time one routine and return the best ns per call across all rounds. */
+
+static double time_op(void (*op)(void)) {
+
+  double best = 0;
+  u32 r, iters = 1;
+
+  /* Find an iteration count that takes long enough to measure. */
+
+  while (1) {
+
+    u64 start = get_cur_time_us(), i;
+
+    for (i = 0; i < iters; i++) op();
+
+    if (get_cur_time_us() - start >= BENCH_MIN_US / 4 || iters >= (1 << 30))
+      break;
+
+    iters *= 2;
+
+  }
+
+  iters *= 4;
+
+  for (r = 0; r < BENCH_ROUNDS; r++) {
+
+    u64 start = get_cur_time_us(), i;
+    double ns;
+
+    for (i = 0; i < iters; i++) op();
+
+    ns = (get_cur_time_us() - start) * 1000.0 / iters;
+    if (!r || ns < best) best = ns;
+
+  }
+
+  return best;
+
+}
+
+
+static void report(const u8* name, u32 ppm, double ns) {
+
+  printf("%s\n    { \"op\": \"%s\", \"impl\": \"%s\", \"map_size\": %u, "
+         "\"density_ppm\": %u, \"ns_per_call\": %0.01f, "
+         "\"mb_per_sec\": %0.01f }", first_result ? "" : ",", name, bm_impl,
+         map_size, ppm, ns, ns ? map_size * 1000.0 / ns : 0);
+
+  first_result = 0;
+
+}
+
+
+/* Set up the map for one size and density, and run everything on it. */
+
+static void bench_one(u32 size, u32 ppm) {
+
+  double copy_ns;
+  u32 i;
+
+  map_size = size;
+  make_trace(ppm);
+
+  memcpy(trace_bits, bench_trace, MAP_SIZE);
+
+  /* The steady state of a fuzzing session: virgin_bits[] has seen this
+     trace already, so has_new_bits() finds nothing. */
+
+  memset(virgin_bits, 255, MAP_SIZE);
+
+  for (i = 0; i < map_size; i++) virgin_bits[i] &= ~bench_trace[i];
+
+  trace_sparse = 0;
+
+  report("has_new_bits", ppm, time_op(op_has_new_bits));
+  report("classify_counts", ppm, time_op(op_classify));
+
+  copy_ns = time_op(op_copy);
+  report("simplify_trace", ppm, MAX(time_op(op_simplify) - copy_ns, 0));
+
+  memcpy(trace_bits, bench_trace, MAP_SIZE);
+
+  report("hash32", ppm, time_op(op_hash32));
+
+  /* A new path that doesn't win any slots, which is how it usually goes.
+     bench_best holds all of them for now. */
+
+  memset(top_rated, 0, sizeof(top_rated));
+  top_cnt = rated_cnt = 0;
+  memset(rated_map, 0, sizeof(rated_map));
+
+  ck_free(bench_best.trace_mini);
+  memset(&bench_best, 0, sizeof(bench_best));
+
+  bench_best.exec_us = bench_best.len = 1;
+  update_bitmap_score(&bench_best);
+
+  bench_q.exec_us = 100;
+  bench_q.len     = 100;
+
+  report("update_bitmap_score", ppm, time_op(op_update_score));
+  report("count_bits", ppm, time_op(op_count_bits));
+
+}
+
+
+int main(int argc, char** argv) {
+
+  u32 s, d;
+
+  srandom(0x41464c);
+
+  trace_bits = mmap(NULL, MAP_SIZE, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (trace_bits == MAP_FAILED) PFATAL("mmap() failed");
+
+  bench_trace = ck_alloc(MAP_SIZE);
+
+  init_count_class16();
+  init_bitmap_ops();
+
+  printf("[");
+
+  for (s = 0; s < sizeof(bench_sizes) / sizeof(u32); s++)
+    for (d = 0; d < sizeof(bench_ppm) / sizeof(u32); d++)
+      bench_one(bench_sizes[s], bench_ppm[d]);
+
+  printf("\n]\n");
+
+  return 0;
+
+}
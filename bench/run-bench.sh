@@ -0,0 +1,154 @@
+#!/bin/sh
+#
+# american fuzzy lop - benchmark driver
+# -------------------------------------
+#
+# Copyright 2019 Google LLC All rights reserved.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at:
+#
+#   http://www.apache.org/licenses/LICENSE-2.0
+#
+# Runs the bitmap microbenchmarks in bench/afl-bench, then builds a couple of
+# reference targets with afl-clang-fast and fuzzes each one for a little
+# while. Everything ends up in one JSON document on stdout; progress goes to
+# stderr. Normally invoked through 'make bench'; see bench/README.bench.
+#
+
+cd "`dirname "$0"`/.." || exit 1
+
+BENCH_SECS="${AFL_BENCH_SECS:-10}"
+BENCH_BLOCKS="${AFL_BENCH_BLOCKS:-5000}"
+
+if [ ! -x ./afl-fuzz -o ! -x ./bench/afl-bench ]; then
+  echo "[-] Error: build afl-fuzz and bench/afl-bench first (make bench)." 1>&2
+  exit 1
+fi
+
+TMP="`mktemp -d /tmp/afl-bench.XXXXXX`" || exit 1
+trap 'rm -rf "$TMP"' 0
+
+now_ms() {
+  echo $((`date +%s%N` / 1000000))
+}
+
+# Pull a value out of fuzzer_stats.
+
+stat_val() {
+  sed -n "s/^$2 *: //p" "$1/fuzzer_stats"
+}
+
+# A synthetic target with lots of blocks and edges, to give the CollAFL
+# solver something to chew on: a chain of byte comparisons, each leading to
+# a small switch.
+
+gen_target() {
+
+  awk -v n="$BENCH_BLOCKS" 'BEGIN {
+    print "#include <unistd.h>\n\nstatic volatile int sink;\n"
+    for (i = 0; i < n; i += 8) {
+      printf "static void f%d(const unsigned char* b, int len) {\n", i
+      for (j = i; j < i + 8 && j < n; j++) {
+        printf "  if (len > %d && b[%d] == %d) {\n", j % 64, j % 64, j * 7 % 256
+        printf "    switch (b[(%d + 1) %% len]) {\n", j
+        printf "      case 0: sink += %d; break;\n", j
+        printf "      case 1: sink ^= %d; break;\n", j
+        printf "      default: sink--;\n    }\n  }\n"
+      }
+      print "}\n"
+    }
+    print "int main(void) {\n\n  unsigned char buf[64];"
+    print "  int len = read(0, buf, sizeof(buf));\n\n  if (len <= 0) return 0;\n"
+    for (i = 0; i < n; i += 8) printf "  f%d(buf, len);\n", i
+    print "\n  return 0;\n\n}"
+  }' >"$TMP/synth.c"
+
+}
+
+# Build one target, fuzz it, and print its JSON record.
+
+bench_target() {
+
+  NAME="$1"
+  SRC="$2"
+  OUT="$TMP/$NAME"
+
+  mkdir -p "$OUT/in" || exit 1
+
+  echo "[*] Building '$NAME'..." 1>&2
+
+  START=`now_ms`
+
+  if ! AFL_QUIET=1 AFL_LLVM_TIMING=1 AFL_PATH=. ./afl-clang-fast -O2 "$SRC" \
+       -o "$OUT/target" 2>"$OUT/build.log"; then
+    cat "$OUT/build.log" 1>&2
+    echo "[-] Error: unable to build '$NAME'." 1>&2
+    exit 1
+  fi
+
+  BUILD_MS=$((`now_ms` - START))
+
+  # With more than one module, add up the solver times.
+
+  FMUL_MS=`sed -n 's/.*fmul=\([0-9.]*\) .*/\1/p' "$OUT/build.log" | \
+           awk '{ s += $1 } END { printf "%0.02f", s }'`
+  BLOCKS=`sed -n 's/.* \([0-9]*\) blocks\..*/\1/p' "$OUT/build.log" | \
+          awk '{ s += $1 } END { print s + 0 }'`
+
+  echo "[*] Fuzzing '$NAME' for $BENCH_SECS seconds..." 1>&2
+
+  echo 0 >"$OUT/in/seed"
+
+  AFL_NO_UI=1 AFL_SKIP_CPUFREQ=1 AFL_NO_AFFINITY=1 AFL_SKIP_CRASHES=1 \
+    timeout -s INT "$BENCH_SECS" ./afl-fuzz -i "$OUT/in" -o "$OUT/out" \
+    -m none -- "$OUT/target" >"$OUT/fuzz.log" 2>&1
+
+  if [ ! -f "$OUT/out/fuzzer_stats" ]; then
+    tail -20 "$OUT/fuzz.log" 1>&2
+    echo "[-] Error: afl-fuzz didn't get very far with '$NAME'." 1>&2
+    exit 1
+  fi
+
+  EXECS=`stat_val "$OUT/out" execs_done`
+  SECS=$((`stat_val "$OUT/out" last_update` - `stat_val "$OUT/out" start_time`))
+  test "$SECS" -gt 0 || SECS=1
+
+  printf '    { "target": "%s", "blocks": %s, "build_ms": %s, ' \
+         "$NAME" "$BLOCKS" "$BUILD_MS"
+  printf '"fmul_ms": %s, "execs": %s, "execs_per_sec": %s, "paths": %s }' \
+         "$FMUL_MS" "$EXECS" \
+         "`awk -v e="$EXECS" -v s="$SECS" 'BEGIN { printf "%0.01f", e / s }'`" \
+         "`stat_val "$OUT/out" paths_total`"
+
+}
+
+echo "[*] Running bitmap microbenchmarks..." 1>&2
+
+MICRO="`./bench/afl-bench`" || exit 1
+
+echo "{"
+printf '  "micro": %s,\n' "$MICRO" | sed '2,$s/^/  /'
+
+if [ ! -x ./afl-clang-fast ]; then
+
+  echo "[!] No afl-clang-fast (see llvm_mode/), skipping the rest." 1>&2
+  echo '  "targets": [], "skipped": "afl-clang-fast not built"'
+
+else
+
+  gen_target
+
+  echo '  "targets": ['
+  bench_target test llvm_mode/test/test.c
+  echo ","
+  bench_target synth "$TMP/synth.c"
+  echo
+  echo '  ]'
+
+fi
+
+echo "}"
+
+echo "[+] All done." 1>&2
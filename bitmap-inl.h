@@ -0,0 +1,478 @@
+/*
+  Copyright 2013 Google LLC All rights reserved.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at:
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+   american fuzzy lop - vectorized bitmap kernels
+   ----------------------------------------------
+
+   SIMD versions of the loops that touch the whole coverage map on every
+   exec: hit count bucketing (optionally fused with a check against a
+   virgin map and with the path checksum), crash / hang simplification,
+   edges-only flattening, and the search for bytes that may still be
+   virgin.
+
+   The kernels are picked at run time by init_bitmap_ops(), which leaves
+   the corresponding pointer NULL when nothing better than the caller's
+   own scalar loop is available (or when AFL_NO_SIMD is set). All lengths
+   must be multiples of 64 bytes; map_size always is, as long as it comes
+   from bm_env_map_size() or from the (rounded) fork server hello.
+*/
+
+#ifndef _HAVE_BITMAP_INL_H
+#define _HAVE_BITMAP_INL_H
+
+#include <stdlib.h>
+
+#include "config.h"
+#include "types.h"
+#include "debug.h"
+
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 5)
+#  define BITMAP_X86
+#  include <immintrin.h>
+#elif defined(__aarch64__)
+#  define BITMAP_NEON
+#  include <arm_neon.h>
+#endif /* ^__x86_64__ */
+
+/* Path checksums. The checksum of a trace is the sum of bm_mix_word() over
+   all of its nonzero 64-bit words, keyed by their byte offset in the map,
+   and folded down to 32 bits at the end. Being a sum, it can be built up in
+   any order - in particular, while the words go by during classification,
+   or from just the dirty chunks - and still come out the same. Each term
+   is a bijective mix of (word, offset), so two different traces collide
+   with roughly the odds of a random 32-bit hash. */
+
+static inline u64 bm_mix_word(u64 w, u32 pos) {
+
+  w ^= (u64)pos * 0x9e3779b97f4a7c15ULL;
+
+  w ^= w >> 33;
+  w *= 0xff51afd7ed558ccdULL;
+  w ^= w >> 33;
+  w *= 0xc4ceb9fe1a85ec53ULL;
+  w ^= w >> 33;
+
+  return w;
+
+}
+
+
+static inline u32 bm_fold_cksum(u64 acc) {
+
+  return (u32)bm_mix_word(acc, HASH_CONST);
+
+}
+
+
+/* Sum of bm_mix_word() over the nonzero words of mem[], which sits at byte
+   offset base in the map. */
+
+static inline u64 bm_cksum(const u8* mem, u32 len, u32 base) {
+
+  const u64* w = (const u64*)mem;
+  u64 acc = 0;
+  u32 i;
+
+  for (i = 0; i < len >> 3; i++)
+    if (w[i]) acc += bm_mix_word(w[i], base + (i << 3));
+
+  return acc;
+
+}
+
+
+/* Bucket hit counts in place, just like count_class_lookup8[]. If virgin
+   is not NULL, also returns nonzero if any of the resulting bits are still
+   set in virgin[], i.e., if has_new_bits() could possibly find anything.
+   If cksum is not NULL, the checksum terms of the classified words are
+   added to it, with mem[] taken to be at byte offset base in the map. */
+
+static u8 (*bm_classify)(u8* mem, const u8* virgin, u32 len, u64* cksum,
+                         u32 base) __attribute__((unused));
+
+/* Replace each byte with 0x80 if it was hit, 0x01 otherwise. */
+
+static void (*bm_simplify)(u8* mem, u32 len) __attribute__((unused));
+
+/* Replace each nonzero byte with 1. */
+
+static void (*bm_edges_only)(u8* mem, u32 len) __attribute__((unused));
+
+/* Return the offset of the first 64-byte chunk at or past pos in which
+   cur[] and virgin[] overlap, or len if there is none. */
+
+static u32 (*bm_find_new)(const u8* cur, const u8* virgin, u32 pos, u32 len)
+  __attribute__((unused));
+
+/* Name of the kernel set in use, for the curious. */
+
+static const char* bm_impl __attribute__((unused)) = "scalar";
+
+
+/* The bucketing trick: for bytes >= 16, the bucket depends only on the high
+   nibble; below that, only on the low one. Two 16-entry table lookups and a
+   select do the whole thing. */
+
+#define BM_LO_TBL 0, 1, 2, 4, 8, 8, 8, 8, 16, 16, 16, 16, 16, 16, 16, 16
+#define BM_HI_TBL 0, 32, 64, 64, 64, 64, 64, 64, \
+                  (char)128, (char)128, (char)128, (char)128, \
+                  (char)128, (char)128, (char)128, (char)128
+
+#ifdef BITMAP_X86
+
+/* AVX2 flavor. */
+
+__attribute__((target("avx2")))
+static u8 bm_classify_avx2(u8* mem, const u8* virgin, u32 len, u64* cksum,
+                           u32 base) {
+
+  const __m256i lo_tbl = _mm256_setr_epi8(BM_LO_TBL, BM_LO_TBL),
+                hi_tbl = _mm256_setr_epi8(BM_HI_TBL, BM_HI_TBL),
+                nib    = _mm256_set1_epi8(0x0f),
+                zero   = _mm256_setzero_si256();
+
+  __m256i acc = zero;
+  u32 i;
+
+  for (i = 0; i < len; i += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)(mem + i)), hi, r;
+
+    /* Optimize for sparse bitmaps. */
+
+    if (_mm256_testz_si256(v, v)) continue;
+
+    hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nib);
+
+    r = _mm256_or_si256(_mm256_shuffle_epi8(hi_tbl, hi),
+          _mm256_and_si256(_mm256_cmpeq_epi8(hi, zero),
+            _mm256_shuffle_epi8(lo_tbl, _mm256_and_si256(v, nib))));
+
+    _mm256_storeu_si256((__m256i*)(mem + i), r);
+
+    if (virgin)
+      acc = _mm256_or_si256(acc, _mm256_and_si256(r,
+              _mm256_loadu_si256((__m256i*)(virgin + i))));
+
+    if (cksum) *cksum += bm_cksum(mem + i, 32, base + i);
+
+  }
+
+  return !_mm256_testz_si256(acc, acc);
+
+}
+
+
+__attribute__((target("avx2")))
+static void bm_simplify_avx2(u8* mem, u32 len) {
+
+  const __m256i one  = _mm256_set1_epi8(0x01),
+                hit  = _mm256_set1_epi8((char)0x80),
+                zero = _mm256_setzero_si256();
+  u32 i;
+
+  for (i = 0; i < len; i += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)(mem + i));
+
+    _mm256_storeu_si256((__m256i*)(mem + i),
+      _mm256_blendv_epi8(hit, one, _mm256_cmpeq_epi8(v, zero)));
+
+  }
+
+}
+
+
+__attribute__((target("avx2")))
+static void bm_edges_only_avx2(u8* mem, u32 len) {
+
+  const __m256i one = _mm256_set1_epi8(0x01);
+  u32 i;
+
+  for (i = 0; i < len; i += 32) {
+
+    __m256i v = _mm256_loadu_si256((__m256i*)(mem + i));
+    _mm256_storeu_si256((__m256i*)(mem + i), _mm256_min_epu8(v, one));
+
+  }
+
+}
+
+
+__attribute__((target("avx2")))
+static u32 bm_find_new_avx2(const u8* cur, const u8* virgin, u32 pos,
+                            u32 len) {
+
+  for (; pos < len; pos += 64) {
+
+    __m256i a = _mm256_loadu_si256((__m256i*)(cur + pos)),
+            b = _mm256_loadu_si256((__m256i*)(cur + pos + 32));
+
+    if (_mm256_testz_si256(a, _mm256_loadu_si256((__m256i*)(virgin + pos))) &&
+        _mm256_testz_si256(b, _mm256_loadu_si256((__m256i*)(virgin + pos + 32))))
+      continue;
+
+    break;
+
+  }
+
+  return pos < len ? pos : len;
+
+}
+
+
+/* AVX-512BW flavor. Same logic, twice the width, and mask registers in
+   place of compare-and-blend. */
+
+__attribute__((target("avx512bw")))
+static u8 bm_classify_avx512(u8* mem, const u8* virgin, u32 len, u64* cksum,
+                             u32 base) {
+
+  const __m512i lo_tbl = _mm512_broadcast_i32x4(_mm_setr_epi8(BM_LO_TBL)),
+                hi_tbl = _mm512_broadcast_i32x4(_mm_setr_epi8(BM_HI_TBL)),
+                nib    = _mm512_set1_epi8(0x0f);
+
+  __mmask64 acc = 0;
+  u32 i;
+
+  for (i = 0; i < len; i += 64) {
+
+    __m512i v = _mm512_loadu_si512(mem + i), hi, r;
+
+    if (!_mm512_test_epi8_mask(v, v)) continue;
+
+    hi = _mm512_and_si512(_mm512_srli_epi16(v, 4), nib);
+
+    r = _mm512_mask_blend_epi8(_mm512_test_epi8_mask(hi, hi),
+          _mm512_shuffle_epi8(lo_tbl, _mm512_and_si512(v, nib)),
+          _mm512_shuffle_epi8(hi_tbl, hi));
+
+    _mm512_storeu_si512(mem + i, r);
+
+    if (virgin)
+      acc |= _mm512_test_epi8_mask(r, _mm512_loadu_si512(virgin + i));
+
+    if (cksum) *cksum += bm_cksum(mem + i, 64, base + i);
+
+  }
+
+  return !!acc;
+
+}
+
+
+__attribute__((target("avx512bw")))
+static void bm_simplify_avx512(u8* mem, u32 len) {
+
+  const __m512i one = _mm512_set1_epi8(0x01),
+                hit = _mm512_set1_epi8((char)0x80);
+  u32 i;
+
+  for (i = 0; i < len; i += 64) {
+
+    __m512i v = _mm512_loadu_si512(mem + i);
+    _mm512_storeu_si512(mem + i,
+      _mm512_mask_blend_epi8(_mm512_test_epi8_mask(v, v), one, hit));
+
+  }
+
+}
+
+
+__attribute__((target("avx512bw")))
+static void bm_edges_only_avx512(u8* mem, u32 len) {
+
+  const __m512i one = _mm512_set1_epi8(0x01);
+  u32 i;
+
+  for (i = 0; i < len; i += 64) {
+
+    __m512i v = _mm512_loadu_si512(mem + i);
+    _mm512_storeu_si512(mem + i, _mm512_min_epu8(v, one));
+
+  }
+
+}
+
+
+__attribute__((target("avx512bw")))
+static u32 bm_find_new_avx512(const u8* cur, const u8* virgin, u32 pos,
+                              u32 len) {
+
+  for (; pos < len; pos += 64)
+    if (_mm512_test_epi8_mask(_mm512_loadu_si512(cur + pos),
+                              _mm512_loadu_si512(virgin + pos))) break;
+
+  return pos < len ? pos : len;
+
+}
+
+#endif /* BITMAP_X86 */
+
+
+#ifdef BITMAP_NEON
+
+/* NEON is always there on AArch64, so no run-time check is needed. */
+
+static u8 bm_classify_neon(u8* mem, const u8* virgin, u32 len, u64* cksum,
+                           u32 base) {
+
+  static const u8 lo_b[16] = { BM_LO_TBL }, hi_b[16] = { BM_HI_TBL };
+
+  const uint8x16_t lo_tbl = vld1q_u8(lo_b), hi_tbl = vld1q_u8(hi_b),
+                   nib    = vdupq_n_u8(0x0f);
+
+  uint8x16_t acc = vdupq_n_u8(0);
+  u32 i;
+
+  for (i = 0; i < len; i += 16) {
+
+    uint8x16_t v = vld1q_u8(mem + i), hi, r;
+
+    if (!vmaxvq_u8(v)) continue;
+
+    hi = vshrq_n_u8(v, 4);
+
+    r = vbslq_u8(vceqzq_u8(hi), vqtbl1q_u8(lo_tbl, vandq_u8(v, nib)),
+                 vqtbl1q_u8(hi_tbl, hi));
+
+    vst1q_u8(mem + i, r);
+
+    if (virgin) acc = vorrq_u8(acc, vandq_u8(r, vld1q_u8(virgin + i)));
+
+    if (cksum) *cksum += bm_cksum(mem + i, 16, base + i);
+
+  }
+
+  return !!vmaxvq_u8(acc);
+
+}
+
+
+static void bm_simplify_neon(u8* mem, u32 len) {
+
+  const uint8x16_t one = vdupq_n_u8(0x01), hit = vdupq_n_u8(0x80);
+  u32 i;
+
+  for (i = 0; i < len; i += 16)
+    vst1q_u8(mem + i, vbslq_u8(vceqzq_u8(vld1q_u8(mem + i)), one, hit));
+
+}
+
+
+static void bm_edges_only_neon(u8* mem, u32 len) {
+
+  const uint8x16_t one = vdupq_n_u8(0x01);
+  u32 i;
+
+  for (i = 0; i < len; i += 16)
+    vst1q_u8(mem + i, vminq_u8(vld1q_u8(mem + i), one));
+
+}
+
+
+static u32 bm_find_new_neon(const u8* cur, const u8* virgin, u32 pos,
+                            u32 len) {
+
+  for (; pos < len; pos += 64) {
+
+    uint8x16_t a = vandq_u8(vld1q_u8(cur + pos), vld1q_u8(virgin + pos)),
+               b = vandq_u8(vld1q_u8(cur + pos + 16),
+                            vld1q_u8(virgin + pos + 16)),
+               c = vandq_u8(vld1q_u8(cur + pos + 32),
+                            vld1q_u8(virgin + pos + 32)),
+               d = vandq_u8(vld1q_u8(cur + pos + 48),
+                            vld1q_u8(virgin + pos + 48));
+
+    if (vmaxvq_u8(vorrq_u8(vorrq_u8(a, b), vorrq_u8(c, d)))) break;
+
+  }
+
+  return pos < len ? pos : len;
+
+}
+
+#endif /* BITMAP_NEON */
+
+#undef BM_LO_TBL
+#undef BM_HI_TBL
+
+
+/* Pick the best kernels for this CPU. */
+
+static void init_bitmap_ops(void) {
+
+  if (getenv("AFL_NO_SIMD")) return;
+
+#ifdef BITMAP_X86
+
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512bw")) {
+
+    bm_classify   = bm_classify_avx512;
+    bm_simplify   = bm_simplify_avx512;
+    bm_edges_only = bm_edges_only_avx512;
+    bm_find_new   = bm_find_new_avx512;
+    bm_impl       = "AVX-512BW";
+
+  } else if (__builtin_cpu_supports("avx2")) {
+
+    bm_classify   = bm_classify_avx2;
+    bm_simplify   = bm_simplify_avx2;
+    bm_edges_only = bm_edges_only_avx2;
+    bm_find_new   = bm_find_new_avx2;
+    bm_impl       = "AVX2";
+
+  }
+
+#elif defined(BITMAP_NEON)
+
+  bm_classify   = bm_classify_neon;
+  bm_simplify   = bm_simplify_neon;
+  bm_edges_only = bm_edges_only_neon;
+  bm_find_new   = bm_find_new_neon;
+  bm_impl       = "NEON";
+
+#endif /* ^BITMAP_X86 */
+
+}
+
+
+
+/* Map size requested with AFL_MAP_SIZE, rounded up to a multiple of 64, or
+   dflt when the variable isn't set. Shared by all the tools; in the ones
+   with a fork server, a size reported by the target overrides this. */
+
+static inline u32 bm_env_map_size(u32 dflt) {
+
+  u8* x = getenv("AFL_MAP_SIZE");
+  s32 val;
+
+  if (!x) return dflt;
+
+  val = atoi(x);
+
+  if (val < 64 || val > MAP_SIZE)
+    FATAL("Invalid value of AFL_MAP_SIZE (must be between 64 and %u)",
+          MAP_SIZE);
+
+  return (val + 63) & ~63;
+
+}
+
+#endif /* !_HAVE_BITMAP_INL_H */
@@ -54,6 +54,16 @@
 
 #define EXEC_TM_ROUND       20
 
+/* Adaptive timeouts while fuzzing a queue entry: the budget is
+   ADAPT_TMOUT_MULT times its calibrated exec time plus ADAPT_TMOUT_SD times
+   the standard deviation, at least ADAPT_TMOUT_MIN_US, and at most the
+   regular timeout. Every run cut off at the budget is tried again with the
+   regular timeout, and the budget doubles if that run finishes: */
+
+#define ADAPT_TMOUT_MULT    4
+#define ADAPT_TMOUT_SD      8
+#define ADAPT_TMOUT_MIN_US  5000
+
 /* 64bit arch MACRO */
 #if (defined (__x86_64__) || defined (__arm64__) || defined (__aarch64__))
 #define WORD_SIZE_64 1
@@ -71,6 +81,12 @@
 
 #define MEM_LIMIT_QEMU      200
 
+/* Default memory limits for afl-cmin (MB), somewhat more generous since
+   corpora often come from elsewhere: */
+
+#define MEM_LIMIT_CMIN      100
+#define MEM_LIMIT_CMIN_QEMU 250
+
 /* Number of calibration cycles per every new test case (and for test
    cases that show variable behavior): */
 
@@ -86,6 +102,14 @@
 #define KEEP_UNIQUE_HANG    500
 #define KEEP_UNIQUE_CRASH   5000
 
+/* Number of queue entries allocated at a time: */
+
+#define QUEUE_SLAB          1024
+
+/* Default size of the in-memory cache of queue files (MB), see AFL_CACHE_MB: */
+
+#define CACHE_SIZE_MB       64
+
 /* Baseline number of random tweaks during a single 'havoc' stage: */
 
 #define HAVOC_CYCLES        256
@@ -171,9 +195,10 @@
 #define MIN_AUTO_EXTRA      3
 #define MAX_AUTO_EXTRA      32
 
-/* Maximum number of user-specified dictionary tokens to use in deterministic
-   steps; past this point, the "extras/user" step will be still carried out,
-   but with proportionally lower odds: */
+/* Maximum number of user-specified dictionary tokens to try at any one offset
+   in deterministic steps; past this point, the "extras/user" steps spread
+   the tokens out over the offsets, except where the input already contains
+   one of them: */
 
 #define MAX_DET_EXTRAS      200
 
@@ -208,6 +233,13 @@
 #define STATS_UPDATE_SEC    60
 #define PLOT_UPDATE_SEC     5
 
+/* Exec latency histograms: how many stages to keep them for (the rest get
+   lumped together), and buckets per histogram. Eight buckets cover every
+   power of two, so 256 of them go up to about two hours (in us): */
+
+#define LAT_STAGES          32
+#define LAT_BUCKETS         256
+
 /* Smoothing divisor for CPU load and exec speed stats (1 - no smoothing). */
 
 #define AVG_SMOOTHING       16
@@ -216,6 +248,28 @@
 
 #define SYNC_INTERVAL       5
 
+/* Maximum number of local fuzzing jobs (-j), and the number of new paths
+   they can hand over to each other. Every path slot takes a bit over
+   MAP_SIZE / 8 bytes of address space, but memory is only committed for
+   the slots that actually get used. Paths found after the table fills up
+   (the shared path ID reaching JOB_MAX_PATHS) stay with the job that found
+   them and are no longer handed over; afl-fuzz warns once when that
+   happens: */
+
+#define JOB_MAX             256
+
+#ifndef WORD_SIZE_64
+#  define JOB_MAX_PATHS     (1 << 12)
+#else
+#  define JOB_MAX_PATHS     (1 << 18)
+#endif /* ^!WORD_SIZE_64 */
+
+/* Data size of the per-instance ring used with AFL_SYNC_RING, and the magic
+   value at the start of the file: */
+
+#define SYNC_RING_SIZE      (32 * 1024 * 1024)
+#define SYNC_RING_MAGIC     0x52534641
+
 /* Output directory reuse grace period (minutes): */
 
 #define OUTPUT_GRACE        25
@@ -278,6 +332,13 @@
 
 #define SHM_ENV_VAR         "__AFL_SHM_ID"
 
+/* The same, for the optional region afl-fuzz uses to hand test cases to
+   targets built with __AFL_FUZZ_TESTCASE_BUF. It holds a 32-bit length
+   followed by up to MAX_FILE bytes of data: */
+
+#define SHM_FUZZ_ENV_VAR    "__AFL_SHM_FUZZ_ID"
+#define SHM_FUZZ_SIZE       (MAX_FILE + sizeof(u32))
+
 /* Other less interesting, internal-only variables. */
 
 #define CLANG_ENV_VAR       "__AFL_CLANG_MODE"
@@ -303,6 +364,26 @@
 
 #define FORKSRV_FD          198
 
+/* Option bits the fork server can set in its four-byte "hello" message. Old
+   runtimes send all zeros, which means "nothing to negotiate". With
+   FS_OPT_MAPSIZE, bits 1-24 carry the map size actually used by the
+   instrumentation, minus one. FS_OPT_DIRTY means the target keeps the
+   dirty-chunk summary described below up to date. FS_OPT_SHMEM_FUZZ means
+   it reads its input from the SHM_FUZZ_ENV_VAR region, not stdin or a
+   file. FS_OPT_FUTEX means a persistent-mode target can have its iterations
+   driven through the FSRV_CTL_* control block instead of pipes and
+   SIGSTOP: */
+
+#define FS_OPT_ENABLED      0x80000001
+#define FS_OPT_MAPSIZE      0x40000000
+#define FS_OPT_DIRTY        0x20000000
+#define FS_OPT_SHMEM_FUZZ   0x10000000
+#define FS_OPT_FUTEX        0x08000000
+#define FS_OPT_MAX_MAPSIZE  ((0x00fffffe >> 1) + 1)
+#define FS_OPT_SET_MAPSIZE(_x) \
+  (((_x) <= 1 || (_x) > FS_OPT_MAX_MAPSIZE) ? 0 : (((_x) - 1) << 1))
+#define FS_OPT_GET_MAPSIZE(_x) ((((_x) & 0x00fffffe) >> 1) + 1)
+
 /* Fork server init timeout multiplier: we'll wait the user-selected
    timeout plus this much for the fork server to spin up. */
 
@@ -328,10 +409,94 @@
 #define MAP_SIZE_POW2       18
 #define MAP_SIZE            (1 << MAP_SIZE_POW2)
 
+/* Smallest map the CollAFL pass will pick in whole-program (AFL_LLVM_LTO)
+   mode, and the minimum ratio of map slots to edges it aims for. The upper
+   bound is always MAP_SIZE: */
+
+#define LTO_MAP_SIZE_POW2_MIN 10
+#define LTO_MAP_LOAD_DIV    2
+
+/* Collision-free IDs for afl-as (AFL_SOLVE_IDS): the non-allocated section
+   that carries the control flow seen by afl-as to the link step, the magic
+   word at the start of every record in it, and the number of random keys
+   afl-gcc tries for a block before settling for the one with the fewest
+   collisions. The map size is picked as in the LTO mode above: */
+
+#define AS_CFG_SECTION      ".afl_cfg"
+#define AS_CFG_MAGIC        0x47464341
+#define AS_SOLVE_TRIES      256
+
+/* On-disk block cache for QEMU mode (AFL_QEMU_CACHE): magic word of the
+   file, and size of the pc -> ID table kept in memory (2^QEMU_ID_TBL_POW2
+   entries, of which at most 3/4 are used): */
+
+#define QEMU_CACHE_MAGIC    0x43514641
+#define QEMU_ID_TBL_POW2    20
+
+/* Layout of the per-block Fhash tables emitted by the CollAFL pass for
+   blocks that Fmul can't solve. Each table is a run of 64-bit entries,
+   (prev_loc << 32) | map_slot, open-addressed on prev_loc and padded to
+   whole cache lines; FHASH_EMPTY in the upper half marks a free entry: */
+
+#define FHASH_EMPTY         0xffffffffU
+#define FHASH_LINE          8
+#define FHASH_IDX(_p, _m)   ((((u32)(_p) * 0x9e3779b1U) >> 16) & (_m))
+
+/* Dirty-chunk tracking (AFL_LLVM_DIRTY_MAP): the instrumentation also sets
+   one summary byte per 2^DIRTY_CHUNK_POW2 map bytes it touches. The summary
+   lives right after the map in the SHM segment, so tools that don't know
+   about it are unaffected: */
+
+#define DIRTY_CHUNK_POW2    6
+#define DIRTY_CHUNK         (1 << DIRTY_CHUNK_POW2)
+#define DIRTY_SIZE          (MAP_SIZE >> DIRTY_CHUNK_POW2)
+
+/* Snapshot mode for persistent targets (AFL_SNAPSHOT): the most mappings
+   we keep track of, and the largest one we're willing to copy. Anything
+   bigger is typically sanitizer shadow memory and is left alone: */
+
+#define SNAP_MAX_REGIONS    1024
+#define SNAP_MAX_REGION     (256 * 1024 * 1024)
+
+/* Written ranges fetched per PAGEMAP_SCAN call in snapshot mode: */
+
+#define SNAP_VEC_LEN        256
+
+/* Fork server control block (FS_OPT_FUTEX), placed right after the dirty-
+   chunk summary in the SHM segment. The field values are u32 indices; what
+   afl-fuzz writes and what the target writes sit on separate cache lines.
+   Both sides sleep on START and DONE with futex(2) when there's nothing to
+   do: */
+
+#define FSRV_CTL_SIZE       128
+#define FSRV_CTL_MODE       0         /* Set by afl-fuzz if it's in use    */
+#define FSRV_CTL_START      1         /* Bumped by afl-fuzz for every run  */
+#define FSRV_CTL_DONE       16        /* Copy of START once a run is over  */
+#define FSRV_CTL_DEAD       17        /* Set by the fork server on exit    */
+
 /* Maximum allocator request size (keep well under INT_MAX): */
 
 #define MAX_ALLOC           0x40000000
 
+/* libdislocator pool mode (AFL_LD_POOL): the largest allocation served from
+   the pools (in pages, not counting the guard page), how much address space
+   a pool grabs at a time when it runs dry (bytes), and the default length of
+   the quarantine ring (freed slots, see AFL_LD_QUARANTINE): */
+
+#define DISLOC_POOL_PAGES   16
+#define DISLOC_POOL_CHUNK   (1 << 20)
+#define DISLOC_QUARANTINE   4096
+
+/* libtokencap: size of the hash set of tokens seen so far (2^n slots), the
+   number of tokens that may wait to be written out, how many of them pile up
+   before a flush, and how long the flush waits on a record left half-written
+   by a killed process before skipping it (ms): */
+
+#define TOKENCAP_TBL_POW2   16
+#define TOKENCAP_RING       16384
+#define TOKENCAP_FLUSH      256
+#define TOKENCAP_STALL_MS   1000
+
 /* A made-up hashing seed: */
 
 #define HASH_CONST          0xa5b35705
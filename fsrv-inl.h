@@ -0,0 +1,518 @@
+/*
+  Copyright 2013 Google LLC All rights reserved.
+
+  Licensed under the Apache License, Version 2.0 (the "License");
+  you may not use this file except in compliance with the License.
+  You may obtain a copy of the License at:
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+  Unless required by applicable law or agreed to in writing, software
+  distributed under the License is distributed on an "AS IS" BASIS,
+  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  See the License for the specific language governing permissions and
+  limitations under the License.
+*/
+
+/*
+   american fuzzy lop - fork server client for the helper tools
+   ------------------------------------------------------------
+
+   A compact version of the fork server logic in afl-fuzz, for tools that
+   need to push a lot of inputs through the same binary (afl-showmap -i,
+   afl-cmin, afl-tmin -j). Each struct fsrv is one fork server with its own
+   SHM region and input file; a single process can drive several of them
+   at once, starting a run on each with fsrv_go() and then collecting them
+   in whatever order they finish with fsrv_wait().
+
+   Timeouts are handled with poll() deadlines rather than SIGALRM, so that
+   they work for any number of servers. The protocol is the same as with
+   afl-fuzz; targets that don't have a fork server can't be used here.
+
+   The including file must define _GNU_SOURCE (for CPU affinity) and pull
+   in alloc-inl.h and debug.h first.
+*/
+
+#ifndef _HAVE_FSRV_INL_H
+#define _HAVE_FSRV_INL_H
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/shm.h>
+#include <sys/resource.h>
+
+#include "config.h"
+#include "types.h"
+
+/* Outcome of a run: */
+
+#define FSRV_NONE   0
+#define FSRV_TMOUT  1
+#define FSRV_CRASH  2
+
+/* Most fork servers a single process may keep around: */
+
+#define FSRV_MAX    JOB_MAX
+
+struct fsrv {
+
+  /* Set by the caller (after fsrv_init()) before fsrv_start(): */
+
+  u8*    target_path;                 /* Binary to run                    */
+  char** argv;                        /* Its command line                 */
+  u8*    out_file;                    /* Where test cases are written     */
+  u8     use_stdin,                   /* Feed out_file on stdin?          */
+         keep_cores,                  /* Allow core dumps?                */
+         quiet;                       /* Sink the target's output?        */
+  u64    mem_limit;                   /* Memory limit (MB), 0 = none      */
+  u32    exec_tmout;                  /* Exec timeout (ms), 0 = none      */
+  s32    cpu;                         /* Core to bind the target to, or -1 */
+
+  /* Maintained by the engine: */
+
+  u8*    trace_bits;                  /* SHM with instrumentation bitmap  */
+  u32    map_size;                    /* Map bytes used by the target     */
+
+  s32    shm_id,                      /* ID of the SHM region             */
+         out_fd,                      /* Descriptor for out_file          */
+         ctl_fd,                      /* Fork server control pipe (write) */
+         st_fd,                       /* Fork server status pipe (read)   */
+         pid,                         /* PID of the fork server           */
+         child_pid,                   /* PID of the current run, if any   */
+         status;                      /* waitpid() status of the last run */
+
+  u8     running,                     /* Run in progress?                 */
+         timed_out;                   /* Last run timed out?              */
+
+  u64    deadline;                    /* When to kill the run (ms), or 0  */
+
+};
+
+static struct fsrv* fsrv_all[FSRV_MAX];
+static u32 fsrv_cnt;
+
+
+/* Get unix time in milliseconds. */
+
+static u64 fsrv_time(void) {
+
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return (tv.tv_sec * 1000ULL) + (tv.tv_usec / 1000);
+
+}
+
+
+/* Kill all fork servers and whatever they're running. Safe to call from
+   signal handlers. */
+
+static inline void fsrv_kill_all(void) {
+
+  u32 i;
+
+  for (i = 0; i < fsrv_cnt; i++) {
+
+    if (fsrv_all[i]->child_pid > 0) kill(fsrv_all[i]->child_pid, SIGKILL);
+    if (fsrv_all[i]->pid > 0) kill(fsrv_all[i]->pid, SIGKILL);
+
+  }
+
+}
+
+
+/* Release a fork server: kill it, get rid of its SHM region and input
+   file. */
+
+static void fsrv_destroy(struct fsrv* f) {
+
+  if (f->child_pid > 0) kill(f->child_pid, SIGKILL);
+
+  if (f->pid > 0) {
+    kill(f->pid, SIGKILL);
+    waitpid(f->pid, NULL, 0);
+  }
+
+  f->pid = f->child_pid = -1;
+
+  if (f->ctl_fd >= 0) close(f->ctl_fd);
+  if (f->st_fd >= 0) close(f->st_fd);
+  f->ctl_fd = f->st_fd = -1;
+
+  if (f->shm_id >= 0) shmctl(f->shm_id, IPC_RMID, NULL);
+  f->shm_id = -1;
+
+  if (f->out_fd >= 0) {
+    close(f->out_fd);
+    unlink(f->out_file); /* Ignore errors */
+  }
+
+  f->out_fd = -1;
+
+}
+
+
+/* atexit() handler. */
+
+static void fsrv_cleanup(void) {
+
+  u32 i;
+
+  for (i = 0; i < fsrv_cnt; i++) fsrv_destroy(fsrv_all[i]);
+
+}
+
+
+/* Fill in the defaults. */
+
+static void fsrv_init(struct fsrv* f) {
+
+  memset(f, 0, sizeof(struct fsrv));
+
+  f->map_size  = MAP_SIZE;
+  f->cpu       = -1;
+  f->mem_limit = MEM_LIMIT;
+
+  f->shm_id = f->out_fd = f->ctl_fd = f->st_fd = -1;
+  f->pid = f->child_pid = -1;
+
+}
+
+
+/* Make a copy of argv with @@ replaced by fn, for use as fsrv->argv. Sets
+   *found if there was any @@ to begin with; it's up to the caller to set
+   use_stdin otherwise. */
+
+static inline char** fsrv_subst_argv(char** argv, u8* fn, u8* found) {
+
+  u32 i, cnt = 0;
+  char** ret;
+
+  while (argv[cnt]) cnt++;
+
+  ret = ck_alloc(sizeof(char*) * (cnt + 1));
+
+  for (i = 0; i < cnt; i++) {
+
+    u8* aa_loc = strstr(argv[i], "@@");
+
+    if (aa_loc) {
+
+      *aa_loc = 0;
+      ret[i] = alloc_printf("%s%s%s", argv[i], fn, aa_loc + 2);
+      *aa_loc = '@';
+      *found = 1;
+
+    } else ret[i] = argv[i];
+
+  }
+
+  return ret;
+
+}
+
+
+/* Spin up a fork server and wait for its hello message. */
+
+static void fsrv_start(struct fsrv* f) {
+
+  s32 st_pipe[2], ctl_pipe[2], status = 0, rlen;
+  struct pollfd pfd;
+
+  if (fsrv_cnt == FSRV_MAX) FATAL("Too many fork servers");
+  if (!fsrv_cnt) atexit(fsrv_cleanup);
+
+  fsrv_all[fsrv_cnt++] = f;
+
+  f->shm_id = shmget(IPC_PRIVATE, MAP_SIZE, IPC_CREAT | IPC_EXCL | 0600);
+  if (f->shm_id < 0) PFATAL("shmget() failed");
+
+  f->trace_bits = shmat(f->shm_id, NULL, 0);
+  if (f->trace_bits == (void *)-1) PFATAL("shmat() failed");
+
+  unlink(f->out_file); /* Ignore errors */
+
+  f->out_fd = open(f->out_file, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (f->out_fd < 0) PFATAL("Unable to create '%s'", f->out_file);
+
+  if (pipe(st_pipe) || pipe(ctl_pipe)) PFATAL("pipe() failed");
+
+  /* Keep our ends (and our input files) out of the other servers. */
+
+  fcntl(ctl_pipe[1], F_SETFD, FD_CLOEXEC);
+  fcntl(st_pipe[0], F_SETFD, FD_CLOEXEC);
+  fcntl(f->out_fd, F_SETFD, FD_CLOEXEC);
+
+  f->pid = fork();
+
+  if (f->pid < 0) PFATAL("fork() failed");
+
+  if (!f->pid) {
+
+    struct rlimit r;
+    u8* shm_str;
+    s32 dev_null_fd = open("/dev/null", O_RDWR);
+
+    /* No FATAL() from here on; exit() would run fsrv_cleanup() and take
+       down the servers started before us. */
+
+    if (dev_null_fd < 0) _exit(1);
+
+    setsid();
+
+    if (f->quiet) {
+      dup2(dev_null_fd, 1);
+      dup2(dev_null_fd, 2);
+    }
+
+    dup2(f->use_stdin ? f->out_fd : dev_null_fd, 0);
+
+    if (dup2(ctl_pipe[0], FORKSRV_FD) < 0 ||
+        dup2(st_pipe[1], FORKSRV_FD + 1) < 0) _exit(1);
+
+    close(ctl_pipe[0]);
+    close(ctl_pipe[1]);
+    close(st_pipe[0]);
+    close(st_pipe[1]);
+    close(dev_null_fd);
+
+    if (f->mem_limit) {
+
+      r.rlim_max = r.rlim_cur = ((rlim_t)f->mem_limit) << 20;
+
+#ifdef RLIMIT_AS
+
+      setrlimit(RLIMIT_AS, &r); /* Ignore errors */
+
+#else
+
+      setrlimit(RLIMIT_DATA, &r); /* Ignore errors */
+
+#endif /* ^RLIMIT_AS */
+
+    }
+
+    if (!f->keep_cores) r.rlim_max = r.rlim_cur = 0;
+    else r.rlim_max = r.rlim_cur = RLIM_INFINITY;
+
+    setrlimit(RLIMIT_CORE, &r); /* Ignore errors */
+
+#ifdef __linux__
+
+    if (f->cpu >= 0) {
+
+      cpu_set_t c;
+
+      CPU_ZERO(&c);
+      CPU_SET(f->cpu, &c);
+
+      sched_setaffinity(0, sizeof(c), &c); /* Ignore errors */
+
+    }
+
+#endif /* __linux__ */
+
+    shm_str = alloc_printf("%d", f->shm_id);
+    setenv(SHM_ENV_VAR, shm_str, 1);
+
+    if (!getenv("LD_BIND_LAZY")) setenv("LD_BIND_NOW", "1", 0);
+
+    execv(f->target_path, f->argv);
+
+    *(u32*)f->trace_bits = EXEC_FAIL_SIG;
+    _exit(0);
+
+  }
+
+  close(ctl_pipe[0]);
+  close(st_pipe[1]);
+
+  f->ctl_fd = ctl_pipe[1];
+  f->st_fd  = st_pipe[0];
+
+  pfd.fd     = f->st_fd;
+  pfd.events = POLLIN;
+
+  while ((rlen = poll(&pfd, 1, f->exec_tmout ?
+                      f->exec_tmout * FORK_WAIT_MULT : -1)) < 0 &&
+         errno == EINTR);
+
+  if (rlen > 0) rlen = read(f->st_fd, &status, 4);
+
+  if (rlen == 4) {
+
+    if ((status & FS_OPT_ENABLED) == FS_OPT_ENABLED &&
+        (status & FS_OPT_MAPSIZE)) {
+
+      u32 tsize = FS_OPT_GET_MAPSIZE(status);
+
+      if (tsize > MAP_SIZE)
+        FATAL("Target uses a %u-byte map, but this tool was built with a "
+              "MAP_SIZE of %u", tsize, MAP_SIZE);
+
+      f->map_size = (tsize + 63) & ~63;
+
+    }
+
+    return;
+
+  }
+
+  if (!rlen) FATAL("Timeout while initializing fork server (adjusting -t may help)");
+
+  if (waitpid(f->pid, &status, 0) <= 0) PFATAL("waitpid() failed");
+
+  f->pid = -1;
+
+  if (*(u32*)f->trace_bits == EXEC_FAIL_SIG)
+    FATAL("Unable to execute target application ('%s')", f->argv[0]);
+
+  if (WIFSIGNALED(status))
+    FATAL("Fork server crashed with signal %d", WTERMSIG(status));
+
+  FATAL("Fork server handshake failed (is the target instrumented?)");
+
+}
+
+
+/* Write a test case to be used by the next run. */
+
+static void fsrv_write(struct fsrv* f, void* mem, u32 len) {
+
+  lseek(f->out_fd, 0, SEEK_SET);
+  ck_write(f->out_fd, mem, len, f->out_file);
+
+  if (ftruncate(f->out_fd, len)) PFATAL("ftruncate() failed");
+  lseek(f->out_fd, 0, SEEK_SET);
+
+}
+
+
+/* Start a run with whatever was last written by fsrv_write(). */
+
+static void fsrv_go(struct fsrv* f) {
+
+  s32 prev_timed_out = f->timed_out;
+
+  memset(f->trace_bits, 0, f->map_size);
+  MEM_BARRIER();
+
+  if (write(f->ctl_fd, &prev_timed_out, 4) != 4 ||
+      read(f->st_fd, &f->child_pid, 4) != 4 || f->child_pid <= 0)
+    FATAL("Unable to request new process from fork server (OOM?)");
+
+  f->running   = 1;
+  f->timed_out = 0;
+  f->deadline  = f->exec_tmout ? fsrv_time() + f->exec_tmout : 0;
+
+}
+
+
+/* Wait for any of the cnt servers in fs[] with a run in progress to finish,
+   killing runs that go past their deadline. Returns the index of the one
+   that's done; its trace is then in trace_bits, and fsrv_fault() tells how
+   it went. */
+
+static u32 fsrv_wait(struct fsrv** fs, u32 cnt) {
+
+  struct pollfd pfd[FSRV_MAX];
+  u32 idx[FSRV_MAX];
+
+  while (1) {
+
+    u64 now = fsrv_time();
+    s32 tmout = -1, n = 0, i;
+
+    for (i = 0; i < cnt; i++) {
+
+      struct fsrv* f = fs[i];
+
+      if (!f->running) continue;
+
+      if (f->deadline && !f->timed_out) {
+
+        if (f->deadline <= now) {
+
+          kill(f->child_pid, SIGKILL);
+          f->timed_out = 1;
+
+        } else if (tmout < 0 || (s64)(f->deadline - now) < tmout)
+          tmout = f->deadline - now;
+
+      }
+
+      pfd[n].fd     = f->st_fd;
+      pfd[n].events = POLLIN;
+      idx[n++]      = i;
+
+    }
+
+    if (!n) FATAL("fsrv_wait() called with nothing running");
+
+    if (poll(pfd, n, tmout) < 0) {
+      if (errno == EINTR) continue;
+      PFATAL("poll() failed");
+    }
+
+    for (i = 0; i < n; i++) {
+
+      struct fsrv* f = fs[idx[i]];
+
+      if (!pfd[i].revents) continue;
+
+      if (read(f->st_fd, &f->status, 4) != 4)
+        FATAL("Unable to communicate with fork server (OOM?)");
+
+      f->running   = 0;
+      f->child_pid = -1;
+
+      MEM_BARRIER();
+
+      return idx[i];
+
+    }
+
+  }
+
+}
+
+
+/* Classify the outcome of the last run. */
+
+static u8 fsrv_fault(struct fsrv* f) {
+
+  if (f->timed_out) return FSRV_TMOUT;
+
+  if (WIFSIGNALED(f->status)) return FSRV_CRASH;
+
+  if (WIFEXITED(f->status) && WEXITSTATUS(f->status) == MSAN_ERROR)
+    return FSRV_CRASH;
+
+  return FSRV_NONE;
+
+}
+
+
+/* Run a single test case and wait for it. */
+
+static inline u8 fsrv_run(struct fsrv* f, void* mem, u32 len) {
+
+  fsrv_write(f, mem, len);
+  fsrv_go(f);
+  fsrv_wait(&f, 1);
+
+  return fsrv_fault(f);
+
+}
+
+#endif /* !_HAVE_FSRV_INL_H */
@@ -73,6 +73,11 @@
 #define ALLOC_CANARY  0xAACCAACC
 #define ALLOC_CLOBBER 0xCC
 
+/* Canary for buffers that came from the pools, so that free() knows where to
+   put them back: */
+
+#define POOL_CANARY   0xAACCAAC5
+
 #define PTR_C(_p) (((u32*)(_p))[-1])
 #define PTR_L(_p) (((u32*)(_p))[-2])
 
@@ -81,21 +86,215 @@
 static u32 max_mem = MAX_ALLOC;         /* Max heap usage to permit         */
 static u8  alloc_verbose,               /* Additional debug messages        */
            hard_fail,                   /* abort() when max_mem exceeded?   */
-           no_calloc_over;              /* abort() on calloc() overflows?   */
+           no_calloc_over,              /* abort() on calloc() overflows?   */
+           use_pool;                    /* Recycle slots (AFL_LD_POOL)?     */
 
 static __thread size_t total_mem;       /* Currently allocated mem          */
 
 static __thread u32 call_depth;         /* To avoid recursion via fprintf() */
 
+/* In pool mode, every buffer of up to DISLOC_POOL_PAGES pages lives in a
+   slot of exactly that many pages, followed by a guard page - the same
+   layout as a fresh mapping would have. Slots that are neither in use nor
+   in the quarantine sit in the free list of their size, PROT_NONE, and get
+   opened up again when handed out. Freed slots go through the quarantine
+   ring first, so that the memory isn't reused right away. */
+
+struct pool {
+  void** free;                          /* Stack of free slots              */
+  u32    free_cnt,                      /* Number of free slots             */
+         free_max;                      /* Room on the stack                */
+};
+
+struct q_slot {
+  void*  addr;                          /* Slot in the quarantine           */
+  u32    pages;                         /* Pages in the slot (no guard)     */
+};
+
+static struct pool pools[DISLOC_POOL_PAGES + 1];
+
+static struct q_slot* quarantine;       /* The ring                         */
+static u32 q_len = DISLOC_QUARANTINE,   /* Size of the ring                 */
+           q_head, q_cnt;               /* Oldest entry and number used     */
+
+static volatile u8 pool_lock;           /* Pools are shared by all threads  */
+
+#define POOL_LOCK() do { \
+    while (__sync_lock_test_and_set(&pool_lock, 1)) ; \
+  } while (0)
+
+#define POOL_UNLOCK() __sync_lock_release(&pool_lock)
+
+
+/* Put a free slot on the stack for its size, making room if needed. The
+   stacks, like everything else here, can't come from malloc(). Returns 0 on
+   failure. Called with the lock held. */
+
+static u8 pool_push(u32 pages, void* slot) {
+
+  struct pool* p = pools + pages;
+
+  if (p->free_cnt == p->free_max) {
+
+    u32 new_max = p->free_max ? p->free_max * 2 : PAGE_SIZE / sizeof(void*);
+    void** new_free = mmap(NULL, new_max * sizeof(void*),
+                           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1, 0);
+
+    if (new_free == (void*)-1) return 0;
+
+    if (p->free) {
+      memcpy(new_free, p->free, p->free_cnt * sizeof(void*));
+      munmap(p->free, p->free_max * sizeof(void*));
+    }
+
+    p->free     = new_free;
+    p->free_max = new_max;
+
+  }
+
+  p->free[p->free_cnt++] = slot;
+  return 1;
+
+}
+
+
+/* Grab a new chunk of slots of the given size. Everything starts out as
+   PROT_NONE, so there's just one syscall for the whole lot. Returns 0 on
+   failure. Called with the lock held. */
+
+static u8 pool_grow(u32 pages) {
+
+  u32 slot_len = (pages + 1) * PAGE_SIZE,
+      cnt = MAX(1, DISLOC_POOL_CHUNK / slot_len), i;
+  u8* chunk;
+
+  chunk = mmap(NULL, cnt * slot_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS,
+               -1, 0);
+
+  if (chunk == (void*)-1) return 0;
+
+  /* In reverse, so that slots get handed out in ascending order. */
+
+  for (i = cnt; i--; )
+    if (!pool_push(pages, chunk + i * slot_len)) return 0;
+
+  return 1;
+
+}
+
+
+/* Take a slot out of the pool, and make its pages (but not the guard page)
+   accessible again. */
+
+static void* pool_alloc(u32 pages) {
+
+  void* slot;
+
+  POOL_LOCK();
+
+  if (!pools[pages].free_cnt && !pool_grow(pages)) {
+    POOL_UNLOCK();
+    return NULL;
+  }
+
+  slot = pools[pages].free[--pools[pages].free_cnt];
+
+  POOL_UNLOCK();
+
+  if (mprotect(slot, pages * PAGE_SIZE, PROT_READ | PROT_WRITE))
+    FATAL("mprotect() failed when allocating memory");
+
+  return slot;
+
+}
+
+
+/* Lock up a freed slot and put it in the quarantine. Whatever falls off the
+   other end of the ring goes back to the pool. */
+
+static void pool_free(void* slot, u32 pages) {
+
+  if (mprotect(slot, pages * PAGE_SIZE, PROT_NONE))
+    FATAL("mprotect() failed when freeing memory");
+
+  POOL_LOCK();
+
+  if (q_cnt == q_len) {
+
+    if (q_len) {
+
+      struct q_slot* old = quarantine + q_head;
+      void* old_addr = old->addr;
+      u32 old_pages = old->pages;
+
+      old->addr  = slot;
+      old->pages = pages;
+      q_head = (q_head + 1) % q_len;
+
+      slot  = old_addr;
+      pages = old_pages;
+
+    }
+
+    /* Failing this just leaks the slot. */
+
+    pool_push(pages, slot);
+
+  } else {
+
+    struct q_slot* q = quarantine + (q_head + q_cnt) % q_len;
+
+    q->addr  = slot;
+    q->pages = pages;
+    q_cnt++;
+
+  }
+
+  POOL_UNLOCK();
+
+}
+
+
+/* Empty the quarantine into the pools. Meant to be called between runs of
+   persistent-mode targets (afl-llvm-rt does that for __AFL_LOOP()), so that
+   every iteration gets to reuse what the previous ones freed, but not what
+   it freed itself. Takes no syscalls. */
+
+void __dislocator_reset(void) {
+
+  if (!use_pool) return;
+
+  POOL_LOCK();
+
+  while (q_cnt) {
+
+    struct q_slot* q = quarantine + q_head;
+
+    pool_push(q->pages, q->addr);
+
+    q_head = (q_head + 1) % q_len;
+    q_cnt--;
+
+  }
+
+  POOL_UNLOCK();
+
+  DEBUGF("quarantine flushed");
+
+}
+
 
 /* This is the main alloc function. It allocates one page more than necessary,
    sets that tailing page to PROT_NONE, and then increments the return address
    so that it is right-aligned to that boundary. Since it always uses mmap(),
-   the returned memory will be zeroed. */
+   the returned memory will be zeroed - except in pool mode, where smaller
+   buffers come from recycled slots, and calloc() has to take care of that. */
 
 static void* __dislocator_alloc(size_t len) {
 
   void* ret;
+  u32   pages = PG_COUNT(len + 8);
 
 
   if (total_mem + len > max_mem || total_mem + len < total_mem) {
@@ -110,6 +309,34 @@ static void* __dislocator_alloc(size_t len) {
 
   }
 
+  /* Pooled slots have the same layout as the mapping below, guard page and
+     all. */
+
+  if (use_pool && pages <= DISLOC_POOL_PAGES) {
+
+    ret = pool_alloc(pages);
+
+    if (!ret) {
+
+      if (hard_fail) FATAL("mmap() failed on alloc (OOM?)");
+
+      DEBUGF("mmap() failed on alloc (OOM?)");
+
+      return NULL;
+
+    }
+
+    ret += PAGE_SIZE * pages - len;
+
+    PTR_L(ret) = len;
+    PTR_C(ret) = POOL_CANARY;
+
+    total_mem += len;
+
+    return ret;
+
+  }
+
   /* We will also store buffer length and a canary below the actual buffer, so
      let's add 8 bytes for that. */
 
@@ -174,6 +401,8 @@ void* calloc(size_t elem_len, size_t elem_cnt) {
 
   ret = __dislocator_alloc(len);
 
+  if (ret && len && PTR_C(ret) == POOL_CANARY) memset(ret, 0, len);
+
   DEBUGF("calloc(%zu, %zu) = %p [%zu total]", elem_len, elem_cnt, ret,
          total_mem);
 
@@ -203,7 +432,8 @@ void* malloc(size_t len) {
 
 /* The wrapper for free(). This simply marks the entire region as PROT_NONE.
    If the region is already freed, the code will segfault during the attempt to
-   read the canary. Not very graceful, but works, right? */
+   read the canary. Not very graceful, but works, right? Pooled buffers also
+   go into the quarantine. */
 
 void free(void* ptr) {
 
@@ -213,12 +443,18 @@ void free(void* ptr) {
 
   if (!ptr) return;
 
-  if (PTR_C(ptr) != ALLOC_CANARY) FATAL("bad allocator canary on free()");
+  if (PTR_C(ptr) != ALLOC_CANARY && PTR_C(ptr) != POOL_CANARY)
+    FATAL("bad allocator canary on free()");
 
   len = PTR_L(ptr);
 
   total_mem -= len;
 
+  if (PTR_C(ptr) == POOL_CANARY) {
+    pool_free(ptr + len - PG_COUNT(len + 8) * PAGE_SIZE, PG_COUNT(len + 8));
+    return;
+  }
+
   /* Protect everything. Note that the extra page at the end is already
      set as PROT_NONE, so we don't need to touch that. */
 
@@ -243,7 +479,8 @@ void* realloc(void* ptr, size_t len) {
 
   if (ret && ptr) {
 
-    if (PTR_C(ptr) != ALLOC_CANARY) FATAL("bad allocator canary on realloc()");
+    if (PTR_C(ptr) != ALLOC_CANARY && PTR_C(ptr) != POOL_CANARY)
+      FATAL("bad allocator canary on realloc()");
 
     memcpy(ret, ptr, MIN(len, PTR_L(ptr)));
     free(ptr);
@@ -272,4 +509,23 @@ __attribute__((constructor)) void __dislocator_init(void) {
   hard_fail = !!getenv("AFL_LD_HARD_FAIL");
   no_calloc_over = !!getenv("AFL_LD_NO_CALLOC_OVER");
 
+  if (getenv("AFL_LD_POOL")) {
+
+    tmp = getenv("AFL_LD_QUARANTINE");
+    if (tmp) q_len = atoi(tmp);
+
+    if (q_len) {
+
+      quarantine = mmap(NULL, q_len * sizeof(struct q_slot),
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+
+      if (quarantine == (void*)-1) FATAL("mmap() failed for the quarantine");
+
+    }
+
+    use_pool = 1;
+
+  }
+
 }
@@ -27,8 +27,14 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
 
 #include "../types.h"
 #include "../config.h"
@@ -48,7 +54,44 @@ static struct mapping {
 
 static u32   __tokencap_ro_cnt;
 static u8    __tokencap_ro_loaded;
-static FILE* __tokencap_out_file;
+static s32   __tokencap_out_fd = -1;
+
+/* Tokens seen so far. This lives in a shared mapping set up before the fork
+   server starts, so that every execution under afl-fuzz sees what the others
+   have already reported, and nothing is written twice. The set holds hashes
+   only; new tokens also go into a ring of records, from which whoever comes
+   next writes them out in batches.
+
+   A writer first reserves a record (by bumping head), then claims the hash,
+   and finally publishes the record by storing its sequence number - the
+   position it was reserved at, plus one. Records whose claim was lost leave
+   len at zero and are just skipped. The ring is reused once flushed (tail
+   moves past it). Everything is lock-free; a record that a killed process
+   reserved but never published holds the flush up for TOKENCAP_STALL_MS,
+   and is then skipped, so that costs at most the token it was working on. */
+
+#define TC_TBL_SIZE   (1 << TOKENCAP_TBL_POW2)
+#define TC_MAX_PROBES 64
+
+struct tc_rec {
+
+  u32 seq;                              /* Position + 1, once published     */
+  u8  len;                              /* Token length, 0 if none          */
+  u8  data[MAX_AUTO_EXTRA];             /* The token                        */
+
+};
+
+static struct tc_state {
+
+  u32 head;                             /* Records handed out               */
+  u32 tail;                             /* Records written out              */
+  u32 stall_seq;                        /* Unpublished record seen, plus 1  */
+  u8  full_noted;                       /* Warned about a full set?         */
+  u64 stall_ms;                         /* ...and since when                */
+  u64 seen[TC_TBL_SIZE];                /* Hashes of known tokens           */
+  struct tc_rec ring[TOKENCAP_RING];    /* Tokens waiting to be written     */
+
+}* __tokencap_state;
 
 
 /* Identify read-only regions in memory. Only parameters that fall into these
@@ -100,22 +143,80 @@ static u8 __tokencap_is_ro(const void* ptr) {
 }
 
 
-/* Dump an interesting token to output file, quoting and escaping it
-   properly. */
+/* FNV-1a; zero marks empty slots, so it's not a valid hash. */
 
-static void __tokencap_dump(const u8* ptr, size_t len, u8 is_text) {
+static u64 __tokencap_hash(const u8* ptr, u32 len) {
+
+  u64 h = 0xcbf29ce484222325ULL;
+
+  while (len--) {
+    h ^= *(ptr++);
+    h *= 0x100000001b3ULL;
+  }
+
+  return h ? h : 1;
+
+}
+
+
+/* Check if a hash is in the set, without touching it. */
+
+static u8 __tokencap_seen(u64 h) {
+
+  u64* seen = __tokencap_state->seen;
+  u32 idx = h & (TC_TBL_SIZE - 1), i;
+
+  for (i = 0; i < TC_MAX_PROBES; i++, idx = (idx + 1) & (TC_TBL_SIZE - 1)) {
+
+    u64 cur = __atomic_load_n(seen + idx, __ATOMIC_RELAXED);
+
+    if (!cur) return 0;
+    if (cur == h) return 1;
+
+  }
+
+  return 0;
+
+}
+
+
+/* Add a hash to the set. Returns 1 if it wasn't there before, 0 if it was, or
+   2 if there's no room left near its slot. */
+
+static u8 __tokencap_claim(u64 h) {
+
+  u64* seen = __tokencap_state->seen;
+  u32 idx = h & (TC_TBL_SIZE - 1), i;
+
+  for (i = 0; i < TC_MAX_PROBES; i++, idx = (idx + 1) & (TC_TBL_SIZE - 1)) {
+
+    u64 cur = __atomic_load_n(seen + idx, __ATOMIC_RELAXED);
+
+    if (!cur && !(cur = __sync_val_compare_and_swap(seen + idx, 0, h)))
+      return 1;
+
+    if (cur == h) return 0;
+
+  }
+
+  return 2;
+
+}
+
+
+/* Quote and escape a token for the output file, one per line, in the format
+   that afl-fuzz -x expects. Returns the number of bytes written to buf, which
+   must have room for MAX_AUTO_EXTRA * 4 + 3 of them. */
+
+static u32 __tokencap_format(u8* buf, const u8* ptr, u32 len) {
 
-  u8 buf[MAX_AUTO_EXTRA * 4 + 1];
   u32 i;
   u32 pos = 0;
 
-  if (len < MIN_AUTO_EXTRA || len > MAX_AUTO_EXTRA || !__tokencap_out_file)
-    return;
+  buf[pos++] = '"';
 
   for (i = 0; i < len; i++) {
 
-    if (is_text && !ptr[i]) break;
-
     switch (ptr[i]) {
 
       case 0 ... 31:
@@ -135,9 +236,216 @@ static void __tokencap_dump(const u8* ptr, size_t len, u8 is_text) {
 
   }
 
-  buf[pos] = 0;
+  buf[pos++] = '"';
+  buf[pos++] = '\n';
+
+  return pos;
+
+}
+
+
+static u64 __tokencap_ms(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+
+}
+
+
+/* Write out whatever is ready in the ring. When several processes try this
+   at once, each batch still goes to the one that wins the race for it. */
+
+static void __tokencap_flush(void) {
+
+  struct tc_state* s = __tokencap_state;
+  u8 buf[4096];
+
+  if (!s) return;
+
+  while (1) {
+
+    u32 start = __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE),
+        head  = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE),
+        end   = start, pos = 0;
+
+    while (end != head && pos + MAX_AUTO_EXTRA * 4 + 3 <= sizeof(buf)) {
+
+      struct tc_rec* r = s->ring + end % TOKENCAP_RING;
+
+      if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != end + 1) {
+
+        /* Not published yet. Give the writer some time, but if it's still
+           not there after TOKENCAP_STALL_MS, it's not going to be. */
+
+        u64 now = __tokencap_ms();
+
+        if (s->stall_seq != end + 1) {
+          s->stall_seq = end + 1;
+          s->stall_ms  = now;
+          break;
+        }
+
+        if (now - s->stall_ms < TOKENCAP_STALL_MS) break;
+
+      } else if (r->len) {
+
+        pos += __tokencap_format(buf + pos, r->data, r->len);
+
+      }
+
+      end++;
+
+    }
+
+    if (end == start) return;
+
+    /* Once tail moves on, the records can be reused, so the copy in buf is
+       all we have; if someone else got there first, it's theirs. */
+
+    if (!__sync_bool_compare_and_swap(&s->tail, start, end)) continue;
+
+    if (pos && write(__tokencap_out_fd, buf, pos) != pos) return;
+
+  }
+
+}
+
+
+/* Reserve a record in the ring, flushing it if it's full. Returns 0 if there
+   is still no room after that. */
+
+static u8 __tokencap_reserve(u32* seq) {
+
+  struct tc_state* s = __tokencap_state;
+  u8 flushed = 0;
+
+  while (1) {
+
+    u32 head = __atomic_load_n(&s->head, __ATOMIC_ACQUIRE);
+
+    if (head - __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE) >= TOKENCAP_RING) {
+
+      if (flushed++) return 0;
+      __tokencap_flush();
+      continue;
+
+    }
+
+    if (__sync_bool_compare_and_swap(&s->head, head, head + 1)) {
+      *seq = head;
+      return 1;
+    }
+
+  }
+
+}
+
+
+/* Record an interesting token, unless it's been seen before. Tokens that
+   don't fit in the ring right now are not claimed, so they get another
+   chance the next time around. */
+
+static void __tokencap_dump(const u8* ptr, size_t len, u8 is_text) {
+
+  struct tc_state* s = __tokencap_state;
+  struct tc_rec* r;
+  u32 i, seq;
+  u8  full = 0;
+  u64 h;
+
+  if (!s) return;
+
+  if (is_text)
+    for (i = 0; i < len && i <= MAX_AUTO_EXTRA; i++)
+      if (!ptr[i]) { len = i; break; }
+
+  if (len < MIN_AUTO_EXTRA || len > MAX_AUTO_EXTRA) return;
+
+  h = __tokencap_hash(ptr, len);
+
+  if (__tokencap_seen(h) || !__tokencap_reserve(&seq)) return;
+
+  r = s->ring + seq % TOKENCAP_RING;
+
+  switch (__tokencap_claim(h)) {
+
+    case 1:
+
+      memcpy(r->data, ptr, len);
+      r->len = len;
+      break;
+
+    case 2:
+
+      full = 1;
+
+      /* Fall through */
+
+    default:
+
+      r->len = 0;
+
+  }
+
+  __atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELEASE);
 
-  fprintf(__tokencap_out_file, "\"%s\"\n", buf);    
+  /* If the set is full, say so once, in a form that -x skips over. */
+
+  if (full && !__sync_lock_test_and_set(&s->full_noted, 1)) {
+
+    static const u8 note[] = "# libtokencap: token set full, "
+                             "dropping new tokens\n";
+
+    if (write(__tokencap_out_fd, note, sizeof(note) - 1) < 0) return;
+
+  }
+
+  if (seq + 1 - __atomic_load_n(&s->tail, __ATOMIC_RELAXED) >= TOKENCAP_FLUSH)
+    __tokencap_flush();
+
+}
+
+
+/* Take note of the tokens already in the output file, so that they don't get
+   written again when it's appended to across many runs. */
+
+static void __tokencap_load_seen(u8* fn) {
+
+  u8 buf[MAX_LINE];
+  FILE* f = fopen(fn, "r");
+
+  if (!f) return;
+
+  while (fgets(buf, MAX_LINE, f)) {
+
+    u8  tok[MAX_AUTO_EXTRA];
+    u8* lptr = buf;
+    u32 len = 0;
+
+    if (*(lptr++) != '"') continue;
+
+    while (*lptr && *lptr != '"' && len < MAX_AUTO_EXTRA) {
+
+      if (lptr[0] == '\\' && lptr[1] == 'x' && isxdigit(lptr[2]) &&
+          isxdigit(lptr[3])) {
+
+        u8 hex[3] = { lptr[2], lptr[3], 0 };
+
+        tok[len++] = strtoul(hex, NULL, 16);
+        lptr += 4;
+
+      } else tok[len++] = *(lptr++);
+
+    }
+
+    if (*lptr == '"' && len >= MIN_AUTO_EXTRA)
+      __tokencap_claim(__tokencap_hash(tok, len));
+
+  }
+
+  fclose(f);
 
 }
 
@@ -300,13 +608,33 @@ char* strcasestr(const char* haystack, const char* needle) {
 }
 
 
-/* Init code to open the output file (or default to stderr). */
+/* Init code to set up the shared state and open the output file (or default
+   to stderr). */
 
 __attribute__((constructor)) void __tokencap_init(void) {
 
   u8* fn = getenv("AFL_TOKEN_FILE");
-  if (fn) __tokencap_out_file = fopen(fn, "a");
-  if (!__tokencap_out_file) __tokencap_out_file = stderr;
+
+  __tokencap_state = mmap(NULL, sizeof(struct tc_state),
+                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                          -1, 0);
+
+  if (__tokencap_state == MAP_FAILED) __tokencap_state = NULL;
+
+  if (fn) __tokencap_out_fd = open(fn, O_WRONLY | O_CREAT | O_APPEND, 0666);
+
+  if (__tokencap_out_fd < 0) __tokencap_out_fd = 2;
+  else if (__tokencap_state) __tokencap_load_seen(fn);
+
+}
+
+
+/* Whatever is left goes out when the process exits normally; tokens from
+   executions that crashed or timed out are picked up by the next one. */
+
+__attribute__((destructor)) void __tokencap_fini(void) {
+
+  __tokencap_flush();
 
 }
 
@@ -103,7 +103,8 @@ static void find_obj(u8* argv0) {
 
 static void edit_params(u32 argc, char** argv) {
 
-  u8 fortify_set = 0, asan_set = 0, x_set = 0, bit_mode = 0;
+  u8 fortify_set = 0, asan_set = 0, x_set = 0, bit_mode = 0,
+     lto_mode = !!getenv("AFL_LLVM_LTO"), link_stage = 1;
   u8 *name;
 
   cc_params = ck_alloc((argc + 128) * sizeof(u8*));
@@ -133,10 +134,42 @@ static void edit_params(u32 argc, char** argv) {
   cc_params[cc_par_cnt++] = "-sanitizer-coverage-block-threshold=0";
 #endif
 #else
-  cc_params[cc_par_cnt++] = "-Xclang";
-  cc_params[cc_par_cnt++] = "-load";
-  cc_params[cc_par_cnt++] = "-Xclang";
-  cc_params[cc_par_cnt++] = alloc_printf("%s/afl-llvm-pass.so", obj_path);
+
+  /* In LTO mode, the per-file compiler output is just bitcode and the pass
+     runs once, from within lld, over the fully linked module. This is what
+     lets CollAFL hand out edge IDs that don't collide across translation
+     units. When we're merely compiling, the pass is not loaded at all. */
+
+  if (lto_mode) {
+
+    u32 i;
+
+    for (i = 1; i < argc; i++)
+      if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "-S") ||
+          !strcmp(argv[i], "-E")) link_stage = 0;
+
+    cc_params[cc_par_cnt++] = "-flto";
+
+    if (link_stage) {
+
+      u8* alt_ld = getenv("AFL_REAL_LD");
+
+      cc_params[cc_par_cnt++] = alt_ld ? alloc_printf("-fuse-ld=%s", alt_ld) :
+                                (u8*)"-fuse-ld=lld";
+      cc_params[cc_par_cnt++] =
+        alloc_printf("-Wl,-mllvm=-load=%s/afl-llvm-pass.so", obj_path);
+
+    }
+
+  } else {
+
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = "-load";
+    cc_params[cc_par_cnt++] = "-Xclang";
+    cc_params[cc_par_cnt++] = alloc_printf("%s/afl-llvm-pass.so", obj_path);
+
+  }
+
 #endif /* ^USE_TRACE_PC */
 
   cc_params[cc_par_cnt++] = "-Qunused-arguments";
@@ -204,6 +237,9 @@ static void edit_params(u32 argc, char** argv) {
   if (getenv("AFL_INST_RATIO"))
     FATAL("AFL_INST_RATIO not available at compile time with 'trace-pc'.");
 
+  if (lto_mode)
+    FATAL("AFL_LLVM_LTO is not available with 'trace-pc'.");
+
 #endif /* USE_TRACE_PC */
 
   if (!getenv("AFL_DONT_OPTIMIZE")) {
@@ -272,6 +308,27 @@ static void edit_params(u32 argc, char** argv) {
 #endif /* ^__APPLE__ */
     "_I(); } while (0)";
 
+  /* Shared-memory test case delivery. __AFL_FUZZ_INIT() goes at file scope
+     and tells the runtime that the program wants its inputs this way; the
+     other two macros fall back to reading stdin when afl-fuzz isn't around
+     (or is too old to offer the region), so the binary still works with
+     afl-showmap, afl-tmin and friends. */
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_INIT()="
+    "int __afl_sharedmem_fuzzing = 1; "
+    "extern unsigned int *__afl_fuzz_len; "
+    "extern unsigned char *__afl_fuzz_ptr; "
+    "unsigned char __afl_fuzz_alt[" STRINGIFY(MAX_FILE) "]; "
+    "unsigned char *__afl_fuzz_alt_ptr = __afl_fuzz_alt";
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_TESTCASE_BUF="
+    "(__afl_fuzz_ptr ? __afl_fuzz_ptr : __afl_fuzz_alt_ptr)";
+
+  cc_params[cc_par_cnt++] = "-D__AFL_FUZZ_TESTCASE_LEN="
+    "(__afl_fuzz_ptr ? *__afl_fuzz_len : "
+    "(*__afl_fuzz_len = read(0, __afl_fuzz_alt_ptr, " STRINGIFY(MAX_FILE)
+    ")) == 0xffffffff ? 0 : *__afl_fuzz_len)";
+
   if (x_set) {
     cc_params[cc_par_cnt++] = "-x";
     cc_params[cc_par_cnt++] = "none";
@@ -336,7 +393,9 @@ int main(int argc, char** argv) {
          "an LLVM pass and tends to offer improved performance with slow programs.\n\n"
 
          "You can specify custom next-stage toolchain via AFL_CC and AFL_CXX. Setting\n"
-         "AFL_HARDEN enables hardening optimizations in the compiled code.\n\n",
+         "AFL_HARDEN enables hardening optimizations in the compiled code; setting\n"
+         "AFL_LLVM_LTO assigns collision-free edge IDs for the whole program at link\n"
+         "time (requires lld).\n\n",
          BIN_PATH, BIN_PATH);
 
     exit(1);
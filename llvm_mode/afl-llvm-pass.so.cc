@@ -35,21 +35,25 @@
 #include "../debug.h"
 
 #include <vector>
-#include <map>
-#include <set> 
-#include <iostream> 
+#include <array>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <algorithm>
+#include <chrono>
+#include <string>
 
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/Statistic.h"
+#include "llvm/Config/llvm-config.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Support/Debug.h"
 #include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/ModuleUtils.h"
 #include "llvm/IR/CFG.h"
+#include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Value.h"
@@ -57,17 +61,6 @@
 using namespace llvm;
 using namespace std; 
 
-vector<BasicBlock*> BBs, MultiBBs, SingleBBs; 
-map<BasicBlock*, vector<BasicBlock*>> Preds; 
-map<BasicBlock*, uint32_t> Keys; 
-
-map<BasicBlock*, uint32_t> SingleHash; 
-set<uint32_t> Hashes; 
-map<BasicBlock*, array<uint32_t ,2>> Params; 
-vector<BasicBlock*> Solv, UnSolv; 
-map<pair<uint32_t, uint32_t>, uint32_t> HashMap; 
-set<uint32_t> FreeHashes; 
-uint32_t globalY; 
 namespace {
 
   class AFLCoverage : public ModulePass {
@@ -75,19 +68,51 @@ namespace {
     public:
 
       static char ID;
-      AFLCoverage() : ModulePass(ID) { }
+      AFLCoverage(bool lto = false) : ModulePass(ID), LTOMode(lto) { }
 
       bool runOnModule(Module &M) override;
+      void ResetState(); 
       void AssignUniqueRandomKeysToBBs(); 
       void CalcFmul(); 
       void CalcFhash();
       void CalcFsingle(); 
       uint32_t RandomPopFreeHashes();  
-      bool isIntersection(set<uint32_t> &a, set <uint32_t> &b); 
+      void SizeMapForModule(); 
+      void WriteEdgeTable(Module &M, const char *dir); 
       // StringRef getPassName() const override {
       //  return "American Fuzzy Lop Instrumentation";
       // }
 
+    protected:
+
+      /* How each block gets its edge ID. */
+
+      enum : uint8_t { BB_FMUL, BB_FHASH, BB_SINGLE };
+
+      bool     LTOMode;                   /* Running at link time?       */
+      uint32_t MapSizePow2 = MAP_SIZE_POW2, /* Map size used to solve      */
+               MapSize     = MAP_SIZE;
+
+      /* Blocks are numbered once, in module order; everything below is
+         indexed by that number. Predecessors are kept CSR-style: the preds
+         of block i are PredList[PredStart[i] .. PredStart[i + 1]). */
+
+      vector<BasicBlock*> BBs; 
+      vector<uint32_t>    MultiBBs, SingleBBs, Solv, UnSolv; 
+      vector<uint32_t>    PredStart, PredList; 
+      vector<uint32_t>    Keys; 
+      vector<uint8_t>     Kind; 
+
+      /* BB_FMUL: {x, z}; BB_FHASH: {table offset, table mask};
+         BB_SINGLE: {map slot, unused}. */
+
+      vector<array<uint32_t, 2>> Params; 
+
+      vector<uint64_t> UsedHashes;        /* MapSize-bit bitmap of taken IDs */
+      uint32_t         FreeCursor;        /* No free ID below this one       */
+      uint32_t         globalY; 
+      vector<uint64_t> FhashTbl; 
+
   };
 
 }
@@ -95,68 +120,139 @@ namespace {
 
 char AFLCoverage::ID = 0;
 
+#define BIT_GET(_b, _h) ((_b)[(_h) >> 6] & (1ULL << ((_h) & 63)))
+#define BIT_SET(_b, _h) ((_b)[(_h) >> 6] |= (1ULL << ((_h) & 63)))
+#define BIT_CLR(_b, _h) ((_b)[(_h) >> 6] &= ~(1ULL << ((_h) & 63)))
+
+/* The pass object may be run on more than one module (e.g., by a linker
+   plugin), so don't let anything carry over. */
+
+void AFLCoverage::ResetState() {
+
+  BBs.clear(); 
+  MultiBBs.clear(); 
+  SingleBBs.clear(); 
+  Solv.clear(); 
+  UnSolv.clear(); 
+  PredStart.clear(); 
+  PredList.clear(); 
+  Keys.clear(); 
+  Kind.clear(); 
+  Params.clear(); 
+  UsedHashes.clear(); 
+  FhashTbl.clear(); 
+
+  FreeCursor  = 1; 
+  globalY     = 0; 
+  MapSizePow2 = MAP_SIZE_POW2; 
+  MapSize     = MAP_SIZE; 
+
+}
+
 void AFLCoverage::AssignUniqueRandomKeysToBBs() {
-  for(auto &BB: BBs) {
-    Keys[&*BB] = AFL_R(MAP_SIZE);  
+  Keys.resize(BBs.size()); 
+  for(auto &K: Keys) {
+    K = AFL_R(MapSize);  
   }
 }
-bool AFLCoverage::isIntersection(set<uint32_t> &a, set <uint32_t> &b) {
-  for(auto &it_a: a) {
-    if(b.find(it_a) != b.end()) {
-      return false; 
-    } 
+
+/* In LTO mode we see every edge of the program at once, so instead of
+   solving against the compile-time MAP_SIZE we pick the smallest power of
+   two that still leaves the solver a comfortable load factor. Per-TU builds
+   can't know the final edge count and keep using MAP_SIZE. */
+
+void AFLCoverage::SizeMapForModule() {
+
+  uint64_t edges = SingleBBs.size();
+
+  if (!LTOMode) return;
+
+  for(auto &i: MultiBBs) {
+    edges += PredStart[i + 1] - PredStart[i]; 
   }
-  return true; 
+
+  MapSizePow2 = LTO_MAP_SIZE_POW2_MIN;
+
+  while (MapSizePow2 < MAP_SIZE_POW2 &&
+         (1ULL << MapSizePow2) < edges * LTO_MAP_LOAD_DIV)
+    MapSizePow2++;
+
+  MapSize = 1 << MapSizePow2;
+
 }
 
+/* Solve Fmul for every multi-predecessor block. For each y, blocks are
+   visited in order and given the first (x, z) whose edge hashes are both
+   pairwise distinct and not yet taken. Taken hashes live in a flat bitmap,
+   so a candidate costs one probe per predecessor and is dropped on the
+   first collision; the predecessor keys are shifted once per y rather than
+   once per candidate. */
+
 void AFLCoverage::CalcFmul() {
-  for(uint32_t y = 1; y < MAP_SIZE_POW2; y++) {
-    Hashes.clear(); 
-    Params.clear(); 
+
+  /* The instrumentation computes (cur >> x) ^ (prev_loc + z), where prev_loc
+     is the predecessor's key >> y; anything that lands outside the map
+     is a miss. */
+
+  uint32_t hash_lim = MapSize;
+  vector<uint64_t> cand((hash_lim + 63) / 64);
+  vector<uint32_t> prev_sh, edge_hashes;
+
+  UsedHashes.resize((hash_lim + 63) / 64);
+  Params.resize(BBs.size());
+  Kind.resize(BBs.size(), BB_FMUL);
+
+  /* If no y solves anything, we're left with the last one tried. */
+
+  globalY = MapSizePow2 - 1;
+
+  for(uint32_t y = 1; y < MapSizePow2; y++) {
     Solv.clear();
     UnSolv.clear(); 
+    fill(UsedHashes.begin(), UsedHashes.end(), 0);
 
-    for(auto &bb_it: MultiBBs) {
-      BasicBlock* BB= &*bb_it; 
+    for(auto &bb: MultiBBs) {
       bool find_one = false; 
-      for(uint32_t x = 1; x < MAP_SIZE_POW2; x++) {
-        if(find_one) {
-          break; 
-        }
-        for(uint32_t z = 1; z < MAP_SIZE_POW2; z++) {
-          set<uint32_t> tmpHashSet; 
-          uint32_t cur = Keys[BB]; 
-// #ifdef DEBUG
-//           cout << "MultiBB***** " << endl;
-// #endif 
-          for(auto &p: Preds[BB]) {
-            BasicBlock* predBB= &*p; 
-            uint32_t edgeHash = (cur >> x) xor (Keys[predBB] >> y) + z; 
-// #ifdef DEBUG 
-//             cout << "cur: " << cur << " prev: " << Keys[predBB] << endl; 
-//             cout << "x: " << x << " y: " << y << " z: " << z << endl; 
-//             cout << edgeHash << " " << endl; 
-// #endif  
-            tmpHashSet.insert(edgeHash);  
-          }   
-
-// #ifdef DEBUG 
-//   cout << "tmpHashSet size: " << tmpHashSet.size() << endl; 
-//   cout << "PredsBB size: " << Preds[BB].size() << endl; 
-// #endif 
-          if(tmpHashSet.size() == Preds[BB].size() && isIntersection(tmpHashSet, Hashes)) {
-            Solv.push_back(BB); 
-            Params[BB] = {x,z}; 
-            for(auto &i: tmpHashSet) {
-              Hashes.insert(i); 
+      uint32_t cur = Keys[bb]; 
+
+      prev_sh.clear();
+      for(uint32_t p = PredStart[bb]; p < PredStart[bb + 1]; p++) {
+        prev_sh.push_back(Keys[PredList[p]] >> y);
+      }
+
+      for(uint32_t x = 1; x < MapSizePow2 && !find_one; x++) {
+        for(uint32_t z = 1; z < MapSizePow2; z++) {
+          bool ok = true; 
+
+          edge_hashes.clear();
+          for(auto &ps: prev_sh) {
+            uint32_t edgeHash = (cur >> x) ^ (ps + z); 
+            if(edgeHash >= hash_lim || BIT_GET(UsedHashes, edgeHash) ||
+               BIT_GET(cand, edgeHash)) {
+              ok = false; 
+              break; 
+            }
+            BIT_SET(cand, edgeHash);
+            edge_hashes.push_back(edgeHash);
+          }
+
+          for(auto &h: edge_hashes) {
+            BIT_CLR(cand, h);
+          }
+
+          if(ok) {
+            Solv.push_back(bb); 
+            Params[bb] = {x,z}; 
+            for(auto &h: edge_hashes) {
+              BIT_SET(UsedHashes, h);
             }
-            find_one = 1; 
+            find_one = true; 
             break; 
           }
         }
       }
       if(!find_one) {
-        UnSolv.push_back(BB); 
+        UnSolv.push_back(bb); 
       }
     }
 
@@ -165,44 +261,174 @@ void AFLCoverage::CalcFmul() {
       break; 
     }
   }
+
 }
 
+/* Hand out the lowest ID nobody has claimed yet. IDs are only ever taken,
+   never given back, so the cursor never needs to move backwards. Once the
+   map is full, there is nothing collision-free left to hand out; fall back
+   to a random slot, just like classic AFL would. */
+
 uint32_t AFLCoverage::RandomPopFreeHashes() {
-  uint32_t randomHash = *FreeHashes.begin(); 
-  FreeHashes.erase(randomHash); 
-  Hashes.insert(randomHash); 
-  return randomHash; 
+
+  while(FreeCursor < MapSize && BIT_GET(UsedHashes, FreeCursor)) {
+    FreeCursor++; 
+  }
+
+  if(FreeCursor >= MapSize) {
+    return AFL_R(MapSize); 
+  }
+
+  BIT_SET(UsedHashes, FreeCursor); 
+  return FreeCursor++; 
+
 }
+
+/* Give every unsolved block an open-addressed (prev_loc -> slot) table, laid
+   out back to back in a single array. At run time, all we know about the
+   predecessor is the prev_loc value it stored, so preds that agree on
+   Keys >> globalY share a slot. Tables are at least twice the number of
+   distinct preds, so probing always ends on an empty entry, and are sized
+   and placed in whole cache lines so that a lookup for a low fan-in block
+   never leaves the first line. */
+
 void AFLCoverage::CalcFhash() {
-  //create FreeHashes 
-  for(uint32_t hash=1 ; hash < MAP_SIZE; hash++) {
-    if(Hashes.count(hash) != 0) {
-      continue ; 
+
+  vector<uint32_t> prevs; 
+
+  for(auto &bb: UnSolv) {
+    uint32_t size = FHASH_LINE; 
+
+    prevs.clear(); 
+    for(uint32_t p = PredStart[bb]; p < PredStart[bb + 1]; p++) {
+      prevs.push_back(Keys[PredList[p]] >> globalY); 
     }
-    FreeHashes.insert(hash); 
-  }
+    std::sort(prevs.begin(), prevs.end()); 
+    prevs.erase(std::unique(prevs.begin(), prevs.end()), prevs.end()); 
 
+    while(size < prevs.size() * 2) size <<= 1; 
 
-  for(auto &BB: UnSolv) {
-    uint32_t cur = Keys[&*BB];  
-    for(auto &P: Preds[&*BB]) {
-      HashMap[make_pair(cur, Keys[&*P])] = RandomPopFreeHashes(); 
+    uint32_t off = FhashTbl.size(), mask = size - 1; 
+    FhashTbl.resize(off + size, (uint64_t)FHASH_EMPTY << 32); 
+
+    for(auto &prev: prevs) {
+      uint32_t i = FHASH_IDX(prev, mask); 
+      while((uint32_t)(FhashTbl[off + i] >> 32) != FHASH_EMPTY) {
+        i = (i + 1) & mask; 
+      }
+      FhashTbl[off + i] = ((uint64_t)prev << 32) | RandomPopFreeHashes(); 
     }
+
+    Kind[bb]   = BB_FHASH; 
+    Params[bb] = {off, mask}; 
   }
 }
 
 void AFLCoverage::CalcFsingle() {
-  for(auto &BB: SingleBBs) {
-    SingleHash[&*BB] = RandomPopFreeHashes(); 
+  for(auto &bb: SingleBBs) {
+    Kind[bb]   = BB_SINGLE; 
+    Params[bb] = {RandomPopFreeHashes(), 0}; 
+  }
+}
+
+/* With AFL_LLVM_EDGE_TABLE=<dir>, write down the map index of every edge
+   within a function, one file per module, for afl-edges to pick up. Edges
+   into function entries depend on the caller's prev_loc, and so do Fhash
+   lookups for a prev_loc the table doesn't know; those aren't listed, but
+   the header says how many entry blocks there were. Blocks are numbered in
+   function order, with the entry block being #0. File format:
+
+   M <tab> module <tab> map size <tab> y <tab> Fmul blocks <tab> Fhash blocks
+     <tab> Fsingle blocks <tab> entry blocks
+   E <tab> map index <tab> F|H|S <tab> function <tab> src <tab> dst <tab>
+     file:line of dst, or '-' */
+
+void AFLCoverage::WriteEdgeTable(Module &M, const char *dir) {
+
+  static uint32_t seq; 
+
+  string id = M.getModuleIdentifier(), fn; 
+  string base = id.substr(id.find_last_of('/') + 1); 
+
+  for(auto &c: base) {
+    if(!isalnum((unsigned char)c) && c != '.' && c != '-') c = '_'; 
+  }
+
+  fn = string(dir) + "/" + base + "." + to_string(getpid()) + "." +
+       to_string(seq++) + ".edges"; 
+
+  FILE *f = fopen(fn.c_str(), "w"); 
+  if (!f) PFATAL("Unable to create '%s'", fn.c_str()); 
+
+  uint32_t entries = 0; 
+
+  for(auto &bb: MultiBBs) {
+    if(PredStart[bb] == PredStart[bb + 1]) entries++; 
+  }
+
+  fprintf(f, "M\t%s\t%u\t%u\t%u\t%u\t%u\t%u\n", id.c_str(), MapSize, globalY,
+          (u32)Solv.size(), (u32)UnSolv.size(), (u32)SingleBBs.size(), entries); 
+
+  Function *curF = NULL; 
+  uint32_t first = 0; 
+
+  for(uint32_t i = 0; i < BBs.size(); i++) {
+    BasicBlock *BB = BBs[i]; 
+    string loc = "-"; 
+
+    if(BB->getParent() != curF) {
+      curF  = BB->getParent(); 
+      first = i; 
+    }
+
+    for(auto &I: *BB) {
+      const DebugLoc &DL = I.getDebugLoc(); 
+      if(DL) {
+        loc = DL->getFilename().str() + ":" + to_string(DL.getLine()); 
+        break; 
+      }
+    }
+
+    for(uint32_t p = PredStart[i]; p < PredStart[i + 1]; p++) {
+      uint32_t src = PredList[p], idx, q; 
+
+      /* Switches can list the same pred more than once. */
+
+      for(q = PredStart[i]; q < p && PredList[q] != src; q++); 
+      if(q < p) continue; 
+
+      if(Kind[i] == BB_SINGLE) {
+        idx = Params[i][0]; 
+      } else if(Kind[i] == BB_FMUL) {
+        idx = (Keys[i] >> Params[i][0]) ^ ((Keys[src] >> globalY) + Params[i][1]); 
+      } else {
+        uint32_t prev = Keys[src] >> globalY, off = Params[i][0],
+                 mask = Params[i][1], j = FHASH_IDX(prev, mask); 
+        while((uint32_t)(FhashTbl[off + j] >> 32) != prev) j = (j + 1) & mask; 
+        idx = (uint32_t)FhashTbl[off + j]; 
+      }
+
+      fprintf(f, "E\t%u\t%c\t%s\t%u\t%u\t%s\n", idx, "FHS"[Kind[i]],
+              curF->getName().str().c_str(), src - first, i - first,
+              loc.c_str()); 
+    }
   }
+
+  fclose(f); 
+
 }
 
+#undef BIT_GET
+#undef BIT_SET
+#undef BIT_CLR
+
 bool AFLCoverage::runOnModule(Module &M) {
 
   LLVMContext &C = M.getContext();
 
   IntegerType *Int8Ty  = IntegerType::getInt8Ty(C);
   IntegerType *Int32Ty = IntegerType::getInt32Ty(C);
+  IntegerType *Int64Ty = IntegerType::getInt64Ty(C);
 
   /* Show a banner */
 
@@ -238,65 +464,134 @@ bool AFLCoverage::runOnModule(Module &M) {
       M, Int32Ty, false, GlobalValue::ExternalLinkage, 0, "__afl_prev_loc",
       0, GlobalVariable::GeneralDynamicTLSModel, 0, false);
 
-  //step1 create BBs, SingleBBs, MultiBBs, Preds 
+  /* With AFL_LLVM_DIRTY_MAP, every map update also flags its chunk in the
+     runtime's dirty summary, so that afl-fuzz can skip untouched parts of
+     the map. Every module registers with the runtime from a constructor,
+     saying whether it did this; the summary is only used if all of them
+     did (see __afl_register_module() in afl-llvm-rt.o.c). */
+
+  bool dirty_map = !!getenv("AFL_LLVM_DIRTY_MAP"); 
+  GlobalVariable *AFLDirtyPtr = NULL; 
+
+  if (dirty_map)
+    AFLDirtyPtr = new GlobalVariable(M, PointerType::get(Int8Ty, 0), false,
+        GlobalValue::ExternalLinkage, 0, "__afl_dirty_ptr"); 
+
+  {
+
+    auto AFLRegister = M.getOrInsertFunction("__afl_register_module",
+        Type::getVoidTy(C), Int32Ty); 
+
+    Function *Ctor = Function::Create(
+        FunctionType::get(Type::getVoidTy(C), false),
+        GlobalValue::InternalLinkage, "__afl_module_ctor", &M); 
+
+    IRBuilder<> CtorIRB(BasicBlock::Create(C, "", Ctor)); 
+    CtorIRB.CreateCall(AFLRegister, ConstantInt::get(Int32Ty, dirty_map)); 
+    CtorIRB.CreateRetVoid(); 
+
+    appendToGlobalCtors(M, Ctor, 0); 
+
+  }
+
+  //step1 number BBs, create SingleBBs, MultiBBs, Preds 
   int inst_blocks = 0;
- 
+  DenseMap<BasicBlock*, uint32_t> BBIdx; 
+
+  ResetState(); 
+
   for (auto &F : M) {
-    for(Function::iterator B = F.begin(), B_end = F.end(); B != B_end; B++) {
-      BasicBlock* BB = &*B; 
-      BBs.push_back(BB); 
+    for(auto &B: F) {
+      BBIdx[&B] = BBs.size(); 
+      BBs.push_back(&B); 
+    }
+  }
 
-      if(BB->hasNPredecessors(1)) {
-        SingleBBs.push_back(BB);
-      } else {
-        MultiBBs.push_back(BB); 
-      }
+  for(uint32_t i = 0; i < BBs.size(); i++) {
+    BasicBlock* BB = BBs[i]; 
 
-      for(auto it = pred_begin(BB), it_end = pred_end(BB); it != it_end; it ++) {
-        Preds[BB].push_back(*it); 
-      }
+    if(BB->hasNPredecessors(1)) {
+      SingleBBs.push_back(i);
+    } else {
+      MultiBBs.push_back(i); 
+    }
+
+    PredStart.push_back(PredList.size()); 
+    for(auto it = pred_begin(BB), it_end = pred_end(BB); it != it_end; it ++) {
+      PredList.push_back(BBIdx[*it]); 
     }
   }
 
-  //step2 create Keys 
+  PredStart.push_back(PredList.size()); 
+
+  //step2 size the map (LTO only), create Keys 
+  SizeMapForModule(); 
   AssignUniqueRandomKeysToBBs(); 
 
+  /* AFL_LLVM_TIMING reports how long the solver took (for make bench). */
+
+  auto t_fmul = chrono::steady_clock::now();
+
   //step3 calc_fmul 
   CalcFmul(); 
 
+  auto t_fhash = chrono::steady_clock::now();
+
   //step4 calc_Fhash 
   CalcFhash();
 
+  auto t_fsingle = chrono::steady_clock::now();
+
   //step5 calc_Fsingle 
   CalcFsingle(); 
 
-// #ifdef DEBUG 
-//   cout << "BBs: "<< BBs.size() << endl; 
-//   cout << "SingleBBs: " << SingleBBs.size() << endl; 
-//   cout << "MultiBBs: " << MultiBBs.size() << endl; 
-  cout << "Solv: " << Solv.size() << endl; 
-  cout << "Unsolv: " << UnSolv.size() << endl; 
-//   cout << "Hashes: " << Hashes.size() << endl; 
+  if (getenv("AFL_LLVM_TIMING")) {
+
+    auto t_done = chrono::steady_clock::now();
+    typedef chrono::duration<double, milli> ms;
+
+    OKF("CollAFL solver time for '%s': fmul=%0.02f fhash=%0.02f "
+        "fsingle=%0.02f ms, %u blocks.", M.getModuleIdentifier().c_str(),
+        ms(t_fhash - t_fmul).count(), ms(t_fsingle - t_fhash).count(),
+        ms(t_done - t_fsingle).count(), (u32)BBs.size());
 
-//   for(auto &BB: MultiBBs) {
-//     printf("%u %u\n", Params[&*BB][0], Params[&*BB][1]); 
-//   }
+  }
+
+  char* edge_dir = getenv("AFL_LLVM_EDGE_TABLE");
+  if (edge_dir) WriteEdgeTable(M, edge_dir);
+
+  /* Per-module Fhash tables and the runtime helper that walks them. */
+
+  GlobalVariable *AFLFhashTbl = NULL; 
+
+  if (!FhashTbl.empty()) {
 
-//   cout << "GlobalY" << globalY << endl; 
+    ArrayType *TblTy = ArrayType::get(Int64Ty, FhashTbl.size()); 
+
+    AFLFhashTbl = new GlobalVariable(M, TblTy, true,
+        GlobalValue::PrivateLinkage, ConstantDataArray::get(C, FhashTbl),
+        "__afl_fhash_tbl"); 
+
+#if LLVM_VERSION_MAJOR >= 10
+    AFLFhashTbl->setAlignment(MaybeAlign(64)); 
+#else
+    AFLFhashTbl->setAlignment(64); 
+#endif /* ^LLVM_VERSION_MAJOR >= 10 */
+
+  }
 
-//   for(auto &i: Hashes) {
-//     cout << i << endl; 
-//   }
-// #endif
+  auto AFLFhashLog = M.getOrInsertFunction("__afl_fhash_log",
+      Type::getVoidTy(C), PointerType::get(Int64Ty, 0), Int32Ty, Int32Ty); 
 
-  //step6 instrument Fsingle 
+  //step6 instrument 
 
-  for(auto &BB: BBs) {
+  for(uint32_t i = 0; i < BBs.size(); i++) {
+    BasicBlock* BB = BBs[i]; 
     BasicBlock::iterator IP = BB->getFirstInsertionPt(); 
     IRBuilder<> IRB(&*IP); 
 
     //make up cur_loc 
-    uint32_t cur_loc = Keys[&*BB]; 
+    uint32_t cur_loc = Keys[i]; 
     ConstantInt *Cur_loc = ConstantInt::get(Int32Ty, cur_loc); 
 
     //load prev_loc  
@@ -307,46 +602,63 @@ bool AFLCoverage::runOnModule(Module &M) {
     //load shm pointer
     LoadInst *MapPtr = IRB.CreateLoad(AFLMapPtr);
     MapPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
-    Value * MapPtrIdx= NULL; 
+    Value * MapPtrIdx= NULL, * MapIdx = NULL; 
     
+    if(Kind[i] == BB_SINGLE) {
     // fsingle 
-    if(SingleHash.count(&*BB)) {
-      MapPtrIdx = IRB.CreateGEP(MapPtr, ConstantInt::get(Int32Ty, SingleHash[&*BB])); 
-    } else if(Params.count(&*BB)) {
-    // fmul 
-      uint32_t x = Params[&*BB][0], z = Params[&*BB][1]; 
+      MapIdx = ConstantInt::get(Int32Ty, Params[i][0]); 
+      MapPtrIdx = IRB.CreateGEP(MapPtr, MapIdx); 
+    } else if(Kind[i] == BB_FMUL) {
+    // fmul: must match the hash CalcFmul() solved for 
+      uint32_t x = Params[i][0], z = Params[i][1]; 
       Cur_loc = ConstantInt::get(Int32Ty, cur_loc>>x); 
-      Value *temp = IRB.CreateXor(PrevLocCasted, Cur_loc); 
-      MapPtrIdx = IRB.CreateGEP(MapPtr, IRB.CreateAdd(temp, ConstantInt::get(Int32Ty, z))); 
+      Value *temp = IRB.CreateAdd(PrevLocCasted, ConstantInt::get(Int32Ty, z)); 
+      MapIdx = IRB.CreateXor(temp, Cur_loc); 
+      MapPtrIdx = IRB.CreateGEP(MapPtr, MapIdx); 
     } else {
-      continue ; 
+    // fhash: the runtime looks up (cur, prev) in this block's table 
+      Constant *Idx[] = { ConstantInt::get(Int32Ty, 0),
+                          ConstantInt::get(Int32Ty, Params[i][0]) }; 
+      IRB.CreateCall(AFLFhashLog, { ConstantExpr::getInBoundsGetElementPtr(
+          AFLFhashTbl->getValueType(), AFLFhashTbl, Idx),
+          ConstantInt::get(Int32Ty, Params[i][1]), Cur_loc }); 
     }
 
 
     //update bitmap 
-    LoadInst *bitmap = IRB.CreateLoad(MapPtrIdx); 
-    bitmap->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None)); 
-    Value* bitmap_update = IRB.CreateAdd(bitmap, ConstantInt::get(Int8Ty, 1)) ; 
-    IRB.CreateStore(bitmap_update, MapPtrIdx)->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+    if(MapPtrIdx) {
+      LoadInst *bitmap = IRB.CreateLoad(MapPtrIdx); 
+      bitmap->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None)); 
+      Value* bitmap_update = IRB.CreateAdd(bitmap, ConstantInt::get(Int8Ty, 1)) ; 
+      IRB.CreateStore(bitmap_update, MapPtrIdx)->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+
+      //flag the chunk (fhash blocks get this from the runtime) 
+      if(dirty_map) {
+        LoadInst *DirtyPtr = IRB.CreateLoad(AFLDirtyPtr); 
+        DirtyPtr->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None)); 
+        Value *DirtyIdx = IRB.CreateGEP(DirtyPtr,
+            IRB.CreateLShr(MapIdx, ConstantInt::get(Int32Ty, DIRTY_CHUNK_POW2))); 
+        IRB.CreateStore(ConstantInt::get(Int8Ty, 1), DirtyIdx)->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+      }
+    }
     
-    // //save prev_loc  
-    // StoreInst *Store =
-    //       IRB.CreateStore(ConstantInt::get(Int32Ty, cur_loc >> globalY), AFLPrevLoc);
-    // Store->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
+    //save prev_loc  
+    StoreInst *Store =
+          IRB.CreateStore(ConstantInt::get(Int32Ty, cur_loc >> globalY), AFLPrevLoc);
+    Store->setMetadata(M.getMDKindID("nosanitize"), MDNode::get(C, None));
 
     inst_blocks ++; 
   }
 
-  //fhash 
-  for(auto &BB: UnSolv) {
-    BasicBlock::iterator IP = BB.getFirstInsertionPt(); 
-    IRBuilder<> IRB(&*IP); 
-    // user <cur, prev> to get hash_map 
-    
-  }
+  /* In LTO mode, tell the runtime how much of the map is actually in use.
+     This overrides the weak MAP_SIZE default in afl-llvm-rt.o. */
 
+  if (LTOMode) {
 
+    new GlobalVariable(M, Int32Ty, true, GlobalValue::ExternalLinkage,
+                       ConstantInt::get(Int32Ty, MapSize), "__afl_map_size");
 
+  }
 
   if (!be_quiet) {
 
@@ -356,6 +668,13 @@ bool AFLCoverage::runOnModule(Module &M) {
              ((getenv("AFL_USE_ASAN") || getenv("AFL_USE_MSAN")) ?
               "ASAN/MSAN" : "non-hardened"), inst_ratio);
 
+    if (inst_blocks) OKF("CollAFL: %u Fmul, %u Fhash, %u Fsingle blocks.",
+                         (u32)Solv.size(), (u32)UnSolv.size(),
+                         (u32)SingleBBs.size());
+
+    if (LTOMode) OKF("LTO mode: whole-program map size is %u (2^%u).",
+                     MapSize, MapSizePow2);
+
   }
 
   return true;
@@ -363,16 +682,35 @@ bool AFLCoverage::runOnModule(Module &M) {
 }
 
 
+/* In LTO mode, afl-clang-fast doesn't load us at compile time at all, but
+   the linker may still run the regular module pipeline (e.g., for ThinLTO
+   backends); AFL_LLVM_LTO keeps us from instrumenting twice. */
+
 static void registerAFLPass(const PassManagerBuilder &,
                             legacy::PassManagerBase &PM) {
 
+  if (getenv("AFL_LLVM_LTO")) return;
+
   PM.add(new AFLCoverage());
 
 }
 
 
+static void registerAFLLTOPass(const PassManagerBuilder &,
+                               legacy::PassManagerBase &PM) {
+
+  if (!getenv("AFL_LLVM_LTO")) return;
+
+  PM.add(new AFLCoverage(true));
+
+}
+
+
 static RegisterStandardPasses RegisterAFLPass(
     PassManagerBuilder::EP_ModuleOptimizerEarly, registerAFLPass);
 
 static RegisterStandardPasses RegisterAFLPass0(
     PassManagerBuilder::EP_EnabledOnOptLevel0, registerAFLPass);
+
+static RegisterStandardPasses RegisterAFLLTOPass(
+    PassManagerBuilder::EP_FullLinkTimeOptimizationLast, registerAFLLTOPass);
@@ -41,6 +41,42 @@
 #include <sys/shm.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <errno.h>
+
+#ifdef __linux__
+#  include <linux/fs.h>
+#  include <linux/futex.h>
+#  include <linux/userfaultfd.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+
+/* PAGEMAP_SCAN and asynchronous write protection are fairly recent (Linux
+   6.7), so spell out what snapshot mode needs if the headers are older. */
+
+#  ifndef PAGEMAP_SCAN
+
+struct page_region {
+  u64 start, end, categories;
+};
+
+struct pm_scan_arg {
+  u64 size, flags, start, end, walk_end, vec, vec_len, max_pages,
+      category_inverted, category_mask, category_anyof_mask, return_mask;
+};
+
+#    define PAGE_IS_WRITTEN     (1 << 1)
+#    define PAGEMAP_SCAN        _IOWR('f', 16, struct pm_scan_arg)
+
+#  endif /* !PAGEMAP_SCAN */
+
+#  ifndef UFFD_FEATURE_WP_ASYNC
+#    define UFFD_FEATURE_WP_UNPOPULATED (1 << 13)
+#    define UFFD_FEATURE_WP_ASYNC       (1 << 15)
+#  endif /* !UFFD_FEATURE_WP_ASYNC */
+
+#endif /* __linux__ */
 
 /* This is a somewhat ugly hack for the experimental 'trace-pc-guard' mode.
    Basically, we need to make sure that the forkserver is initialized after
@@ -60,6 +96,47 @@
 u8  __afl_area_initial[MAP_SIZE];
 u8* __afl_area_ptr = __afl_area_initial;
 
+/* Portion of the map actually used by the instrumentation. In AFL_LLVM_LTO
+   mode, the pass emits a strong definition sized to the real edge count. */
+
+__attribute__((weak)) u32 __afl_map_size = MAP_SIZE;
+
+/* Dirty-chunk summary (see DIRTY_CHUNK_POW2 in config.h). We always keep
+   one, so that the instrumentation never has to check; it only moves into
+   the SHM segment if the parent made room for it and all the edges are
+   actually being tracked: every module instrumented by the pass registers
+   through __afl_register_module(), and all of them have to have been built
+   with AFL_LLVM_DIRTY_MAP. */
+
+u8  __afl_dirty_initial[DIRTY_SIZE];
+u8* __afl_dirty_ptr = __afl_dirty_initial;
+
+static u32 __afl_mod_cnt,             /* Modules registered by the pass   */
+           __afl_dirty_mod_cnt;       /* ...and those that flag chunks    */
+
+static u8  __afl_dirty_all;           /* Flag every chunk on every run?   */
+
+/* Defined by the afl-as payload (64-bit) in objects built with afl-gcc,
+   which record edges without flagging anything. */
+
+extern u8* __afl_global_area_ptr __attribute__((weak));
+
+/* Test case delivered through shared memory (see __AFL_FUZZ_TESTCASE_BUF in
+   afl-clang-fast.c). __afl_fuzz_ptr stays NULL unless the target defined
+   __afl_sharedmem_fuzzing and afl-fuzz offered a region; the dummy length
+   keeps the macros simple when it didn't. */
+
+static u32 __afl_fuzz_len_dummy;
+u32* __afl_fuzz_len = &__afl_fuzz_len_dummy;
+u8*  __afl_fuzz_ptr;
+
+extern s32 __afl_sharedmem_fuzzing __attribute__((weak));
+
+/* Provided by libdislocator in pool mode; lets each __AFL_LOOP() iteration
+   reuse the buffers freed by the previous ones. */
+
+extern void __dislocator_reset(void) __attribute__((weak));
+
 __thread u32 __afl_prev_loc;
 
 
@@ -67,6 +144,11 @@ __thread u32 __afl_prev_loc;
 
 static u8 is_persistent;
 
+/* Fork server control block (see FSRV_CTL_SIZE in config.h), if the parent
+   made room for one. */
+
+static u32* __afl_fsrv_ctl;
+
 
 /* SHM setup. */
 
@@ -81,6 +163,7 @@ static void __afl_map_shm(void) {
   if (id_str) {
 
     u32 shm_id = atoi(id_str);
+    struct shmid_ds ds;
 
     __afl_area_ptr = shmat(shm_id, NULL, 0);
 
@@ -88,10 +171,39 @@ static void __afl_map_shm(void) {
 
     if (__afl_area_ptr == (void *)-1) _exit(1);
 
+    memset(&ds, 0, sizeof(ds));
+
+    if (!shmctl(shm_id, IPC_STAT, &ds)) {
+
+      if (__afl_dirty_mod_cnt && __afl_dirty_mod_cnt == __afl_mod_cnt &&
+          !&__afl_global_area_ptr && ds.shm_segsz >= MAP_SIZE + DIRTY_SIZE)
+        __afl_dirty_ptr = __afl_area_ptr + MAP_SIZE;
+
+#ifdef __linux__
+      if (ds.shm_segsz >= MAP_SIZE + DIRTY_SIZE + FSRV_CTL_SIZE)
+        __afl_fsrv_ctl = (u32*)(__afl_area_ptr + MAP_SIZE + DIRTY_SIZE);
+#endif /* __linux__ */
+
+    }
+
     /* Write something into the bitmap so that even with low AFL_INST_RATIO,
        our parent doesn't give up on us. */
 
     __afl_area_ptr[0] = 1;
+    __afl_dirty_ptr[0] = 1;
+
+  }
+
+  id_str = getenv(SHM_FUZZ_ENV_VAR);
+
+  if (id_str && &__afl_sharedmem_fuzzing && __afl_sharedmem_fuzzing) {
+
+    u8* map = shmat(atoi(id_str), NULL, 0);
+
+    if (map == (void *)-1) _exit(1);
+
+    __afl_fuzz_len = (u32*)map;
+    __afl_fuzz_ptr = map + sizeof(u32);
 
   }
 
@@ -102,25 +214,37 @@ static void __afl_map_shm(void) {
 
 static void __afl_start_forkserver(void) {
 
-  static u8 tmp[4];
+  u32 hello = FS_OPT_ENABLED | FS_OPT_MAPSIZE |
+              FS_OPT_SET_MAPSIZE(__afl_map_size);
   s32 child_pid;
 
   u8  child_stopped = 0;
 
-  /* Phone home and tell the parent that we're OK. If parent isn't there,
-     assume we're not running in forkserver mode and just execute program. */
+  /* Phone home and tell the parent that we're OK, and how big our map is.
+     If parent isn't there, assume we're not running in forkserver mode and
+     just execute program. */
+
+  if (__afl_dirty_ptr != __afl_dirty_initial) hello |= FS_OPT_DIRTY;
+  if (__afl_fuzz_ptr) hello |= FS_OPT_SHMEM_FUZZ;
+  if (__afl_fsrv_ctl && is_persistent) hello |= FS_OPT_FUTEX;
 
-  if (write(FORKSRV_FD + 1, tmp, 4) != 4) return;
+  if (write(FORKSRV_FD + 1, &hello, 4) != 4) return;
 
   while (1) {
 
     u32 was_killed;
     int status;
+    u8  use_futex;
 
     /* Wait for parent by reading from the pipe. Abort if read fails. */
 
     if (read(FORKSRV_FD, &was_killed, 4) != 4) _exit(1);
 
+    /* afl-fuzz has made up its mind about FS_OPT_FUTEX by now. If it took
+       it, children never stop; they only come back to us when they die. */
+
+    use_futex = __afl_fsrv_ctl && __afl_fsrv_ctl[FSRV_CTL_MODE];
+
     /* If we stopped the child in persistent mode, but there was a race
        condition and afl-fuzz already issued SIGKILL, write off the old
        process. */
@@ -161,7 +285,8 @@ static void __afl_start_forkserver(void) {
 
     if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) _exit(1);
 
-    if (waitpid(child_pid, &status, is_persistent ? WUNTRACED : 0) < 0)
+    if (waitpid(child_pid, &status,
+                is_persistent && !use_futex ? WUNTRACED : 0) < 0)
       _exit(1);
 
     /* In persistent mode, the child stops itself with SIGSTOP to indicate
@@ -170,6 +295,23 @@ static void __afl_start_forkserver(void) {
 
     if (WIFSTOPPED(status)) child_stopped = 1;
 
+#ifdef __linux__
+
+    /* The parent may be sleeping on the control block rather than reading
+       from the pipe; let it know the child is gone first. */
+
+    if (use_futex) {
+
+      __afl_fsrv_ctl[FSRV_CTL_DEAD] = 1;
+      __atomic_store_n(&__afl_fsrv_ctl[FSRV_CTL_DONE],
+                       __afl_fsrv_ctl[FSRV_CTL_START], __ATOMIC_RELEASE);
+      syscall(SYS_futex, &__afl_fsrv_ctl[FSRV_CTL_DONE], FUTEX_WAKE, 1,
+              NULL, NULL, 0);
+
+    }
+
+#endif /* __linux__ */
+
     /* Relay wait status to pipe, then loop back. */
 
     if (write(FORKSRV_FD + 1, &status, 4) != 4) _exit(1);
@@ -179,6 +321,336 @@ static void __afl_start_forkserver(void) {
 }
 
 
+#ifdef __linux__
+
+/* Snapshot mode (AFL_SNAPSHOT=1, persistent mode only). On the first pass
+   through __AFL_LOOP(), we take a copy of every private, writable mapping
+   except for the stack. After each iteration, only the pages written to
+   since then are put back, and the program break is reset. The kernel
+   keeps track of the writes for us: with asynchronous userfaultfd write
+   protection where available (Linux 6.7+), or with soft-dirty bits. The
+   bookkeeping itself lives in shared mappings, which are never part of the
+   snapshot. */
+
+#define PM_SOFT_DIRTY (1ULL << 55)
+
+struct snap_region {
+  u8* addr;                           /* Start of the mapping             */
+  u8* copy;                           /* Saved contents                   */
+  u32 pages;                          /* Size, in pages                   */
+  u8  tracked;                        /* Writes to it are being tracked   */
+};
+
+static struct snap_region* snap_regions;
+static u32   snap_cnt;                /* 0 if snapshots are not in use    */
+static u8    snap_uffd;               /* Tracking via userfaultfd?        */
+static u64*  snap_pm;                 /* Soft-dirty: pagemap entries      */
+static struct page_region* snap_vec;  /* userfaultfd: written ranges      */
+static u32   snap_page;
+static u8*   snap_brk;
+static s32   snap_pm_fd = -1, snap_refs_fd = -1, snap_uffd_fd = -1;
+
+
+static void* __afl_snap_alloc(u64 len) {
+
+  void* ret = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  return ret == MAP_FAILED ? NULL : ret;
+
+}
+
+
+/* (Re-)arm write protection for a range, userfaultfd mode. */
+
+static u8 __afl_snap_protect(u8* addr, u64 len) {
+
+  struct uffdio_writeprotect wp;
+
+  wp.range.start = (u64)addr;
+  wp.range.len   = len;
+  wp.mode        = UFFDIO_WRITEPROTECT_MODE_WP;
+
+  return !ioctl(snap_uffd_fd, UFFDIO_WRITEPROTECT, &wp);
+
+}
+
+
+/* See if the kernel supports asynchronous userfaultfd write protection. */
+
+static u8 __afl_snap_open_uffd(void) {
+
+  struct uffdio_api api;
+
+  snap_uffd_fd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  if (snap_uffd_fd < 0) return 0;
+
+  memset(&api, 0, sizeof(api));
+  api.api      = UFFD_API;
+  api.features = UFFD_FEATURE_WP_ASYNC | UFFD_FEATURE_WP_UNPOPULATED;
+
+  if (ioctl(snap_uffd_fd, UFFDIO_API, &api) ||
+      !(api.features & UFFD_FEATURE_WP_ASYNC)) {
+
+    close(snap_uffd_fd);
+    snap_uffd_fd = -1;
+    return 0;
+
+  }
+
+  return 1;
+
+}
+
+
+/* Start tracking writes to a region, userfaultfd mode. */
+
+static u8 __afl_snap_track_uffd(struct snap_region* r) {
+
+  struct uffdio_register reg;
+
+  memset(&reg, 0, sizeof(reg));
+  reg.range.start = (u64)r->addr;
+  reg.range.len   = (u64)r->pages * snap_page;
+  reg.mode        = UFFDIO_REGISTER_MODE_WP;
+
+  if (ioctl(snap_uffd_fd, UFFDIO_REGISTER, &reg) && errno != EBUSY) return 0;
+
+  return __afl_snap_protect(r->addr, reg.range.len);
+
+}
+
+
+/* Take the snapshot. If anything goes wrong, snap_cnt ends up at zero and
+   we fall back to plain persistent mode. Note that our own state lives in
+   .bss too, so all of it has to be settled before the copy is made. */
+
+static void __afl_snapshot_take(void) {
+
+  FILE* f;
+  char  line[PATH_MAX + 128];
+  u64   total = 0, test;
+  u32   max_pages = 1, i;
+  u8*   copy;
+
+  snap_page  = getpagesize();
+  snap_pm_fd = open("/proc/self/pagemap", O_RDONLY);
+
+  if (snap_pm_fd < 0) return;
+
+  snap_regions = __afl_snap_alloc(SNAP_MAX_REGIONS *
+                                  sizeof(struct snap_region));
+  if (!snap_regions) return;
+
+  f = fopen("/proc/self/maps", "r");
+  if (!f) return;
+
+  while (fgets(line, sizeof(line), f)) {
+
+    unsigned long start, end;
+    char perms[5], path[PATH_MAX] = "";
+
+    if (sscanf(line, "%lx-%lx %4s %*s %*s %*s %s",
+               &start, &end, perms, path) < 3) continue;
+
+    if (perms[0] != 'r' || perms[1] != 'w' || perms[3] != 'p') continue;
+
+    if (!strncmp(path, "[stack", 6) || !strcmp(path, "[vvar]") ||
+        !strcmp(path, "[vsyscall]")) continue;
+
+    if (end - start > SNAP_MAX_REGION) continue;
+
+    if (snap_cnt == SNAP_MAX_REGIONS) {
+      fclose(f);
+      snap_cnt = 0;
+      return;
+    }
+
+    snap_regions[snap_cnt].addr  = (u8*)start;
+    snap_regions[snap_cnt].pages = (end - start) / snap_page;
+    snap_cnt++;
+
+  }
+
+  fclose(f);
+
+  /* Whatever fopen() grew the heap by is still there, but let's not copy
+     past the break if free() gave some of it back. */
+
+  snap_brk = sbrk(0);
+
+  for (i = 0; i < snap_cnt; i++) {
+
+    struct snap_region* r = &snap_regions[i];
+
+    if (r->addr < snap_brk && r->addr + (u64)r->pages * snap_page > snap_brk)
+      r->pages = (snap_brk - r->addr) / snap_page;
+
+    if (r->pages > max_pages) max_pages = r->pages;
+    total += (u64)r->pages * snap_page;
+
+  }
+
+  copy = __afl_snap_alloc(total ? total : 1);
+
+  if (__afl_snap_open_uffd()) {
+
+    snap_uffd = 1;
+    snap_vec  = __afl_snap_alloc(SNAP_VEC_LEN * sizeof(struct page_region));
+
+  } else {
+
+    snap_refs_fd = open("/proc/self/clear_refs", O_WRONLY);
+    snap_pm      = __afl_snap_alloc((u64)max_pages * 8);
+
+  }
+
+  if (!copy || (snap_uffd ? !snap_vec : (snap_refs_fd < 0 || !snap_pm))) {
+    snap_cnt = 0;
+    return;
+  }
+
+  for (i = 0; i < snap_cnt; i++) {
+
+    snap_regions[i].copy = copy;
+    memcpy(copy, snap_regions[i].addr, (u64)snap_regions[i].pages * snap_page);
+    copy += (u64)snap_regions[i].pages * snap_page;
+
+  }
+
+  /* Regions we can't track get restored in full. */
+
+  if (snap_uffd) {
+
+    for (i = 0; i < snap_cnt; i++)
+      snap_regions[i].tracked = __afl_snap_track_uffd(&snap_regions[i]);
+
+    return;
+
+  }
+
+  /* Soft-dirty bits need CONFIG_MEM_SOFT_DIRTY, which we can only find
+     out by trying. */
+
+  if (write(snap_refs_fd, "4", 1) != 1) {
+    snap_cnt = 0;
+    return;
+  }
+
+  *(volatile u64*)snap_pm = 0;
+
+  if (pread(snap_pm_fd, &test, 8, (u64)snap_pm / snap_page * 8) != 8 ||
+      !(test & PM_SOFT_DIRTY)) {
+    snap_cnt = 0;
+    return;
+  }
+
+  for (i = 0; i < snap_cnt; i++) snap_regions[i].tracked = 1;
+
+}
+
+
+/* Restore one region, userfaultfd mode. Returns 0 if we couldn't tell
+   what was written to. */
+
+static u8 __afl_snap_restore_uffd(struct snap_region* r) {
+
+  struct pm_scan_arg arg;
+  u8* end = r->addr + (u64)r->pages * snap_page;
+  s32 n, i;
+
+  memset(&arg, 0, sizeof(arg));
+  arg.size          = sizeof(arg);
+  arg.start         = (u64)r->addr;
+  arg.end           = (u64)end;
+  arg.vec           = (u64)snap_vec;
+  arg.vec_len       = SNAP_VEC_LEN;
+  arg.category_mask = PAGE_IS_WRITTEN;
+  arg.return_mask   = PAGE_IS_WRITTEN;
+
+  while (1) {
+
+    n = ioctl(snap_pm_fd, PAGEMAP_SCAN, &arg);
+    if (n < 0) return 0;
+
+    for (i = 0; i < n; i++) {
+
+      u8* start = (u8*)snap_vec[i].start;
+      u64 len   = snap_vec[i].end - snap_vec[i].start;
+
+      memcpy(start, r->copy + (start - r->addr), len);
+      if (!__afl_snap_protect(start, len)) return 0;
+
+    }
+
+    if (arg.walk_end >= (u64)end) return 1;
+    arg.start = arg.walk_end;
+
+  }
+
+}
+
+
+/* Same, soft-dirty mode. */
+
+static u8 __afl_snap_restore_sd(struct snap_region* r) {
+
+  u64 len = (u64)r->pages * 8;
+  u32 i;
+
+  if (pread(snap_pm_fd, snap_pm, len,
+            (u64)r->addr / snap_page * 8) != (ssize_t)len) return 0;
+
+  for (i = 0; i < r->pages; i++)
+    if (snap_pm[i] & PM_SOFT_DIRTY)
+      memcpy(r->addr + (u64)i * snap_page, r->copy + (u64)i * snap_page,
+             snap_page);
+
+  return 1;
+
+}
+
+
+/* Put back whatever the last iteration changed. */
+
+static void __afl_snapshot_restore(void) {
+
+  u8* cur_brk = (u8*)syscall(SYS_brk, 0);
+  u32 i;
+
+  if (cur_brk != snap_brk) syscall(SYS_brk, snap_brk);
+
+  for (i = 0; i < snap_cnt; i++) {
+
+    struct snap_region* r = &snap_regions[i];
+    u64 len = (u64)r->pages * snap_page;
+    u8  ok  = 0;
+
+    /* If the heap shrank below where it was, the pages that have come back
+       are brand new; restore the whole thing, and track it all again. */
+
+    if (cur_brk < snap_brk && r->addr < snap_brk && r->addr + len >= snap_brk)
+      r->tracked = 0;
+
+    if (r->tracked)
+      ok = snap_uffd ? __afl_snap_restore_uffd(r) : __afl_snap_restore_sd(r);
+
+    if (!ok) {
+
+      memcpy(r->addr, r->copy, len);
+      r->tracked = snap_uffd ? __afl_snap_track_uffd(r) : 1;
+
+    }
+
+  }
+
+  if (!snap_uffd && write(snap_refs_fd, "4", 1) != 1) snap_cnt = 0;
+
+}
+
+#endif /* __linux__ */
+
+
 /* A simplified persistent mode handler, used as explained in README.llvm. */
 
 int __afl_persistent_loop(unsigned int max_cnt) {
@@ -195,13 +667,19 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
     if (is_persistent) {
 
-      memset(__afl_area_ptr, 0, MAP_SIZE);
+      memset(__afl_area_ptr, 0, __afl_map_size);
       __afl_area_ptr[0] = 1;
+      __afl_dirty_ptr[0] = 1;
       __afl_prev_loc = 0;
     }
 
     cycle_cnt  = max_cnt;
     first_pass = 0;
+
+#ifdef __linux__
+    if (is_persistent && getenv("AFL_SNAPSHOT")) __afl_snapshot_take();
+#endif /* __linux__ */
+
     return 1;
 
   }
@@ -210,11 +688,61 @@ int __afl_persistent_loop(unsigned int max_cnt) {
 
     if (--cycle_cnt) {
 
-      raise(SIGSTOP);
+#ifdef __linux__
+
+      /* In futex mode, report the run as done and sleep until afl-fuzz
+         posts the next one; this never involves the fork server. */
+
+      if (__afl_fsrv_ctl && __afl_fsrv_ctl[FSRV_CTL_MODE]) {
+
+        u32 seq = __atomic_load_n(&__afl_fsrv_ctl[FSRV_CTL_START],
+                                  __ATOMIC_ACQUIRE);
+
+        __atomic_store_n(&__afl_fsrv_ctl[FSRV_CTL_DONE], seq,
+                         __ATOMIC_RELEASE);
+        syscall(SYS_futex, &__afl_fsrv_ctl[FSRV_CTL_DONE], FUTEX_WAKE, 1,
+                NULL, NULL, 0);
+
+        /* The snapshot doesn't cover the map, so we can restore it
+           while afl-fuzz is looking at the results. */
+
+        if (snap_cnt) {
+          u32 cnt = cycle_cnt;
+          __afl_snapshot_restore();
+          cycle_cnt = cnt;
+        }
+
+        while (__atomic_load_n(&__afl_fsrv_ctl[FSRV_CTL_START],
+                               __ATOMIC_ACQUIRE) == seq)
+          syscall(SYS_futex, &__afl_fsrv_ctl[FSRV_CTL_START], FUTEX_WAIT,
+                  seq, NULL, NULL, 0);
+
+      } else
+
+#endif /* __linux__ */
+
+      {
+
+        raise(SIGSTOP);
+
+#ifdef __linux__
+        if (snap_cnt) {
+          u32 cnt = cycle_cnt;
+          __afl_snapshot_restore();
+          cycle_cnt = cnt;
+        }
+#endif /* __linux__ */
+
+      }
 
       __afl_area_ptr[0] = 1;
+      __afl_dirty_ptr[0] = 1;
       __afl_prev_loc = 0;
 
+      if (__afl_dirty_all) memset(__afl_dirty_ptr, 1, DIRTY_SIZE);
+
+      if (__dislocator_reset) __dislocator_reset();
+
       return 1;
 
     } else {
@@ -223,7 +751,8 @@ int __afl_persistent_loop(unsigned int max_cnt) {
          follows the loop is not traced. We do that by pivoting back to the
          dummy output region. */
 
-      __afl_area_ptr = __afl_area_initial;
+      __afl_area_ptr  = __afl_area_initial;
+      __afl_dirty_ptr = __afl_dirty_initial;
 
     }
 
@@ -252,6 +781,29 @@ void __afl_manual_init(void) {
 }
 
 
+/* Called from a constructor in every module instrumented by the pass, with
+   dirty set if the module flags the chunks it touches. Modules that show up
+   after the fork server told afl-fuzz to rely on the summary (typically,
+   libraries loaded with dlopen()) but don't keep it updated make us flag the
+   whole map from then on, for this process. */
+
+void __afl_register_module(u32 dirty) {
+
+  __afl_mod_cnt++;
+
+  if (dirty) {
+    __afl_dirty_mod_cnt++;
+    return;
+  }
+
+  if (__afl_dirty_ptr != __afl_dirty_initial && !__afl_dirty_all) {
+    __afl_dirty_all = 1;
+    memset(__afl_dirty_ptr, 1, DIRTY_SIZE);
+  }
+
+}
+
+
 /* Proper initialization routine. */
 
 __attribute__((constructor(CONST_PRIO))) void __afl_auto_init(void) {
@@ -265,6 +817,38 @@ __attribute__((constructor(CONST_PRIO))) void __afl_auto_init(void) {
 }
 
 
+/* Called by CollAFL-instrumented blocks that couldn't be given an Fmul
+   formula. The pass hands us the block's own lookup table, laid out as
+   described next to FHASH_IDX in config.h; the first probe usually hits,
+   and the whole table rarely spans more than one cache line. Edges the
+   pass never saw (e.g., coming in from another module through a call)
+   get a classic AFL-style slot instead. */
+
+void __afl_fhash_log(const u64* tbl, u32 mask, u32 cur) {
+
+  u32 prev = __afl_prev_loc, i = FHASH_IDX(prev, mask);
+  u64 e;
+
+  while ((u32)((e = tbl[i]) >> 32) != FHASH_EMPTY) {
+
+    if ((u32)(e >> 32) == prev) {
+      __afl_area_ptr[(u32)e]++;
+      __afl_dirty_ptr[(u32)e >> DIRTY_CHUNK_POW2] = 1;
+      return;
+    }
+
+    i = (i + 1) & mask;
+
+  }
+
+  i = (cur ^ prev) & (__afl_map_size - 1);
+
+  __afl_area_ptr[i]++;
+  __afl_dirty_ptr[i >> DIRTY_CHUNK_POW2] = 1;
+
+}
+
+
 /* The following stuff deals with supporting -fsanitize-coverage=trace-pc-guard.
    It remains non-operational in the traditional, plugin-backed LLVM mode.
    For more info about 'trace-pc-guard', see README.llvm.
@@ -274,6 +858,7 @@ __attribute__((constructor(CONST_PRIO))) void __afl_auto_init(void) {
 
 void __sanitizer_cov_trace_pc_guard(uint32_t* guard) {
   __afl_area_ptr[*guard]++;
+  __afl_dirty_ptr[*guard >> DIRTY_CHUNK_POW2] = 1;
 }
 
 
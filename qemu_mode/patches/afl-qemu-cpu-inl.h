@@ -31,10 +31,19 @@
    The resulting QEMU binary is essentially a standalone instrumentation
    tool; for an example of how to leverage it for other purposes, you can
    have a look at afl-showmap.c.
+
+   With AFL_QEMU_CACHE, the blocks that were translated and the IDs handed
+   out to them are also kept in a file shared by all instances and runs;
+   see README.qemu.
 */
 
+#include <pthread.h>
 #include <sys/shm.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include "../../config.h"
+#include "../../hash.h"
 
 /***************************
  * VARIOUS AUXILIARY STUFF *
@@ -66,6 +75,11 @@
 
 #define TSL_FD (FORKSRV_FD - 1)
 
+/* With AFL_QEMU_CACHE, the fork server also hands out block IDs, and sends
+   them back to the child through this one: */
+
+#define TSL_REPLY_FD (FORKSRV_FD - 2)
+
 /* This is equivalent to afl-as.h: */
 
 static unsigned char *afl_area_ptr;
@@ -91,17 +105,72 @@ static void afl_setup(void);
 static void afl_forkserver(CPUState*);
 static inline void afl_maybe_log(abi_ulong);
 
-static void afl_wait_tsl(CPUState*, int);
+static void afl_wait_tsl(CPUState*, int, int);
 static void afl_request_tsl(target_ulong, target_ulong, uint64_t);
 
-/* Data structure passed around by the translate handlers: */
+/* Data structure passed around by the translate handlers. In cache mode,
+   the child also asks for the IDs of blocks that it has no translation
+   request for (AFL_TSL_ID_ONLY), and tells which block it came from. */
+
+#define AFL_TSL_ID_ONLY 1
 
 struct afl_tsl {
   target_ulong pc;
   target_ulong cs_base;
   uint64_t flags;
+  target_ulong prev;
+  uint32_t kind;
+};
+
+/* Layout of the AFL_QEMU_CACHE file: a header that identifies the binary,
+   followed by records appended by whoever translates a new block (TSL) or
+   gives a new block its ID (ID). The file is only appended to, under
+   flock(); a torn record at the end just gets overwritten by the next one. */
+
+#define AFL_REC_TSL 1
+#define AFL_REC_ID  2
+
+struct afl_cache_hdr {
+  uint32_t magic;                   /* QEMU_CACHE_MAGIC                   */
+  uint32_t rec_size;                /* sizeof(struct afl_cache_rec)       */
+  uint64_t entry, start, end;       /* Entry point and .text range        */
+  uint32_t text_hash;               /* Hash of the .text contents         */
+  uint32_t map_size;                /* MAP_SIZE the IDs were picked for   */
+};
+
+struct afl_cache_rec {
+  uint32_t type;                    /* AFL_REC_*                          */
+  uint32_t id;                      /* Block ID (ID)                      */
+  uint64_t pc;                      /* Block address                      */
+  uint64_t aux;                     /* cs_base (TSL) or predecessor (ID)  */
+  uint64_t flags;                   /* TB flags (TSL)                     */
+};
+
+/* The pc -> ID table. pc 0 marks a free entry; nothing gets executed
+   there. */
+
+struct afl_id_ent {
+  abi_ulong pc;
+  uint32_t id;
 };
 
+static int afl_cache_fd = -1;       /* AFL_QEMU_CACHE, if open            */
+static off_t afl_cache_off;         /* End of what we've read from it     */
+
+static struct afl_id_ent *afl_id_tbl;
+static unsigned int afl_id_cnt;
+
+static unsigned char *afl_map_used; /* Map slots taken by known edges     */
+
+/* Guest threads share TSL_FD and TSL_REPLY_FD, and ask for IDs from
+   afl_maybe_log() without holding tb_lock. Each request is sent and
+   answered under this lock, and so is anything that adds to the table;
+   afl_id_find() can run without it. */
+
+static pthread_mutex_t afl_tsl_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread abi_ulong afl_prev_pc;
+
 /* Some forward decls: */
 
 TranslationBlock *tb_htable_lookup(CPUState*, target_ulong, target_ulong, uint32_t);
@@ -111,6 +180,315 @@ static inline TranslationBlock *tb_find(CPUState*, TranslationBlock*, int);
  * ACTUAL IMPLEMENTATION *
  *************************/
 
+/* The classic, PC-derived location of a block. Instruction addresses may be
+   aligned, so we mangle the value to get something quasi-uniform. This also
+   decides which blocks AFL_INST_RATIO skips, which keeps the instrumented
+   locations stable across runs. */
+
+static inline unsigned int afl_hash_loc(abi_ulong pc) {
+
+  return ((pc >> 4) ^ (pc << 8)) & (MAP_SIZE - 1);
+
+}
+
+
+/* Is the block at pc instrumented at all? */
+
+static inline int afl_instrumented(abi_ulong pc) {
+
+  return pc <= afl_end_code && pc >= afl_start_code &&
+         afl_hash_loc(pc) < afl_inst_rms;
+
+}
+
+
+/* Look up the ID of the block at pc. Returns 0 if it doesn't have one. */
+
+static inline int afl_id_find(abi_ulong pc, uint32_t *id) {
+
+  uint32_t mask = (1 << QEMU_ID_TBL_POW2) - 1,
+           i = ((uint64_t)pc * 0x9e3779b97f4a7c15ULL) >> (64 - QEMU_ID_TBL_POW2);
+
+  abi_ulong cur;
+
+  while ((cur = __atomic_load_n(&afl_id_tbl[i].pc, __ATOMIC_ACQUIRE))) {
+
+    if (cur == pc) {
+      *id = afl_id_tbl[i].id;
+      return 1;
+    }
+
+    i = (i + 1) & mask;
+
+  }
+
+  return 0;
+
+}
+
+
+/* Add a block and its ID to the table, and mark the map slot of the edge it
+   was discovered through as taken. */
+
+static void afl_id_add(abi_ulong pc, uint32_t id, abi_ulong prev) {
+
+  uint32_t mask = (1 << QEMU_ID_TBL_POW2) - 1,
+           i = ((uint64_t)pc * 0x9e3779b97f4a7c15ULL) >> (64 - QEMU_ID_TBL_POW2),
+           prev_id;
+
+  if (!pc || afl_id_cnt >= (mask + 1) / 4 * 3) return;
+
+  while (afl_id_tbl[i].pc) {
+    if (afl_id_tbl[i].pc == pc) return;
+    i = (i + 1) & mask;
+  }
+
+  /* Readers don't lock, so the ID has to be there before the pc is. */
+
+  afl_id_tbl[i].id = id;
+  __atomic_store_n(&afl_id_tbl[i].pc, pc, __ATOMIC_RELEASE);
+  afl_id_cnt++;
+
+  if (prev && afl_id_find(prev, &prev_id))
+    afl_map_used[(id ^ (prev_id >> 1)) & (MAP_SIZE - 1)] = 1;
+
+}
+
+
+/* Pick an ID for a new block. If we know the block we came from, the new
+   edge gets a map slot of its own (CollAFL's Fsingle case, with the regular
+   cur ^ (prev >> 1) formula). Otherwise, we settle for the classic one. */
+
+static uint32_t afl_pick_id(abi_ulong pc, abi_ulong prev) {
+
+  uint32_t prev_id, slot, start;
+
+  if (!prev || !afl_id_find(prev, &prev_id)) return afl_hash_loc(pc);
+
+  slot = start = afl_hash_loc(pc);
+
+  while (afl_map_used[slot]) {
+    slot = (slot + 1) & (MAP_SIZE - 1);
+    if (slot == start) break;
+  }
+
+  return slot ^ (prev_id >> 1);
+
+}
+
+
+/* Translate a block in our own context, unless we have it already. Returns
+   1 if it was new. */
+
+static int afl_translate(CPUState *cpu, target_ulong pc, target_ulong cs_base,
+                         uint64_t flags) {
+
+  TranslationBlock *tb = tb_htable_lookup(cpu, pc, cs_base, flags);
+
+  if (tb) return 0;
+
+  mmap_lock();
+  tb_lock();
+  tb_gen_code(cpu, pc, cs_base, flags, 0);
+  mmap_unlock();
+  tb_unlock();
+
+  return 1;
+
+}
+
+
+/* Go over the cache records from offset off on, and return where they end.
+   ID records go into the table if ids is set; blocks from TSL records are
+   translated if we're given a CPU to do it with. Anything that isn't mapped
+   executable right now is left alone. */
+
+static off_t afl_cache_read(off_t off, CPUState *cpu, int ids) {
+
+  struct afl_cache_rec buf[256];
+  ssize_t len;
+
+  while ((len = pread(afl_cache_fd, buf, sizeof(buf), off)) >=
+         (ssize_t)sizeof(struct afl_cache_rec)) {
+
+    unsigned int i, cnt = len / sizeof(struct afl_cache_rec);
+
+    for (i = 0; i < cnt; i++) {
+
+      if (ids && buf[i].type == AFL_REC_ID)
+        afl_id_add(buf[i].pc, buf[i].id, buf[i].aux);
+
+      if (cpu && buf[i].type == AFL_REC_TSL &&
+          (page_get_flags(buf[i].pc) & PAGE_EXEC))
+        afl_translate(cpu, buf[i].pc, buf[i].aux, buf[i].flags);
+
+    }
+
+    off += cnt * sizeof(struct afl_cache_rec);
+
+  }
+
+  return off;
+
+}
+
+
+/* Append a record. Whatever others appended in the meantime is read first,
+   so that we don't write over it and see the same IDs as everybody else.
+   Their new translations have to wait for the next startup, though; we
+   don't want to hold the lock for that long. */
+
+static void afl_cache_append(struct afl_cache_rec *rec) {
+
+  if (flock(afl_cache_fd, LOCK_EX)) return;
+
+  afl_cache_off = afl_cache_read(afl_cache_off, NULL, 1);
+
+  if (pwrite(afl_cache_fd, rec, sizeof(struct afl_cache_rec), afl_cache_off) ==
+      sizeof(struct afl_cache_rec)) afl_cache_off += sizeof(struct afl_cache_rec);
+
+  flock(afl_cache_fd, LOCK_UN);
+
+}
+
+
+/* Give the block at pc an ID, or return the one it has, possibly from
+   another instance. Only ever called in the fork server, or when there's
+   none to ask. */
+
+static uint32_t afl_assign_id(abi_ulong pc, abi_ulong prev) {
+
+  struct afl_cache_rec rec;
+  uint32_t id;
+
+  if (afl_id_find(pc, &id)) return id;
+
+  if (flock(afl_cache_fd, LOCK_EX)) return afl_hash_loc(pc);
+
+  afl_cache_off = afl_cache_read(afl_cache_off, NULL, 1);
+
+  if (!afl_id_find(pc, &id)) {
+
+    id = afl_pick_id(pc, prev);
+    afl_id_add(pc, id, prev);
+
+    memset(&rec, 0, sizeof(rec));
+    rec.type = AFL_REC_ID;
+    rec.id   = id;
+    rec.pc   = pc;
+    rec.aux  = prev;
+
+    if (pwrite(afl_cache_fd, &rec, sizeof(rec), afl_cache_off) == sizeof(rec))
+      afl_cache_off += sizeof(rec);
+
+  }
+
+  flock(afl_cache_fd, LOCK_UN);
+
+  return id;
+
+}
+
+
+/* Ask the fork server for the ID of a block the child doesn't know about,
+   or work it out ourselves if there's no fork server. */
+
+static uint32_t afl_child_id(abi_ulong pc) {
+
+  struct afl_tsl t;
+  uint32_t id;
+
+  pthread_mutex_lock(&afl_tsl_lock);
+
+  /* Another thread may have asked in the meantime. */
+
+  if (afl_id_find(pc, &id)) goto out;
+
+  if (!afl_fork_child) {
+    id = afl_assign_id(pc, afl_prev_pc);
+    goto out;
+  }
+
+  memset(&t, 0, sizeof(t));
+  t.pc   = pc;
+  t.prev = afl_prev_pc;
+  t.kind = AFL_TSL_ID_ONLY;
+
+  if (write(TSL_FD, &t, sizeof(t)) != sizeof(t) ||
+      read(TSL_REPLY_FD, &id, 4) != 4) {
+    id = afl_hash_loc(pc);
+    goto out;
+  }
+
+  afl_id_add(pc, id, afl_prev_pc);
+
+out:
+
+  pthread_mutex_unlock(&afl_tsl_lock);
+  return id;
+
+}
+
+
+/* Open AFL_QEMU_CACHE and load the IDs from it. If the file was made for a
+   different binary, start it over. Any trouble just means no caching. */
+
+static void afl_cache_open(void) {
+
+  char *fn = getenv("AFL_QEMU_CACHE");
+  struct afl_cache_hdr hdr, cur;
+
+  if (!fn) return;
+
+  afl_cache_fd = open(fn, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (afl_cache_fd < 0) return;
+
+  afl_id_tbl = mmap(NULL, sizeof(struct afl_id_ent) << QEMU_ID_TBL_POW2,
+                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  afl_map_used = mmap(NULL, MAP_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (afl_id_tbl == MAP_FAILED || afl_map_used == MAP_FAILED) goto no_cache;
+
+  memset(&cur, 0, sizeof(cur));
+
+  cur.magic    = QEMU_CACHE_MAGIC;
+  cur.rec_size = sizeof(struct afl_cache_rec);
+  cur.entry    = afl_entry_point;
+  cur.start    = afl_start_code;
+  cur.end      = afl_end_code;
+  cur.map_size = MAP_SIZE;
+
+  if (afl_end_code > afl_start_code)
+    cur.text_hash = hash32(g2h(afl_start_code), afl_end_code - afl_start_code,
+                           HASH_CONST);
+
+  if (flock(afl_cache_fd, LOCK_EX)) goto no_cache;
+
+  if (pread(afl_cache_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      memcmp(&hdr, &cur, sizeof(hdr))) {
+
+    if (ftruncate(afl_cache_fd, 0) ||
+        pwrite(afl_cache_fd, &cur, sizeof(cur), 0) != sizeof(cur)) {
+      flock(afl_cache_fd, LOCK_UN);
+      goto no_cache;
+    }
+
+  }
+
+  afl_cache_off = afl_cache_read(sizeof(cur), NULL, 1);
+
+  flock(afl_cache_fd, LOCK_UN);
+  return;
+
+no_cache:
+
+  close(afl_cache_fd);
+  afl_cache_fd = -1;
+
+}
+
 /* Set up SHM region and initialize other stuff. */
 
 static void afl_setup(void) {
@@ -148,6 +526,11 @@ static void afl_setup(void) {
 
   }
 
+  /* The cache is keyed to the .text range of the binary, so open it before
+     AFL_INST_LIBS widens that. */
+
+  if (afl_area_ptr) afl_cache_open();
+
   if (getenv("AFL_INST_LIBS")) {
 
     afl_start_code = 0;
@@ -179,12 +562,18 @@ static void afl_forkserver(CPUState *cpu) {
 
   afl_forksrv_pid = getpid();
 
+  /* Whatever this or any other instance translated before doesn't have to
+     be translated again in every child. Records are only ever appended, so
+     there's no need to lock the file for this. */
+
+  if (afl_cache_fd >= 0) afl_cache_read(sizeof(struct afl_cache_hdr), cpu, 0);
+
   /* All right, let's await orders... */
 
   while (1) {
 
     pid_t child_pid;
-    int status, t_fd[2];
+    int status, t_fd[2], r_fd[2] = { -1, -1 };
 
     /* Whoops, parent dead? */
 
@@ -196,6 +585,15 @@ static void afl_forkserver(CPUState *cpu) {
     if (pipe(t_fd) || dup2(t_fd[1], TSL_FD) < 0) exit(3);
     close(t_fd[1]);
 
+    /* A socket rather than a pipe for the replies, so that a child killed
+       on a timeout doesn't get us a SIGPIPE. */
+
+    if (afl_cache_fd >= 0) {
+      if (socketpair(AF_UNIX, SOCK_STREAM, 0, r_fd) ||
+          dup2(r_fd[0], TSL_REPLY_FD) < 0) exit(3);
+      close(r_fd[0]);
+    }
+
     child_pid = fork();
     if (child_pid < 0) exit(4);
 
@@ -207,6 +605,7 @@ static void afl_forkserver(CPUState *cpu) {
       close(FORKSRV_FD);
       close(FORKSRV_FD + 1);
       close(t_fd[0]);
+      if (r_fd[1] >= 0) close(r_fd[1]);
       return;
 
     }
@@ -214,12 +613,13 @@ static void afl_forkserver(CPUState *cpu) {
     /* Parent. */
 
     close(TSL_FD);
+    if (r_fd[1] >= 0) close(TSL_REPLY_FD);
 
     if (write(FORKSRV_FD + 1, &child_pid, 4) != 4) exit(5);
 
     /* Collect translation requests until child dies and closes the pipe. */
 
-    afl_wait_tsl(cpu, t_fd[0]);
+    afl_wait_tsl(cpu, t_fd[0], r_fd[1]);
 
     /* Get and relay exit status to parent. */
 
@@ -236,6 +636,7 @@ static void afl_forkserver(CPUState *cpu) {
 static inline void afl_maybe_log(abi_ulong cur_loc) {
 
   static __thread abi_ulong prev_loc;
+  uint32_t id;
 
   /* Optimize for cur_loc > afl_end_code, which is the most likely case on
      Linux systems. */
@@ -244,19 +645,24 @@ static inline void afl_maybe_log(abi_ulong cur_loc) {
     return;
 
   /* Looks like QEMU always maps to fixed locations, so ASAN is not a
-     concern. Phew. But instruction addresses may be aligned. Let's mangle
-     the value to get something quasi-uniform. */
+     concern. Phew. Probabilistic instrumentation goes by the scrambled block
+     address, see afl_hash_loc(). */
+
+  if (afl_hash_loc(cur_loc) >= afl_inst_rms) return;
+
+  /* In cache mode, the ID comes from the table; blocks the fork server
+     gave us a translation for already have one there. */
 
-  cur_loc  = (cur_loc >> 4) ^ (cur_loc << 8);
-  cur_loc &= MAP_SIZE - 1;
+  if (afl_cache_fd >= 0) {
 
-  /* Implement probabilistic instrumentation by looking at scrambled block
-     address. This keeps the instrumented locations stable across runs. */
+    if (!afl_id_find(cur_loc, &id)) id = afl_child_id(cur_loc);
 
-  if (cur_loc >= afl_inst_rms) return;
+    afl_prev_pc = cur_loc;
 
-  afl_area_ptr[cur_loc ^ prev_loc]++;
-  prev_loc = cur_loc >> 1;
+  } else id = afl_hash_loc(cur_loc);
+
+  afl_area_ptr[id ^ prev_loc]++;
+  prev_loc = id >> 1;
 
 }
 
@@ -269,25 +675,62 @@ static inline void afl_maybe_log(abi_ulong cur_loc) {
 static void afl_request_tsl(target_ulong pc, target_ulong cb, uint64_t flags) {
 
   struct afl_tsl t;
+  uint32_t id;
+
+  pthread_mutex_lock(&afl_tsl_lock);
+
+  if (!afl_fork_child) {
 
-  if (!afl_fork_child) return;
+    /* No fork server to mirror this; in cache mode, remember the block for
+       next time. We're holding the translation locks, so no CPU. */
+
+    if (afl_cache_fd >= 0) {
+
+      struct afl_cache_rec rec;
+
+      memset(&rec, 0, sizeof(rec));
+      rec.type  = AFL_REC_TSL;
+      rec.pc    = pc;
+      rec.aux   = cb;
+      rec.flags = flags;
+
+      afl_cache_append(&rec);
+
+    }
+
+    goto out;
+
+  }
+
+  memset(&t, 0, sizeof(t));
 
   t.pc      = pc;
   t.cs_base = cb;
   t.flags   = flags;
+  t.prev    = afl_prev_pc;
 
   if (write(TSL_FD, &t, sizeof(struct afl_tsl)) != sizeof(struct afl_tsl))
-    return;
+    goto out;
+
+  /* The fork server also picks the ID of the new block, so that all future
+     children agree with us. */
+
+  if (afl_cache_fd >= 0 && afl_instrumented(pc) &&
+      read(TSL_REPLY_FD, &id, 4) == 4) afl_id_add(pc, id, afl_prev_pc);
+
+out:
+
+  pthread_mutex_unlock(&afl_tsl_lock);
 
 }
 
 /* This is the other side of the same channel. Since timeouts are handled by
    afl-fuzz simply killing the child, we can just wait until the pipe breaks. */
 
-static void afl_wait_tsl(CPUState *cpu, int fd) {
+static void afl_wait_tsl(CPUState *cpu, int fd, int reply_fd) {
 
   struct afl_tsl t;
-  TranslationBlock *tb;
+  uint32_t id;
 
   while (1) {
 
@@ -296,18 +739,35 @@ static void afl_wait_tsl(CPUState *cpu, int fd) {
     if (read(fd, &t, sizeof(struct afl_tsl)) != sizeof(struct afl_tsl))
       break;
 
-    tb = tb_htable_lookup(cpu, t.pc, t.cs_base, t.flags);
+    if (t.kind != AFL_TSL_ID_ONLY &&
+        afl_translate(cpu, t.pc, t.cs_base, t.flags) && afl_cache_fd >= 0) {
+
+      struct afl_cache_rec rec;
+
+      memset(&rec, 0, sizeof(rec));
+      rec.type  = AFL_REC_TSL;
+      rec.pc    = t.pc;
+      rec.aux   = t.cs_base;
+      rec.flags = t.flags;
+
+      afl_cache_append(&rec);
+
+    }
+
+    /* The child is waiting for an answer about anything instrumented. */
+
+    if (afl_cache_fd >= 0 && (t.kind == AFL_TSL_ID_ONLY ||
+                              afl_instrumented(t.pc))) {
+
+      id = afl_assign_id(t.pc, t.prev);
+
+      if (send(reply_fd, &id, 4, MSG_NOSIGNAL) != 4) break;
 
-    if(!tb) {
-      mmap_lock();
-      tb_lock();
-      tb_gen_code(cpu, t.pc, t.cs_base, t.flags, 0);
-      mmap_unlock();
-      tb_unlock();
     }
 
   }
 
   close(fd);
+  if (reply_fd >= 0) close(reply_fd);
 
 }